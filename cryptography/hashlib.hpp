@@ -3,11 +3,12 @@
 #include <array>
 #include <cstdint>
 #include <string>
+#include <string_view>
 
 namespace hashutil {
     namespace impl {
         struct Sha1BlockFeeder {
-            const std::string &bytes; std::size_t pos {};
+            std::string_view bytes; std::size_t pos {};
             enum State {CopyBytes, Add80, ZeroPad, WriteLen, Finished} state {CopyBytes};
 
             constexpr bool nextBlock(std::array<uint8_t, 64> &chunk) {
@@ -94,7 +95,7 @@ namespace hashutil {
         return (b << shift) | (b >> (32u - shift));
     }
 
-    [[nodiscard]] constexpr std::string sha1(const std::string &raw, bool asBytes = false) {
+    [[nodiscard]] constexpr std::string sha1(std::string_view raw, bool asBytes = false) {
         // Define constants for SHA1 we will overwrite these for each chunk
         // Final sha string is just the concatenation of these values
         uint32_t h0{0x67452301};
@@ -62,6 +62,9 @@ namespace async {
                 }
             }
 
+            // Number of worker threads
+            std::size_t size() const { return workers.size(); }
+
             // Wait for completion without destroying thread pool
             void wait() {
                 std::unique_lock lock(taskMutex);
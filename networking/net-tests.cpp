@@ -101,4 +101,97 @@ int main() {
         assert(net::utils::checkIPType("::1").value() == net::IP::V6);
         assert(!net::utils::checkIPType("a23123").has_value());
     }
+
+    // PollManager on both backends: events, updates, untracking & cleanup of closed sockets (socketpair ends)
+    for (auto backend: {net::PollManager::Backend::Epoll, net::PollManager::Backend::Poll}) {
+        using net::PollEventType;
+        net::PollManager pm {backend};
+        assert(pm.backend() == backend);
+
+        int fds[2]; assert(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+        int left {pm.track(net::Socket{fds[0], net::SOCKTYPE::TCP, net::IP::V4}, PollEventType::Readable)};
+        int right {pm.track(net::Socket{fds[1], net::SOCKTYPE::TCP, net::IP::V4}, PollEventType::Unknown)};
+        assert(pm.size() == 2 && pm.poll(0).empty());
+
+        assert(::write(right, "x", 1) == 1);
+        auto &events {pm.poll(100)};
+        assert(events.size() == 1 && events[0].first.fd() == left && events[0].second == PollEventType::Readable);
+
+        pm.updateTracking(right, PollEventType::Writable);
+        assert(pm.poll(0).size() == 2);
+
+        // Untracking closes the socket, peer sees a hangup
+        pm.untrack(left);
+        // Results are reused across calls
+        assert(&pm.poll(100) == &events);
+        assert(pm.size() == 1 && events.size() == 1 && events[0].second & PollEventType::Closed);
+
+        // Sockets closed while handling an event are dropped on the next poll
+        events[0].first.close();
+        std::ignore = pm.poll(0);
+        assert(pm.empty() && !pm.hasSocket(right));
+
+        // Idle sockets closed without untracking aren't counted, their fd can be tracked again
+        assert(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+        int idle {pm.track(net::Socket{fds[0], net::SOCKTYPE::TCP, net::IP::V4}, PollEventType::Readable)};
+        net::Socket other {fds[1], net::SOCKTYPE::TCP, net::IP::V4};
+        pm.getSocket(idle).close();
+        assert(pm.empty() && pm.size() == 0 && !pm.hasSocket(idle));
+        assert(pm.poll(0).empty());
+    }
+
+    // Reactor on both backends: accept, echo (small gathered & large zero copy messages) and peer hangups.
+    // Few small receive buffers, messages are split across many & the kernel runs out of them
+    for (auto backend: {net::Reactor::Backend::IoUring, net::Reactor::Backend::Epoll}) {
+        std::vector<int> closed;
+        net::Reactor *self {nullptr};
+        net::Reactor reactor {{
+            .accept=[](int, int) {},
+            .data=[&self](int fd, std::string_view data) { self->send(fd, std::string{data}); },
+            .close=[&closed](int fd) { closed.push_back(fd); }
+        }, backend, 4096, 7};
+        self = &reactor;
+
+        net::Socket listener;
+        listener.bind("127.0.0.1", 0);
+        sockaddr_in addr {}; socklen_t addrLen {sizeof(addr)};
+        assert(::getsockname(listener.fd(), reinterpret_cast<sockaddr*>(&addr), &addrLen) == 0);
+        listener.listen(16);
+        reactor.listen(std::move(listener));
+
+        net::Socket client;
+        client.connect("127.0.0.1", net::utils::bswap(addr.sin_port));
+        client.setNonBlocking();
+        const std::string message {std::string(100'000, 'x') + "end"};
+        std::string echoed;
+        for (std::size_t sent {}; echoed.size() < 2 * message.size() + 5;) {
+            if (sent < message.size()) sent += static_cast<std::size_t>(client.send(std::string_view{message}.substr(sent)));
+            else if (sent == message.size()) { assert(client.sendAll("small") == 5); sent += 5; }
+            else if (sent == message.size() + 5) { assert(client.sendAll(message) == static_cast<long>(message.size())); sent += message.size(); }
+            std::ignore = reactor.poll(10);
+            client.recvAll(echoed);
+        }
+        assert(echoed == message + "small" + message && reactor.size() == 2);
+
+        client.close();
+        for (int i {}; i < 100 && closed.empty(); ++i) std::ignore = reactor.poll(10);
+        assert(closed.size() == 1 && reactor.size() == 1);
+
+        bool rejected {false};
+        try { net::Reactor invalid {{}, backend, 0}; } catch (std::invalid_argument&) { rejected = true; }
+        assert(rejected);
+    }
+
+    // Edge triggered epoll reports a readiness change once, until more data arrives
+    {
+        net::PollManager pm {net::PollManager::Backend::Epoll, true};
+        int fds[2]; assert(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+        pm.track(net::Socket{fds[0], net::SOCKTYPE::TCP, net::IP::V4}, net::PollEventType::Readable);
+        net::Socket writer {fds[1], net::SOCKTYPE::TCP, net::IP::V4};
+
+        assert(::write(writer.fd(), "x", 1) == 1);
+        assert(pm.poll(100).size() == 1 && pm.poll(0).empty());
+        assert(::write(writer.fd(), "y", 1) == 1);
+        assert(pm.poll(100).size() == 1);
+    }
 }
@@ -11,10 +11,19 @@
 #pragma once
 
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <csignal>
 #include <cstdint>
 #include <cstring>
+#include <deque>
+#include <functional>
 #include <iomanip>
+#include <limits>
 #include <memory>
+#include <span>
 #include <sstream>
 #include <unordered_map>
 #include <type_traits>
@@ -25,13 +34,26 @@
 #include <fcntl.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
 #include <poll.h>
 #include <netdb.h>
 #include <unistd.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 
+// io_uring reactor needs multishot recv & zero copy sendmsg (6.1+ headers), epoll only otherwise
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#if defined(IORING_RECV_MULTISHOT) && defined(IORING_SEND_ZC_REPORT_USAGE)
+#define NET_IO_URING 1
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
 #include "../json-parser/json/json.hpp"
 
 namespace net {
@@ -473,6 +495,26 @@ namespace net {
                 return {buffer.data(), static_cast<std::size_t>(std::max(0l, totalRecv))};
             }
 
+            // Appends whatever is available (up to maxBytes) straight onto the buffer, returns no of bytes received
+            std::size_t recvAll(std::string &buffer, std::size_t recvBatchSize = 16384,
+                std::size_t maxBytes = std::numeric_limits<std::size_t>::max()) 
+            {
+                const std::size_t initialSize {buffer.size()}; std::size_t totalRecv {};
+                try {
+                    while (_fd != -1 && totalRecv < maxBytes) {
+                        const std::size_t batchSize {std::min(recvBatchSize, maxBytes - totalRecv)};
+                        buffer.resize(initialSize + totalRecv + batchSize);
+                        long recvBytes {::recv(_fd, buffer.data() + initialSize + totalRecv, batchSize, 0)};
+                        if (recvBytes > 0) totalRecv += static_cast<std::size_t>(recvBytes);
+                        else if (recvBytes == 0 || (recvBytes < 0 && errno == ECONNRESET)) close();
+                        else if (errno == EAGAIN || errno == EWOULDBLOCK) break; 
+                        else throw SocketError{"Failed to recv"};
+                    }
+                } catch (...) { buffer.resize(initialSize + totalRecv); throw; }
+                buffer.resize(initialSize + totalRecv);
+                return totalRecv;
+            }
+
             void sendTo(std::string_view message, std::string_view host, std::uint16_t port) {
                 sockaddr_storage hostAddr {Sockaddr(host, port)};
                 long sentBytes {::sendto(_fd, message.data(), message.size(), 0, 
@@ -1195,9 +1237,13 @@ namespace net {
             }
     };
 
+    // Tracks sockets & waits for events on them, through epoll by default. The poll() backend is the
+    // fallback (if epoll_create1 fails). Both track / update / untrack in O(1), edge triggered mode
+    // (epoll only) reports a readiness change once, the socket must then be drained until EAGAIN
     class PollManager {
         public:
             enum class EventType { Unknown=0, Readable=1, Writable=2, Closed=4, Error=8 };
+            enum class Backend { Epoll, Poll };
 
             friend EventType operator|=(EventType &e1, EventType e2) { return e1 = e1 | e2; }
             friend EventType operator|(EventType e1, EventType e2) {
@@ -1210,92 +1256,810 @@ namespace net {
                 return (static_cast<T>(e1) & static_cast<T>(e2)) != 0; 
             }
 
+            explicit PollManager(Backend backend = Backend::Epoll, bool edgeTriggered = false):
+                edgeTriggered {edgeTriggered}
+            {
+                if (backend == Backend::Epoll) epollFd = ::epoll_create1(EPOLL_CLOEXEC);
+            }
+
+            ~PollManager() { if (epollFd != -1) ::close(epollFd); }
+
+            // Disable copy ctor and assignment
+            PollManager(const PollManager&) = delete;
+            PollManager &operator=(const PollManager&) = delete;
+
+            PollManager(PollManager &&other) noexcept:
+                epollFd {std::exchange(other.epollFd, -1)}, edgeTriggered {other.edgeTriggered},
+                epollEvents {std::move(other.epollEvents)}, reported {std::move(other.reported)},
+                pollsSinceSweep {other.pollsSinceSweep}, result {std::move(other.result)},
+                pollFds {std::move(other.pollFds)}, sockets {std::move(other.sockets)}
+            {}
+
+            PollManager &operator=(PollManager &&other) noexcept {
+                if (this != &other) {
+                    if (epollFd != -1) ::close(epollFd);
+                    epollFd = std::exchange(other.epollFd, -1); edgeTriggered = other.edgeTriggered;
+                    epollEvents = std::move(other.epollEvents); reported = std::move(other.reported);
+                    pollsSinceSweep = other.pollsSinceSweep; result = std::move(other.result);
+                    pollFds = std::move(other.pollFds); sockets = std::move(other.sockets);
+                }
+                return *this;
+            }
+
+            [[nodiscard]] Backend backend() const { return epollFd != -1? Backend::Epoll: Backend::Poll; }
+
             void untrack(int fd) {
                 auto it {sockets.find(fd)};
-                if (it != sockets.end()) {
-                    sockets.erase(fd);
-                    auto newEnd {std::ranges::remove(pollFds, fd, &pollfd::fd)};
-                    pollFds.erase(newEnd.begin(), newEnd.end());
-                }
+                if (it == sockets.end()) return;
+
+                // Socket may have been closed already (removing it from the epoll set), ignore failures
+                if (epollFd != -1) ::epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+                else removePollFd(it->second.pollIdx);
+                sockets.erase(it);
             }
 
             int track(Socket &&socket, EventType event = EventType::Readable | EventType::Writable) {
-                int eventInt {}, fd {socket.fd()};
-                sockets.emplace(fd, std::move(socket));
-                if (event & EventType::Readable) eventInt |= POLLIN;
-                if (event & EventType::Writable) eventInt |= POLLOUT;
-                pollFds.emplace_back(fd, eventInt, 0);
+                int fd {socket.fd()};
+
+                // Fd reused after the socket it belonged to was closed without being untracked
+                if (auto it {sockets.find(fd)}; it != sockets.end() && !it->second.socket.ok()) {
+                    if (epollFd == -1) removePollFd(it->second.pollIdx);
+                    sockets.erase(it);
+                }
+
+                auto [it, inserted] {sockets.try_emplace(fd, std::move(socket))};
+                if (!inserted) throw std::runtime_error("Socket FD is already tracked: " + std::to_string(fd));
+                if (epollFd != -1) {
+                    epoll_event ev {.events=epollMask(event), .data={.fd=fd}};
+                    if (::epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+                        sockets.erase(it); throw SocketError{"Failed to add socket to epoll"};
+                    }
+                } else {
+                    it->second.pollIdx = pollFds.size();
+                    pollFds.push_back({.fd=fd, .events=pollMask(event), .revents=0});
+                }
                 return fd;
             }
 
             void updateTracking(int fd, EventType event = EventType::Readable | EventType::Writable) {
-                if (!hasSocket(fd)) throw std::runtime_error("Socket FD is not tracked: " + std::to_string(fd));
-
-                int eventInt {};
-                if (event & EventType::Readable) eventInt |= POLLIN;
-                if (event & EventType::Writable) eventInt |= POLLOUT;
+                auto it {sockets.find(fd)};
+                if (it == sockets.end()) throw std::runtime_error("Socket FD is not tracked: " + std::to_string(fd));
 
-                std::ranges::find(pollFds, fd, &pollfd::fd)->events 
-                    = static_cast<short>(eventInt);
+                if (epollFd != -1) {
+                    epoll_event ev {.events=epollMask(event), .data={.fd=fd}};
+                    if (::epoll_ctl(epollFd, EPOLL_CTL_MOD, fd, &ev) == -1)
+                        throw SocketError{"Failed to update socket in epoll"};
+                } else pollFds[it->second.pollIdx].events = pollMask(event);
             }
 
             // To prevent ambiguity, lets delete this one
             void poll(bool) = delete;
 
+            // Result is reused, valid until the next call to poll
             // Warning: While safe to `untrack` while iterating, Socket& can become dangling
-            [[nodiscard]] std::vector<std::pair<Socket&, EventType>> 
+            [[nodiscard]] std::vector<std::pair<Socket&, EventType>> &
             poll(int timeout = -1, bool raiseError = true) {
+                result.clear();
+                if (epollFd != -1) pollEpoll(timeout, raiseError);
+                else pollPoll(timeout, raiseError);
+                return result;
+            }
+
+            // Sockets closed without being untracked are only dropped on a later poll, don't count them
+            [[nodiscard]] bool empty() const { return size() == 0; }
+            [[nodiscard]] std::size_t size() const { 
+                return static_cast<std::size_t>(std::ranges::count_if(sockets, [](const auto &kv) { return kv.second.socket.ok(); }));
+            }
+
+            [[nodiscard]] bool hasSocket(int fd) const { 
+                auto it {sockets.find(fd)};
+                return it != sockets.end() && it->second.socket.ok();
+            }
+
+            [[nodiscard]] Socket &getSocket(int fd) {
+                auto it {sockets.find(fd)};
+                if (it == sockets.end()) 
+                    throw std::runtime_error("No such file descriptor: " + std::to_string(fd));
+                return it->second.socket;
+            }
+
+        private:
+            // Position in `pollFds` is only used by the poll() backend
+            struct Entry { 
+                Socket socket; std::size_t pollIdx {};
+                explicit Entry(Socket &&socket): socket {std::move(socket)} {}
+            };
+
+            int epollFd {-1};
+            bool edgeTriggered {false};
+
+            // epoll backend: events array reused across calls (grown with the number of sockets) &
+            // fds reported by the last call, closed sockets among them are dropped on the next
+            std::vector<epoll_event> epollEvents;
+            std::vector<int> reported;
+
+            // Idle sockets closed without being untracked are never reported, swept every so many polls
+            static constexpr std::size_t SWEEP_INTERVAL {1024};
+            std::size_t pollsSinceSweep {};
+
+            std::vector<std::pair<Socket&, EventType>> result;
+
+            std::vector<pollfd> pollFds;
+            std::unordered_map<int, Entry> sockets;
+
+        private:
+            static short pollMask(EventType event) {
+                int eventInt {};
+                if (event & EventType::Readable) eventInt |= POLLIN;
+                if (event & EventType::Writable) eventInt |= POLLOUT;
+                return static_cast<short>(eventInt);
+            }
+
+            std::uint32_t epollMask(EventType event) const {
+                std::uint32_t eventInt {edgeTriggered? static_cast<std::uint32_t>(EPOLLET): 0u};
+                if (event & EventType::Readable) eventInt |= EPOLLIN;
+                if (event & EventType::Writable) eventInt |= EPOLLOUT;
+                return eventInt;
+            }
+
+            // Swap with the last entry & pop
+            void removePollFd(std::size_t idx) {
+                if (idx + 1 != pollFds.size()) {
+                    pollFds[idx] = pollFds.back();
+                    sockets.at(pollFds[idx].fd).pollIdx = idx;
+                }
+                pollFds.pop_back();
+            }
+
+            void pollEpoll(int timeout, bool raiseError) {
+                // Sockets closed while handling the last batch of events were removed from the epoll set by the kernel
+                for (int fd: reported)
+                    if (auto it {sockets.find(fd)}; it != sockets.end() && !it->second.socket.ok()) sockets.erase(it);
+                reported.clear();
+                if (++pollsSinceSweep == SWEEP_INTERVAL) {
+                    std::erase_if(sockets, [](const auto &kv) { return !kv.second.socket.ok(); });
+                    pollsSinceSweep = 0;
+                }
+
+                if (epollEvents.size() < std::max<std::size_t>(sockets.size(), 64))
+                    epollEvents.resize(std::max<std::size_t>(sockets.size(), 64));
+                int count {::epoll_wait(epollFd, epollEvents.data(), static_cast<int>(epollEvents.size()), timeout)};
+                if (count == -1) {
+                    if (raiseError && errno != EINTR) throw SocketError{"Poll failed"};
+                    return;
+                }
+
+                for (const epoll_event &ev: std::span{epollEvents.data(), static_cast<std::size_t>(count)}) {
+                    auto it {sockets.find(ev.data.fd)};
+                    if (it == sockets.end()) continue;
+                    EventType event {EventType::Unknown};
+                    if (ev.events & EPOLLIN) 
+                        event |= EventType::Readable;
+                    if (ev.events & EPOLLOUT)
+                        event |= EventType::Writable;
+                    if (ev.events & EPOLLHUP)
+                        event |= EventType::Closed;
+                    if (ev.events & EPOLLERR)
+                        event |= EventType::Error;
+                    if (event != EventType::Unknown) {
+                        result.emplace_back(it->second.socket, event);
+                        reported.push_back(ev.data.fd);
+                    }
+                }
+            }
+
+            void pollPoll(int timeout, bool raiseError) {
+                // Clean any closed sockets
+                for (std::size_t idx {}; idx < pollFds.size();) {
+                    if (auto it {sockets.find(pollFds[idx].fd)}; !it->second.socket.ok()) {
+                        removePollFd(idx); sockets.erase(it);
+                    } else ++idx;
+                }
+
                 // If poll failed return empty
                 if (::poll(pollFds.data(), pollFds.size(), timeout) == -1) {
-                    if (raiseError) throw SocketError{"Poll failed"};
-                    return {};
+                    if (raiseError && errno != EINTR) throw SocketError{"Poll failed"};
+                    return;
                 }
 
-                // Store the result into events & clean any closed sockets
-                std::vector<std::pair<Socket&, EventType>> result;
-                std::vector<pollfd> pollFdsCleaned;
-                pollFdsCleaned.reserve(pollFds.size());
+                // Store the result into events
                 for (auto &pollFd: pollFds) {
-                    if (int fd = pollFd.fd; getSocket(pollFd.fd).fd() == -1) {
-                        sockets.erase(fd);
-                    } else {
-                        pollFdsCleaned.push_back(pollFd);
-                        EventType event {EventType::Unknown};
-                        if (pollFd.revents & POLLIN) 
-                            event |= EventType::Readable;
-                        if (pollFd.revents & POLLOUT)
-                            event |= EventType::Writable;
-                        if (pollFd.revents & POLLHUP)
-                            event |= EventType::Closed;
-                        if (pollFd.revents & POLLERR || pollFd.revents & POLLNVAL)
-                            event |= EventType::Error;
-                        if (event != EventType::Unknown)
-                            result.emplace_back(getSocket(pollFd.fd), event);
+                    EventType event {EventType::Unknown};
+                    if (pollFd.revents & POLLIN) 
+                        event |= EventType::Readable;
+                    if (pollFd.revents & POLLOUT)
+                        event |= EventType::Writable;
+                    if (pollFd.revents & POLLHUP)
+                        event |= EventType::Closed;
+                    if (pollFd.revents & POLLERR || pollFd.revents & POLLNVAL)
+                        event |= EventType::Error;
+                    if (event != EventType::Unknown)
+                        result.emplace_back(sockets.at(pollFd.fd).socket, event);
+                }
+            }
+    };
+
+    using PollEventType = PollManager::EventType;
+
+    // Completion based reactor for high throughput servers & proxies, owns its sockets like PollManager.
+    // io_uring backend: multishot accept, multishot recv into a shared ring of provided buffers (no buffer per
+    // connection) and every poll's sends handed over in one submission. Queued messages are gathered into
+    // a single sendmsg, large ones go out zero copy. Falls back to epoll on kernels without these. Not thread safe,
+    // the io_uring backend must be polled from the thread that created it
+    class Reactor {
+        public:
+            enum class Backend { IoUring, Epoll };
+
+            // Called with the reactor's fd of the connection, data is only valid during the call. `close`
+            // is called when the peer hangs up or the connection fails, not for `Reactor::close`
+            struct Handlers {
+                std::function<void(int listenerFd, int fd)> accept {};
+                std::function<void(int fd, std::string_view data)> data {};
+                std::function<void(int fd)> close {};
+            };
+
+            // Receives go into `bufferCount` buffers of `bufferSize` bytes shared by every connection (io_uring,
+            // rounded up to a power of two) or a single one (epoll). A message that fits a buffer arrives in one call
+            explicit Reactor(Handlers handlers, Backend backend = Backend::IoUring, 
+                std::size_t bufferSize = BUFFER_SIZE, unsigned bufferCount = BUFFER_COUNT): handlers {std::move(handlers)} 
+            {
+                if (!bufferSize || bufferSize > std::numeric_limits<std::uint32_t>::max() || !bufferCount || bufferCount > MAX_BUFFERS)
+                    throw std::invalid_argument("Invalid receive buffer size or count");
+#ifdef NET_IO_URING
+                if (backend == Backend::IoUring) ring = Ring::create(bufferSize, std::bit_ceil(bufferCount));
+#endif
+                if (!ring) {
+                    epollFd = ::epoll_create1(EPOLL_CLOEXEC);
+                    if (epollFd == -1) throw SocketError{"Failed to create epoll instance"};
+                    epollEvents.resize(64); scratch.resize(bufferSize);
+                }
+            }
+
+            ~Reactor() {
+#ifdef NET_IO_URING
+                // The kernel may still write into receive buffers & read from send buffers, wait for every op to end
+                if (ring) {
+                    io_uring_sqe &sqe {ring->sqe()};
+                    sqe.opcode = IORING_OP_ASYNC_CANCEL; sqe.fd = -1;
+                    sqe.cancel_flags = IORING_ASYNC_CANCEL_ANY | IORING_ASYNC_CANCEL_ALL; sqe.user_data = Op::Cancel;
+                    ids.clear();
+                    const auto deadline {std::chrono::steady_clock::now() + std::chrono::seconds{2}};
+                    while ((armed || !sends.empty()) && std::chrono::steady_clock::now() < deadline) {
+                        ring->enter(1, 100);
+                        ring->reap([this](const io_uring_cqe &cqe) { complete(cqe); });
                     }
                 }
+#endif
+                if (epollFd != -1) ::close(epollFd);
+            }
 
-                std::swap(pollFds, pollFdsCleaned);
-                pollFds.shrink_to_fit();
+            Reactor(const Reactor&) = delete;
+            Reactor &operator=(const Reactor&) = delete;
 
-                return result;
+            [[nodiscard]] Backend backend() const { return ring? Backend::IoUring: Backend::Epoll; }
+
+            // Accept connections on a listening socket, accepted ones are added (non blocking) & announced
+            int listen(Socket &&listener) {
+                listener.setNonBlocking();
+                Connection &conn {insert(std::move(listener), true)};
+#ifdef NET_IO_URING
+                if (ring) { armAccept(conn); return conn.socket.fd(); }
+#endif
+                watch(conn, EPOLL_CTL_ADD, EPOLLIN);
+                return conn.socket.fd();
+            }
+
+            // Start receiving on a connected socket. Queued messages are already coalesced into one send,
+            // Nagle would only hold the tail back waiting on the peer's delayed ack
+            int add(Socket &&socket) {
+                socket.setNonBlocking();
+                if (socket.socketType() == SOCKTYPE::TCP) {
+                    int opt {1};
+                    ::setsockopt(socket.fd(), IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+                }
+                Connection &conn {insert(std::move(socket), false)};
+                conn.zeroCopy = !loopbackPeer(conn.socket.fd());
+#ifdef NET_IO_URING
+                if (ring) { armRecv(conn); return conn.socket.fd(); }
+#endif
+                watch(conn, EPOLL_CTL_ADD, EPOLLIN);
+                return conn.socket.fd();
+            }
+
+            // Queued & sent in order, all queued messages go out with the next `poll`
+            void send(int fd, std::string message) {
+                Connection &conn {get(fd)};
+                if (message.empty()) return;
+                conn.outbox.push_back(std::move(message));
+                if (conn.outbox.size() == 1 && !conn.sending) dirty.push_back(fd);
+            }
+
+            // Close without calling the close handler, queued messages are dropped
+            void close(int fd) { drop(fd, false); }
+
+            // Flush queued messages, wait up to timeout ms (-1 forever) & dispatch to the handlers.
+            // Returns the no of completions / events handled
+            std::size_t poll(int timeout = -1) {
+#ifdef NET_IO_URING
+                if (ring) {
+                    for (int fd: dirty) submitSend(fd);
+                    dirty.clear();
+                    ring->enter(timeout? 1: 0, timeout);
+                    return ring->reap([this](const io_uring_cqe &cqe) { complete(cqe); });
+                }
+#endif
+                for (int fd: dirty) writeOut(fd);
+                dirty.clear();
+
+                if (epollEvents.size() < connections.size()) epollEvents.resize(connections.size());
+                int count {::epoll_wait(epollFd, epollEvents.data(), static_cast<int>(epollEvents.size()), timeout)};
+                if (count == -1) {
+                    if (errno == EINTR) return 0;
+                    throw SocketError{"Poll failed"};
+                }
+                for (const epoll_event &ev: std::span{epollEvents.data(), static_cast<std::size_t>(count)})
+                    dispatch(ev.data.fd, ev.events);
+                return static_cast<std::size_t>(count);
             }
 
-            [[nodiscard]] bool empty() const { return sockets.empty(); }
-            [[nodiscard]] std::size_t size() const { return sockets.size(); }
+            [[nodiscard]] bool empty() const { return connections.empty(); }
+            [[nodiscard]] std::size_t size() const { return connections.size(); }
+            [[nodiscard]] bool hasSocket(int fd) const { return connections.contains(fd); }
+            [[nodiscard]] Socket &getSocket(int fd) { return get(fd).socket; }
 
-            [[nodiscard]] bool hasSocket(int fd) const { return sockets.contains(fd); }
+            // Bytes queued but not yet handed to the kernel
+            [[nodiscard]] std::size_t pending(int fd) {
+                return std::ranges::fold_left(get(fd).outbox, std::size_t {}, 
+                    [](std::size_t acc, const std::string &msg) { return acc + msg.size(); });
+            }
 
-            [[nodiscard]] Socket &getSocket(int fd) {
-                auto it {sockets.find(fd)};
-                if (it == sockets.end()) 
+        private:
+            // Messages from this size up are sent zero copy & max messages per gather send
+            static constexpr std::size_t ZERO_COPY_MIN {16384}, MAX_GATHER {64};
+
+            // Default receive buffers, large enough for a 64 KB message to arrive in one completion
+            static constexpr std::size_t BUFFER_SIZE {1 << 16};
+            static constexpr unsigned BUFFER_COUNT {64}, MAX_BUFFERS {1 << 15};
+
+            // Sending is the send in flight (io_uring) or waiting for the socket to drain (epoll)
+            struct Connection {
+                Socket socket; std::uint64_t id; bool listener;
+                bool sending {false}, zeroCopy {true};
+                std::deque<std::string> outbox {};
+            };
+
+            Handlers handlers;
+            std::unordered_map<int, Connection> connections;
+            std::vector<int> dirty;
+            std::uint64_t nextId {1};
+
+            // epoll backend, scratch buffer reads go into
+            int epollFd {-1};
+            std::vector<epoll_event> epollEvents;
+            std::string scratch;
+
+            Connection &get(int fd) {
+                auto it {connections.find(fd)};
+                if (it == connections.end()) 
                     throw std::runtime_error("No such file descriptor: " + std::to_string(fd));
                 return it->second;
             }
 
-        private:
-            std::vector<pollfd> pollFds;
-            std::unordered_map<int, Socket> sockets;
-    };
+            Connection &insert(Socket &&socket, bool listener) {
+                const int fd {socket.fd()};
 
-    using PollEventType = PollManager::EventType;
+                // Fd reused after the socket it belonged to was closed behind our back
+                if (auto it {connections.find(fd)}; it != connections.end()) {
+                    if (it->second.socket.ok()) throw std::runtime_error("Socket FD is already tracked: " + std::to_string(fd));
+                    drop(fd, false);
+                }
+
+                const std::uint64_t id {nextId++};
+                ids[id] = fd;
+                return connections.try_emplace(fd, Connection{.socket=std::move(socket), .id=id, .listener=listener}).first->second;
+            }
+
+            void drop(int fd, bool notify) {
+                auto it {connections.find(fd)};
+                if (it == connections.end()) return;
+                const std::uint64_t id {it->second.id};
+                ids.erase(id);
+
+                // Handler may look at (or close) the socket, it may even be replaced meanwhile
+                if (notify && handlers.close) {
+                    handlers.close(fd);
+                    it = connections.find(fd);
+                    if (it == connections.end() || it->second.id != id) return;
+                }
+
+#ifdef NET_IO_URING
+                // Completions of ops still armed are dropped by id, cancel so that they release the file
+                if (ring) {
+                    io_uring_sqe &sqe {ring->sqe()};
+                    sqe.opcode = IORING_OP_ASYNC_CANCEL; sqe.fd = -1;
+                    sqe.addr = (id << 8) | (it->second.listener? Op::Accept: Op::Recv); sqe.user_data = Op::Cancel;
+                }
+#endif
+                if (epollFd != -1) ::epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+                connections.erase(it);
+            }
+
+            // The kernel copies loopback traffic anyway, zero copy would only add the notification
+            static bool loopbackPeer(int fd) {
+                sockaddr_storage addr {}; socklen_t addrLen {sizeof(addr)};
+                if (::getpeername(fd, reinterpret_cast<sockaddr*>(&addr), &addrLen) == -1) return false;
+                if (addr.ss_family == AF_INET)
+                    return (ntohl(reinterpret_cast<const sockaddr_in&>(addr).sin_addr.s_addr) >> 24) == 127;
+                if (addr.ss_family == AF_INET6) {
+                    const in6_addr &addr6 {reinterpret_cast<const sockaddr_in6&>(addr).sin6_addr};
+                    return IN6_IS_ADDR_LOOPBACK(&addr6) || (IN6_IS_ADDR_V4MAPPED(&addr6) && addr6.s6_addr[12] == 127);
+                }
+                return false;
+            }
+
+            void watch(const Connection &conn, int op, std::uint32_t events) {
+                epoll_event ev {.events=events, .data={.fd=conn.socket.fd()}};
+                if (::epoll_ctl(epollFd, op, conn.socket.fd(), &ev) == -1) throw SocketError{"Failed to update epoll"};
+            }
+
+            // epoll: accept / read everything available & write out when the socket drains
+            void dispatch(int fd, std::uint32_t events) {
+                auto it {connections.find(fd)};
+                if (it == connections.end()) return;
+                const std::uint64_t id {it->second.id};
+                auto alive {[this, fd, id] { auto it {connections.find(fd)}; return it != connections.end() && it->second.id == id; }};
+
+                if (it->second.listener) {
+                    const IP ipType {it->second.socket.ipType()};
+                    for (int client; alive() && (client = ::accept4(fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1;) {
+                        const int clientFd {add(Socket{client, SOCKTYPE::TCP, ipType})};
+                        if (handlers.accept) handlers.accept(fd, clientFd);
+                    }
+                    return;
+                }
+
+                if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                    for (;;) {
+                        long received {::recv(fd, scratch.data(), scratch.size(), 0)};
+                        if (received > 0) {
+                            if (handlers.data) handlers.data(fd, {scratch.data(), static_cast<std::size_t>(received)});
+                            if (!alive()) return;
+                            if (static_cast<std::size_t>(received) < scratch.size()) break;
+                        } else if (received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+                        else if (received == -1 && errno == EINTR) continue;
+                        else { drop(fd, true); return; }
+                    }
+                }
+                if (events & EPOLLOUT) writeOut(fd);
+            }
+
+            void writeOut(int fd) {
+                auto it {connections.find(fd)};
+                if (it == connections.end()) return;
+                Connection &conn {it->second};
+
+                std::array<iovec, MAX_GATHER> iovs;
+                while (!conn.outbox.empty()) {
+                    std::size_t count {};
+                    for (; count < std::min(MAX_GATHER, conn.outbox.size()); ++count)
+                        iovs[count] = {conn.outbox[count].data(), conn.outbox[count].size()};
+                    msghdr msg {.msg_name=nullptr, .msg_namelen=0, .msg_iov=iovs.data(), .msg_iovlen=count,
+                        .msg_control=nullptr, .msg_controllen=0, .msg_flags=0};
+
+                    long sent {::sendmsg(fd, &msg, MSG_NOSIGNAL)};
+                    if (sent == -1 && errno == EINTR) continue;
+                    if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+                    if (sent == -1) { drop(fd, true); return; }
+                    consume(conn.outbox, static_cast<std::size_t>(sent));
+                }
+
+                // Only wait for the socket to drain while there's something left to write
+                if (conn.sending != !conn.outbox.empty()) {
+                    conn.sending = !conn.outbox.empty();
+                    watch(conn, EPOLL_CTL_MOD, conn.sending? EPOLLIN | EPOLLOUT: EPOLLIN);
+                }
+            }
+
+            // Drop sent bytes off the front of the queue
+            static void consume(std::deque<std::string> &outbox, std::size_t sent) {
+                while (sent && sent >= outbox.front().size()) { sent -= outbox.front().size(); outbox.pop_front(); }
+                if (sent) outbox.front().erase(0, sent);
+            }
+
+            // Live connections by id, completions of closed ones (their fd may have been reused) are dropped
+            std::unordered_map<std::uint64_t, int> ids;
+
+            // Op is in the low byte of the user data, the connection's (or send's) id above it
+            enum Op : std::uint8_t { Accept, Recv, Send, Cancel };
+
+#ifdef NET_IO_URING
+            // Raw io_uring (no liburing) with a ring of buffers the kernel picks from for multishot recvs
+            class Ring {
+                public:
+                    static constexpr unsigned ENTRIES {256};
+                    bool zeroCopy {false};
+
+                    // Buffer count must be a power of two
+                    static std::unique_ptr<Ring> create(std::size_t bufferSize, unsigned bufferCount) {
+                        auto ring {std::make_unique<Ring>(bufferSize, bufferCount)};
+                        try { if (ring->setup()) return ring; } catch (SocketError&) {}
+                        return nullptr;
+                    }
+
+                    Ring(std::size_t bufferSize, unsigned bufferCount): bufferSize {bufferSize}, bufferCount {bufferCount} {}
+                    Ring(const Ring&) = delete;
+                    Ring &operator=(const Ring&) = delete;
+                    ~Ring() {
+                        if (bufRing) ::munmap(bufRing, bufferCount * sizeof(io_uring_buf));
+                        if (sqes) ::munmap(sqes, sqesSize);
+                        if (cqRing && cqRing != sqRing) ::munmap(cqRing, cqRingSize);
+                        if (sqRing) ::munmap(sqRing, sqRingSize);
+                        if (fd != -1) ::close(fd);
+                    }
+
+                    // Next free submission entry (zeroed), queued ones are submitted first if full
+                    io_uring_sqe &sqe() {
+                        if (*sqTail - load(sqHead) >= sqEntries) enter(0, 0);
+                        const unsigned idx {*sqTail & sqMask};
+                        io_uring_sqe &entry {sqes[idx]};
+                        entry = {}; sqArray[idx] = idx;
+                        store(sqTail, *sqTail + 1); ++queued;
+                        return entry;
+                    }
+
+                    // Submit queued entries & wait up to timeout ms (-1 forever) for `minComplete` completions
+                    void enter(unsigned minComplete, int timeout) {
+                        unsigned flags {minComplete || deferTaskrun || (load(sqFlags) & IORING_SQ_CQ_OVERFLOW)? IORING_ENTER_GETEVENTS: 0u};
+                        __kernel_timespec ts {.tv_sec=timeout / 1000, .tv_nsec=(timeout % 1000) * 1'000'000ll};
+                        io_uring_getevents_arg arg {.sigmask=0, .sigmask_sz=_NSIG / 8, .pad=0, .ts=reinterpret_cast<std::uint64_t>(&ts)};
+                        const bool timed {minComplete && timeout >= 0};
+                        if (timed) flags |= IORING_ENTER_EXT_ARG;
+
+                        for (;;) {
+                            long ret {::syscall(__NR_io_uring_enter, fd, queued, minComplete, flags, 
+                                timed? &arg: nullptr, timed? sizeof(arg): 0)};
+                            if (ret >= 0) { queued -= static_cast<unsigned>(ret); return; }
+                            if (errno == ETIME || errno == EINTR) return;
+                            if (errno != EAGAIN && errno != EBUSY) throw SocketError{"io_uring_enter failed"};
+                        }
+                    }
+
+                    // Hand every completion so far to fn, returns how many
+                    template<typename Fn> std::size_t reap(Fn &&fn) {
+                        std::size_t count {};
+                        for (unsigned head {*cqHead}; head != load(cqTail); ++head, ++count) {
+                            const io_uring_cqe cqe {cqes[head & cqMask]};
+                            store(cqHead, head + 1); fn(cqe);
+                        }
+                        return count;
+                    }
+
+                    std::string_view buffer(unsigned bid, std::size_t length) const {
+                        return {buffers.get() + static_cast<std::size_t>(bid) * bufferSize, length};
+                    }
+
+                    // Give a buffer back to the kernel once its data was consumed
+                    void recycle(unsigned bid) {
+                        // Ring's tail overlays the first entry's reserved field, only set the others
+                        io_uring_buf &buf {bufRing[bufTail & (bufferCount - 1)]};
+                        buf.addr = reinterpret_cast<std::uint64_t>(buffers.get() + static_cast<std::size_t>(bid) * bufferSize);
+                        buf.len = static_cast<std::uint32_t>(bufferSize); buf.bid = static_cast<std::uint16_t>(bid);
+                        std::atomic_ref<std::uint16_t>{bufRing[0].resv}.store(++bufTail, std::memory_order_release);
+                    }
+
+                private:
+                    std::size_t bufferSize;
+                    unsigned bufferCount;
+
+                    int fd {-1};
+                    void *sqRing {}, *cqRing {};
+                    std::size_t sqRingSize {}, cqRingSize {}, sqesSize {};
+                    unsigned *sqHead {}, *sqTail {}, *sqFlags {}, *sqArray {}, *cqHead {}, *cqTail {};
+                    unsigned sqMask {}, cqMask {}, sqEntries {}, queued {};
+                    bool deferTaskrun {false};
+                    io_uring_sqe *sqes {};
+                    io_uring_cqe *cqes {};
+
+                    // Plain array of entries, `io_uring_buf_ring::bufs` sits past an empty struct (1 byte in C++)
+                    io_uring_buf *bufRing {};
+                    std::uint16_t bufTail {};
+                    std::unique_ptr<char[]> buffers;
+
+                    // Heads & tails are written by one side and read by the other
+                    static unsigned load(unsigned *ptr) { return std::atomic_ref<unsigned>{*ptr}.load(std::memory_order_acquire); }
+                    static void store(unsigned *ptr, unsigned value) { std::atomic_ref<unsigned>{*ptr}.store(value, std::memory_order_release); }
+
+                    static void *map(int fd, std::size_t size, off_t offset) {
+                        void *ptr {::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset)};
+                        return ptr == MAP_FAILED? nullptr: ptr;
+                    }
+
+                    bool setup() {
+                        // Multishot ops post many completions per submission, give them room & never drop any.
+                        // Completions are only run when entering to reap them (6.1), batched instead of per wakeup
+                        io_uring_params params {};
+                        params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+                        params.cq_entries = ENTRIES * 8;
+                        fd = static_cast<int>(::syscall(__NR_io_uring_setup, ENTRIES, &params));
+                        if (fd < 0) {
+                            params = {};
+                            params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+                            params.cq_entries = ENTRIES * 8;
+                            fd = static_cast<int>(::syscall(__NR_io_uring_setup, ENTRIES, &params));
+                            if (fd < 0) return false;
+                        } else deferTaskrun = true;
+                        if (!(params.features & IORING_FEAT_NODROP) || !(params.features & IORING_FEAT_EXT_ARG)) return false;
+
+                        sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+                        cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+                        const bool singleMap {(params.features & IORING_FEAT_SINGLE_MMAP) != 0};
+                        if (singleMap) sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+                        sqRing = map(fd, sqRingSize, IORING_OFF_SQ_RING);
+                        cqRing = singleMap? sqRing: map(fd, cqRingSize, IORING_OFF_CQ_RING);
+                        sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+                        sqes = static_cast<io_uring_sqe*>(map(fd, sqesSize, IORING_OFF_SQES));
+                        if (!sqRing || !cqRing || !sqes) return false;
+
+                        char *sq {static_cast<char*>(sqRing)}, *cq {static_cast<char*>(cqRing)};
+                        sqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+                        sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+                        sqFlags = reinterpret_cast<unsigned*>(sq + params.sq_off.flags);
+                        sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+                        sqMask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+                        cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+                        cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+                        cqMask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+                        cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+                        sqEntries = params.sq_entries;
+
+                        // Zero copy send (6.0) also implies multishot recv, zero copy sendmsg is optional (6.1)
+                        constexpr unsigned MAX_OPS {256};
+                        alignas(io_uring_probe) std::array<std::byte, sizeof(io_uring_probe) + MAX_OPS * sizeof(io_uring_probe_op)> probeBuf {};
+                        auto *probe {reinterpret_cast<io_uring_probe*>(probeBuf.data())};
+                        if (::syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, MAX_OPS) < 0) return false;
+                        auto has {[probe](unsigned op) { return op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED); }};
+                        for (unsigned op: {IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SENDMSG, IORING_OP_ASYNC_CANCEL, IORING_OP_SEND_ZC})
+                            if (!has(op)) return false;
+                        zeroCopy = has(IORING_OP_SENDMSG_ZC);
+
+                        // Provided buffer ring (5.19), every buffer handed to the kernel up front
+                        void *ringMem {::mmap(nullptr, bufferCount * sizeof(io_uring_buf), PROT_READ | PROT_WRITE, 
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)};
+                        if (ringMem == MAP_FAILED) return false;
+                        bufRing = static_cast<io_uring_buf*>(ringMem);
+                        io_uring_buf_reg reg {.ring_addr=reinterpret_cast<std::uint64_t>(ringMem), .ring_entries=bufferCount, .bgid=0, .pad=0, .resv={}};
+                        if (::syscall(__NR_io_uring_register, fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) return false;
+                        buffers = std::make_unique_for_overwrite<char[]>(bufferCount * bufferSize);
+                        for (unsigned bid {}; bid < bufferCount; ++bid) recycle(bid);
+                        return true;
+                    }
+            };
+
+            // A send in flight, its buffers live until the kernel is done with them (the notification for zero copy)
+            struct SendOp {
+                std::uint64_t conn;
+                std::vector<std::string> chunks {};
+                std::vector<iovec> iovs {};
+                msghdr msg {};
+                std::size_t total {};
+                bool zeroCopy {false}, completed {false}, notified {true};
+            };
+
+            std::unique_ptr<Ring> ring;
+            std::unordered_map<std::uint64_t, std::unique_ptr<SendOp>> sends;
+            std::size_t armed {};
+
+            void armAccept(const Connection &conn) {
+                io_uring_sqe &sqe {ring->sqe()};
+                sqe.opcode = IORING_OP_ACCEPT; sqe.fd = conn.socket.fd(); sqe.ioprio = IORING_ACCEPT_MULTISHOT;
+                sqe.accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC; sqe.user_data = (conn.id << 8) | Op::Accept;
+                ++armed;
+            }
+
+            void armRecv(const Connection &conn) {
+                io_uring_sqe &sqe {ring->sqe()};
+                sqe.opcode = IORING_OP_RECV; sqe.fd = conn.socket.fd(); sqe.ioprio = IORING_RECV_MULTISHOT;
+                sqe.flags = IOSQE_BUFFER_SELECT; sqe.buf_group = 0; sqe.user_data = (conn.id << 8) | Op::Recv;
+                ++armed;
+            }
+
+            // Everything queued goes out in one gather send (sent in pieces, Nagle would hold them back),
+            // zero copy when it adds up to enough to be worth pinning the pages
+            void submitSend(int fd) {
+                auto it {connections.find(fd)};
+                if (it == connections.end() || it->second.sending || it->second.outbox.empty()) return;
+                Connection &conn {it->second};
+
+                auto op {std::make_unique<SendOp>(conn.id)};
+                while (!conn.outbox.empty() && op->chunks.size() < MAX_GATHER) {
+                    op->total += conn.outbox.front().size();
+                    op->chunks.push_back(std::move(conn.outbox.front())); conn.outbox.pop_front();
+                }
+                for (std::string &chunk: op->chunks) op->iovs.push_back({chunk.data(), chunk.size()});
+                op->msg.msg_iov = op->iovs.data(); op->msg.msg_iovlen = op->iovs.size();
+                op->zeroCopy = ring->zeroCopy && conn.zeroCopy && op->total >= ZERO_COPY_MIN;
+
+                const std::uint64_t sendId {nextId++};
+                io_uring_sqe &sqe {ring->sqe()};
+                sqe.opcode = op->zeroCopy? IORING_OP_SENDMSG_ZC: IORING_OP_SENDMSG; sqe.fd = fd; 
+                sqe.addr = reinterpret_cast<std::uint64_t>(&op->msg); sqe.len = 1;
+                sqe.msg_flags = MSG_NOSIGNAL; sqe.user_data = (sendId << 8) | Op::Send;
+                conn.sending = true;
+                sends.emplace(sendId, std::move(op));
+            }
+
+            void complete(const io_uring_cqe &cqe) {
+                const std::uint64_t id {cqe.user_data >> 8};
+                const bool more {(cqe.flags & IORING_CQE_F_MORE) != 0};
+                switch (static_cast<Op>(cqe.user_data & 0xff)) {
+                    case Op::Send: completeSend(id, cqe); return;
+                    case Op::Cancel: return;
+                    case Op::Accept: {
+                        if (!more) --armed;
+                        auto it {ids.find(id)};
+                        if (it == ids.end()) { if (cqe.res >= 0) ::close(cqe.res); return; }
+                        const int listenerFd {it->second};
+                        if (cqe.res >= 0) {
+                            const int fd {add(Socket{cqe.res, SOCKTYPE::TCP, connections.at(listenerFd).socket.ipType()})};
+                            if (handlers.accept) handlers.accept(listenerFd, fd);
+                        }
+                        if (!more && ids.contains(id)) armAccept(connections.at(listenerFd));
+                        return;
+                    }
+                    case Op::Recv: {
+                        if (!more) --armed;
+                        const bool hasBuffer {(cqe.flags & IORING_CQE_F_BUFFER) != 0};
+                        const unsigned bid {cqe.flags >> IORING_CQE_BUFFER_SHIFT};
+                        auto it {ids.find(id)};
+                        if (it != ids.end() && cqe.res > 0 && hasBuffer && handlers.data)
+                            handlers.data(it->second, ring->buffer(bid, static_cast<std::size_t>(cqe.res)));
+                        if (hasBuffer) ring->recycle(bid);
+
+                        // Ran out of buffers (they're back now) or the kernel ended the multishot, rearm. EOF & errors close
+                        it = ids.find(id);
+                        if (it == ids.end()) return;
+                        if (cqe.res > 0 || cqe.res == -ENOBUFS) { if (!more) armRecv(connections.at(it->second)); }
+                        else drop(it->second, true);
+                        return;
+                    }
+                }
+            }
+
+            void completeSend(std::uint64_t sendId, const io_uring_cqe &cqe) {
+                auto it {sends.find(sendId)};
+                if (it == sends.end()) return;
+                SendOp &op {*it->second};
+
+                // Zero copy sends post a notification once the buffer is no longer in use
+                if (cqe.flags & IORING_CQE_F_NOTIF) {
+                    op.notified = true;
+                    if (op.completed) sends.erase(it);
+                    return;
+                }
+                op.completed = true; op.notified = !(cqe.flags & IORING_CQE_F_MORE);
+
+                if (auto connIt {ids.find(op.conn)}; connIt != ids.end()) {
+                    const int fd {connIt->second};
+                    Connection &conn {connections.at(fd)};
+                    conn.sending = false;
+
+                    // Requeue what wasn't sent (all of it where zero copy isn't supported, like AF_UNIX) in front
+                    std::size_t sent {cqe.res > 0? static_cast<std::size_t>(cqe.res): 0};
+                    if (cqe.res >= 0 || (cqe.res == -EOPNOTSUPP && op.zeroCopy)) {
+                        if (cqe.res < 0) conn.zeroCopy = false;
+                        std::vector<std::string> rest;
+                        for (std::string &chunk: op.chunks) {
+                            if (sent >= chunk.size()) { sent -= chunk.size(); continue; }
+                            rest.push_back(sent? chunk.substr(sent): std::move(chunk)); sent = 0;
+                        }
+                        for (auto chunk {rest.rbegin()}; chunk != rest.rend(); ++chunk) conn.outbox.push_front(std::move(*chunk));
+                        if (!conn.outbox.empty()) dirty.push_back(fd);
+                    } else drop(fd, true);
+                }
+                if (op.completed && op.notified) sends.erase(sendId);
+            }
+#else
+            static constexpr std::nullptr_t ring {};
+#endif
+    };
 }
@@ -0,0 +1,142 @@
+/*
+ * Loopback echo benchmark: the same echo server on PollManager (poll backend), the Reactor on epoll &
+ * the Reactor on io_uring. Client threads each keep one message in flight and wait for its echo.
+ * Reports throughput, round trips per second and the server thread's CPU time.
+ *
+ * g++ reactor-bench.cpp -std=c++23 -O2 -lssl -lcrypto -o reactor-bench
+ */
+
+#include "net.hpp"
+
+#include <sys/resource.h>
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <print>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+namespace {
+    constexpr std::size_t CLIENTS {32};
+
+    struct Load { std::string name; std::size_t messageSize, rounds; };
+    struct Result { double seconds, serverCpu; };
+
+    double threadCpuSeconds() {
+        rusage usage {}; ::getrusage(RUSAGE_THREAD, &usage);
+        return static_cast<double>(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec)
+            + static_cast<double>(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+    }
+
+    net::Socket makeListener(std::uint16_t &port) {
+        net::Socket listener;
+        listener.bind("127.0.0.1", 0);
+        sockaddr_in addr {}; socklen_t addrLen {sizeof(addr)};
+        if (::getsockname(listener.fd(), reinterpret_cast<sockaddr*>(&addr), &addrLen) == -1)
+            throw net::SocketError{"getsockname failed"};
+        port = net::utils::bswap(addr.sin_port);
+        listener.listen(CLIENTS);
+        listener.setNonBlocking();
+        return listener;
+    }
+
+    // Echo over PollManager, replies wait for the socket to drain when they don't fit
+    void pollServer(net::Socket listener, const std::atomic<bool> &stop) {
+        net::PollManager pm {net::PollManager::Backend::Poll};
+        const int listenerFd {pm.track(std::move(listener), net::PollEventType::Readable)};
+        std::unordered_map<int, std::string> outbox;
+        while (!stop) {
+            for (auto &[socket, event]: pm.poll(10)) {
+                const int fd {socket.fd()};
+                if (fd == listenerFd) {
+                    for (;;) {
+                        try { pm.track(socket.accept(), net::PollEventType::Readable); }
+                        catch (net::SocketError&) { break; }
+                    }
+                    continue;
+                }
+
+                std::string &out {outbox[fd]};
+                if (event & net::PollEventType::Readable) socket.recvAll(out);
+                if (!socket.ok()) { outbox.erase(fd); continue; }
+                if (!out.empty()) out.erase(0, static_cast<std::size_t>(socket.send(out)));
+                pm.updateTracking(fd, out.empty()? net::PollEventType::Readable
+                    : net::PollEventType::Readable | net::PollEventType::Writable);
+            }
+        }
+    }
+
+    void reactorServer(net::Socket listener, const std::atomic<bool> &stop, net::Reactor::Backend backend) {
+        net::Reactor *reactorPtr {nullptr};
+        net::Reactor reactor {{.data=[&reactorPtr](int fd, std::string_view data) {
+            reactorPtr->send(fd, std::string{data}); }}, backend};
+        reactorPtr = &reactor;
+        reactor.listen(std::move(listener));
+        while (!stop) std::ignore = reactor.poll(10);
+    }
+
+    template<typename Server>
+    Result run(const Load &load, Server server) {
+        std::uint16_t port;
+        net::Socket listener {makeListener(port)};
+        std::atomic<bool> stop {false};
+        double serverCpu {};
+        std::thread serverThread {[&] { server(std::move(listener), stop); serverCpu = threadCpuSeconds(); }};
+
+        const auto start {Clock::now()};
+        std::vector<std::thread> clients;
+        for (std::size_t i {}; i < CLIENTS; ++i) {
+            clients.emplace_back([&load, port] {
+                net::Socket socket;
+                socket.connect("127.0.0.1", port);
+                const std::string message(load.messageSize, 'x');
+                std::string reply(load.messageSize, '\0');
+                for (std::size_t round {}; round < load.rounds; ++round) {
+                    if (socket.sendAll(message) != static_cast<long>(message.size())) throw net::SocketError{"Short send"};
+                    for (std::size_t received {}; received < reply.size();) {
+                        long bytes {::recv(socket.fd(), reply.data() + received, reply.size() - received, 0)};
+                        if (bytes <= 0) throw net::SocketError{"Echo server hung up"};
+                        received += static_cast<std::size_t>(bytes);
+                    }
+                }
+            });
+        }
+        for (std::thread &client: clients) client.join();
+        const double seconds {std::chrono::duration<double>(Clock::now() - start).count()};
+
+        stop = true; serverThread.join();
+        return {seconds, serverCpu};
+    }
+}
+
+int main() {
+    const std::vector<Load> loads {{"512 B", 512, 4000}, {"64 KB", 64 << 10, 1000}};
+    struct Server { std::string name; std::function<Result(const Load&)> run; };
+    const std::vector<Server> servers {
+        {"poll", [](const Load &load) { return run(load, pollServer); }},
+        {"epoll", [](const Load &load) { return run(load, [](net::Socket listener, const std::atomic<bool> &stop) {
+            reactorServer(std::move(listener), stop, net::Reactor::Backend::Epoll); }); }},
+        {"io_uring", [](const Load &load) { return run(load, [](net::Socket listener, const std::atomic<bool> &stop) {
+            reactorServer(std::move(listener), stop, net::Reactor::Backend::IoUring); }); }},
+    };
+
+    net::Reactor probe {{}};
+    if (probe.backend() != net::Reactor::Backend::IoUring)
+        std::println("io_uring unavailable, the io_uring row runs on epoll");
+
+    std::println("{:<8} {:<9} {:>10} {:>12} {:>14} {:>14}", "Message", "Server", "Time (s)", "MB/s",
+        "Round trips/s", "Server CPU s");
+    for (const Load &load: loads) {
+        const double totalBytes {static_cast<double>(2 * CLIENTS * load.rounds * load.messageSize)};
+        for (const auto &[name, runServer]: servers) {
+            const auto [seconds, serverCpu] {runServer(load)};
+            std::println("{:<8} {:<9} {:>10.2f} {:>12.1f} {:>14.0f} {:>14.2f}", load.name, name, seconds,
+                totalBytes / (1 << 20) / seconds, static_cast<double>(CLIENTS * load.rounds) / seconds, serverCpu);
+        }
+    }
+}
@@ -1,7 +1,13 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
 #include <memory>
-namespace JSON { 
+#include <string>
+#include <string_view>
+#include <utility>
+
+namespace JSON {
     struct JSONHandle; class JSONNode;
     using JSONNodePtr = std::shared_ptr<JSONNode>;
 }
@@ -9,4 +15,63 @@ namespace JSON {
 namespace Bencode {
     [[nodiscard]] std::string encode(JSON::JSONNodePtr root, bool sortKeys = false, bool _skipKey = true);
     [[nodiscard]] JSON::JSONHandle decode(const std::string &encoded, bool ignoreSpaces = true);
+
+    // Zero copy alternative to `decode`: a value is the span of its raw bytes inside the encoded buffer,
+    // which must outlive it. Nothing is built up front, fields are found by skipping over the bytes as they
+    // are accessed. Like JSONHandle, missing keys / indices give a null view that reads as 0 or ""
+    class View {
+        public:
+            enum class Type : std::uint8_t { null, integer, string, list, dict };
+
+            // Dict entries come with their key, list elements with an empty one
+            class Iterator {
+                public:
+                    using value_type = std::pair<std::string_view, View>;
+                    using difference_type = std::ptrdiff_t;
+
+                    Iterator() = default;
+                    Iterator(std::string_view rest, bool dict);
+
+                    [[nodiscard]] value_type operator*() const;
+                    Iterator &operator++();
+                    Iterator operator++(int) { Iterator prev {*this}; ++*this; return prev; }
+                    [[nodiscard]] bool operator==(const Iterator &other) const { return rest.data() == other.rest.data(); }
+
+                private:
+                    // Bytes from the current element up to the container's end marker
+                    std::string_view rest;
+                    bool dict {false};
+            };
+
+            View() = default;
+
+            // Validates that `encoded` holds exactly one well formed value, throws otherwise
+            [[nodiscard]] static View parse(std::string_view encoded);
+
+            [[nodiscard]] Type type() const;
+            [[nodiscard]] explicit operator bool() const { return !bytes.empty(); }
+
+            // Encoded bytes of the value, e.g. what the info hash is computed over
+            [[nodiscard]] std::string_view raw() const { return bytes; }
+
+            // Contents of a string / integer value, throws on any other type
+            [[nodiscard]] std::string_view str() const;
+            [[nodiscard]] std::int64_t integer() const;
+
+            // Lookup by key (dicts) or position (lists), linear in the entries skipped
+            [[nodiscard]] View operator[](std::string_view key) const;
+            [[nodiscard]] View operator[](std::size_t idx) const;
+
+            // Same as above but throw if the key / index doesn't exist
+            [[nodiscard]] View at(std::string_view key) const;
+            [[nodiscard]] View at(std::size_t idx) const;
+
+            // Elements of a list or the (key, value) pairs of a dict, empty for anything else
+            [[nodiscard]] Iterator begin() const;
+            [[nodiscard]] Iterator end() const;
+
+        private:
+            explicit View(std::string_view bytes): bytes {bytes} {}
+            std::string_view bytes;
+    };
 }
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace Torrent {
+    // Assembled pieces are shared read only between the hasher, disk writer & read cache
+    using SharedPiece = std::shared_ptr<const std::string>;
+
+    // Recycles piece sized slabs so that assembling a piece doesn't allocate (and zero fill)
+    // a fresh buffer. A slab returns to the pool once its last reference is dropped, on any thread
+    class BufferPool {
+        private:
+            struct State {
+                const std::size_t slabSize, maxFree;
+                std::vector<std::unique_ptr<std::string>> free;
+                std::mutex mutex;
+            };
+
+            // Shared with the deleters since slabs may outlive the pool
+            std::shared_ptr<State> state;
+
+        public:
+            explicit BufferPool(const std::size_t slabSize, const std::size_t maxFree = 32);
+
+            // Slab of `slabSize` bytes, contents are whatever the previous user left behind
+            [[nodiscard]] std::shared_ptr<std::string> acquire() const;
+
+            [[nodiscard]] std::size_t available() const;
+    };
+}
@@ -4,7 +4,7 @@
 #include <filesystem>
 #include <functional>
 #include <random>
-#include <unordered_set>
+#include <string>
 
 namespace Torrent {
     enum class MsgType : std::uint8_t {
@@ -18,6 +18,11 @@ namespace Torrent {
         Piece = 7,
         Cancel = 8,
         Port = 9,
+        SuggestPiece = 13,  // BEP 6 (Fast Extension)
+        HaveAll = 14,
+        HaveNone = 15,
+        RejectRequest = 16,
+        AllowedFast = 17,
         KeepAlive = 99,
         Unknown = 100
     };
@@ -35,6 +40,11 @@ namespace Torrent {
             case MsgType::Piece:         return "Piece";
             case MsgType::Cancel:        return "Cancel";
             case MsgType::Port:          return "Port";
+            case MsgType::SuggestPiece:  return "SuggestPiece";
+            case MsgType::HaveAll:       return "HaveAll";
+            case MsgType::HaveNone:      return "HaveNone";
+            case MsgType::RejectRequest: return "RejectRequest";
+            case MsgType::AllowedFast:   return "AllowedFast";
             case MsgType::KeepAlive:     return "KeepAlive";
             default:                     return "Unknown";
         }
@@ -42,7 +52,7 @@ namespace Torrent {
 
     template<std::integral T> 
     T randInteger() {
-        static std::mt19937 rng {std::random_device{}()};
+        thread_local std::mt19937 rng {std::random_device{}()};
         std::uniform_int_distribution<T> gen{
             std::numeric_limits<T>::min(), 
             std::numeric_limits<T>::max()
@@ -71,9 +81,19 @@ namespace Torrent {
 
     struct FileStruct { std::filesystem::path path; std::uint64_t size; };
 
+    // Per file download priority, pieces take the highest priority of the files they overlap
+    enum class FilePriority : std::uint8_t { Skip, Low, Normal, High };
+
+    constexpr std::string_view str(FilePriority priority) {
+        switch (priority) {
+            case FilePriority::Skip:   return "skip";
+            case FilePriority::Low:    return "low";
+            case FilePriority::Normal: return "normal";
+            case FilePriority::High:   return "high";
+            default:                   return "unknown";
+        }
+    }
+
     std::string randString(std::size_t length);
     std::string generatePeerID();
-
-    std::unordered_set<std::uint32_t> readBitField(std::string_view payload);
-    std::string writeBitField(const std::unordered_set<std::uint32_t>&);
 }
@@ -0,0 +1,147 @@
+#pragma once
+
+#include "torrent_tracker.hpp"
+
+#include "../../networking/net.hpp"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Forward declare to speed up compilation
+namespace JSON { struct JSONHandle; }
+
+namespace Torrent {
+    // Kademlia DHT node (BEP 5) for finding peers without a tracker. Runs on a UDP socket & thread of
+    // its own: answers ping / find_node / get_peers / announce_peer from other nodes and drives the
+    // iterative lookups behind `getPeers` (ALPHA queries in flight, converging on the K closest nodes).
+    // Our ID & the good nodes of the routing table are cached on disk so the next run can skip the routers
+    class DHTNode {
+        public:
+            using Peer = TorrentTracker::Peer;
+            using Clock = std::chrono::steady_clock;
+
+            // Public routers to join through when the node cache has nothing to offer
+            static const std::vector<Peer> BOOTSTRAP_ROUTERS;
+
+        private:
+            // Bucket size & lookup concurrency, nodes failing MAX_FAILS queries in a row are replaced first
+            static constexpr std::size_t K {8}, ALPHA {3}, MAX_FAILS {2}, ID_BITS {160};
+            static constexpr std::chrono::milliseconds QUERY_TIMEOUT {2000};
+
+            // Tokens rotate every TOKEN_INTERVAL (the previous one is still accepted) & announced peers
+            // expire after PEER_TTL. Our neighbourhood is refreshed every REFRESH_INTERVAL, or every
+            // BOOTSTRAP_RETRY while the table is nearly empty, and the node cache saved every SAVE_INTERVAL
+            static constexpr std::chrono::minutes TOKEN_INTERVAL {5}, PEER_TTL {30}, REFRESH_INTERVAL {15}, SAVE_INTERVAL {10};
+            static constexpr std::chrono::seconds BOOTSTRAP_RETRY {30};
+
+            // Bounds on what other nodes can make us store & how many peers go into a single reply
+            static constexpr std::size_t MAX_STORED_HASHES {1 << 12}, MAX_PEERS_PER_HASH {128}, MAX_VALUES {50};
+
+            // Contacts may not have an ID yet (bootstrap routers)
+            struct Node {
+                std::string id {}, ip {}; std::uint16_t port {};
+                Clock::time_point lastSeen {}; std::size_t fails {};
+            };
+
+            struct Candidate { Node node; bool queried {false}, responded {false}, failed {false}; std::string token {}; };
+
+            // Iterative find_node / get_peers towards `target`, done once the K closest live candidates answered
+            struct Lookup {
+                std::string target;
+                bool getPeers {false};
+                std::uint16_t announcePort {};
+                std::vector<Candidate> candidates {};
+                std::size_t inFlight {};
+                std::vector<Peer> peers {};
+                bool done {false};
+            };
+
+            // Outstanding query by transaction ID, lookup is null for pings & announces
+            struct Query { std::shared_ptr<Lookup> lookup; Node node; Clock::time_point sentAt; };
+
+            struct StoredPeer { Peer peer; Clock::time_point announcedAt; };
+
+            const std::filesystem::path cachePath;
+            net::Socket socket;
+            std::uint16_t _port {};
+            std::string nodeID;
+
+            // Everything below is shared by the worker & callers of the public methods
+            mutable std::mutex mutex;
+            std::condition_variable lookupDone;
+            std::array<std::vector<Node>, ID_BITS> buckets;
+            std::vector<Node> contacts;
+            std::unordered_map<std::string, Query> queries;
+            std::uint16_t nextTransaction {};
+
+            // Peers announced to us by info hash & the secrets tokens are derived from
+            std::unordered_map<std::string, std::vector<StoredPeer>> storage;
+            std::string secret, previousSecret;
+            Clock::time_point lastRotate, lastSave, nextRefresh;
+
+            std::atomic<bool> stop {false};
+            std::thread worker;
+
+            void run(std::vector<Peer> bootstrap);
+            void receive(Clock::time_point now);
+            void tick(Clock::time_point now);
+
+            void handleMessage(const std::string &data, const std::string &ip, std::uint16_t port, Clock::time_point now);
+            void handleQuery(JSON::JSONHandle message, const std::string &transaction,
+                const std::string &ip, std::uint16_t port, Clock::time_point now);
+            void handleResponse(JSON::JSONHandle message, const std::string &transaction,
+                const std::string &ip, std::uint16_t port, Clock::time_point now);
+            void onFailure(Query &query, Clock::time_point now);
+
+            void send(const std::string &message, const std::string &ip, std::uint16_t port);
+            void sendQuery(const std::string &method, std::map<std::string, std::string> args, const Node &node,
+                std::shared_ptr<Lookup> lookup, Clock::time_point now);
+            void startLookup(const std::shared_ptr<Lookup> &lookup, Clock::time_point now);
+            void advance(const std::shared_ptr<Lookup> &lookup, Clock::time_point now);
+            void finish(Lookup &lookup, Clock::time_point now);
+
+            void insert(Node node);
+            void store(const std::string &infoHash, Peer peer, Clock::time_point now);
+            [[nodiscard]] std::vector<Node> closest(const std::string &target, std::size_t count) const;
+            [[nodiscard]] std::size_t bucketIndex(const std::string &id) const;
+            [[nodiscard]] std::size_t countNodes() const;
+            [[nodiscard]] std::string makeToken(const std::string &ip, const std::string &key) const;
+
+            void loadCache();
+            void saveCache() const;
+
+        public:
+            ~DHTNode();
+            DHTNode(const DHTNode&) = delete;
+            DHTNode &operator=(const DHTNode&) = delete;
+
+            // Bind the UDP port (0 picks a free one) & join the DHT through the cached nodes and `bootstrap`
+            // (resolved off the caller's thread). Nothing is cached if the path is empty
+            explicit DHTNode(const std::uint16_t port, const std::filesystem::path &cachePath = {},
+                const std::vector<Peer> &bootstrap = BOOTSTRAP_ROUTERS);
+
+            // Another node to join through (a torrent's `nodes`), hostnames are resolved right away
+            void addContact(const std::string &host, const std::uint16_t port);
+
+            // Iterative get_peers for the info hash, blocks for up to `timeout` & returns the peers found by then.
+            // We are announced on `announcePort` to the closest nodes that answered unless it is 0
+            [[nodiscard]] std::vector<Peer> getPeers(const std::string &infoHash, const std::uint16_t announcePort,
+                const std::chrono::milliseconds timeout);
+
+            // Nodes in the routing table
+            [[nodiscard]] std::size_t size() const;
+            [[nodiscard]] std::uint16_t port() const { return _port; }
+            [[nodiscard]] const std::string &id() const { return nodeID; }
+    };
+}
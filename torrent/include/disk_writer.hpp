@@ -1,47 +1,258 @@
 #pragma once
 
+#include "buffer_pool.hpp"
 #include "common.hpp"
+#include "dynamic_bitset.hpp"
+#include "file_cache.hpp"
+#include "io_ring.hpp"
+#include "mpsc_queue.hpp"
+#include "piece_cache.hpp"
+
+#include "../../misc/threadPool.hpp"
 
 #include <atomic>
 #include <condition_variable>
 #include <cstdint>
+#include <deque>
 #include <filesystem>
-#include <fstream>
+#include <functional>
+#include <memory>
 #include <mutex>
 #include <openssl/ssl.h>
-#include <queue>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 namespace Torrent {
+    class DiskWriter;
+
+    // How pieces reach the disk: io_uring if the kernel supports it (Auto), or pwritev / pread on worker threads
+    enum class DiskBackend : std::uint8_t { Auto, IoUring, Threads };
+
+    // I/O shared by all disk writers of a session. Writers with pending pieces are serviced
+    // round robin, one batch at a time, so a busy torrent can't starve the rest. Syncs & upload
+    // reads run on threads of their own, completed reads are signalled on an eventfd
+    class DiskIOPool {
+        public:
+            // Part of a piece read for upload, straight into the caller's buffer
+            struct ReadOp { int fd; char *buffer; std::uint64_t length, offset; };
+
+        private:
+            std::vector<std::thread> workers;
+            std::thread syncer, reader;
+            std::deque<DiskWriter*> ready, syncQueue;
+            std::deque<std::pair<DiskWriter*, std::uint32_t>> readQueue;
+            int eventFd {-1};
+            std::condition_variable poolCV;
+            std::mutex poolMutex;
+            bool exitCondition {false};
+
+            // io_uring backend: a single thread keeps up to RING_DEPTH gather writes in flight across
+            // all writers, reads go through a ring of their own on the caller's thread
+            static constexpr unsigned RING_DEPTH {64}, READ_RING_DEPTH {16};
+            std::unique_ptr<IoRing> ring, readRing;
+            std::mutex readMutex;
+
+            // Files of every writer are opened on demand, up to a limit shared across the pool
+            FileCache fileCache;
+
+            void runWorker();
+            void runRing();
+            void runSyncer();
+            void runReader();
+
+        public:
+            ~DiskIOPool();
+            explicit DiskIOPool(const std::size_t nWorkers = 4, const DiskBackend backend = DiskBackend::Auto,
+                const std::size_t maxOpenFiles = 512);
+
+            // Writer has pieces queued up, add it to the ready list if not already present
+            void notify(DiskWriter &writer);
+
+            // Writer's sync task is due, queue it for the sync thread if not already queued
+            void requestSync(DiskWriter &writer);
+
+            // Read a piece of the writer off the caller's thread, the result is queued on the writer
+            void readAsync(DiskWriter &writer, std::uint32_t pieceIdx);
+
+            // Remove writer from the ready, sync & read lists and wait for workers to be done with it
+            void detach(DiskWriter &writer);
+
+            // Fill every buffer from its file, all at once on the read ring when there is one
+            void read(const std::vector<ReadOp> &ops);
+
+            // Readable once reads have completed, to be registered with the event loop. Cleared
+            // by `clearCompletions`, before the writers' reads are drained
+            [[nodiscard]] int completionFd() const { return eventFd; }
+            void clearCompletions();
+
+            [[nodiscard]] bool usingIoUring() const { return ring != nullptr; }
+            [[nodiscard]] FileCache &files() { return fileCache; }
+    };
+
     class DiskWriter {
+        private:
+            // Slice of the torrent's byte stream stored in a single file, `fileIdx` is its index in the torrent.
+            // Files are sparse until wanted, skipped ones only ever hold the edges of shared pieces. Opened
+            // through the pool's file cache, by slot index
+            struct FileSlot {
+                std::filesystem::path path; std::uint64_t offset, size; std::size_t fileIdx;
+                bool wanted {true}, allocated {false};
+            };
+
+            // Part of a byte range that falls within one file
+            struct Segment { std::size_t slot; std::uint64_t fileOffset, offset, length; };
+
+            // Contiguous pieces written together (sorted by offset) & the gather write of a batch into one file
+            using Batch = std::vector<std::pair<std::uint64_t, SharedPiece>>;
+            struct WriteOp { std::size_t slot; int fd; std::uint64_t fileOffset; std::vector<iovec> iovs; };
+
+        public:
+            // Upload read done by the pool, piece is null on failure
+            struct ReadResult { std::uint32_t pieceIdx; SharedPiece piece; std::string error; };
+
         private:
             const std::string name;
-            const std::uint64_t totalSize; 
+            const std::uint64_t totalSize;
             const std::uint32_t pieceSize;
             const std::filesystem::path DownloadDir;
             const std::size_t MAX_QUEUE;
 
-            std::filesystem::path DownloadTempFilePath;
-            std::fstream DownloadTempFile;
+            // Max no of contiguous pieces merged into a single gather write
+            static constexpr std::size_t MAX_COALESCE {16};
+
+            // Files are written in their final layout under a hidden staging directory
+            // which is renamed into place once the download completes
+            std::filesystem::path StagingDir;
+            std::vector<FileSlot> slots;
+            std::mutex fileMutex;
 
-            // Threading related stuff
-            std::queue<std::pair<std::uint64_t, std::string>> tasks;
-            std::atomic<bool> exitCondition {false};
+            // Files written to since the last `syncFiles`, by slot
+            std::vector<bool> dirty;
+            std::mutex dirtyMutex;
+
+            // Staging files were left behind by an earlier run
+            bool existingData {false};
+
+            // Pieces read for uploads are cached in the session's shared memory budget
+            PieceCache &cache;
+
+            // Told about every byte range once written, from the pool workers
+            std::vector<std::function<void(std::uint64_t, std::uint64_t)>> writeListeners;
+
+            // Run on the pool's sync thread when requested
+            std::function<void()> syncTask;
+
+            // Async reads: results come back from the pool, the rest is only touched by the network thread.
+            // Pieces drained are held in `loaded` until the next drain, the cache may not have room for them
+            MPSCQueue<ReadResult> readResults;
+            std::unordered_set<std::uint32_t> reading;
+            std::unordered_map<std::uint32_t, SharedPiece> loaded;
+
+            // Threading related stuff, deques since reads look up pieces not yet written. Pieces
+            // being written are kept around until the write completes & are served from memory
+            std::deque<std::pair<std::uint64_t, SharedPiece>> tasks, writing;
+            std::atomic<bool> exitCondition {false}, failed {false};
             std::condition_variable tasksCV;
             std::mutex taskMutex;
-            std::thread writer;
+
+            // Shared pool state, guarded by the pool's mutex
+            DiskIOPool &pool;
+            bool queued {false}, syncQueued {false}, detached {false};
+            std::size_t servicing {};
+            friend class DiskIOPool;
 
         private:
-            bool chunkCopy(std::ifstream &source, std::ofstream &destination, 
-                std::uint64_t size, std::uint64_t chunkSize = 5 * 1024 * 1024);
+            // Split a byte range of the torrent into per file segments
+            std::vector<Segment> segments(std::uint64_t offset, std::uint64_t length) const;
+
+            // Piece from the cache or the write queue, null if it has to come from disk
+            SharedPiece readMemory(std::uint32_t pieceIdx);
+            SharedPiece readDisk(std::uint32_t pieceIdx);
+
+            // Fd of a file pinned open until released
+            int openSlot(std::size_t slot) const { return pool.files().acquire(this, slot, slots[slot].path); }
+            void releaseSlot(std::size_t slot) const { pool.files().release(this, slot); }
+
+            // Gather writes (one per file) covering a batch, pointing into its pieces. Their files
+            // stay open until the ops are released
+            std::vector<WriteOp> writeOps(const Batch &batch) const;
+            void releaseOps(const std::vector<WriteOp> &ops) const;
+
+            // Write out pieces covering one contiguous range, sorted by offset
+            void writeRange(const Batch &batch);
+
+            // Pop the oldest queued piece along with those contiguous with it, moved to `writing`
+            Batch takeBatch();
+
+            // Batch is on disk: mark its files dirty, tell the listeners & release its pieces, returns if more are pending
+            bool completeBatch(const Batch &batch);
+
+            // Stop accepting pieces after a failed write
+            void onWriteFailure(const std::exception &ex);
+
+            [[nodiscard]] bool hasTasks();
+
+            // Called from pool workers, writes queued pieces contiguous with the oldest 
+            // one in a single batch and returns if more are pending
+            bool writeOne();
+
+            void closeFiles();
 
         public:
             ~DiskWriter();
-            DiskWriter(const std::string name, const std::uint64_t totalSize, const std::uint32_t pieceSize, 
-                    const std::filesystem::path downloadDir, bool coldStart, const std::size_t maxQueueSize = 5000);
-            void schedule(std::uint64_t offset, std::string &&piece);
-            [[nodiscard]] bool finish(const std::vector<FileStruct> &files, bool status);
+            DiskWriter(DiskIOPool &pool, PieceCache &cache, const std::string name, const std::uint64_t totalSize,
+                    const std::uint32_t pieceSize, const std::vector<FileStruct> &files, 
+                    const std::filesystem::path downloadDir, bool coldStart,
+                    const std::size_t maxQueueSize = 5000);
+            // Piece is shared, not copied: it's held until written & may be served from the queue
+            void schedule(std::uint64_t offset, SharedPiece piece);
+
+            // SHA1 checks every piece already on disk (mmap'd) across the pool, workers claim 
+            // pieces in order so that files are read sequentially. Returns the valid pieces.
+            // Must be called before any piece is scheduled
+            [[nodiscard]] DynamicBitset recheck(std::string_view pieceHashes, async::ThreadPool &pool);
+            [[nodiscard]] bool hasExistingData() const { return existingData; }
+            [[nodiscard]] const std::filesystem::path &stagingPath() const { return StagingDir; }
+
+            // Preallocate the wanted files (indexed as in the torrent, missing entries are wanted),
+            // may be called again to change the selection. Skipped files are removed once complete
+            void setWantedFiles(const std::vector<bool> &wanted);
+
+            // Called with (offset, length) after each write, must be added before any piece is scheduled
+            void addWriteListener(std::function<void(std::uint64_t, std::uint64_t)> listener) {
+                writeListeners.push_back(std::move(listener));
+            }
+
+            // Task for the pool's sync thread, must be set before any piece is scheduled
+            void setSyncTask(std::function<void()> task) { syncTask = std::move(task); }
+
+            // Run the sync task off the write path, safe to call from write listeners
+            void requestSync() { pool.requestSync(*this); }
+
+            // fdatasync the files written to since the last call
+            void syncFiles();
+
+            // Read a verified piece (for uploads) through the cache, blocking on the disk
+            [[nodiscard]] SharedPiece read(std::uint32_t pieceIdx);
+
+            // Piece if it's in memory, otherwise null & the piece is read off the network thread. Once the pool's
+            // `completionFd` fires, `drainReads` makes it available here. Network thread only
+            [[nodiscard]] SharedPiece tryRead(std::uint32_t pieceIdx);
+            [[nodiscard]] std::vector<ReadResult> drainReads();
+
+            // Verified pieces waiting to be written (metrics)
+            [[nodiscard]] std::size_t queueDepth() {
+                std::unique_lock lock {taskMutex};
+                return tasks.size();
+            }
+
+            // Flush pending pieces, once complete the staging directory is moved into place
+            [[nodiscard]] bool finish(bool status);
 
-            [[deprecated("Do not mix sync and async writes, this writes without locking")]] 
-            void scheduleSync(std::uint64_t offset, std::string &&piece);
+            [[deprecated("Do not mix sync and async writes, this writes without locking")]]
+            void scheduleSync(std::uint64_t offset, SharedPiece piece);
     };
 }
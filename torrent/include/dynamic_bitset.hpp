@@ -0,0 +1,72 @@
+#pragma once
+
+#include <bit>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace Torrent {
+    // Fixed size (set at runtime) set of piece indices backed by 64 bit words. Words hold bits in
+    // wire order (bit 0 is the MSB of the first word) so that bitfields load with a byte swap per word.
+    // Bulk operations run word at a time and vectorize with -O3 -march=native
+    class DynamicBitset {
+        public:
+            static constexpr std::size_t npos {std::numeric_limits<std::size_t>::max()};
+
+        private:
+            std::vector<std::uint64_t> words;
+            std::size_t bits {}, ones {};
+
+            static constexpr std::size_t WORD_BITS {64};
+            static constexpr std::uint64_t mask(std::size_t idx) { return std::uint64_t{1} << (WORD_BITS - 1 - idx % WORD_BITS); }
+
+            // Bits past `bits` in the last word, must always stay zero
+            [[nodiscard]] std::uint64_t spareMask() const;
+
+        public:
+            DynamicBitset() = default;
+            explicit DynamicBitset(const std::size_t size);
+
+            // Wire format: MSB of the first byte is piece 0, exactly ceil(size / 8) bytes.
+            // Returns nullopt on a length mismatch or if any spare bit is set
+            [[nodiscard]] static std::optional<DynamicBitset> fromWire(std::string_view payload, const std::size_t size);
+            [[nodiscard]] std::string toWire() const;
+
+            [[nodiscard]] bool test(const std::size_t idx) const {
+                return idx < bits && (words[idx / WORD_BITS] & mask(idx));
+            }
+
+            // Returns true if the bit was not set before
+            bool set(const std::size_t idx);
+            bool reset(const std::size_t idx);
+            void clear();
+            void setAll();
+
+            [[nodiscard]] std::size_t size() const { return bits; }
+            [[nodiscard]] std::size_t count() const { return ones; }
+            [[nodiscard]] bool none() const { return !ones; }
+            [[nodiscard]] bool all() const { return ones == bits; }
+
+            // First index >= `from` set in this but not in `other` (npos if none), `other`
+            // may be empty. With an empty `other` this is a plain find next set bit
+            [[nodiscard]] std::size_t findNextAndNot(const DynamicBitset &other, const std::size_t from = 0) const;
+            [[nodiscard]] std::size_t findNext(const std::size_t from = 0) const { return findNextAndNot({}, from); }
+
+            // Number of bits set in this but not in `other`
+            [[nodiscard]] std::size_t countAndNot(const DynamicBitset &other) const;
+
+            // Invoke fn(idx) for every set bit in ascending order
+            template<typename Fn>
+            void forEach(Fn &&fn) const {
+                for (std::size_t w {}; w < words.size(); ++w) {
+                    for (std::uint64_t word {words[w]}; word;) {
+                        const auto bit {static_cast<std::size_t>(std::countl_zero(word))};
+                        word ^= mask(bit); fn(w * WORD_BITS + bit);
+                    }
+                }
+            }
+    };
+}
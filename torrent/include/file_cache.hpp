@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstddef>
+#include <filesystem>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
+namespace Torrent {
+    // File descriptors shared by every disk writer of a pool, opened on first use. Least recently used
+    // ones are closed past the capacity. Files in use are pinned & never closed, while more than the
+    // capacity are pinned at once the limit is exceeded. Thread safe
+    class FileCache {
+        private:
+            // Files are keyed by the disk writer that opens them & its index of the file
+            struct Key {
+                const void *owner; std::size_t slot;
+                bool operator==(const Key &other) const = default;
+            };
+
+            struct HashKey {
+                std::size_t operator()(const Key &key) const {
+                    return std::hash<const void*>{}(key.owner) ^ (std::hash<std::size_t>{}(key.slot) << 1);
+                }
+            };
+
+            // Only unpinned files are on the LRU list
+            struct Entry { int fd; std::size_t pins; std::list<Key>::iterator lruIt; };
+
+            const std::size_t capacity;
+            std::list<Key> lru;
+            std::unordered_map<Key, Entry, HashKey> index;
+            std::mutex mutex;
+
+            // Close unpinned files, least recently used first, until no more than `limit` are open
+            void evict(const std::size_t limit);
+
+        public:
+            ~FileCache();
+            explicit FileCache(const std::size_t capacity);
+
+            FileCache(const FileCache&) = delete;
+            FileCache &operator=(const FileCache&) = delete;
+
+            // Fd of the file (opened read write), pinned until released
+            [[nodiscard]] int acquire(const void *owner, const std::size_t slot, const std::filesystem::path &path);
+            void release(const void *owner, const std::size_t slot);
+
+            // Close every file of the owner, none may be pinned
+            void drop(const void *owner);
+
+            // Files currently open
+            [[nodiscard]] std::size_t size();
+    };
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <sys/uio.h>
+
+namespace Torrent {
+    // Minimal io_uring over the raw syscalls (no liburing): a submission & completion queue shared
+    // with the kernel. Ops are queued with `writev` / `read`, handed over in one `submit` and their
+    // results come back through `reap` tagged with the caller's user data. Not thread safe
+    class IoRing {
+        public:
+            struct Completion { std::uint64_t userData; std::int32_t result; };
+
+            // Sets up a ring with room for `entries` ops in flight, throws if the kernel won't give us one
+            explicit IoRing(const unsigned entries);
+            ~IoRing();
+            IoRing(const IoRing&) = delete;
+            IoRing &operator=(const IoRing&) = delete;
+
+            // io_uring may be missing (< 5.1) or disabled by sysctl / seccomp
+            [[nodiscard]] static bool supported();
+
+            // Queue an op, false if the submission queue is full. Buffers & iovecs must outlive the op
+            [[nodiscard]] bool writev(int fd, const iovec *iovs, unsigned count, std::uint64_t offset, std::uint64_t userData);
+            [[nodiscard]] bool read(int fd, void *buffer, unsigned length, std::uint64_t offset, std::uint64_t userData);
+
+            // Hand queued ops to the kernel & block until at least `minComplete` have completed
+            void submit(unsigned minComplete = 0);
+
+            // Completions so far, up to `max` of them written to `out`. Returns how many
+            std::size_t reap(Completion *out, std::size_t max);
+
+            [[nodiscard]] unsigned capacity() const { return sqEntries; }
+
+            // Ops submitted (or queued) whose completion hasn't been reaped yet
+            [[nodiscard]] unsigned inFlight() const { return pending; }
+
+        private:
+            int fd {-1};
+            void *sqRing {}, *cqRing {}, *sqes {};
+            std::size_t sqRingSize {}, cqRingSize {}, sqesSize {};
+
+            // Pointers into the mapped rings, heads & tails are shared with the kernel
+            unsigned *sqHead {}, *sqTail {}, *sqArray {}, *cqHead {}, *cqTail {};
+            unsigned sqMask {}, cqMask {}, sqEntries {};
+            void *cqes {};
+
+            unsigned queued {}, pending {};
+
+            void *nextSqe();
+            void unmap();
+    };
+}
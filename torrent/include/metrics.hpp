@@ -0,0 +1,52 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+namespace Torrent {
+    // Snapshot of a connected peer, rates in bytes/s
+    struct PeerMetrics {
+        std::string id;
+        double downloadRate, uploadRate, rttSeconds, chokedSeconds;
+        std::size_t outstanding;
+        bool choked, snubbed;
+    };
+
+    // Snapshot of a torrent, info hash in raw bytes. Goodput only counts verified bytes, wasted ones are blocks we didn't ask for
+    // (or of the wrong size) & pieces failing the hash check. Step time is the torrent's share of the loop
+    struct TorrentMetrics {
+        std::string name, infoHash;
+        std::uint64_t downloadedBytes, uploadedBytes, verifiedBytes, wastedBytes, hashFailures;
+        double goodput;
+        std::size_t piecesDone, numPieces, diskQueueDepth;
+        double stepSeconds {};
+        std::vector<PeerMetrics> peers {};
+    };
+
+    // Busy time of the event loop (excluding the wait in poll), smoothed & the worst since the last export
+    struct LoopMetrics {
+        std::uint64_t iterations {};
+        double busySeconds {}, maxBusySeconds {};
+    };
+
+    // Prometheus text exposition format, torrents are labelled by name & info hash, peers by ip:port
+    [[nodiscard]] std::string formatPrometheus(const LoopMetrics &loop, const std::vector<TorrentMetrics> &torrents);
+
+    // Rewrites a metrics file every interval, written aside & renamed so scrapers never see a partial file
+    class MetricsFile {
+        public:
+            MetricsFile(const std::filesystem::path &path, const std::chrono::seconds interval);
+
+            [[nodiscard]] bool due(const std::chrono::steady_clock::time_point now) const { return now >= nextWrite; }
+            void write(const std::string &contents, const std::chrono::steady_clock::time_point now);
+
+        private:
+            const std::filesystem::path path, tmpPath;
+            const std::chrono::seconds interval;
+            std::chrono::steady_clock::time_point nextWrite {};
+    };
+}
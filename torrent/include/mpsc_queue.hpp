@@ -0,0 +1,45 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <tuple>
+#include <vector>
+
+namespace Torrent {
+    // Lock free multi producer, single consumer queue. Producers push with a CAS on the
+    // head of an intrusive list, the consumer takes the whole list in one exchange
+    template<typename T>
+    class MPSCQueue {
+        private:
+            struct Node { T value; Node *next; };
+            std::atomic<Node*> head {nullptr};
+
+        public:
+            MPSCQueue() = default;
+            MPSCQueue(const MPSCQueue&) = delete;
+            MPSCQueue &operator=(const MPSCQueue&) = delete;
+            ~MPSCQueue() { std::ignore = drain(); }
+
+            // Safe to call from any thread
+            void push(T value) {
+                Node *node {new Node{std::move(value), head.load(std::memory_order_relaxed)}};
+                while (!head.compare_exchange_weak(node->next, node,
+                    std::memory_order_release, std::memory_order_relaxed));
+            }
+
+            // Consumer thread only, returns everything pushed so far in FIFO order
+            [[nodiscard]] std::vector<T> drain() {
+                std::vector<T> result;
+                Node *node {head.exchange(nullptr, std::memory_order_acquire)};
+                while (node) {
+                    Node *next {node->next};
+                    result.push_back(std::move(node->value));
+                    delete node; node = next;
+                }
+                std::ranges::reverse(result);
+                return result;
+            }
+
+            [[nodiscard]] bool empty() const { return head.load(std::memory_order_acquire) == nullptr; }
+    };
+}
@@ -1,9 +1,14 @@
 #pragma once
 
 #include "common.hpp"
+#include "dynamic_bitset.hpp"
+#include "rate_limiter.hpp"
 
 #include <chrono>
+#include <deque>
+#include <optional>
 #include <unordered_set>
+#include <vector>
 
 namespace Torrent {
     struct PeerContext {
@@ -15,30 +20,69 @@ namespace Torrent {
         int fd;                      // Socket file descriptor
 
         bool handshaked {false};     // whether handshake done
-        bool choked {true};          // we are choking them by default
+        bool choked {true};          // peer is choking us by default
         bool closed {false};         // whether to maintain the connection
+        bool amChoking {true};       // we are choking the peer by default
+        bool peerInterested {false}; // whether peer wants pieces from us
+        bool inbound {false};        // peer connected to our listener
+        bool fastExtension {false};  // both sides support BEP 6
+        bool recvThrottled {false};  // reads paused until download tokens are back
+        bool awaitingRead {false};   // next request waits on a piece being read from disk
 
         std::uint8_t unchokeAttempts {};   // track # of unchoke attempts and drop if needed
         std::uint8_t reconnectAttempts {}; // track # of unchoke attempts and drop if needed
-        std::uint8_t backlog {};           // # of unfulfilled requests pending
+        std::uint16_t backlog {};          // # of unfulfilled requests pending
+        std::uint16_t maxBacklog {};       // adaptive request queue depth (0 until measured)
 
-        std::unordered_set<std::uint32_t> haves {};  // which pieces the peer has
+        std::uint64_t downloaded {}; // bytes received from peer in current choke round
+        std::uint64_t uploaded {};   // bytes sent to peer in current choke round
+
+        DynamicBitset haves {};      // which pieces the peer has (sized to the torrent)
+
+        // Blocks requested by this peer, served as the send buffer drains
+        std::deque<PieceBlock> requests {};
 
         // Blocks requested from this peer
         std::unordered_set<PieceBlock, HashPieceBlock> pending {};
 
+        // Fast Extension: pieces the peer lets us request while choked & pieces it suggests,
+        // along with the pieces we let the peer request while we choke it
+        std::vector<std::uint32_t> allowedFast {}, suggested {}, allowedFastOut {};
+
+        // Per peer rate limits, rates are synced from the session every tick
+        TokenBucket downloadLimit {}, uploadLimit {};
+
         std::string recvBuffer {};   // accumulate partial message data
         std::string sendBuffer {};   // pending outgoing data
 
         // Last read event we received from the client
         std::chrono::steady_clock::time_point lastReadTimeStamp;
 
+        // Adaptive pipelining: smoothed delivery rate (bytes/s), lowest RTT seen 
+        // and the single request currently being timed to sample the RTT
+        double rate {};
+        std::uint64_t rateBytes {};
+        std::chrono::steady_clock::duration minRtt {};
+        std::optional<PieceBlock> rttProbe {};
+        std::chrono::steady_clock::time_point rttProbeSentAt {};
+
+        // Metrics: smoothed upload rate (bytes/s), time spent choked by the peer since the handshake
+        // and when it last delivered a block, a peer sitting on our requests for long is snubbing us
+        double uploadRate {};
+        std::uint64_t uploadRateBytes {};
+        std::chrono::steady_clock::duration chokedTime {};
+        std::chrono::steady_clock::time_point chokedSince {}, lastBlockAt {};
+
         // Resets all non const fields to defaults
         inline void onReconnect(int newFd, auto &tick) {
             fd = newFd; ++reconnectAttempts;
             handshaked = false; choked = true; closed = false;
-            unchokeAttempts = 0; backlog = 0;
-            haves.clear(); pending.clear(); 
+            amChoking = true; peerInterested = false; recvThrottled = false; awaitingRead = false;
+            unchokeAttempts = 0; backlog = 0; downloaded = 0; uploaded = 0;
+            haves.clear(); pending.clear(); requests.clear(); fastExtension = false;
+            allowedFast.clear(); suggested.clear(); allowedFastOut.clear();
+            maxBacklog = 0; rate = 0; rateBytes = 0; minRtt = {}; rttProbe.reset();
+            uploadRate = 0; uploadRateBytes = 0; chokedTime = {}; chokedSince = tick; lastBlockAt = tick;
             recvBuffer.clear(); sendBuffer.clear();
             lastReadTimeStamp = tick;
         }
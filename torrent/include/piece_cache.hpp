@@ -0,0 +1,64 @@
+#pragma once
+
+#include "buffer_pool.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <unordered_map>
+
+namespace Torrent {
+    // Memory budget shared by the partial piece buffers of every torrent in a session and an LRU
+    // cache of pieces read for upload. Downloads come first: cached pieces only fill what partial
+    // pieces leave free and are evicted to make room for new ones. Only used from the network thread
+    class PieceCache {
+        public:
+            struct Stats { std::uint64_t hits, misses; std::size_t partialBytes, cachedBytes, capacity; };
+
+        private:
+            // Cached pieces are keyed by the disk writer that read them & the piece index
+            struct Key {
+                const void *owner; std::uint32_t pieceIdx;
+                bool operator==(const Key &other) const = default;
+            };
+
+            struct HashKey {
+                std::size_t operator()(const Key &key) const {
+                    return std::hash<const void*>{}(key.owner) ^ (std::hash<std::uint32_t>{}(key.pieceIdx) << 1);
+                }
+            };
+
+            const std::size_t capacity;
+            std::size_t partialBytes {}, cachedBytes {};
+            std::uint64_t hits {}, misses {};
+
+            std::list<std::pair<Key, SharedPiece>> lru;
+            std::unordered_map<Key, decltype(lru)::iterator, HashKey> index;
+
+            void evictOne();
+
+        public:
+            explicit PieceCache(const std::size_t capacity);
+
+            // Whether a new partial piece of `bytes` fits, evicting cached pieces as needed
+            [[nodiscard]] bool makeRoom(const std::size_t bytes);
+
+            // Account for partial piece buffers, acquiring may overshoot the budget (see `makeRoom`)
+            void acquirePartial(const std::size_t bytes) { partialBytes += bytes; }
+            void releasePartial(const std::size_t bytes) { partialBytes -= std::min(partialBytes, bytes); }
+
+            // Cached piece (refreshed as most recently used) or null, counted as a hit or miss
+            [[nodiscard]] SharedPiece lookup(const void *owner, const std::uint32_t pieceIdx);
+
+            // Cache a piece, skipped if partial pieces leave no room for it
+            void insert(const void *owner, const std::uint32_t pieceIdx, SharedPiece piece);
+
+            // Drop every piece cached by the owner
+            void drop(const void *owner);
+
+            [[nodiscard]] Stats stats() const;
+            [[nodiscard]] double hitRate() const;
+    };
+}
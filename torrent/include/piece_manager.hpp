@@ -1,8 +1,12 @@
 #pragma once
 
+#include "../include/buffer_pool.hpp"
 #include "../include/common.hpp"
+#include "../include/dynamic_bitset.hpp"
+#include "../include/piece_cache.hpp"
 
 #include <cstdint>
+#include <span>
 #include <string>
 #include <unordered_map>
 #include <unordered_set>
@@ -15,21 +19,34 @@ namespace Torrent {
                 enum class State { PENDING, REQUESTED, DONE };
 
                 const PieceManager &outer;
-                std::string buffer;
+                std::shared_ptr<std::string> buffer;
                 const std::uint32_t actualPieceSize;
                 const std::uint16_t lastBlockSize;
                 const std::uint16_t actualNumBlocks;
                 std::vector<State> states;
 
+                // # of peers a block is requested from (> 1 only in endgame)
+                std::vector<std::uint8_t> requesters;
+
                 // Track the current status count
                 std::uint16_t requestedBlocks {}, completedBlocks {};
 
+                // All blocks received, hash is being checked off the network thread
+                bool verifying {false};
+
                 // Marks the block as requested and returns the block size
                 std::uint32_t requestBlockNum(std::uint16_t blockOffset);
 
                 bool finished() const;
-                void writeBlock(std::uint32_t blockOffset, std::string &&payload);
+
+                // Returns false if block was already written (duplicate from endgame)
+                bool writeBlock(std::uint32_t blockOffset, std::string_view block);
+
+                // Buffer is charged to the session's memory budget for as long as the piece is partial
                 Piece(const PieceManager &outer, const std::uint32_t pieceIdx);
+                ~Piece();
+                Piece(const Piece&) = delete;
+                Piece &operator=(const Piece&) = delete;
             };
 
         private:
@@ -41,34 +58,94 @@ namespace Torrent {
             const std::uint16_t numBlocks;
             const std::string &pieceBlob;
 
+            // Piece buffers are recycled once written to disk
+            BufferPool bufferPool;
+
+            // Partial piece buffers count against the session's memory budget, once it is
+            // used up no new pieces are started until the partial ones complete
+            PieceCache &cache;
+
+            // Max no of peers a single block can be requested from during endgame
+            static constexpr std::uint8_t MAX_ENDGAME_REQUESTERS {3};
+
+            // Pieces held by at most this many peers are requested ahead of the other partial pieces
+            static constexpr std::uint32_t RARE_AVAILABILITY {1};
+
             // Pieces that we have completed downloading
-            std::unordered_set<std::uint32_t> haves;
+            DynamicBitset haves;
+
+            // Number of connected peers that have each piece (rarest first)
+            std::vector<std::uint32_t> availability;
+
+            // Pieces overlapping at least one file that isn't skipped & the priority of each piece
+            DynamicBitset wanted;
+            std::vector<FilePriority> priorities;
 
             // Blocks in transit and received are accumulated 
             // here until they can be written to disk
             std::unordered_map<std::uint32_t, Piece> partialPieces;
 
+            // Streaming: pieces [windowStart, windowStart + windowSize) are requested before anything else
+            std::uint32_t windowStart {}, windowSize {};
+
         private:
             void clearInTransitBlock(std::uint32_t pieceIdx, std::uint32_t blockOffset);
-            std::string_view getPieceHash(std::size_t idx) const;
 
         public:
             [[nodiscard]] inline decltype(auto) getHaves(this auto &self) { return (self.haves); }
 
             PieceManager(const std::uint64_t totalSize, const std::uint32_t pieceSize, 
-                const std::uint16_t blockSize, const std::string &pieceBlob);
+                const std::uint16_t blockSize, const std::string &pieceBlob, PieceCache &cache);
 
+            // Every wanted piece is in, skipped files may still be missing pieces
             bool finished() const;
 
+            // Wanted pieces not downloaded yet
+            [[nodiscard]] std::size_t remaining() const { return wanted.countAndNot(haves); }
+
+            // Map file priorities onto pieces, files without an entry are downloaded at normal priority.
+            // Pieces shared with a wanted file are still fetched, so the edges of skipped files may be too
+            void setFilePriorities(const std::vector<FileStruct> &files, const std::vector<FilePriority> &filePriorities);
+
+            // Expected SHA1 (raw bytes) of a piece, safe to call from any thread
+            std::string_view getPieceHash(std::size_t idx) const;
+
+            // Endgame kicks in once every remaining block has been requested from some peer
+            bool inEndgame() const;
+
             void onPeerReset(const std::vector<PieceBlock> &pendingRequests);
 
-            // Input payload from peer request must be passed as it is
-            // Returns a pair denoting if we are good to schedule writing to disk
-            std::pair<bool, std::string> onBlockReceived(const std::uint32_t pieceIdx, 
-                const std::uint32_t blockOffset, std::string piecePayload);
+            // Keep the piece availability counts in sync with peer haves
+            void onPeerHave(const std::uint32_t pieceIdx);
+            void onPeerBitfield(const DynamicBitset &peerHaves);
+            void onPeerDisconnect(const DynamicBitset &peerHaves);
+
+            // Block data is copied straight into the piece's pooled buffer
+            // Returns the assembled piece once every block is in (null otherwise), the piece stays 
+            // marked as verifying (never re-requested) until `onPieceVerified` reports the hash check
+            [[nodiscard]] SharedPiece onBlockReceived(const std::uint32_t pieceIdx, 
+                const std::uint32_t blockOffset, std::string_view block);
+
+            // Valid pieces are added to haves, invalid ones are dropped to be requested again
+            void onPieceVerified(const std::uint32_t pieceIdx, bool valid);
+
+            // Sliding window of pieces just ahead of a stream reader, a size of 0 disables it
+            void setPriorityWindow(const std::uint32_t first, const std::uint32_t count);
 
             // Non const since we will update the partialPieces state for the requested blocks
+            // Pieces in the priority window come first in order, then partial & new pieces hardly any peer has,
+            // then the other partial pieces, then `preferred` pieces (suggested by the peer) in the given order,
+            // remaining new pieces are picked by priority and rarest first among equals. Pieces of skipped
+            // files are never started. New pieces
+            // are only started while the memory budget has room (or when no piece is partial at all), the
+            // priority window may overshoot the budget by its size
+            std::vector<std::tuple<std::uint32_t, std::uint32_t, std::uint32_t>> 
+            getPendingBlocks(const DynamicBitset &peerHaves, std::uint16_t count, 
+                std::span<const std::uint32_t> preferred = {});
+
+            // Blocks already in flight with other peers that can be requested in duplicate
             std::vector<std::tuple<std::uint32_t, std::uint32_t, std::uint32_t>> 
-            getPendingBlocks(const std::unordered_set<std::uint32_t> &peerHaves, std::uint8_t count);
+            getEndgameBlocks(const DynamicBitset &peerHaves, 
+                const std::unordered_set<PieceBlock, HashPieceBlock> &peerPending, std::uint16_t count);
     };
 }
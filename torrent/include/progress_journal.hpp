@@ -0,0 +1,74 @@
+#pragma once
+
+#include "dynamic_bitset.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <string>
+
+namespace Torrent {
+    // Crash safe record of the pieces on disk: a bitfield snapshot (the `.ctorrent` file) plus an
+    // append only journal of the piece indices (4 byte big endian) written since. Pieces are staged as
+    // they hit the disk & appended in batches by `flush`, once the data they point to is synced, off the
+    // write path. The journal is folded back into the snapshot every so often. Recording is thread safe
+    // (called from disk workers)
+    class ProgressJournal {
+        private:
+            using Clock = std::chrono::steady_clock;
+
+            // Journal is flushed once this many entries are pending or the oldest is this old,
+            // compacted into the snapshot once it holds this many entries or hasn't been in a while
+            static constexpr std::size_t SYNC_BATCH {64}, COMPACT_ENTRIES {1 << 14};
+            static constexpr std::chrono::seconds SYNC_INTERVAL {1}, COMPACT_INTERVAL {60};
+
+            const std::filesystem::path snapshotPath, journalPath;
+            const std::size_t numPieces;
+            const bool savedState;
+
+            // `onDisk` holds every piece recorded, `durable` those journaled or snapshotted. Flushes
+            // are serialized, recording only waits on `mutex`
+            std::mutex mutex, flushMutex;
+            DynamicBitset onDisk, durable;
+            std::string pending;
+            int fd {-1};
+            std::size_t entries {};
+            Clock::time_point lastSync, lastCompact;
+
+            // Journal is opened lazily so that torrents which never write leave nothing behind
+            void open();
+            void writeSnapshot();
+
+        public:
+            ~ProgressJournal();
+            ProgressJournal(const ProgressJournal&) = delete;
+            ProgressJournal &operator=(const ProgressJournal&) = delete;
+
+            ProgressJournal(const std::filesystem::path &snapshotPath, const std::size_t numPieces);
+
+            // A snapshot or journal was left behind by an earlier run
+            [[nodiscard]] bool hasSavedState() const { return savedState; }
+
+            // Snapshot with the journal replayed on top, nullopt if the snapshot is corrupt. A torn
+            // entry at the end of the journal (crash mid append) is ignored
+            [[nodiscard]] std::optional<DynamicBitset> load();
+
+            // Start over from a known set of pieces (after a recheck), snapshot is written right away
+            void reset(const DynamicBitset &pieces);
+
+            // Pieces [first, last] are on disk, staged for the next flush. Returns true once one is due
+            [[nodiscard]] bool record(const std::uint32_t first, const std::uint32_t last);
+
+            // Make recorded pieces durable: `syncData` makes the data they point to durable, then the
+            // staged entries are appended & synced. Compacts when due
+            void flush(const std::function<void()> &syncData);
+
+            // Flush & fold the journal into the snapshot (on shutdown), nothing is kept if no piece is durable
+            void compact(const std::function<void()> &syncData);
+
+            [[nodiscard]] std::size_t count();
+    };
+}
@@ -2,6 +2,9 @@
 
 #include "common.hpp"
 
+#include <string>
+#include <vector>
+
 namespace Torrent {
     // Forward declaration for faster compilation times
     class TorrentTracker;
@@ -16,12 +19,25 @@ namespace Torrent {
     std::string buildUnchoke();
     std::string buildChoke();
     std::string buildHave(std::uint32_t pIndex);
+    std::string buildHaveAll();
+    std::string buildHaveNone();
+    std::string buildSuggestPiece(std::uint32_t pIndex);
+    std::string buildAllowedFast(std::uint32_t pIndex);
+    std::string buildReject(std::uint32_t pIndex, std::uint32_t pBegin, std::uint32_t pLength);
     std::string buildBitField(const std::string &bitfield);
     std::string buildRequest(std::uint32_t pIndex, std::uint32_t pBegin, std::uint32_t pLength, bool cancel = false);
-    std::string buildPiece(std::uint32_t pIndex, std::uint32_t pBegin, const std::string &block);
+    std::string buildPiece(std::uint32_t pIndex, std::uint32_t pBegin, std::string_view block);
     std::string buildPort(std::uint16_t port);
 
+    // Reserved handshake bit advertising the Fast Extension (BEP 6)
+    bool supportsFastExtension(std::string_view handshake);
+
+    // Canonical allowed fast set (BEP 6) for an IPv4 peer, empty for other address types
+    std::vector<std::uint32_t> allowedFastSet(const std::string &ip, const std::string &infoHash, 
+        std::uint32_t numPieces, std::size_t count);
+
     // Request Message parser
     std::uint32_t IsCompleteMessage(std::string_view buffer);
-    std::tuple<MsgType, std::string> parseMessage(std::string_view message);
+    // Payload is a view into the input message
+    std::tuple<MsgType, std::string_view> parseMessage(std::string_view message);
 }
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+
+namespace Torrent {
+    // Bytes accrue at `rate` per second up to a short burst. A rate of 0 means no limit,
+    // in which case `available` reports UNLIMITED and consuming is a no-op
+    class TokenBucket {
+        public:
+            using TimePoint = std::chrono::steady_clock::time_point;
+            static constexpr std::size_t UNLIMITED {std::numeric_limits<std::size_t>::max()};
+
+        private:
+            // Tokens held at most, keeps a peer that was throttled from bursting past the cap
+            static constexpr double BURST_SECONDS {0.25}, MIN_BURST {1 << 14};
+
+            std::uint64_t bytesPerSec {};
+            double tokens {};
+            TimePoint lastRefill {};
+
+            [[nodiscard]] double capacity() const;
+
+        public:
+            // Takes effect from the next refill, tokens above the new burst size are dropped
+            void setRate(const std::uint64_t rate);
+            [[nodiscard]] std::uint64_t rate() const { return bytesPerSec; }
+            [[nodiscard]] bool limited() const { return bytesPerSec != 0; }
+
+            // Credit the time elapsed since the previous refill
+            void refill(const TimePoint now);
+
+            [[nodiscard]] std::size_t available() const {
+                return limited()? static_cast<std::size_t>(tokens): UNLIMITED;
+            }
+
+            void consume(const std::size_t bytes);
+    };
+
+    // Session wide bucket for one direction, shared by all peers. Every tick each peer that wants
+    // to transfer gets an equal share of what is left, so capacity left unused by idle or slow
+    // peers flows to the ones still asking instead of going to waste
+    class BandwidthChannel {
+        private:
+            // Smaller grants are not worth a syscall, the bucket is drained by the first peers instead
+            static constexpr std::size_t MIN_GRANT {1 << 12};
+
+            TokenBucket bucket;
+            std::size_t expected {1}, asked {};
+
+        public:
+            void setRate(const std::uint64_t rate) { bucket.setRate(rate); }
+            [[nodiscard]] std::uint64_t rate() const { return bucket.rate(); }
+
+            // Called once per event loop iteration, before any peer asks for bandwidth
+            void tick(const TokenBucket::TimePoint now);
+
+            // Bytes a peer holding `peerAvailable` tokens of its own may transfer right now
+            [[nodiscard]] std::size_t grant(const std::size_t peerAvailable);
+
+            void consume(const std::size_t bytes) { bucket.consume(bytes); }
+            [[nodiscard]] bool exhausted() const { return bucket.available() == 0; }
+    };
+}
@@ -0,0 +1,156 @@
+#pragma once
+
+#include "dht.hpp"
+#include "disk_writer.hpp"
+#include "metrics.hpp"
+#include "piece_cache.hpp"
+#include "stream_server.hpp"
+#include "torrent_downloader.hpp"
+#include "torrent_file.hpp"
+#include "torrent_tracker.hpp"
+
+#include "../../networking/net.hpp"
+#include "../../misc/threadPool.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace Torrent {
+    // Runs many torrents on a single event loop, sharing the listen port,
+    // connection & unchoke budgets and the disk I/O worker pool
+    class Session {
+        public:
+            using TimePoint = TorrentDownloader::TimePoint;
+
+            ~Session();
+            Session(
+                const int timeout = 10,
+                const std::uint16_t port = 6881,
+                const std::size_t maxConnections = 500,
+                const std::size_t maxUnchoked = 64,
+                const std::size_t diskThreads = 4,
+                const std::size_t hashThreads = 4,
+                const std::size_t memoryBudget = std::size_t{512} << 20,
+                const DiskBackend diskBackend = DiskBackend::Auto
+            );
+
+            // Load a torrent, extra args are forwarded to the TorrentDownloader.
+            // Torrent is started on the next `poll`, returns its info hash
+            template<typename ...Args>
+            const std::string &add(const std::string &torrentFP, const std::filesystem::path &downloadDir, Args&&... args) {
+                auto file {std::make_unique<TorrentFile>(torrentFP)};
+                if (torrents.contains(file->infoHash))
+                    throw std::runtime_error("Torrent already added: " + file->name);
+                auto tracker {std::make_unique<TorrentTracker>(*file, _port)};
+                auto downloader {std::make_unique<TorrentDownloader>(*tracker, diskPool, hashPool,
+                    pieceCache, downloadDir, std::forward<Args>(args)...)};
+                if (streamServer) streamServer->add(downloader->enableStreaming());
+                if (dht) downloader->setDHT(*dht);
+                // Key is copied first, argument evaluation order would otherwise let the Entry take the file
+                std::string infoHash {file->infoHash};
+                auto [it, _] {torrents.emplace(std::move(infoHash),
+                    Entry{std::move(file), std::move(tracker), std::move(downloader)})};
+                return it->first;
+            }
+
+            // Port peers connect to & trackers are told about, the one picked if constructed with 0
+            [[nodiscard]] std::uint16_t port() const { return _port; }
+
+            // Serve the files of every torrent (already added or not) over HTTP on 127.0.0.1:port
+            // while they download, 0 picks a free port. `run` keeps going until interrupted
+            void enableStreaming(const std::uint16_t streamPort);
+
+            // Look for peers of every torrent (already added or not) on the DHT, through a node on UDP `dhtPort`.
+            // Known nodes are kept in `cachePath` between runs
+            void enableDHT(const std::uint16_t dhtPort, const std::filesystem::path &cachePath = {});
+
+            // Export per torrent & per peer figures along with the event loop timings to `path` every
+            // `interval`, in the Prometheus text format (e.g. for node_exporter's textfile collector)
+            void enableMetrics(const std::filesystem::path &path, const std::chrono::seconds interval = std::chrono::seconds{5});
+
+            // Per file priorities of a torrent (see `TorrentDownloader::setFilePriorities`)
+            void setFilePriorities(const std::string &infoHash, std::vector<FilePriority> priorities);
+
+            // Torrent is stopped (and state saved) on the next `poll`
+            void remove(const std::string &infoHash);
+
+            // Bandwidth caps in bytes/s, 0 removes the limit. May be changed at any time, applied from the next poll
+            void setRateLimits(const std::uint64_t download, const std::uint64_t upload);
+            void setPeerRateLimits(const std::uint64_t download, const std::uint64_t upload);
+
+            // Run one iteration of the event loop, returns false once no torrents are left
+            bool poll(int timeoutMs = 5);
+
+            // Drive the event loop until all torrents are done or interrupted
+            void run();
+
+            [[nodiscard]] std::size_t size() const { return torrents.size(); }
+
+            // Memory held by partial pieces & the read cache along with the cache hit counts
+            [[nodiscard]] PieceCache::Stats cacheStats() const { return pieceCache.stats(); }
+
+        private:
+            struct Entry {
+                std::unique_ptr<TorrentFile> file;
+                std::unique_ptr<TorrentTracker> tracker;
+                std::unique_ptr<TorrentDownloader> downloader;
+                bool started {false}, removed {false};
+                double stepSeconds {};
+            };
+
+            // Inbound connections whose handshake hasn't told us the torrent yet
+            struct Inbound {
+                std::string ip;
+                std::uint16_t port;
+                std::string recvBuffer;
+                TimePoint acceptedAt;
+            };
+
+            const int timeout;
+            std::uint16_t _port;
+
+            // Must outlive the disk writers owned by the torrents
+            DiskIOPool diskPool;
+
+            // Piece hashes are verified here, off the network thread (on it when it has no workers)
+            async::ThreadPool hashPool;
+
+            // Memory budget for partial pieces & cached pieces of all torrents
+            PieceCache pieceCache;
+
+            // Loopback HTTP server for streaming, null unless enabled
+            std::unique_ptr<StreamServer> streamServer;
+
+            // DHT node shared by the torrents, null unless enabled. Must outlive the torrents
+            std::unique_ptr<DHTNode> dht;
+
+            // Metrics export, null unless enabled. Loop & step timings are smoothed with METRICS_SMOOTHING
+            static constexpr double METRICS_SMOOTHING {0.1};
+            std::unique_ptr<MetricsFile> metricsFile;
+            LoopMetrics loopMetrics;
+
+            net::PollManager pollManager;
+            SessionLimits limits;
+            int listenerFd {-1}, diskFd {-1};
+
+            std::unordered_map<int, Inbound> pendingInbound;
+            std::unordered_map<int, std::string> fdOwners;
+            std::unordered_map<std::string, Entry> torrents;
+
+        private:
+            void acceptInbound(TimePoint lastTick);
+            void onInboundEvent(net::Socket &peer, net::PollEventType event, TimePoint lastTick);
+            void dropInbound(int fd);
+            void logCacheStats() const;
+            void exportMetrics(TimePoint now);
+
+            // Torrent owning the fd, cached since lookups happen for every event
+            TorrentDownloader *findOwner(int fd);
+    };
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include "common.hpp"
+#include "dynamic_bitset.hpp"
+
+#include "../../networking/net.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace Torrent {
+    // Read side of a torrent being streamed, shared by the torrent (network thread & disk workers)
+    // and the HTTP server threads. Files are read through descriptors of their own which stay
+    // valid once the download is moved into place, so a stream can outlive its torrent
+    class StreamSource {
+        public:
+            struct File { std::filesystem::path path; std::uint64_t offset, size; int fd; };
+
+        private:
+            const std::string _name;
+            const std::uint32_t pieceSize;
+            const std::uint64_t totalSize;
+            std::vector<File> _files;
+
+            // Pieces on disk, the byte offset readers are currently waiting on / reading from
+            mutable std::mutex mutex;
+            std::condition_variable written;
+            DynamicBitset onDisk;
+            std::optional<std::uint64_t> readCursor;
+            bool closed {false};
+
+        public:
+            ~StreamSource();
+            StreamSource(const StreamSource&) = delete;
+            StreamSource &operator=(const StreamSource&) = delete;
+
+            // Files are opened read only from `dir` (where the torrent is being written to),
+            // pieces set in `haves` are already on disk
+            StreamSource(const std::string &name, const std::uint32_t pieceSize, const std::uint64_t totalSize,
+                const std::vector<FileStruct> &files, const std::filesystem::path &dir, const DynamicBitset &haves);
+
+            // Called from the disk workers once a range of whole pieces has been written
+            void markWritten(const std::uint64_t offset, const std::uint64_t length);
+
+            // Torrent is gone, readers waiting on pieces that never made it to disk give up
+            void close();
+
+            [[nodiscard]] std::optional<std::uint64_t> cursor() const;
+            [[nodiscard]] const std::string &name() const { return _name; }
+            [[nodiscard]] const std::vector<File> &files() const { return _files; }
+
+            // Moves the cursor to `offset` & blocks until [offset, offset + length) is on disk.
+            // Returns false if the source was closed or `stop` was raised before that
+            [[nodiscard]] bool waitFor(const std::uint64_t offset, const std::uint64_t length, const std::atomic<bool> &stop);
+
+            // Read bytes already known to be on disk (see `waitFor`) spanning any number of files
+            void read(std::uint64_t offset, char *buffer, std::uint64_t length) const;
+    };
+
+    // Loopback HTTP server streaming the files of registered torrents while they download.
+    // Files are served at /<torrent name>/<path in torrent>, `GET /` lists them. Range requests
+    // are supported, each response only waits for the pieces it is about to send
+    class StreamServer {
+        private:
+            // Bytes sent per wait & send round, concurrent clients served
+            static constexpr std::uint64_t CHUNK_SIZE {1 << 18};
+            static constexpr std::size_t MAX_CLIENTS {16}, MAX_HEADER_SIZE {1 << 13};
+
+            net::Socket listener;
+            std::uint16_t _port {};
+            std::atomic<bool> stop {false};
+            std::thread acceptor;
+
+            // Registered torrents by name & count of client threads still running
+            std::mutex mutex;
+            std::condition_variable clientsDone;
+            std::unordered_map<std::string, std::shared_ptr<StreamSource>> sources;
+            std::size_t clients {};
+
+            void acceptLoop();
+            void serve(net::Socket client);
+            void respond(net::Socket &client, const std::string &method, const std::string &target, const std::string &range);
+            [[nodiscard]] std::string listing();
+
+        public:
+            ~StreamServer();
+            explicit StreamServer(const std::uint16_t port);
+
+            void add(std::shared_ptr<StreamSource> source);
+            [[nodiscard]] std::uint16_t port() const { return _port; }
+    };
+}
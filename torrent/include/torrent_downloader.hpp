@@ -1,31 +1,101 @@
 #pragma once
 
+#include "dht.hpp"
 #include "disk_writer.hpp"
+#include "metrics.hpp"
+#include "mpsc_queue.hpp"
 #include "torrent_tracker.hpp"
 #include "peer_context.hpp"
 #include "piece_manager.hpp"
+#include "progress_journal.hpp"
+#include "rate_limiter.hpp"
+#include "stream_server.hpp"
+#include "web_seed.hpp"
 
+#include "../../misc/threadPool.hpp"
+
+#include <algorithm>
+#include <chrono>
 #include <cstdint>
 #include <filesystem>
+#include <future>
+#include <memory>
+#include <optional>
 #include <string>
+#include <string_view>
+#include <unordered_map>
 
 namespace Torrent {
+    // Budgets shared by all the torrents of a session
+    struct SessionLimits {
+        const std::size_t maxConnections, maxUnchoked;
+        std::size_t connections {}, unchoked {};
+
+        // Bandwidth shared by every peer & the cap on each peer, in bytes/s (0 = unlimited)
+        BandwidthChannel download {}, upload {};
+        std::uint64_t peerDownloadRate {}, peerUploadRate {};
+    };
+
     class TorrentDownloader {
         public:
+            using TimePoint = std::chrono::steady_clock::time_point;
+
             ~TorrentDownloader();
 
             TorrentDownloader(
                 TorrentTracker &tTracker, 
+                DiskIOPool &diskPool,
+                async::ThreadPool &hashPool,
+                PieceCache &pieceCache,
                 const std::filesystem::path downloadDir, 
                 const std::uint16_t bSize = 1 << 14, 
                 const std::uint8_t backlog = 8,
                 const std::uint8_t maxUnchokeAttempts = 3, 
                 const std::uint8_t maxReconnectAttempts = 3,
                 const std::uint16_t maxReqWaitTime = 5,
-                const std::uint16_t minReconWaitTime = 30
+                const std::uint16_t minReconWaitTime = 30,
+                const std::uint8_t uploadSlots = 4,
+                const double seedRatio = 0,
+                const std::uint32_t seedTime = 0,
+                const bool recheck = false,
+                const bool adaptiveBacklog = true
             );
 
-            void download(int timeout = 10);
+            // Announce to the trackers off the event loop & connect to the peers they return as the announce completes
+            void start(net::PollManager &pollManager, SessionLimits &limits, int timeout = 10);
+
+            // Handle poll events for a socket owned by this torrent (see `hasPeer`)
+            void onEvent(net::Socket &peer, net::PollEventType event, TimePoint lastTick);
+
+            // Housekeeping after every poll, returns false once the torrent is done
+            [[nodiscard]] bool step(TimePoint lastTick);
+
+            // Drop all peers from the event loop and finalize files, returns completion status
+            bool stop();
+
+            // Per file priorities indexed as in the torrent, files left out are downloaded at normal
+            // priority. Skipped files get no disk space, may be changed at any time
+            void setFilePriorities(std::vector<FilePriority> priorities);
+
+            // Serve the torrent's files while downloading, pieces ahead of the reader's cursor are
+            // fetched first. Must be called before `start`
+            [[nodiscard]] std::shared_ptr<StreamSource> enableStreaming();
+
+            // Look for peers on the DHT too, we are announced there on the tracker port.
+            // The node must outlive the torrent, must be called before `start`
+            void setDHT(DHTNode &node) { dht = &node; }
+
+            // Take over an inbound connection (already tracked) whose handshake matched our info hash
+            void adoptInbound(int fd, const std::string &ip, std::uint16_t port, std::string &&recvBuffer, TimePoint lastTick);
+
+            [[nodiscard]] bool hasPeer(int fd) const { 
+                return fd2PeerID.contains(fd) || std::ranges::find(webSeeds, fd, &WebSeed::fd) != webSeeds.end();
+            }
+            // Live figures of the torrent & its connected peers
+            [[nodiscard]] TorrentMetrics metrics(TimePoint now);
+
+            [[nodiscard]] const std::string &infoHash() const { return torrentFile.infoHash; }
+            [[nodiscard]] const std::string &name() const { return torrentFile.name; }
 
         private:
             // Const reference to torrent file meta data
@@ -39,13 +109,41 @@ namespace Torrent {
 
             // User defined constants
             const std::uint16_t blockSize, MAX_REQ_WAIT_TIME, MIN_RECON_WAIT_TIME;
-            const std::uint8_t MAX_BACKLOG, MAX_UNCHOKE_ATTEMPTS, MAX_RECONNECT_ATTEMPTS;
+            const std::uint8_t INITIAL_BACKLOG, MAX_UNCHOKE_ATTEMPTS, MAX_RECONNECT_ATTEMPTS;
+            const bool ADAPTIVE_BACKLOG;
+
+            // Upload related constants, seed time in minutes (0 disables the limit)
+            const std::uint8_t UPLOAD_SLOTS;
+            const double SEED_RATIO;
+            const std::uint32_t SEED_TIME;
+
+            // Choking rounds: reciprocate top uploaders & rotate one optimistic unchoke
+            static constexpr std::chrono::seconds CHOKE_INTERVAL {10}, OPTIMISTIC_INTERVAL {30};
+
+            // Request queue depth per peer tracks rate x RTT within these bounds (unless fixed at INITIAL_BACKLOG),
+            // re-estimated every RATE_INTERVAL.
+            // Near the end of the download, peers slower than 1/SLOW_PEER_RATIO of the fastest get a single request
+            static constexpr std::uint16_t MIN_BACKLOG {2}, MAX_BACKLOG {256};
+            static constexpr std::chrono::seconds RATE_INTERVAL {1};
+            static constexpr double RATE_SMOOTHING {0.3}, SLOW_PEER_RATIO {8};
+
+            // Unchoked peers holding our requests without delivering a block for this long are snubbing us
+            static constexpr std::chrono::seconds SNUB_TIMEOUT {15};
+
+            // Requests from peers are served only while send buffer is below this size
+            static constexpr std::size_t MAX_SEND_BUFFER {1 << 18}, MAX_PEER_REQUESTS {256};
+
+            // Fast Extension: size of the allowed fast set we grant, cap on what we keep from each peer
+            static constexpr std::size_t ALLOWED_FAST_COUNT {10}, MAX_FAST_PIECES {32};
 
             // Save torrent state
             const std::filesystem::path StateSavePath;
 
+            // Pieces on disk, journaled as they are written & snapshotted to StateSavePath
+            ProgressJournal journal;
+
             // Whether to download from scratch
-            // Decided based on whether we have the StateSavePath on disk
+            // Decided based on whether we have a snapshot or journal on disk
             const bool coldStart {true};
 
             // Piece Manager to determine which piece to download next
@@ -54,12 +152,105 @@ namespace Torrent {
             // Disk writer manages to actual file writes
             DiskWriter diskWriter;
 
+            // Completed pieces are hashed on the pool (inline without workers), results come back through the queue.
+            // Queue is shared with the jobs so that it outlives any still running after stop
+            struct VerifiedPiece { std::uint32_t pieceIdx; bool valid; SharedPiece piece; };
+            async::ThreadPool &hashPool;
+            std::shared_ptr<MPSCQueue<VerifiedPiece>> verified;
+            std::size_t verifying {};
+
+            // Peer states keyed by peer ID (ip:port)
+            std::unordered_map<std::string, PeerContext> states;
+
+            // Choker state and total bytes uploaded / downloaded across all peers
+            std::string optimisticPeerID;
+            TimePoint lastChokeRound, lastOptimisticRound;
+            std::uint64_t uploadedBytes {}, downloadedBytes {};
+            std::size_t unchokedCount {};
+
+            // Pipelining state, fastest peer rate is refreshed every rate round
+            TimePoint lastRateRound;
+            double bestRate {};
+
+            // Endgame as of the last step, duplicate requests are cancelled once it's left unfinished
+            bool endgame {false};
+
+            // Metrics: verified bytes, their smoothed rate (refreshed every rate round), bytes received
+            // to no use & pieces failing the hash check
+            std::uint64_t verifiedBytes {}, roundVerifiedBytes {}, wastedBytes {}, hashFailures {};
+            double goodput {};
+
+            // Event loop & budgets shared with other torrents in the session
+            net::PollManager *pollManager {nullptr};
+            SessionLimits *limits {nullptr};
+            std::unordered_map<int, std::string> fd2PeerID;
+            const std::string handshake;
+            std::optional<TimePoint> seedStart;
+
+            // Files selected for download, empty until priorities are set (all wanted)
+            std::vector<bool> wantedFiles;
+
+            // Streaming reader if any, the window of pieces ahead of its cursor is requested first
+            static constexpr std::uint64_t STREAM_WINDOW {1 << 25};
+            std::shared_ptr<StreamSource> stream;
+
+            // HTTP seeds from the torrent's url-list, each is kept WEB_SEED_QUEUE bytes of requests ahead.
+            // They have every piece, block selection goes through the piece manager like any peer
+            static constexpr std::uint64_t WEB_SEED_QUEUE {1 << 22};
+            std::vector<WebSeed> webSeeds;
+            DynamicBitset allPieces;
+
+            // Trackers are announced to from `start` & every interval they ask for, off the event loop
+            static constexpr std::chrono::seconds ANNOUNCE_RETRY {60};
+            std::future<std::vector<TorrentTracker::Peer>> announcing;
+            bool announced {false};
+            TimePoint nextAnnounce {TimePoint::max()};
+            int announceTimeout {10};
+
+            // DHT lookups also run off the event loop, again every DHT_INTERVAL or DHT_RETRY if nothing turned up
+            static constexpr std::chrono::seconds DHT_INTERVAL {900}, DHT_RETRY {30};
+            DHTNode *dht {nullptr};
+            std::future<std::vector<TorrentTracker::Peer>> dhtLookup;
+            TimePoint nextDHTLookup {TimePoint::max()};
+
         private:
-            void handleHave(const std::string &payload, PeerContext &ctx);
-            void handleBitfield(const std::string &payload, PeerContext &ctx);
-            void handlePiece(const std::string &payload, PeerContext &ctx);
-            void handleChoke(const std::string&, PeerContext &ctx);
-            void handleUnchoke(const std::string&, PeerContext &ctx);
+            void handleHave(std::string_view payload, PeerContext &ctx);
+            void handleBitfield(std::string_view payload, PeerContext &ctx);
+            void handlePiece(std::string_view payload, PeerContext &ctx);
+            void handleChoke(std::string_view, PeerContext &ctx);
+            void handleUnchoke(std::string_view, PeerContext &ctx);
+            void handleInterested(std::string_view, PeerContext &ctx);
+            void handleNotInterested(std::string_view, PeerContext &ctx);
+            void handleRequest(std::string_view payload, PeerContext &ctx);
+            void handleCancel(std::string_view payload, PeerContext &ctx);
+            void handleHaveAll(std::string_view, PeerContext &ctx);
+            void handleHaveNone(std::string_view, PeerContext &ctx);
+            void handleSuggestPiece(std::string_view payload, PeerContext &ctx);
+            void handleAllowedFast(std::string_view payload, PeerContext &ctx);
+            void handleReject(std::string_view payload, PeerContext &ctx);
+            void requestBlocks(PeerContext &ctx, std::uint16_t depth);
+            void processRecvBuffer(PeerContext &ctx);
             void clearPendingFromPeer(PeerContext &ctx);
+            void dropPeer(PeerContext &ctx, TimePoint lastTick);
+            void serveRequests(PeerContext &ctx);
+            void updateInterest(PeerContext &ctx);
+            void setChoking(PeerContext &ctx, bool choke);
+            void runChoker(TimePoint now);
+            void updatePipelines(TimePoint now);
+            void reannounce(TimePoint now);
+            void lookupDHT(TimePoint now);
+            void addPeer(const std::string &ip, std::uint16_t port, TimePoint lastTick);
+            [[nodiscard]] std::uint16_t pipelineDepth(const PeerContext &ctx) const;
+            void broadcastHave(std::uint32_t pieceIdx);
+            [[nodiscard]] bool seeding(TimePoint now) const;
+            void cancelDuplicateRequests(const PieceBlock &block, const PeerContext *receiver = nullptr);
+            void cancelStaleRequests(const std::vector<std::uint32_t> &resetPieces);
+            void onWebSeedEvent(WebSeed &seed, net::Socket &socket, net::PollEventType event, TimePoint lastTick);
+            void serviceWebSeeds(TimePoint lastTick);
+            void dropWebSeed(WebSeed &seed, TimePoint lastTick, bool failed);
+            void updateInterest(WebSeed &seed);
+            void verifyPiece(std::uint32_t pieceIdx, SharedPiece piece);
+            void drainVerified();
+            void drainReads();
     };
 };
@@ -4,27 +4,33 @@
 
 #include <cstdint>
 #include <string>
+#include <utility>
 #include <vector>
 
 // Forward declare to speed up compilation
-namespace JSON { struct JSONHandle; }
+namespace Bencode { class View; }
 
 namespace Torrent {
     class TorrentFile {
         private:
-            // Helper to extract the total length from json field 'length'
-            static std::uint64_t calculateTotalLength(JSON::JSONHandle info);
-
-            // Helper to parse the file structure from json field 'files'
-            static std::vector<FileStruct> parseFileStructure(JSON::JSONHandle info);
+            // Helper to parse the file structure from field 'files' (or 'name' & 'length' for single files)
+            static std::vector<FileStruct> parseFileStructure(const Bencode::View &info);
 
         public:
-            std::string announceURL;
+            // Tracker tiers (BEP 12), a single tier holding `announce` if there is no announce-list
+            std::vector<std::vector<std::string>> announceList;
             std::uint32_t pieceSize;
             std::uint64_t length;
             std::string name, pieceBlob, infoHash;
             std::size_t numPieces;
             std::vector<FileStruct> files;
+            bool multiFile;
+
+            // HTTP servers holding the same files (BEP 19 `url-list`)
+            std::vector<std::string> webSeeds;
+
+            // DHT nodes to join through for trackerless torrents (BEP 5 `nodes`), as host & port
+            std::vector<std::pair<std::string, std::uint16_t>> dhtNodes;
 
         public:
             TorrentFile(const std::string_view torrentFP);
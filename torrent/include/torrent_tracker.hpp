@@ -6,18 +6,41 @@
 
 namespace Torrent {
     class TorrentTracker {
+            public:
+                using Peer = std::pair<std::string, std::uint16_t>;
+
             private:
-                std::vector<std::pair<std::string, std::uint16_t>> getUDPPeers(int timeout);
-                std::vector<std::pair<std::string, std::uint16_t>> getTCPPeers(int timeout);
+                struct Announce { std::vector<Peer> peers; std::uint32_t interval {}, seeders {}, leechers {}; };
+
+                // BEP 12 tiers, trackers within a tier are tried in order and
+                // the one that responds is moved to the front of its tier
+                std::vector<std::vector<net::URL>> tiers;
+
+                // Trackers may ask for anything, don't re-announce more often than this (seconds)
+                const std::uint32_t MIN_INTERVAL;
+
+                Announce announceUDP(net::URL &url, int timeout) const;
+                Announce announceHTTP(const net::URL &url, int timeout) const;
+                Announce announceTier(std::vector<net::URL> &tier, int timeout) const;
 
             public:
                 const std::string peerID;
                 const TorrentFile &torrentFile;
-                mutable net::URL announceURL;
-                std::uint32_t interval, seeders, leechers;
+                const std::uint16_t port;
+
+                // Stats from the last announce (best across tiers), interval is in seconds
+                std::uint32_t interval {1800}, seeders {}, leechers {};
+
+                // Reported to the trackers, must not be updated while an announce is running
+                std::uint64_t uploaded {}, downloaded {}, left;
 
             public:
-                TorrentTracker(const TorrentFile &torrentFile);
-                [[nodiscard]] std::vector<std::pair<std::string, std::uint16_t>> getPeers(int timeout);
+                TorrentTracker(const TorrentFile &torrentFile, const std::uint16_t port = 6881, const std::uint32_t minInterval = 60);
+
+                // Announce to all tiers concurrently, returns the merged & deduplicated peers.
+                // Blocks for up to `timeout` seconds per tracker tried, throws only if every tier fails
+                [[nodiscard]] std::vector<Peer> getPeers(int timeout);
+
+                [[nodiscard]] std::size_t trackerCount() const;
         };
 }
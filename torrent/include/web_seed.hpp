@@ -0,0 +1,101 @@
+#pragma once
+
+#include "common.hpp"
+
+#include "../../networking/net.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <vector>
+
+namespace Torrent {
+    class TorrentFile;
+
+    // HTTP server holding the torrent's files (BEP 19 `url-list`), used as one more peer that has every
+    // piece. Runs of contiguous blocks are fetched with range requests, one per file they span, pipelined
+    // on a keep-alive connection tracked by the torrent's poll loop. Responses arrive in request order and
+    // are cut back into blocks so that they take the same path as blocks from peers
+    class WebSeed {
+        public:
+            using TimePoint = std::chrono::steady_clock::time_point;
+            using BlockHandler = std::function<void(const PieceBlock &block, std::string_view data)>;
+
+        private:
+            // Responses are expected to start with a header of at most this size,
+            // failed connections are retried after RETRY_INTERVAL times the failures so far
+            static constexpr std::size_t MAX_HEADER_SIZE {1 << 14};
+            static constexpr std::chrono::seconds RETRY_INTERVAL {10};
+
+            // Body length of a request & whether it covered the whole file (a plain 200 is fine then)
+            struct Request { std::uint64_t length; bool wholeFile; };
+
+            // File layout of the torrent as offsets into the torrent & URL paths on the server
+            struct File { std::uint64_t offset, size; std::string path; };
+
+            const std::uint32_t pieceSize;
+            std::string _url;
+            net::URL baseURL;
+            std::string host;
+            std::vector<File> files;
+
+            int _fd {-1};
+            bool closeRequested {false}, disabled {false};
+            std::uint8_t failures {};
+            TimePoint retryAt {}, lastRead {};
+
+            // Blocks & requests in flight in the order the server answers them, part of the current
+            // response body still to come & the bytes of the block being assembled
+            std::deque<PieceBlock> pending;
+            std::deque<Request> requests;
+            std::uint64_t bodyLeft {}, pendingBytes {};
+            std::string recvBuffer, block;
+
+            void queueRange(std::uint64_t first, std::uint64_t last);
+            void parseHeader(std::string_view header);
+
+        public:
+            // Request bytes not yet written to the socket, reads paused by the session download limit
+            std::string sendBuffer;
+            bool recvThrottled {false};
+
+            // Throws on URLs we can't fetch from (anything but plain http)
+            WebSeed(const std::string &url, const TorrentFile &torrent);
+
+            // Blocking DNS lookup done once before the first connect, hosts that don't resolve are given up on
+            void resolve();
+
+            // Non blocking connect, the socket is to be tracked by the caller's poll manager
+            [[nodiscard]] net::Socket connect(TimePoint now);
+
+            // Connection is gone, blocks still in flight are returned to be requested again. Failed connections
+            // back off & the seed is given up on after `maxFailures` in a row
+            [[nodiscard]] std::vector<PieceBlock> disconnect(TimePoint now, bool failed, std::uint8_t maxFailures);
+
+            // Request blocks (pieceIdx, blockOffset, blockSize) in any order, sent once the connect completes
+            void request(std::vector<std::tuple<std::uint32_t, std::uint32_t, std::uint32_t>> blocks);
+
+            // Feed response bytes, completed blocks are handed to `onBlock` in request order.
+            // Throws on responses we can't use (errors, missing ranges, chunked bodies)
+            void onData(std::string_view data, TimePoint now, const BlockHandler &onBlock);
+
+            // Connection is open & the server hasn't asked to close it, can take more requests
+            [[nodiscard]] bool ready() const { return _fd != -1 && !closeRequested; }
+
+            // Server asked to close the connection and every response is in
+            [[nodiscard]] bool done() const { return closeRequested && requests.empty() && !bodyLeft; }
+
+            // Not connected & due for a (re)connect
+            [[nodiscard]] bool due(TimePoint now) const { return _fd == -1 && !disabled && now >= retryAt; }
+
+            [[nodiscard]] bool active() const { return !disabled; }
+            [[nodiscard]] int fd() const { return _fd; }
+            [[nodiscard]] const std::string &url() const { return _url; }
+            [[nodiscard]] std::uint64_t inFlight() const { return pendingBytes; }
+            [[nodiscard]] TimePoint lastReadTimeStamp() const { return lastRead; }
+    };
+}
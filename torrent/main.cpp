@@ -1,6 +1,4 @@
-#include "include/torrent_downloader.hpp"
-#include "include/torrent_file.hpp"
-#include "include/torrent_tracker.hpp"
+#include "include/session.hpp"
 
 #include "../cli/argparse.hpp"
 #include "../misc/logger.hpp"
@@ -8,7 +6,8 @@
 int main(int argc, char **argv) try {
     // Define the command line parser with supported arguments
     argparse::ArgumentParser cli {"ctorrent"};
-    cli.addArgument("torrent-file").alias("f").required().help("Path to the .torrent file.");
+    cli.addArgument("torrent-files").alias("f").scan<std::vector<std::string>>().required()
+        .help("Comma separated paths to the .torrent files, all are downloaded in a single session.");
 
     cli.addArgument("download-directory").alias("d").defaultValue("downloads")
         .help("Where to store the downloaded files?");
@@ -19,7 +18,7 @@ int main(int argc, char **argv) try {
 
     cli.addArgument("backlog", argparse::NAMED).alias("L").defaultValue(8)
         .validate<int>(argparse::validators::between(1, 32))
-        .help("Number of concurrent block requests to keep pipelined per peer");
+        .help("Initial number of block requests pipelined per peer, adapted to each peer's rate x RTT once measured");
 
     cli.addArgument("unchoke-attempts", argparse::NAMED).alias("u").defaultValue(3)
         .validate<int>(argparse::validators::between(1, 10))
@@ -37,6 +36,91 @@ int main(int argc, char **argv) try {
         .validate<int>(argparse::validators::between(1, 6000))
         .help("Minimum seconds we will wait before attempting to reconnect to a disconnected peer");
 
+    cli.addArgument("port", argparse::NAMED).alias("p").defaultValue(6881)
+        .validate<int>(argparse::validators::between(1, 65535))
+        .help("Port to listen on for incoming peer connections");
+
+    cli.addArgument("upload-slots", argparse::NAMED).alias("U").defaultValue(4)
+        .validate<int>(argparse::validators::between(1, 64))
+        .help("Number of peers unchoked for upload (excluding the optimistic unchoke)");
+
+    cli.addArgument("seed-ratio", argparse::NAMED).alias("s").defaultValue(0.0)
+        .validate<double>(argparse::validators::between(0.0, 100.0))
+        .help("Keep seeding after download until upload/size reaches this ratio (0 = disabled)");
+
+    cli.addArgument("seed-time", argparse::NAMED).alias("T").defaultValue(0)
+        .validate<int>(argparse::validators::between(0, 10080))
+        .help("Keep seeding after download for these many minutes (0 = disabled)");
+
+    cli.addArgument("max-connections", argparse::NAMED).alias("C").defaultValue(500)
+        .validate<int>(argparse::validators::between(1, 10000))
+        .help("Maximum peer connections across all torrents of the session");
+
+    cli.addArgument("max-unchoked", argparse::NAMED).alias("K").defaultValue(64)
+        .validate<int>(argparse::validators::between(1, 1024))
+        .help("Maximum peers unchoked for upload across all torrents of the session");
+
+    cli.addArgument("download-limit", argparse::NAMED).alias("dl").defaultValue(0)
+        .validate<int>(argparse::validators::between(0, 1 << 22))
+        .help("Download rate cap in KB/s across all torrents, idle bandwidth is shared by active peers (0 = unlimited)");
+
+    cli.addArgument("upload-limit", argparse::NAMED).alias("ul").defaultValue(0)
+        .validate<int>(argparse::validators::between(0, 1 << 22))
+        .help("Upload rate cap in KB/s across all torrents, idle bandwidth is shared by active peers (0 = unlimited)");
+
+    cli.addArgument("peer-download-limit", argparse::NAMED).alias("pdl").defaultValue(0)
+        .validate<int>(argparse::validators::between(0, 1 << 22))
+        .help("Download rate cap in KB/s for each peer (0 = unlimited)");
+
+    cli.addArgument("peer-upload-limit", argparse::NAMED).alias("pul").defaultValue(0)
+        .validate<int>(argparse::validators::between(0, 1 << 22))
+        .help("Upload rate cap in KB/s for each peer (0 = unlimited)");
+
+    cli.addArgument("memory-budget", argparse::NAMED).alias("M").defaultValue(512)
+        .validate<int>(argparse::validators::between(16, 1 << 20))
+        .help("MB of memory for partially downloaded pieces and the upload read cache across all torrents");
+
+    cli.addArgument("file-priorities", argparse::NAMED).alias("F").defaultValue(std::vector<std::string>{})
+        .help("Comma separated priority (skip, low, normal, high) of each file by its index in the torrent, files left out "
+              "are downloaded at normal priority. Skipped files get no disk space, only pieces shared with wanted files are fetched");
+
+    cli.addArgument("list-files", argparse::NAMED).alias("l").defaultValue(false).implicitValue(true)
+        .help("Print the index, size & path of every file in the torrents and exit");
+
+    cli.addArgument("stream-port", argparse::NAMED).alias("S").defaultValue(0)
+        .validate<int>(argparse::validators::between(0, 65535))
+        .help("Stream files over HTTP on 127.0.0.1:<port> while downloading, pieces ahead of the player are fetched first (0 = disabled)");
+
+    cli.addArgument("dht-port", argparse::NAMED).alias("dp").defaultValue(0)
+        .validate<int>(argparse::validators::between(0, 65535))
+        .help("Find peers on the DHT through a node on this UDP port, for when the trackers are down or missing (0 = disabled)");
+
+    cli.addArgument("metrics-file", argparse::NAMED).alias("mf").defaultValue("")
+        .help("Periodically write per torrent & per peer metrics (rates, RTT, wasted bytes, disk queue, loop timings) "
+              "to this file in the Prometheus text format (empty = disabled)");
+
+    cli.addArgument("metrics-interval", argparse::NAMED).alias("mi").defaultValue(5)
+        .validate<int>(argparse::validators::between(1, 3600))
+        .help("Seconds between metrics file refreshes");
+
+    cli.addArgument("disk-threads", argparse::NAMED).alias("D").defaultValue(4)
+        .validate<int>(argparse::validators::between(1, 64))
+        .help("Worker threads writing pieces to disk, shared by all torrents");
+
+    cli.addArgument("disk-backend", argparse::NAMED).alias("db").defaultValue("auto")
+        .help("How pieces reach the disk: auto (io_uring when the kernel supports it), uring or threads "
+              "(pwrite on the disk threads)");
+
+    cli.addArgument("hash-threads", argparse::NAMED).alias("H").defaultValue(4)
+        .validate<int>(argparse::validators::between(0, 64))
+        .help("Worker threads verifying piece hashes, shared by all torrents (0 hashes on the network thread)");
+
+    cli.addArgument("fixed-backlog", argparse::NAMED).defaultValue(false).implicitValue(true)
+        .help("Keep every peer at --backlog pipelined requests instead of adapting to its rate x RTT");
+
+    cli.addArgument("recheck", argparse::NAMED).alias("R").defaultValue(false).implicitValue(true)
+        .help("Ignore the saved state and verify the data already on disk before resuming");
+
     cli.addArgument("timeout", argparse::NAMED).alias("t").defaultValue(10)
         .validate<int>(argparse::validators::between(1, 120))
         .help("Timeout (in seconds) for trackers and general socket operations");
@@ -50,7 +134,7 @@ int main(int argc, char **argv) try {
 
     // Parse and extract the arguments
     cli.parseArgs(argc, argv);
-    std::string torrentFilePath {cli.get("torrent-file")};
+    std::vector<std::string> torrentFilePaths {cli.get<std::vector<std::string>>("torrent-files")};
     std::string downloadDirectory {cli.get("download-directory")};
     auto blockSize {static_cast<std::uint16_t>(cli.get<int>("block-size"))};
     auto backlog {static_cast<std::uint8_t>(cli.get<int>("backlog"))};
@@ -58,18 +142,76 @@ int main(int argc, char **argv) try {
     auto reconAttempts {static_cast<std::uint8_t>(cli.get<int>("recon-attempts"))};
     auto reqWaitTime {static_cast<std::uint16_t>(cli.get<int>("max-iwait"))};
     auto reconWaitTime {static_cast<std::uint16_t>(cli.get<int>("min-rwait"))};
+    auto port {static_cast<std::uint16_t>(cli.get<int>("port"))};
+    auto uploadSlots {static_cast<std::uint8_t>(cli.get<int>("upload-slots"))};
+    auto seedRatio {cli.get<double>("seed-ratio")};
+    auto seedTime {static_cast<std::uint32_t>(cli.get<int>("seed-time"))};
+    auto maxConnections {static_cast<std::size_t>(cli.get<int>("max-connections"))};
+    auto maxUnchoked {static_cast<std::size_t>(cli.get<int>("max-unchoked"))};
+    auto downloadLimit {static_cast<std::uint64_t>(cli.get<int>("download-limit")) * 1024};
+    auto uploadLimit {static_cast<std::uint64_t>(cli.get<int>("upload-limit")) * 1024};
+    auto peerDownloadLimit {static_cast<std::uint64_t>(cli.get<int>("peer-download-limit")) * 1024};
+    auto peerUploadLimit {static_cast<std::uint64_t>(cli.get<int>("peer-upload-limit")) * 1024};
+    auto memoryBudget {static_cast<std::size_t>(cli.get<int>("memory-budget")) << 20};
+    auto priorityNames {cli.get<std::vector<std::string>>("file-priorities")};
+    auto listFiles {cli.get<bool>("list-files")};
+    auto streamPort {static_cast<std::uint16_t>(cli.get<int>("stream-port"))};
+    auto dhtPort {static_cast<std::uint16_t>(cli.get<int>("dht-port"))};
+    auto metricsPath {cli.get("metrics-file")};
+    auto metricsInterval {std::chrono::seconds{cli.get<int>("metrics-interval")}};
+    auto diskThreads {static_cast<std::size_t>(cli.get<int>("disk-threads"))};
+    auto diskBackendName {cli.get("disk-backend")};
+    auto hashThreads {static_cast<std::size_t>(cli.get<int>("hash-threads"))};
+    auto recheck {cli.get<bool>("recheck")};
+    auto fixedBacklog {cli.get<bool>("fixed-backlog")};
     auto timeout {cli.get<int>("timeout")};
     auto verbose {cli.get<short>("verbose")};
 
     // Verbosity of logger set by the verbosity cli arg (validated b/w 1-5)
     Logging::Dynamic::setLogLevel(static_cast<Logging::Level>(verbose));
 
-    // Actual torrent stuff
-    Torrent::TorrentFile torrent{torrentFilePath};
-    Torrent::TorrentTracker tTracker {torrent};
-    Torrent::TorrentDownloader tDownloader {tTracker, downloadDirectory, blockSize, 
-        backlog, unchokeAttempts, reconAttempts, reqWaitTime, reconWaitTime};
-    tDownloader.download(timeout);
+    // File indices to pass along with --file-priorities
+    if (listFiles) {
+        for (const std::string &torrentFilePath: torrentFilePaths) {
+            Torrent::TorrentFile torrentFile {torrentFilePath};
+            std::println("{} ({} files)", torrentFile.name, torrentFile.files.size());
+            for (std::size_t fileIdx {}; fileIdx < torrentFile.files.size(); ++fileIdx) {
+                const auto &[path, size] {torrentFile.files[fileIdx]};
+                std::println("{:>6} {:>12.2f} MB  {}", fileIdx, static_cast<double>(size) / (1024 * 1024), path.string());
+            }
+        }
+        return 0;
+    }
+
+    // Same priorities apply to every torrent of the session
+    std::vector<Torrent::FilePriority> filePriorities;
+    for (const std::string &name: priorityNames) {
+        if (name == "skip") filePriorities.push_back(Torrent::FilePriority::Skip);
+        else if (name == "low") filePriorities.push_back(Torrent::FilePriority::Low);
+        else if (name == "normal" || name.empty()) filePriorities.push_back(Torrent::FilePriority::Normal);
+        else if (name == "high") filePriorities.push_back(Torrent::FilePriority::High);
+        else throw std::runtime_error("Invalid file priority: " + name + ", expected one of skip, low, normal, high");
+    }
+
+    Torrent::DiskBackend diskBackend;
+    if (diskBackendName == "auto") diskBackend = Torrent::DiskBackend::Auto;
+    else if (diskBackendName == "uring") diskBackend = Torrent::DiskBackend::IoUring;
+    else if (diskBackendName == "threads") diskBackend = Torrent::DiskBackend::Threads;
+    else throw std::runtime_error("Invalid disk backend: " + diskBackendName + ", expected one of auto, uring, threads");
+
+    // Actual torrent stuff, every torrent shares the session's event loop & budgets
+    Torrent::Session session {timeout, port, maxConnections, maxUnchoked, diskThreads, hashThreads, memoryBudget, diskBackend};
+    session.setRateLimits(downloadLimit, uploadLimit);
+    session.setPeerRateLimits(peerDownloadLimit, peerUploadLimit);
+    if (streamPort) session.enableStreaming(streamPort);
+    if (!metricsPath.empty()) session.enableMetrics(metricsPath, metricsInterval);
+    if (dhtPort) session.enableDHT(dhtPort, std::filesystem::path{downloadDirectory} / ".ctorrent-dht");
+    for (const std::string &torrentFilePath: torrentFilePaths) {
+        const std::string &infoHash {session.add(torrentFilePath, downloadDirectory, blockSize, backlog, unchokeAttempts, 
+            reconAttempts, reqWaitTime, reconWaitTime, uploadSlots, seedRatio, seedTime, recheck, !fixedBacklog)};
+        if (!filePriorities.empty()) session.setFilePriorities(infoHash, filePriorities);
+    }
+    session.run();
 } 
 
 // Catch exceptions & just print the message, ensures RAII cleanup can happen
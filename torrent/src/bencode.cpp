@@ -2,11 +2,63 @@
 
 #include "../../json-parser/json/json.hpp"
 
+#include <cctype>
+#include <charconv>
 #include <sstream>
 #include <stack>
 
 // Helpers inside annoymous namespace only visible inside this translation unit
 namespace {
+    // Nesting deeper than this is rejected rather than risking the stack
+    constexpr std::size_t MAX_DEPTH {256};
+
+    [[noreturn]] void invalid() { throw std::runtime_error("Invalid bencoded string"); }
+
+    bool isDigit(char ch) { return std::isdigit(static_cast<unsigned char>(ch)); }
+
+    // Start & length of the contents of the string at `pos` (<length>:<contents>)
+    std::pair<std::size_t, std::size_t> stringBounds(std::string_view bytes, std::size_t pos) {
+        const char *last {bytes.data() + bytes.size()};
+        std::size_t length {};
+        auto [ptr, ec] {std::from_chars(bytes.data() + pos, last, length)};
+        if (ec != std::errc{} || ptr == last || *ptr != ':') invalid();
+        const auto start {static_cast<std::size_t>(ptr - bytes.data()) + 1};
+        if (length > bytes.size() - start) invalid();
+        return {start, length};
+    }
+
+    // One past the end of the value starting at `pos`, checking that it is well formed on the way.
+    // Strings are jumped over by their length, so only containers cost anything to skip
+    std::size_t skip(std::string_view bytes, std::size_t pos, std::size_t depth = 0) {
+        if (pos >= bytes.size() || depth > MAX_DEPTH) invalid();
+        const char ch {bytes[pos]};
+        if (isDigit(ch)) {
+            auto [start, length] {stringBounds(bytes, pos)};
+            return start + length;
+        }
+
+        if (ch == 'i') {
+            const std::size_t end {bytes.find('e', pos)};
+            if (end == std::string_view::npos) invalid();
+            std::int64_t value;
+            auto [ptr, ec] {std::from_chars(bytes.data() + pos + 1, bytes.data() + end, value)};
+            if (ec != std::errc{} || ptr != bytes.data() + end) invalid();
+            return end + 1;
+        }
+
+        // Lists & dicts run until their end marker, dict keys must be strings
+        if (ch != 'l' && ch != 'd') invalid();
+        for (++pos; pos < bytes.size() && bytes[pos] != 'e';) {
+            if (ch == 'd') {
+                if (!isDigit(bytes[pos])) invalid();
+                pos = skip(bytes, pos, depth + 1);
+            }
+            pos = skip(bytes, pos, depth + 1);
+        }
+        if (pos >= bytes.size()) invalid();
+        return pos + 1;
+    }
+
     // Extract the top most node and insert it back into its parent
     void extract_Push_to_ancestor(std::stack<JSON::JSONNodePtr> &stk) {
         if (stk.size() <= 1) std::runtime_error("Stack has insufficient nodes for this operation");
@@ -110,7 +162,7 @@ namespace Bencode {
                 if (endP == std::string::npos || (!stk.empty() && stk.top()->getType() == JSON::NodeType::object))
                     throw std::runtime_error("Invalid bencoded string");
 
-                std::int64_t val {std::stoll(encoded.substr(idx + 1, endP))};
+                std::int64_t val {std::stoll(encoded.substr(idx + 1, endP - idx - 1))};
                 if (stk.empty())
                     stk.push(JSON::helper::createNode(val));
                 else if (stk.top()->getType() == JSON::NodeType::array)
@@ -132,7 +184,7 @@ namespace Bencode {
                 if (numEndP == std::string::npos)
                     throw std::runtime_error("Invalid bencoded string");
 
-                std::size_t strLen {std::stoull(encoded.substr(idx, numEndP))};
+                std::size_t strLen {std::stoull(encoded.substr(idx, numEndP - idx))};
                 if (numEndP + 1 + strLen > N) 
                     throw std::runtime_error("Invalid bencoded string");
 
@@ -179,4 +231,94 @@ namespace Bencode {
         if (stk.size() != 1) throw std::runtime_error("Invalid bencoded string");
         return std::move(stk.top());
     }
+
+    View View::parse(std::string_view encoded) {
+        if (skip(encoded, 0) != encoded.size()) invalid();
+        return View{encoded};
+    }
+
+    View::Type View::type() const {
+        if (bytes.empty()) return Type::null;
+        switch (bytes.front()) {
+            case 'i': return Type::integer;
+            case 'l': return Type::list;
+            case 'd': return Type::dict;
+            default: return Type::string;
+        }
+    }
+
+    std::string_view View::str() const {
+        if (bytes.empty()) return {};
+        if (type() != Type::string) throw std::runtime_error("Bencoded value is not a string");
+        auto [start, length] {stringBounds(bytes, 0)};
+        return bytes.substr(start, length);
+    }
+
+    std::int64_t View::integer() const {
+        if (bytes.empty()) return 0;
+        if (type() != Type::integer) throw std::runtime_error("Bencoded value is not an integer");
+        std::int64_t value {};
+        std::from_chars(bytes.data() + 1, bytes.data() + bytes.size() - 1, value);
+        return value;
+    }
+
+    View View::operator[](std::string_view key) const {
+        if (type() != Type::dict) return {};
+        for (auto [entryKey, value]: *this)
+            if (entryKey == key) return value;
+        return {};
+    }
+
+    View View::operator[](std::size_t idx) const {
+        if (type() != Type::list) return {};
+        for (auto [_, value]: *this)
+            if (!idx--) return value;
+        return {};
+    }
+
+    View View::at(std::string_view key) const {
+        View result {(*this)[key]};
+        if (!result) {
+            if (type() != Type::dict) throw std::runtime_error("Bencoded value is not a dict");
+            throw std::runtime_error("Dict key doesn't exist, tried to access with: " + std::string{key});
+        }
+        return result;
+    }
+
+    View View::at(std::size_t idx) const {
+        View result {(*this)[idx]};
+        if (!result) {
+            if (type() != Type::list) throw std::runtime_error("Bencoded value is not a list");
+            throw std::runtime_error("List idx out of bounds, tried to access: " + std::to_string(idx));
+        }
+        return result;
+    }
+
+    View::Iterator View::begin() const {
+        const Type kind {type()};
+        if (kind != Type::list && kind != Type::dict) return {};
+        return {bytes.substr(1), kind == Type::dict};
+    }
+
+    View::Iterator View::end() const {
+        const Type kind {type()};
+        if (kind != Type::list && kind != Type::dict) return {};
+        return {bytes.substr(bytes.size() - 1), kind == Type::dict};
+    }
+
+    View::Iterator::Iterator(std::string_view rest, bool dict): rest {rest}, dict {dict} {}
+
+    View::Iterator::value_type View::Iterator::operator*() const {
+        if (!dict) return {{}, View{rest.substr(0, skip(rest, 0))}};
+        auto [start, length] {stringBounds(rest, 0)};
+        const std::size_t valueStart {start + length};
+        return {rest.substr(start, length), View{rest.substr(valueStart, skip(rest, valueStart) - valueStart)}};
+    }
+
+    View::Iterator &View::Iterator::operator++() {
+        std::size_t pos {skip(rest, 0)};
+        if (dict) pos = skip(rest, pos);
+        rest.remove_prefix(pos);
+        return *this;
+    }
 }
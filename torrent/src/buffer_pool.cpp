@@ -0,0 +1,37 @@
+#include "../include/buffer_pool.hpp"
+
+namespace Torrent {
+    BufferPool::BufferPool(const std::size_t slabSize, const std::size_t maxFree): 
+        state {std::make_shared<State>(slabSize, maxFree)}
+    {
+        // Reserved upfront so that returning a slab from the deleter never allocates
+        state->free.reserve(maxFree);
+    }
+
+    std::shared_ptr<std::string> BufferPool::acquire() const {
+        std::unique_ptr<std::string> slab;
+        {
+            std::scoped_lock lock {state->mutex};
+            if (!state->free.empty()) {
+                slab = std::move(state->free.back());
+                state->free.pop_back();
+            }
+        }
+
+        // Recycled slabs may have been shrunk to fit the last piece, capacity is retained
+        if (!slab) slab = std::make_unique<std::string>(state->slabSize, '\0');
+        else slab->resize(state->slabSize);
+
+        return {slab.release(), [state = state](std::string *ptr) {
+            std::unique_ptr<std::string> slab {ptr};
+            std::scoped_lock lock {state->mutex};
+            if (state->free.size() < state->maxFree) 
+                state->free.push_back(std::move(slab));
+        }};
+    }
+
+    std::size_t BufferPool::available() const {
+        std::scoped_lock lock {state->mutex};
+        return state->free.size();
+    }
+}
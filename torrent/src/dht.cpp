@@ -0,0 +1,480 @@
+#include "../include/dht.hpp"
+#include "../include/bencode.hpp"
+#include "../include/common.hpp"
+
+#include "../../cryptography/hashlib.hpp"
+#include "../../json-parser/json/json.hpp"
+#include "../../misc/logger.hpp"
+
+#include <arpa/inet.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <bit>
+#include <fstream>
+
+namespace {
+    constexpr std::size_t ID_SIZE {20}, COMPACT_NODE_SIZE {26};
+
+    std::string bstr(std::string_view str) { return std::to_string(str.size()) + ':' + std::string{str}; }
+    std::string bint(std::int64_t value) { return 'i' + std::to_string(value) + 'e'; }
+
+    // Dictionary of encoded values, std::map keeps the keys in the sorted order bencode requires
+    std::string bdict(const std::map<std::string, std::string> &entries) {
+        std::string result {"d"};
+        for (const auto &[key, value]: entries) result += bstr(key) + value;
+        return result + 'e';
+    }
+
+    // String under `key` of a decoded dict, empty if missing
+    std::string field(JSON::JSONHandle dict, const std::string &key) { return dict[key].to<std::string>(); }
+
+    std::string randomBytes(std::size_t count) {
+        std::string bytes;
+        while (bytes.size() < count) bytes += static_cast<char>(Torrent::randInteger<std::uint32_t>() & 0xFF);
+        return bytes;
+    }
+
+    // 4 byte address followed by a 2 byte port, both big endian. Empty for anything but IPv4
+    std::string compactAddress(const std::string &ip, std::uint16_t port) {
+        std::string result(6, '\0');
+        if (::inet_pton(AF_INET, ip.c_str(), result.data()) != 1) return {};
+        result[4] = static_cast<char>(port >> 8); result[5] = static_cast<char>(port & 0xFF);
+        return result;
+    }
+
+    // Sockets come with SO_REUSEADDR, which for UDP lets another node share the port & steal half our datagrams
+    void bindExclusive(net::Socket &socket, std::uint16_t port) {
+        int opt {0};
+        if (::setsockopt(socket.fd(), SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1)
+            throw net::SocketError{"Error clearing opt 'SO_REUSEADDR'"};
+        socket.bind("0.0.0.0", port); socket.setNonBlocking();
+    }
+
+    Torrent::DHTNode::Peer parseAddress(std::string_view compact) {
+        std::uint16_t port; std::memcpy(&port, compact.data() + 4, 2);
+        return {net::utils::ipBytesToString(compact.substr(0, 4)), net::utils::bswap(port)};
+    }
+
+    // Whether `lhs` is closer to `target` than `rhs` by XOR distance, unknown IDs are the farthest
+    bool closer(std::string_view lhs, std::string_view rhs, std::string_view target) {
+        if (lhs.size() != ID_SIZE || rhs.size() != ID_SIZE) return lhs.size() == ID_SIZE && rhs.size() != ID_SIZE;
+        for (std::size_t i {}; i < ID_SIZE; ++i) {
+            const auto left {static_cast<std::uint8_t>(lhs[i] ^ target[i])};
+            const auto right {static_cast<std::uint8_t>(rhs[i] ^ target[i])};
+            if (left != right) return left < right;
+        }
+        return false;
+    }
+}
+
+namespace Torrent {
+    const std::vector<DHTNode::Peer> DHTNode::BOOTSTRAP_ROUTERS {
+        {"router.bittorrent.com", 6881}, {"dht.transmissionbt.com", 6881}, {"router.utorrent.com", 6881}
+    };
+
+    DHTNode::DHTNode(const std::uint16_t port, const std::filesystem::path &cachePath, const std::vector<Peer> &bootstrap):
+        cachePath {cachePath}, socket {net::SOCKTYPE::UDP, net::IP::V4}, secret {randomBytes(16)}, previousSecret {secret}
+    {
+        bindExclusive(socket, port);
+        sockaddr_in addr {}; socklen_t addrLen {sizeof(addr)};
+        ::getsockname(socket.fd(), reinterpret_cast<sockaddr*>(&addr), &addrLen);
+        _port = net::utils::bswap(addr.sin_port);
+
+        // Cached ID keeps our place in the DHT across runs, cached nodes are asked first
+        loadCache();
+        if (nodeID.size() != ID_SIZE) nodeID = randomBytes(ID_SIZE);
+        lastRotate = lastSave = nextRefresh = Clock::now();
+        Logging::Dynamic::Info("DHT node listening on UDP port {}, {} cached nodes", _port, contacts.size());
+        worker = std::thread{&DHTNode::run, this, bootstrap};
+    }
+
+    DHTNode::~DHTNode() {
+        stop = true; worker.join();
+        try { saveCache(); }
+        catch (std::exception &ex) { Logging::Dynamic::Warn("Failed to save the DHT node cache: {}", ex.what()); }
+    }
+
+    void DHTNode::loadCache() {
+        if (cachePath.empty() || !std::filesystem::exists(cachePath)) return;
+        std::ifstream ifs {cachePath, std::ios::binary};
+        const std::string cache {std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>()};
+        if (cache.size() < ID_SIZE || (cache.size() - ID_SIZE) % COMPACT_NODE_SIZE) {
+            Logging::Dynamic::Warn("DHT node cache {} is corrupted, starting afresh", cachePath.string());
+            return;
+        }
+
+        // <our id> followed by compact node infos (20 byte id, 4 byte ip, 2 byte port)
+        nodeID = cache.substr(0, ID_SIZE);
+        for (std::size_t pos {ID_SIZE}; pos < cache.size(); pos += COMPACT_NODE_SIZE) {
+            auto [ip, port] {parseAddress(std::string_view{cache}.substr(pos + ID_SIZE, 6))};
+            contacts.push_back({.id=cache.substr(pos, ID_SIZE), .ip=std::move(ip), .port=port});
+        }
+    }
+
+    void DHTNode::saveCache() const {
+        if (cachePath.empty()) return;
+
+        // Contacts are kept if we never got to talk to anyone, so an offline run doesn't wipe the cache
+        std::string cache {nodeID};
+        for (const auto &bucket: buckets)
+            for (const Node &node: bucket)
+                if (!node.fails) cache += node.id + compactAddress(node.ip, node.port);
+        if (cache.size() == ID_SIZE)
+            for (const Node &node: contacts)
+                if (node.id.size() == ID_SIZE) cache += node.id + compactAddress(node.ip, node.port);
+        if ((cache.size() - ID_SIZE) % COMPACT_NODE_SIZE) return;
+
+        if (cachePath.has_parent_path()) std::filesystem::create_directories(cachePath.parent_path());
+        const std::filesystem::path tmpPath {cachePath.string() + ".tmp"};
+        {
+            std::ofstream ofs {tmpPath, std::ios::binary};
+            ofs << cache;
+            if (!ofs) throw std::runtime_error("Failed to write " + tmpPath.string());
+        }
+        std::filesystem::rename(tmpPath, cachePath);
+    }
+
+    void DHTNode::addContact(const std::string &host, const std::uint16_t port) {
+        try {
+            std::string ip {net::utils::resolveHostname(host, nullptr, net::SOCKTYPE::UDP)};
+            std::scoped_lock lock {mutex};
+            if (std::ranges::any_of(contacts, [&](const Node &node) { return node.ip == ip && node.port == port; })) return;
+            contacts.push_back({.ip=std::move(ip), .port=port});
+            if (countNodes() < K) nextRefresh = Clock::now();
+        } catch (net::SocketError &err) {
+            Logging::Dynamic::Debug("Skipping DHT contact {}:{}: {}", host, port, err.what());
+        }
+    }
+
+    std::size_t DHTNode::bucketIndex(const std::string &id) const {
+        // Length of the prefix shared with our ID, closer nodes land in the higher buckets
+        for (std::size_t i {}; i < ID_SIZE; ++i) {
+            if (auto diff {static_cast<std::uint8_t>(id[i] ^ nodeID[i])})
+                return i * 8 + static_cast<std::size_t>(std::countl_zero(diff));
+        }
+        return ID_BITS - 1;
+    }
+
+    std::size_t DHTNode::countNodes() const {
+        return std::ranges::fold_left(buckets, std::size_t {}, [](std::size_t acc, const auto &bucket) { return acc + bucket.size(); });
+    }
+
+    std::size_t DHTNode::size() const {
+        std::scoped_lock lock {mutex};
+        return countNodes();
+    }
+
+    void DHTNode::insert(Node node) {
+        if (node.id.size() != ID_SIZE || node.id == nodeID) return;
+        auto &bucket {buckets[bucketIndex(node.id)]};
+        if (auto it {std::ranges::find(bucket, node.id, &Node::id)}; it != bucket.end()) {
+            it->ip = std::move(node.ip); it->port = node.port; it->lastSeen = node.lastSeen; it->fails = 0;
+            return;
+        }
+
+        // Full buckets only take new nodes in place of ones that stopped answering
+        if (bucket.size() < K) bucket.push_back(std::move(node));
+        else if (auto bad {std::ranges::find_if(bucket, [](const Node &other) { return other.fails >= MAX_FAILS; })};
+            bad != bucket.end()) *bad = std::move(node);
+    }
+
+    std::vector<DHTNode::Node> DHTNode::closest(const std::string &target, std::size_t count) const {
+        std::vector<Node> nodes;
+        for (const auto &bucket: buckets)
+            for (const Node &node: bucket)
+                if (node.fails < MAX_FAILS) nodes.push_back(node);
+
+        auto byDistance {[&target](const Node &lhs, const Node &rhs) { return closer(lhs.id, rhs.id, target); }};
+        count = std::min(count, nodes.size());
+        std::ranges::partial_sort(nodes, nodes.begin() + static_cast<std::ptrdiff_t>(count), byDistance);
+        nodes.resize(count);
+        return nodes;
+    }
+
+    std::string DHTNode::makeToken(const std::string &ip, const std::string &key) const {
+        return hashutil::sha1(key + ip, true).substr(0, 8);
+    }
+
+    void DHTNode::store(const std::string &infoHash, Peer peer, Clock::time_point now) {
+        if (!storage.contains(infoHash) && storage.size() >= MAX_STORED_HASHES) return;
+        auto &peers {storage[infoHash]};
+        if (auto it {std::ranges::find(peers, peer, &StoredPeer::peer)}; it != peers.end()) it->announcedAt = now;
+        else if (peers.size() < MAX_PEERS_PER_HASH) peers.push_back({.peer=std::move(peer), .announcedAt=now});
+    }
+
+    void DHTNode::send(const std::string &message, const std::string &ip, std::uint16_t port) {
+        try { socket.sendTo(message, ip, port); }
+        catch (net::SocketError &err) { Logging::Dynamic::Trace("DHT send to {}:{} failed: {}", ip, port, err.what()); }
+    }
+
+    void DHTNode::sendQuery(const std::string &method, std::map<std::string, std::string> args, const Node &node,
+        std::shared_ptr<Lookup> lookup, Clock::time_point now)
+    {
+        std::string transaction {static_cast<char>(nextTransaction >> 8), static_cast<char>(nextTransaction & 0xFF)};
+        ++nextTransaction;
+        args["id"] = bstr(nodeID);
+        send(bdict({{"a", bdict(args)}, {"q", bstr(method)}, {"t", bstr(transaction)}, {"y", bstr("q")}}), node.ip, node.port);
+        queries.insert_or_assign(std::move(transaction), Query{.lookup=std::move(lookup), .node=node, .sentAt=now});
+    }
+
+    void DHTNode::startLookup(const std::shared_ptr<Lookup> &lookup, Clock::time_point now) {
+        // Lookups start from the closest nodes we know, contacts fill in while the table is short of K nodes
+        for (Node &node: closest(lookup->target, K)) lookup->candidates.push_back({.node=std::move(node)});
+        if (lookup->candidates.size() < K) {
+            for (const Node &contact: contacts) {
+                if (std::ranges::none_of(lookup->candidates, [&contact](const Candidate &candidate) {
+                    return candidate.node.ip == contact.ip && candidate.node.port == contact.port; }))
+                    lookup->candidates.push_back({.node=contact});
+            }
+        }
+        advance(lookup, now);
+    }
+
+    void DHTNode::advance(const std::shared_ptr<Lookup> &lookup, Clock::time_point now) {
+        // Only the K closest candidates still alive matter, the lookup is over once all of them were asked
+        std::ranges::stable_sort(lookup->candidates, [&target = lookup->target](const Candidate &lhs, const Candidate &rhs) {
+            return closer(lhs.node.id, rhs.node.id, target); });
+
+        std::size_t considered {};
+        for (Candidate &candidate: lookup->candidates) {
+            if (candidate.failed) continue;
+            if (++considered > K || lookup->inFlight >= ALPHA) break;
+            if (candidate.queried) continue;
+
+            candidate.queried = true; ++lookup->inFlight;
+            if (lookup->getPeers) sendQuery("get_peers", {{"info_hash", bstr(lookup->target)}}, candidate.node, lookup, now);
+            else sendQuery("find_node", {{"target", bstr(lookup->target)}}, candidate.node, lookup, now);
+        }
+        if (!lookup->inFlight) finish(*lookup, now);
+    }
+
+    void DHTNode::finish(Lookup &lookup, Clock::time_point now) {
+        lookup.done = true;
+
+        // Peers are announced to the closest nodes that handed out a token
+        if (lookup.getPeers && lookup.announcePort) {
+            std::size_t announced {};
+            for (const Candidate &candidate: lookup.candidates) {
+                if (!candidate.responded || candidate.token.empty()) continue;
+                if (announced++ >= K) break;
+                sendQuery("announce_peer", {{"implied_port", bint(0)}, {"info_hash", bstr(lookup.target)},
+                    {"port", bint(lookup.announcePort)}, {"token", bstr(candidate.token)}}, candidate.node, nullptr, now);
+            }
+        }
+
+        Logging::Dynamic::Debug("DHT {} lookup done, {} candidates, {} peers, {} nodes in the routing table",
+            lookup.getPeers? "get_peers": "find_node", lookup.candidates.size(), lookup.peers.size(), countNodes());
+        lookupDone.notify_all();
+    }
+
+    void DHTNode::handleMessage(const std::string &data, const std::string &ip, std::uint16_t port, Clock::time_point now) {
+        JSON::JSONHandle message {Bencode::decode(data)};
+        const std::string type {field(message, "y")}, transaction {field(message, "t")};
+        if (type == "q") handleQuery(message, transaction, ip, port, now);
+        else if (type == "r" || type == "e") handleResponse(message, transaction, ip, port, now);
+    }
+
+    void DHTNode::handleQuery(JSON::JSONHandle message, const std::string &transaction,
+        const std::string &ip, std::uint16_t port, Clock::time_point now)
+    {
+        JSON::JSONHandle args {message["a"]};
+        const std::string method {field(message, "q")}, senderID {field(args, "id")};
+        auto reply {[&](std::map<std::string, std::string> values) {
+            values["id"] = bstr(nodeID);
+            send(bdict({{"r", bdict(values)}, {"t", bstr(transaction)}, {"y", bstr("r")}}), ip, port);
+        }};
+        auto error {[&](int code, std::string_view what) {
+            send(bdict({{"e", 'l' + bint(code) + bstr(what) + 'e'}, {"t", bstr(transaction)}, {"y", bstr("e")}}), ip, port);
+        }};
+        auto compactNodes {[this](const std::string &target) {
+            std::string nodes;
+            for (const Node &node: closest(target, K))
+                if (std::string address {compactAddress(node.ip, node.port)}; !address.empty()) nodes += node.id + address;
+            return bstr(nodes);
+        }};
+
+        if (senderID.size() != ID_SIZE) return error(203, "Invalid node ID");
+        insert({.id=senderID, .ip=ip, .port=port, .lastSeen=now});
+
+        if (method == "ping") return reply({});
+
+        if (method == "find_node") {
+            const std::string target {field(args, "target")};
+            if (target.size() != ID_SIZE) return error(203, "Invalid target");
+            return reply({{"nodes", compactNodes(target)}});
+        }
+
+        // Peers if we have any for the hash, the closest nodes otherwise. Either way a token to announce with
+        if (method == "get_peers") {
+            const std::string infoHash {field(args, "info_hash")};
+            if (infoHash.size() != ID_SIZE) return error(203, "Invalid info hash");
+            std::map<std::string, std::string> values {{"token", bstr(makeToken(ip, secret))}};
+            if (auto it {storage.find(infoHash)}; it != storage.end() && !it->second.empty()) {
+                std::string list {"l"};
+                for (const auto &[peer, announcedAt]: it->second | std::views::take(MAX_VALUES))
+                    list += bstr(compactAddress(peer.first, peer.second));
+                values["values"] = list + 'e';
+            } else values["nodes"] = compactNodes(infoHash);
+            return reply(std::move(values));
+        }
+
+        // Tokens tie an announce to an address that recently asked us for peers
+        if (method == "announce_peer") {
+            const std::string infoHash {field(args, "info_hash")}, token {field(args, "token")};
+            if (infoHash.size() != ID_SIZE) return error(203, "Invalid info hash");
+            if (token != makeToken(ip, secret) && token != makeToken(ip, previousSecret)) return error(203, "Bad token");
+            const std::int64_t announcedPort {args["implied_port"].to<std::int64_t>()? port: args["port"].to<std::int64_t>()};
+            if (announcedPort <= 0 || announcedPort > 65535) return error(203, "Invalid port");
+            store(infoHash, {ip, static_cast<std::uint16_t>(announcedPort)}, now);
+            return reply({});
+        }
+
+        error(204, "Method Unknown");
+    }
+
+    void DHTNode::handleResponse(JSON::JSONHandle message, const std::string &transaction,
+        const std::string &ip, std::uint16_t port, Clock::time_point now)
+    {
+        // Replies must come from the node we asked, anything else is stale or spoofed
+        auto it {queries.find(transaction)};
+        if (it == queries.end() || it->second.node.ip != ip || it->second.node.port != port) return;
+        Query query {std::move(it->second)};
+        queries.erase(it);
+
+        JSON::JSONHandle values {message["r"]};
+        const std::string responderID {field(values, "id")};
+        if (field(message, "y") != "r" || responderID.size() != ID_SIZE) return onFailure(query, now);
+        insert({.id=responderID, .ip=ip, .port=port, .lastSeen=now});
+        if (!query.lookup) return;
+
+        Lookup &lookup {*query.lookup}; --lookup.inFlight;
+        if (lookup.done) return;
+        auto candidate {std::ranges::find_if(lookup.candidates, [&](const Candidate &other) {
+            return other.node.ip == ip && other.node.port == port; })};
+        if (candidate != lookup.candidates.end()) {
+            candidate->responded = true; candidate->node.id = responderID;
+            candidate->token = field(values, "token");
+        }
+
+        // Nodes closer to the target join the candidates, peers are collected without duplicates
+        const std::string nodes {field(values, "nodes")};
+        for (std::size_t pos {}; pos + COMPACT_NODE_SIZE <= nodes.size(); pos += COMPACT_NODE_SIZE) {
+            std::string id {nodes.substr(pos, ID_SIZE)};
+            auto [nodeIP, nodePort] {parseAddress(std::string_view{nodes}.substr(pos + ID_SIZE, 6))};
+            if (id == nodeID || !nodePort || std::ranges::any_of(lookup.candidates, [&](const Candidate &other) {
+                return other.node.id == id || (other.node.ip == nodeIP && other.node.port == nodePort); }))
+                continue;
+            lookup.candidates.push_back({.node={.id=std::move(id), .ip=std::move(nodeIP), .port=nodePort}});
+        }
+
+        for (JSON::JSONHandle value: values["values"]) {
+            const std::string compact {value.to<std::string>()};
+            if (compact.size() != 6) continue;
+            if (Peer peer {parseAddress(compact)}; std::ranges::find(lookup.peers, peer) == lookup.peers.end())
+                lookup.peers.push_back(std::move(peer));
+        }
+        advance(query.lookup, now);
+    }
+
+    void DHTNode::onFailure(Query &query, Clock::time_point now) {
+        // Nodes that keep failing are the first to be replaced in their bucket
+        if (query.node.id.size() == ID_SIZE) {
+            auto &bucket {buckets[bucketIndex(query.node.id)]};
+            if (auto it {std::ranges::find(bucket, query.node.id, &Node::id)}; it != bucket.end()) ++it->fails;
+        }
+        if (!query.lookup) return;
+
+        Lookup &lookup {*query.lookup}; --lookup.inFlight;
+        if (lookup.done) return;
+        auto candidate {std::ranges::find_if(lookup.candidates, [&query](const Candidate &other) {
+            return other.node.ip == query.node.ip && other.node.port == query.node.port; })};
+        if (candidate != lookup.candidates.end()) candidate->failed = true;
+        advance(query.lookup, now);
+    }
+
+    void DHTNode::receive(Clock::time_point now) {
+        std::string ip; std::uint16_t port;
+        while (socket.fd() != -1) {
+            std::string data;
+            try { data = socket.recvFrom(ip, port, 1 << 12); }
+            catch (net::SocketError &err) { Logging::Dynamic::Debug("DHT recv failed: {}", err.what()); break; }
+            if (data.empty()) break;
+
+            std::scoped_lock lock {mutex};
+            try { handleMessage(data, ip, port, now); }
+            catch (std::exception &ex) {
+                Logging::Dynamic::Trace("Dropping malformed DHT message from {}:{}: {}", ip, port, ex.what());
+            }
+        }
+    }
+
+    void DHTNode::tick(Clock::time_point now) {
+        // Unanswered queries count as failures, handled once out of the map since they may send new queries
+        std::vector<Query> expired;
+        std::erase_if(queries, [&expired, now](auto &entry) {
+            if (now - entry.second.sentAt < QUERY_TIMEOUT) return false;
+            expired.push_back(std::move(entry.second));
+            return true;
+        });
+        for (Query &query: expired) onFailure(query, now);
+
+        if (now >= nextRefresh) {
+            nextRefresh = now + (countNodes() < K? std::chrono::duration_cast<Clock::duration>(BOOTSTRAP_RETRY): REFRESH_INTERVAL);
+            startLookup(std::make_shared<Lookup>(Lookup{.target=nodeID}), now);
+        }
+
+        // Tokens handed out stay valid for two rotations, peers that stopped re-announcing expire
+        if (now - lastRotate >= TOKEN_INTERVAL) {
+            previousSecret = std::exchange(secret, randomBytes(16)); lastRotate = now;
+            for (auto &[infoHash, peers]: storage)
+                std::erase_if(peers, [now](const StoredPeer &stored) { return now - stored.announcedAt >= PEER_TTL; });
+            std::erase_if(storage, [](const auto &entry) { return entry.second.empty(); });
+        }
+
+        if (now - lastSave >= SAVE_INTERVAL) {
+            lastSave = now;
+            try { saveCache(); }
+            catch (std::exception &ex) { Logging::Dynamic::Warn("Failed to save the DHT node cache: {}", ex.what()); }
+        }
+    }
+
+    void DHTNode::run(std::vector<Peer> bootstrap) {
+        // Routers are resolved here so that DNS doesn't hold up the caller
+        for (const auto &[host, port]: bootstrap) addContact(host, port);
+
+        while (!stop) {
+            pollfd pfd {.fd=socket.fd(), .events=POLLIN, .revents=0};
+            if (::poll(&pfd, 1, 50) > 0) receive(Clock::now());
+
+            std::scoped_lock lock {mutex};
+
+            // An empty datagram reads as EOF & closes the socket, bring it back on the same port
+            if (socket.fd() == -1) {
+                try {
+                    net::Socket reopened {net::SOCKTYPE::UDP, net::IP::V4};
+                    bindExclusive(reopened, _port);
+                    socket = std::move(reopened);
+                } catch (net::SocketError &err) {
+                    Logging::Dynamic::Error("DHT socket closed & could not be reopened: {}", err.what());
+                    return;
+                }
+            }
+            tick(Clock::now());
+        }
+    }
+
+    std::vector<DHTNode::Peer> DHTNode::getPeers(const std::string &infoHash, const std::uint16_t announcePort,
+        const std::chrono::milliseconds timeout)
+    {
+        auto lookup {std::make_shared<Lookup>(Lookup{.target=infoHash, .getPeers=true, .announcePort=announcePort})};
+        std::unique_lock lock {mutex};
+        startLookup(lookup, Clock::now());
+
+        // Lookups cut short still announce to whoever answered, late replies are ignored
+        lookupDone.wait_for(lock, timeout, [&lookup] { return lookup->done; });
+        if (!lookup->done) finish(*lookup, Clock::now());
+        return lookup->peers;
+    }
+}
@@ -1,14 +1,359 @@
 #include "../include/disk_writer.hpp"
 
+#include "../../cryptography/hashlib.hpp"
 #include "../../misc/logger.hpp"
 
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace {
+    std::runtime_error systemError(const std::string &message) {
+        return std::runtime_error{message + ": " + std::strerror(errno)};
+    }
+
+    // Paths come from the torrent, they must stay within the download directory
+    bool safePath(const std::filesystem::path &path) {
+        if (path.empty() || path.is_absolute()) return false;
+        for (const auto &part: path) if (part == "..") return false;
+        return true;
+    }
+
+    // Preallocate so that the pieces don't fragment the file, ftruncate where unsupported
+    void preallocate(int fd, std::uint64_t size) {
+        if (::fallocate(fd, 0, 0, static_cast<off_t>(size)) == 0) return;
+        if ((errno != EOPNOTSUPP && errno != ENOSYS) || ::ftruncate(fd, static_cast<off_t>(size)) == -1)
+            throw systemError("Failed to preallocate file");
+    }
+
+    // pwritev may write partially, advance the iovecs and retry until done
+    void pwritevAll(int fd, std::vector<iovec> iovs, std::uint64_t offset) {
+        std::size_t idx {};
+        while (idx < iovs.size()) {
+            int count {static_cast<int>(std::min<std::size_t>(iovs.size() - idx, IOV_MAX))};
+            ssize_t written {::pwritev(fd, iovs.data() + idx, count, static_cast<off_t>(offset))};
+            if (written == -1 && errno == EINTR) continue;
+            if (written <= 0) throw systemError("Write to file failed");
+
+            offset += static_cast<std::uint64_t>(written);
+            for (auto remaining {static_cast<std::size_t>(written)}; remaining && idx < iovs.size();) {
+                if (remaining >= iovs[idx].iov_len) { remaining -= iovs[idx].iov_len; ++idx; }
+                else {
+                    iovs[idx].iov_base = static_cast<char*>(iovs[idx].iov_base) + remaining;
+                    iovs[idx].iov_len -= remaining; remaining = 0;
+                }
+            }
+        }
+    }
+
+    void preadAll(int fd, char *buffer, std::uint64_t length, std::uint64_t offset) {
+        while (length) {
+            ssize_t bytesRead {::pread(fd, buffer, length, static_cast<off_t>(offset))};
+            if (bytesRead == -1 && errno == EINTR) continue;
+            if (bytesRead <= 0) throw systemError("Read from file failed");
+            buffer += bytesRead; offset += static_cast<std::uint64_t>(bytesRead);
+            length -= static_cast<std::uint64_t>(bytesRead);
+        }
+    }
+}
+
 namespace Torrent {
+    DiskIOPool::DiskIOPool(const std::size_t nWorkers, const DiskBackend backend, const std::size_t maxOpenFiles): 
+        fileCache {maxOpenFiles} 
+    {
+        if (backend != DiskBackend::Threads) {
+            try {
+                if (!IoRing::supported()) throw std::runtime_error("not supported by the kernel");
+                ring = std::make_unique<IoRing>(RING_DEPTH);
+                readRing = std::make_unique<IoRing>(READ_RING_DEPTH);
+            } catch (std::exception &ex) {
+                ring.reset(); readRing.reset();
+                if (backend == DiskBackend::IoUring) Logging::Dynamic::Warn("io_uring unavailable ({}), using disk threads", ex.what());
+            }
+        }
+
+        eventFd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (eventFd == -1) throw systemError("Failed to create the disk completion eventfd");
+        syncer = std::thread {[this] { runSyncer(); }};
+        reader = std::thread {[this] { runReader(); }};
+        if (ring) {
+            Logging::Dynamic::Info("Disk I/O through io_uring, up to {} writes in flight", ring->capacity());
+            workers.emplace_back([this] { runRing(); });
+        } else {
+            Logging::Dynamic::Info("Disk I/O on {} threads", std::max<std::size_t>(nWorkers, 1));
+            for (std::size_t i {}; i < std::max<std::size_t>(nWorkers, 1); ++i)
+                workers.emplace_back([this] { runWorker(); });
+        }
+    }
+
+    void DiskIOPool::runWorker() {
+        for (;;) {
+            std::unique_lock lock {poolMutex};
+            poolCV.wait(lock, [this] { return exitCondition || !ready.empty(); });
+            if (ready.empty()) return;
+
+            DiskWriter *writer {ready.front()}; ready.pop_front();
+            writer->queued = false; ++writer->servicing;
+            lock.unlock();
+
+            bool pending {writer->writeOne()};
+
+            // Requeue at the back so other writers get their turn
+            lock.lock(); --writer->servicing;
+            if (pending && !writer->queued && !writer->detached) {
+                ready.push_back(writer); writer->queued = true;
+            }
+            lock.unlock(); poolCV.notify_all();
+        }
+    }
+
+    void DiskIOPool::runSyncer() {
+        for (;;) {
+            std::unique_lock lock {poolMutex};
+            poolCV.wait(lock, [this] { return exitCondition || !syncQueue.empty(); });
+            if (syncQueue.empty()) return;
+
+            DiskWriter *writer {syncQueue.front()}; syncQueue.pop_front();
+            writer->syncQueued = false; ++writer->servicing;
+            lock.unlock();
+
+            try { if (writer->syncTask) writer->syncTask(); }
+            catch (std::exception &ex) { Logging::Dynamic::Error("Sync failed for {}: {}", writer->name, ex.what()); }
+
+            { std::scoped_lock relock {poolMutex}; --writer->servicing; }
+            poolCV.notify_all();
+        }
+    }
+
+    void DiskIOPool::runReader() {
+        for (;;) {
+            std::unique_lock lock {poolMutex};
+            poolCV.wait(lock, [this] { return exitCondition || !readQueue.empty(); });
+            if (readQueue.empty()) return;
+
+            auto [writer, pieceIdx] {readQueue.front()}; readQueue.pop_front();
+            ++writer->servicing;
+            lock.unlock();
+
+            try { writer->readResults.push({.pieceIdx=pieceIdx, .piece=writer->readDisk(pieceIdx), .error={}}); }
+            catch (std::exception &ex) { writer->readResults.push({.pieceIdx=pieceIdx, .piece=nullptr, .error=ex.what()}); }
+            const std::uint64_t one {1};
+            std::ignore = ::write(eventFd, &one, sizeof(one));
+
+            { std::scoped_lock relock {poolMutex}; --writer->servicing; }
+            poolCV.notify_all();
+        }
+    }
+
+    void DiskIOPool::runRing() {
+        // A batch being written, one gather write per file it spans. Completions are tagged with the
+        // address of the write's tag, which points back to the job
+        struct Job;
+        struct Tag { Job *job; std::size_t op; };
+        struct Job {
+            DiskWriter *writer;
+            DiskWriter::Batch batch;
+            std::vector<DiskWriter::WriteOp> ops;
+            std::vector<Tag> tags {};
+            std::size_t submitted {}, remaining {};
+            std::string error {};
+        };
+
+        std::vector<std::unique_ptr<Job>> jobs;
+        std::deque<Job*> unsubmitted;
+        std::vector<IoRing::Completion> completions(ring->capacity());
+
+        auto finishJob {[this, &jobs](Job *job) {
+            DiskWriter *writer {job->writer};
+            writer->releaseOps(job->ops);
+            try {
+                if (!job->error.empty()) throw std::runtime_error(job->error);
+                writer->completeBatch(job->batch);
+            } catch (std::exception &ex) { writer->onWriteFailure(ex); }
+            std::erase_if(jobs, [job](const std::unique_ptr<Job> &ptr) { return ptr.get() == job; });
+
+            { std::scoped_lock lock {poolMutex}; --writer->servicing; }
+            poolCV.notify_all();
+        }};
+
+        for (;;) {
+            // Take batches round robin, as long as everything taken so far fit into the ring
+            while (unsubmitted.empty() && ring->inFlight() < ring->capacity()) {
+                std::unique_lock lock {poolMutex};
+                if (jobs.empty()) poolCV.wait(lock, [this] { return exitCondition || !ready.empty(); });
+                if (ready.empty()) break;
+
+                DiskWriter *writer {ready.front()}; ready.pop_front();
+                writer->queued = false; ++writer->servicing;
+                lock.unlock();
+
+                auto job {std::make_unique<Job>(writer, writer->takeBatch(), std::vector<DiskWriter::WriteOp>{})};
+                bool pending {writer->hasTasks()};
+                try {
+                    if (!job->batch.empty()) job->ops = writer->writeOps(job->batch);
+                } catch (std::exception &ex) { job->error = ex.what(); }
+
+                // Requeue right away, the writer's next batch can be in flight alongside this one
+                lock.lock();
+                if (pending && !writer->queued && !writer->detached) {
+                    ready.push_back(writer); writer->queued = true;
+                }
+                lock.unlock();
+
+                if (job->batch.empty()) {
+                    { std::scoped_lock poolLock {poolMutex}; --writer->servicing; }
+                    poolCV.notify_all(); continue;
+                }
+
+                job->remaining = job->ops.size();
+                for (std::size_t op {}; op < job->ops.size(); ++op) job->tags.push_back({job.get(), op});
+                jobs.push_back(std::move(job));
+                if (jobs.back()->ops.empty()) finishJob(jobs.back().get());
+                else unsubmitted.push_back(jobs.back().get());
+            }
+
+            if (jobs.empty()) {
+                std::scoped_lock lock {poolMutex};
+                if (exitCondition && ready.empty()) return;
+                continue;
+            }
+
+            // Queue up writes until the ring is full, then wait for at least one of them
+            while (!unsubmitted.empty()) {
+                Job *job {unsubmitted.front()};
+                for (; job->submitted < job->ops.size(); ++job->submitted) {
+                    const DiskWriter::WriteOp &op {job->ops[job->submitted]};
+                    const auto count {static_cast<unsigned>(std::min<std::size_t>(op.iovs.size(), IOV_MAX))};
+                    if (!ring->writev(op.fd, op.iovs.data(), count, op.fileOffset, 
+                        reinterpret_cast<std::uint64_t>(&job->tags[job->submitted]))) break;
+                }
+                if (job->submitted < job->ops.size()) break;
+                unsubmitted.pop_front();
+            }
+            ring->submit(1);
+
+            const std::size_t count {ring->reap(completions.data(), completions.size())};
+            for (std::size_t i {}; i < count; ++i) {
+                const auto [job, opIdx] {*reinterpret_cast<Tag*>(completions[i].userData)};
+                DiskWriter::WriteOp &op {job->ops[opIdx]};
+                const std::int32_t result {completions[i].result};
+
+                // Rare short writes (or ops past IOV_MAX) are finished off here, synchronously
+                try {
+                    if (result < 0) { errno = -result; throw systemError("Write to file failed"); }
+                    const auto total {std::ranges::fold_left(op.iovs, std::uint64_t {}, 
+                        [](std::uint64_t acc, const iovec &iov) { return acc + iov.iov_len; })};
+                    if (static_cast<std::uint64_t>(result) < total) {
+                        std::uint64_t written {static_cast<std::uint64_t>(result)};
+                        auto it {op.iovs.begin()};
+                        for (; written >= it->iov_len; ++it) written -= it->iov_len;
+                        std::vector<iovec> rest {it, op.iovs.end()};
+                        rest.front().iov_base = static_cast<char*>(rest.front().iov_base) + written;
+                        rest.front().iov_len -= written;
+                        pwritevAll(op.fd, std::move(rest), op.fileOffset + static_cast<std::uint64_t>(result));
+                    }
+                } catch (std::exception &ex) { if (job->error.empty()) job->error = ex.what(); }
+
+                if (!--job->remaining) finishJob(job);
+            }
+        }
+    }
+
+    void DiskIOPool::read(const std::vector<ReadOp> &ops) {
+        if (!readRing) {
+            for (const auto &[fd, buffer, length, offset]: ops) preadAll(fd, buffer, length, offset);
+            return;
+        }
+
+        // Every op has to complete (the buffers are the caller's) before an error is thrown
+        std::scoped_lock lock {readMutex};
+        std::vector<IoRing::Completion> completions(readRing->capacity());
+        std::string error;
+        for (std::size_t next {}; next < ops.size() || readRing->inFlight();) {
+            for (; next < ops.size(); ++next) {
+                const auto &[fd, buffer, length, offset] {ops[next]};
+                if (!readRing->read(fd, buffer, static_cast<unsigned>(length), offset, next)) break;
+            }
+            readRing->submit(1);
+
+            const std::size_t count {readRing->reap(completions.data(), completions.size())};
+            for (std::size_t i {}; i < count; ++i) {
+                const auto &[fd, buffer, length, offset] {ops[completions[i].userData]};
+                const std::int32_t result {completions[i].result};
+                try {
+                    if (result < 0) { errno = -result; throw systemError("Read from file failed"); }
+                    const auto done {static_cast<std::uint64_t>(result)};
+                    if (done < length) preadAll(fd, buffer + done, length - done, offset + done);
+                } catch (std::exception &ex) { if (error.empty()) error = ex.what(); }
+            }
+        }
+        if (!error.empty()) throw std::runtime_error(error);
+    }
+
+    DiskIOPool::~DiskIOPool() {
+        { std::scoped_lock lock {poolMutex}; exitCondition = true; }
+        poolCV.notify_all();
+        for (std::thread &worker: workers) 
+            if (worker.joinable()) worker.join();
+        if (syncer.joinable()) syncer.join();
+        if (reader.joinable()) reader.join();
+        ::close(eventFd);
+    }
+
+    void DiskIOPool::clearCompletions() {
+        std::uint64_t count;
+        std::ignore = ::read(eventFd, &count, sizeof(count));
+    }
+
+    void DiskIOPool::readAsync(DiskWriter &writer, std::uint32_t pieceIdx) {
+        {
+            std::scoped_lock lock {poolMutex};
+            if (writer.detached) return;
+            readQueue.emplace_back(&writer, pieceIdx);
+        }
+        poolCV.notify_all();
+    }
+
+    void DiskIOPool::notify(DiskWriter &writer) {
+        {
+            std::scoped_lock lock {poolMutex};
+            if (writer.queued || writer.detached) return;
+            ready.push_back(&writer); writer.queued = true;
+        }
+        poolCV.notify_all();
+    }
+
+    void DiskIOPool::requestSync(DiskWriter &writer) {
+        {
+            std::scoped_lock lock {poolMutex};
+            if (writer.syncQueued || writer.detached) return;
+            syncQueue.push_back(&writer); writer.syncQueued = true;
+        }
+        poolCV.notify_all();
+    }
+
+    void DiskIOPool::detach(DiskWriter &writer) {
+        std::unique_lock lock {poolMutex};
+        writer.detached = true; writer.queued = writer.syncQueued = false;
+        std::erase(ready, &writer); std::erase(syncQueue, &writer);
+        std::erase_if(readQueue, [&writer](const auto &read) { return read.first == &writer; });
+        poolCV.wait(lock, [&writer] { return writer.servicing == 0; });
+    }
+
     DiskWriter::DiskWriter(
-        const std::string name, const std::uint64_t totalSize, const std::uint32_t pieceSize, 
-        const std::filesystem::path downloadDir, bool coldStart, const std::size_t maxQueueSize
+        DiskIOPool &pool, PieceCache &cache, const std::string name, const std::uint64_t totalSize, 
+        const std::uint32_t pieceSize, const std::vector<FileStruct> &files, const std::filesystem::path downloadDir, 
+        bool coldStart, const std::size_t maxQueueSize
     ): 
         name {name}, totalSize {totalSize}, pieceSize {pieceSize}, 
-        DownloadDir {downloadDir}, MAX_QUEUE {maxQueueSize}
+        DownloadDir {downloadDir}, MAX_QUEUE {maxQueueSize}, cache {cache}, pool {pool}
     {
         // Create download directory if it doesn't already exist
         if (!std::filesystem::exists(DownloadDir))
@@ -16,80 +361,342 @@ namespace Torrent {
         if (!std::filesystem::is_directory(DownloadDir))
             throw std::runtime_error("Download directory provided is not a valid folder path");
 
-        // Check if already split
+        // Check if already moved into place
         if (std::filesystem::exists(DownloadDir / name))
             throw std::runtime_error("Torrent already downloaded?");
 
-        // Create a temp sparse file for saving the pieces
-        DownloadTempFilePath = DownloadDir / ("." + std::string{name});
-        if (!std::filesystem::exists(DownloadTempFilePath)) {
-            if (!coldStart) throw std::runtime_error{"Temp download file is missing, delete "
-                "the `.ctorrent` file and restart"};
-            std::ofstream tempFile {DownloadTempFilePath, std::ios::binary};
-            tempFile.seekp(static_cast<std::int64_t>(totalSize - 1)); 
-            tempFile.put('\0');
+        // Staging directory mirrors the final layout
+        StagingDir = DownloadDir / ("." + std::string{name});
+        existingData = std::filesystem::exists(StagingDir);
+        if (existingData && !std::filesystem::is_directory(StagingDir))
+            throw std::runtime_error{"Found a temp download file from an older version at " + 
+                StagingDir.string() + ", delete it along with the `.ctorrent` file and restart"};
+        if (!existingData && !coldStart) throw std::runtime_error{"Staging directory is missing, delete "
+            "the `.ctorrent` file and restart"};
+
+        // Create every file and lay them out back to back, empty files are only created. Files are
+        // sized sparse here, disk space is only reserved for wanted files (`setWantedFiles`)
+        std::uint64_t offset {};
+        try {
+            for (std::size_t fileIdx {}; fileIdx < files.size(); ++fileIdx) {
+                const auto &[path, size] {files[fileIdx]};
+                if (!safePath(path))
+                    throw std::runtime_error("Torrent contains an unsafe file path: " + path.string());
+
+                const std::filesystem::path filePath {StagingDir / path};
+                if (filePath.has_parent_path()) std::filesystem::create_directories(filePath.parent_path());
+                if (!size) {
+                    int fd {::open(filePath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644)};
+                    if (fd == -1) throw systemError("Failed to open " + filePath.string());
+                    ::close(fd); continue;
+                }
+
+                slots.emplace_back(filePath, offset, size, fileIdx);
+                int fd {openSlot(slots.size() - 1)};
+                const bool sized {::ftruncate(fd, static_cast<off_t>(size)) == 0};
+                releaseSlot(slots.size() - 1);
+                if (!sized) throw systemError("Failed to size " + filePath.string());
+                offset += size;
+            }
+        } catch (...) { closeFiles(); throw; }
+
+        if (offset != totalSize) {
+            closeFiles();
+            throw std::runtime_error("File sizes do not add up to the torrent length");
         }
+        dirty.resize(slots.size());
+    }
 
-        // Open the file handle
-        DownloadTempFile = std::fstream {DownloadTempFilePath, std::ios::binary | std::ios::in | std::ios::out};
-        if (!DownloadTempFile) throw std::runtime_error("Failed to open temp file for writing");
+    void DiskWriter::setWantedFiles(const std::vector<bool> &wanted) {
+        std::scoped_lock lock {fileMutex};
+        for (std::size_t idx {}; idx < slots.size(); ++idx) {
+            FileSlot &slot {slots[idx]};
+            slot.wanted = slot.fileIdx >= wanted.size() || wanted[slot.fileIdx];
+            if (!slot.wanted || slot.allocated) continue;
+            int fd {openSlot(idx)};
+            try { preallocate(fd, slot.size); } catch (...) { releaseSlot(idx); throw; }
+            releaseSlot(idx); slot.allocated = true;
+        }
+    }
 
-        // Spawn the worker thread and keep it running
-        writer = std::thread {[this] {
-            try {
-                std::size_t piecesWritten {}; // Flush after every 1000 pieces written
-                for (;;) {
-                    std::unique_lock lock {taskMutex}; 
-                    tasksCV.wait(lock, [this]{ return exitCondition || !tasks.empty(); });
-                    if (exitCondition && tasks.empty()) { DownloadTempFile.close(); return; } 
-                    else {
-                        auto [offset, piece] {std::move(tasks.front())};
-                        tasks.pop(); lock.unlock(); tasksCV.notify_one();
-                        DownloadTempFile.seekp(static_cast<std::int64_t>(offset), std::ios::beg);
-                        DownloadTempFile.write(piece.c_str(), static_cast<std::streamsize>(piece.size()));
-                        if (!DownloadTempFile.good()) throw std::runtime_error("Write to temp file failed");
-                        else if (++piecesWritten % MAX_QUEUE == 0) DownloadTempFile.flush();
-                        Logging::Dynamic::Debug("Piece #{} written to disk asynchronously", offset / this->pieceSize);
-                    }
+    void DiskWriter::syncFiles() {
+        std::vector<bool> written(slots.size());
+        { std::scoped_lock lock {dirtyMutex}; written.swap(dirty); }
+
+        // On failure every file stays dirty for the next call
+        try {
+            for (std::size_t idx {}; idx < slots.size(); ++idx) {
+                if (!written[idx]) continue;
+                const bool synced {::fdatasync(openSlot(idx)) == 0};
+                releaseSlot(idx);
+                if (!synced) throw systemError("Failed to sync " + slots[idx].path.string());
+            }
+        } catch (...) {
+            std::scoped_lock lock {dirtyMutex};
+            for (std::size_t idx {}; idx < slots.size(); ++idx) if (written[idx]) dirty[idx] = true;
+            throw;
+        }
+    }
+
+    void DiskWriter::closeFiles() { pool.files().drop(this); }
+
+    std::vector<DiskWriter::Segment> DiskWriter::segments(std::uint64_t offset, std::uint64_t length) const {
+        if (offset + length > totalSize) throw std::runtime_error("Access out of bounds");
+
+        // First file whose range ends past the offset
+        auto it {std::ranges::upper_bound(slots, offset, {}, 
+            [](const FileSlot &slot) { return slot.offset + slot.size; })};
+
+        std::vector<Segment> result;
+        for (; length && it != slots.end(); ++it) {
+            const std::uint64_t fileOffset {offset - it->offset};
+            const std::uint64_t segLength {std::min(length, it->size - fileOffset)};
+            result.emplace_back(static_cast<std::size_t>(it - slots.begin()), fileOffset, offset, segLength);
+            offset += segLength; length -= segLength;
+        }
+        return result;
+    }
+
+    std::vector<DiskWriter::WriteOp> DiskWriter::writeOps(const Batch &batch) const {
+        const std::uint64_t start {batch.front().first};
+        const std::uint64_t end {batch.back().first + batch.back().second->size()};
+
+        // One gather write per file, pieces spanning file boundaries are split across files
+        std::vector<WriteOp> ops;
+        try {
+            for (auto [slot, fileOffset, offset, length]: segments(start, end - start)) {
+                std::vector<iovec> iovs;
+                for (const auto &[pieceOffset, piece]: batch) {
+                    std::uint64_t lo {std::max(pieceOffset, offset)}; 
+                    std::uint64_t hi {std::min(pieceOffset + piece->size(), offset + length)};
+                    if (lo < hi) iovs.push_back({const_cast<char*>(piece->data()) + (lo - pieceOffset), hi - lo});
                 }
-            } catch (std::exception &ex) { 
-                Logging::Dynamic::Error("An exception occured inside writer thread: {}", ex.what());
-                exitCondition = true; tasksCV.notify_all();
+                ops.emplace_back(slot, openSlot(slot), fileOffset, std::move(iovs));
             }
-        }};
+        } catch (...) { releaseOps(ops); throw; }
+        return ops;
+    }
+
+    void DiskWriter::releaseOps(const std::vector<WriteOp> &ops) const {
+        for (const WriteOp &op: ops) releaseSlot(op.slot);
+    }
+
+    void DiskWriter::writeRange(const Batch &batch) {
+        std::vector<WriteOp> ops {writeOps(batch)};
+        try {
+            for (auto &[slot, fd, fileOffset, iovs]: ops) pwritevAll(fd, iovs, fileOffset);
+        } catch (...) { releaseOps(ops); throw; }
+        releaseOps(ops);
+    }
+
+    DiskWriter::Batch DiskWriter::takeBatch() {
+        std::unique_lock lock {taskMutex};
+        if (tasks.empty() || failed) return {};
+
+        // Pull in queued pieces that continue the oldest one to write them in one go
+        Batch batch;
+        batch.push_back(std::move(tasks.front())); tasks.pop_front();
+        while (batch.size() < MAX_COALESCE) {
+            const std::uint64_t end {batch.back().first + batch.back().second->size()};
+            auto nextIt {std::ranges::find(tasks, end, &decltype(tasks)::value_type::first)};
+            if (nextIt == tasks.end()) break;
+            batch.push_back(std::move(*nextIt)); tasks.erase(nextIt);
+        }
+        writing.insert(writing.end(), batch.begin(), batch.end());
+        lock.unlock(); tasksCV.notify_all();
+        return batch;
+    }
+
+    bool DiskWriter::completeBatch(const Batch &batch) {
+        const std::uint64_t start {batch.front().first};
+        const std::uint64_t length {batch.back().first + batch.back().second->size() - start};
+        {
+            std::scoped_lock lock {dirtyMutex};
+            for (const Segment &segment: segments(start, length)) dirty[segment.slot] = true;
+        }
+        for (const auto &listener: writeListeners) listener(start, length);
+        Logging::Dynamic::Debug("Pieces #{}-{} written to disk asynchronously", batch.front().first / pieceSize, 
+            batch.back().first / pieceSize);
+
+        std::unique_lock lock {taskMutex};
+        for (const auto &[offset, _]: batch)
+            writing.erase(std::ranges::find(writing, offset, &decltype(writing)::value_type::first));
+        bool pending {!tasks.empty()};
+        lock.unlock(); tasksCV.notify_all();
+        return pending;
+    }
+
+    void DiskWriter::onWriteFailure(const std::exception &ex) {
+        Logging::Dynamic::Error("An exception occured inside writer thread: {}", ex.what());
+        { std::scoped_lock lock {taskMutex}; failed = true; exitCondition = true; }
+        tasksCV.notify_all();
+    }
+
+    bool DiskWriter::hasTasks() {
+        std::scoped_lock lock {taskMutex};
+        return !tasks.empty() && !failed;
     }
 
-    void DiskWriter::scheduleSync(std::uint64_t offset, std::string &&piece) {
-        DownloadTempFile.seekp(static_cast<std::int64_t>(offset), std::ios::beg);
-        DownloadTempFile.write(piece.c_str(), static_cast<std::streamsize>(piece.size()));
-        if (!DownloadTempFile.good()) throw std::runtime_error("Write to temp file failed");
+    bool DiskWriter::writeOne() {
+        try {
+            Batch batch {takeBatch()};
+            if (batch.empty()) return false;
+            writeRange(batch);
+            return completeBatch(batch);
+        } catch (std::exception &ex) { 
+            onWriteFailure(ex);
+            return false;
+        }
+    }
+
+    void DiskWriter::scheduleSync(std::uint64_t offset, SharedPiece piece) {
+        Batch batch;
+        batch.emplace_back(offset, std::move(piece));
+        writeRange(batch);
         Logging::Dynamic::Debug("Piece #{} written to disk synchronously", offset / this->pieceSize);
     }
 
-    void DiskWriter::schedule(std::uint64_t offset, std::string &&piece) {
-        std::size_t currPieceLen {piece.size()};
+    void DiskWriter::schedule(std::uint64_t offset, SharedPiece piece) {
+        std::size_t currPieceLen {piece->size()};
         std::unique_lock lock{taskMutex};
         tasksCV.wait(lock, [this]{ return exitCondition || tasks.size() < MAX_QUEUE; });
         if (exitCondition) throw std::runtime_error("Scheduled after exit called, state may be corrupt");
-        tasks.emplace(offset, std::move(piece));
+        tasks.emplace_back(offset, std::move(piece));
         std::size_t queueItemCount {tasks.size()}; 
-        lock.unlock(); tasksCV.notify_one();
+        lock.unlock(); pool.notify(*this);
         Logging::Dynamic::Debug("Piece (idx={}, offset={}, size={}) scheduled, total queue size: {}", 
             offset / this->pieceSize, currPieceLen, offset, queueItemCount);
     }
 
-    bool DiskWriter::chunkCopy(std::ifstream &source, std::ofstream &destination, std::uint64_t size, std::uint64_t chunkSize) {
-        std::vector<char> buffer(chunkSize);
-        while (size > 0) {
-            std::size_t toRead {size > chunkSize? chunkSize: size};
-            source.read(buffer.data(), static_cast<std::streamsize>(toRead));
-            std::streamsize bytesRead {source.gcount()};
-            if (bytesRead <= 0) return false;
-            destination.write(buffer.data(), bytesRead);
-            if (!destination.good()) return false;
-            size -= static_cast<std::uint64_t>(bytesRead);
+    DynamicBitset DiskWriter::recheck(std::string_view pieceHashes, async::ThreadPool &pool) {
+        const std::uint32_t numPieces {static_cast<std::uint32_t>(pieceHashes.size() / 20)};
+
+        // Map every file read only, pieces are assembled from the mappings they span
+        std::vector<const char*> mappings(slots.size(), nullptr);
+        auto unmap {[&] {
+            for (std::size_t i {}; i < slots.size(); ++i)
+                if (mappings[i]) ::munmap(const_cast<char*>(mappings[i]), slots[i].size);
+        }};
+        for (std::size_t i {}; i < slots.size(); ++i) {
+            // Mappings outlive the fd, files needn't stay open
+            void *mapped;
+            try { mapped = ::mmap(nullptr, slots[i].size, PROT_READ, MAP_SHARED, openSlot(i), 0); }
+            catch (...) { unmap(); throw; }
+            releaseSlot(i);
+            if (mapped == MAP_FAILED) { unmap(); throw systemError("Failed to mmap " + slots[i].path.string()); }
+            ::madvise(mapped, slots[i].size, MADV_SEQUENTIAL);
+            mappings[i] = static_cast<const char*>(mapped);
+        }
+
+        // Workers pull the next piece off a shared counter, keeping reads close to sequential
+        std::vector<std::uint8_t> valid(numPieces, 0);
+        std::atomic<std::uint32_t> next {0}, checked {0};
+        auto check {[&] {
+            std::string piece;
+            for (std::uint32_t pieceIdx; (pieceIdx = next.fetch_add(1, std::memory_order_relaxed)) < numPieces;) {
+                const std::uint64_t offset {static_cast<std::uint64_t>(pieceIdx) * pieceSize};
+                piece.clear();
+                for (auto [slot, fileOffset, _, length]: segments(offset, std::min<std::uint64_t>(pieceSize, totalSize - offset)))
+                    piece.append(mappings[slot] + fileOffset, length);
+                valid[pieceIdx] = hashutil::sha1(piece, true) == pieceHashes.substr(pieceIdx * 20ul, 20);
+                checked.fetch_add(1, std::memory_order_relaxed);
+            }
+        }};
+
+        // A pool without workers would never run the jobs, check on the calling thread instead
+        std::vector<std::future<void>> jobs;
+        if (!pool.size()) {
+            try { check(); } catch (...) { unmap(); throw; }
         }
-        return !size;
+        for (unsigned i {}; pool.size() && i < std::max(1u, std::thread::hardware_concurrency()); ++i)
+            jobs.emplace_back(pool.enqueue(check));
+
+        // Report progress until every worker is done
+        try {
+            for (std::future<void> &job: jobs) {
+                while (job.wait_for(std::chrono::seconds{2}) != std::future_status::ready) {
+                    std::uint32_t done {checked.load(std::memory_order_relaxed)};
+                    Logging::Dynamic::Info("[{}] Rechecking existing data: {}/{} pieces ({:.1f}%)", 
+                        name, done, numPieces, 100. * done / numPieces);
+                }
+                job.get();
+            }
+        } catch (...) {
+            for (std::future<void> &job: jobs) if (job.valid()) job.wait();
+            unmap(); throw;
+        }
+        unmap();
+
+        DynamicBitset haves {numPieces};
+        for (std::uint32_t pieceIdx {}; pieceIdx < numPieces; ++pieceIdx)
+            if (valid[pieceIdx]) haves.set(pieceIdx);
+        return haves;
+    }
+
+    SharedPiece DiskWriter::readMemory(std::uint32_t pieceIdx) {
+        if (SharedPiece cached {cache.lookup(this, pieceIdx)}) return cached;
+
+        const std::uint64_t offset {static_cast<std::uint64_t>(pieceIdx) * pieceSize};
+        if (offset >= totalSize) throw std::runtime_error("Piece read out of bounds");
+
+        // Pieces stay in `writing` until their write completes, so a piece
+        // is either still in memory or has been completely written to disk
+        SharedPiece result;
+        {
+            std::scoped_lock lock {taskMutex};
+            auto queuedIt {std::ranges::find(tasks, offset, &decltype(tasks)::value_type::first)};
+            if (queuedIt != tasks.end()) result = queuedIt->second;
+            else if (auto writingIt {std::ranges::find(writing, offset, &decltype(writing)::value_type::first)}; 
+                writingIt != writing.end()) result = writingIt->second;
+        }
+        if (result) cache.insert(this, pieceIdx, result);
+        return result;
+    }
+
+    SharedPiece DiskWriter::readDisk(std::uint32_t pieceIdx) {
+        const std::uint64_t offset {static_cast<std::uint64_t>(pieceIdx) * pieceSize};
+        if (offset >= totalSize) throw std::runtime_error("Piece read out of bounds");
+        std::string piece(std::min<std::uint64_t>(pieceSize, totalSize - offset), '\0');
+
+        std::vector<DiskIOPool::ReadOp> ops;
+        std::vector<std::size_t> opened;
+        char *buffer {piece.data()};
+        auto release {[this, &opened] { for (std::size_t slot: opened) releaseSlot(slot); }};
+        try {
+            for (auto [slot, fileOffset, _, length]: segments(offset, piece.size())) {
+                ops.push_back({openSlot(slot), buffer, length, fileOffset});
+                opened.push_back(slot); buffer += length;
+            }
+            pool.read(ops);
+        } catch (...) { release(); throw; }
+        release();
+
+        Logging::Dynamic::Debug("Piece #{} read from disk for upload", pieceIdx);
+        SharedPiece result {std::make_shared<const std::string>(std::move(piece))};
+        cache.insert(this, pieceIdx, result);
+        return result;
+    }
+
+    SharedPiece DiskWriter::read(std::uint32_t pieceIdx) {
+        if (SharedPiece result {readMemory(pieceIdx)}) return result;
+        return readDisk(pieceIdx);
+    }
+
+    SharedPiece DiskWriter::tryRead(std::uint32_t pieceIdx) {
+        if (auto it {loaded.find(pieceIdx)}; it != loaded.end()) return it->second;
+        if (SharedPiece result {readMemory(pieceIdx)}) return result;
+        if (reading.insert(pieceIdx).second) pool.readAsync(*this, pieceIdx);
+        return nullptr;
+    }
+
+    std::vector<DiskWriter::ReadResult> DiskWriter::drainReads() {
+        loaded.clear();
+        std::vector<ReadResult> results {readResults.drain()};
+        for (const ReadResult &result: results) {
+            reading.erase(result.pieceIdx);
+            if (result.piece) loaded.emplace(result.pieceIdx, result.piece);
+        }
+        return results;
     }
 
     DiskWriter::~DiskWriter() {
@@ -97,35 +704,45 @@ namespace Torrent {
             Logging::Dynamic::Warn("Disk writer cleanup called abnormally");
             exitCondition = true;
             tasksCV.notify_all();
-            writer.join();
         }
+        pool.detach(*this);
+        cache.drop(this);
+        closeFiles();
     }
 
-    bool DiskWriter::finish(const std::vector<FileStruct> &files, bool status) {
-        // Stop the running thread
-        exitCondition = true;
-        tasksCV.notify_all();
-        if (writer.joinable()) writer.join();
+    bool DiskWriter::finish(bool status) {
+        // Wait for the pool to drain our queue and stop accepting new pieces
+        {
+            std::unique_lock lock {taskMutex};
+            exitCondition = true;
+            tasksCV.wait(lock, [this] { return failed || (tasks.empty() && writing.empty()); });
+        }
+        pool.detach(*this);
 
         Logging::Dynamic::Info("Stopping disk writer, download completion status: {}", 
             status? "DONE": "PENDING");
 
-        if (!status) return false;
+        if (status && !failed) {
+            for (std::size_t idx {}; idx < slots.size(); ++idx) {
+                try { if (::fsync(openSlot(idx)) == -1) status = false; }
+                catch (std::exception &ex) { Logging::Dynamic::Error("{}", ex.what()); status = false; continue; }
+                releaseSlot(idx);
+            }
+            if (status) { std::scoped_lock lock {dirtyMutex}; dirty.assign(slots.size(), false); }
+        }
+        closeFiles();
+        if (!status || failed) return false;
 
-        std::ifstream ifs {DownloadTempFilePath, std::ios::binary};
-        for (auto [filePath, fileSize]: files) {
-            filePath = DownloadDir / name / filePath;
-            const auto parentPath {filePath.parent_path()};
-            if (!parentPath.empty() && !std::filesystem::exists(parentPath))
-                std::filesystem::create_directories(parentPath);
-            std::ofstream ofs {filePath, std::ios::binary};
-            if (!ofs || !chunkCopy(ifs, ofs, fileSize)) 
-                return false;
-            Logging::Dynamic::Info("File split created on disk: {}", filePath.string());
+        // Skipped files only hold the edges of pieces shared with wanted files, drop them
+        for (const FileSlot &slot: slots) {
+            if (slot.wanted) continue;
+            std::filesystem::remove(slot.path);
+            Logging::Dynamic::Info("Skipped file removed: {}", slot.path.string());
         }
 
-        Logging::Dynamic::Info("Clearing temp download file"); 
-        std::filesystem::remove(DownloadTempFilePath);
+        // Files are already in their final layout, just move the directory into place
+        std::filesystem::rename(StagingDir, DownloadDir / name);
+        Logging::Dynamic::Info("Download moved into place: {}", (DownloadDir / name).string());
         return true;
     }
 }
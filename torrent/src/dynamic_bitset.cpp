@@ -0,0 +1,90 @@
+#include "../include/dynamic_bitset.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+namespace {
+    // Words are kept in wire (big endian) bit order regardless of the host
+    constexpr std::uint64_t toBigEndian(std::uint64_t word) {
+        if constexpr (std::endian::native == std::endian::little) return std::byteswap(word);
+        else return word;
+    }
+}
+
+namespace Torrent {
+    DynamicBitset::DynamicBitset(const std::size_t size): 
+        words((size + WORD_BITS - 1) / WORD_BITS, 0), bits {size} {}
+
+    std::uint64_t DynamicBitset::spareMask() const {
+        const std::size_t used {bits % WORD_BITS};
+        return used? std::numeric_limits<std::uint64_t>::max() >> used: 0;
+    }
+
+    std::optional<DynamicBitset> DynamicBitset::fromWire(std::string_view payload, const std::size_t size) {
+        if (payload.size() != (size + 7) / 8) return std::nullopt;
+        DynamicBitset result {size};
+        for (std::size_t w {}; w < result.words.size(); ++w) {
+            std::uint64_t word {};
+            std::memcpy(&word, payload.data() + w * 8, std::min<std::size_t>(8, payload.size() - w * 8));
+            result.words[w] = toBigEndian(word);
+            result.ones += static_cast<std::size_t>(std::popcount(result.words[w]));
+        }
+        if (!result.words.empty() && (result.words.back() & result.spareMask())) return std::nullopt;
+        return result;
+    }
+
+    std::string DynamicBitset::toWire() const {
+        std::string payload(words.size() * 8, '\0');
+        for (std::size_t w {}; w < words.size(); ++w) {
+            const std::uint64_t word {toBigEndian(words[w])};
+            std::memcpy(payload.data() + w * 8, &word, 8);
+        }
+        payload.resize((bits + 7) / 8);
+        return payload;
+    }
+
+    bool DynamicBitset::set(const std::size_t idx) {
+        if (idx >= bits || test(idx)) return false;
+        words[idx / WORD_BITS] |= mask(idx); ++ones;
+        return true;
+    }
+
+    bool DynamicBitset::reset(const std::size_t idx) {
+        if (!test(idx)) return false;
+        words[idx / WORD_BITS] &= ~mask(idx); --ones;
+        return true;
+    }
+
+    void DynamicBitset::clear() {
+        std::ranges::fill(words, 0); ones = 0;
+    }
+
+    void DynamicBitset::setAll() {
+        std::ranges::fill(words, std::numeric_limits<std::uint64_t>::max());
+        if (!words.empty()) words.back() &= ~spareMask();
+        ones = bits;
+    }
+
+    std::size_t DynamicBitset::findNextAndNot(const DynamicBitset &other, const std::size_t from) const {
+        if (from >= bits) return npos;
+        std::size_t w {from / WORD_BITS};
+
+        // Mask off the bits before `from` in the first word
+        std::uint64_t word {words[w] & (std::numeric_limits<std::uint64_t>::max() >> (from % WORD_BITS))};
+        for (;;) {
+            if (w < other.words.size()) word &= ~other.words[w];
+            if (word) return w * WORD_BITS + static_cast<std::size_t>(std::countl_zero(word));
+            if (++w == words.size()) return npos;
+            word = words[w];
+        }
+    }
+
+    std::size_t DynamicBitset::countAndNot(const DynamicBitset &other) const {
+        std::size_t result {};
+        for (std::size_t w {}; w < words.size(); ++w) {
+            const std::uint64_t otherWord {w < other.words.size()? other.words[w]: 0};
+            result += static_cast<std::size_t>(std::popcount(words[w] & ~otherWord));
+        }
+        return result;
+    }
+}
@@ -0,0 +1,65 @@
+#include "../include/file_cache.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <string>
+#include <unistd.h>
+
+namespace Torrent {
+    FileCache::FileCache(const std::size_t capacity): capacity {std::max<std::size_t>(capacity, 1)} {}
+
+    FileCache::~FileCache() {
+        for (auto &[key, entry]: index) ::close(entry.fd);
+    }
+
+    void FileCache::evict(const std::size_t limit) {
+        while (index.size() > limit && !lru.empty()) {
+            auto it {index.find(lru.back())};
+            ::close(it->second.fd);
+            index.erase(it); lru.pop_back();
+        }
+    }
+
+    int FileCache::acquire(const void *owner, const std::size_t slot, const std::filesystem::path &path) {
+        std::scoped_lock lock {mutex};
+        if (auto it {index.find({owner, slot})}; it != index.end()) {
+            if (!it->second.pins++) lru.erase(it->second.lruIt);
+            return it->second.fd;
+        }
+
+        // Make room first so that the limit holds unless everything open is pinned
+        evict(capacity - 1);
+
+        int fd {::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644)};
+        if (fd == -1) throw std::runtime_error("Failed to open " + path.string() + ": " + std::strerror(errno));
+        index.emplace(Key{owner, slot}, Entry{.fd=fd, .pins=1, .lruIt=lru.end()});
+        return fd;
+    }
+
+    void FileCache::release(const void *owner, const std::size_t slot) {
+        std::scoped_lock lock {mutex};
+        auto it {index.find({owner, slot})};
+        if (it == index.end() || !it->second.pins || --it->second.pins) return;
+        lru.push_front(it->first);
+        it->second.lruIt = lru.begin();
+        evict(capacity);
+    }
+
+    void FileCache::drop(const void *owner) {
+        std::scoped_lock lock {mutex};
+        for (auto it {index.begin()}; it != index.end();) {
+            if (it->first.owner != owner) { ++it; continue; }
+            if (!it->second.pins) lru.erase(it->second.lruIt);
+            ::close(it->second.fd);
+            it = index.erase(it);
+        }
+    }
+
+    std::size_t FileCache::size() {
+        std::scoped_lock lock {mutex};
+        return index.size();
+    }
+}
@@ -0,0 +1,141 @@
+#include "../include/io_ring.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <linux/io_uring.h>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace {
+    std::runtime_error systemError(const std::string &message) {
+        return std::runtime_error{message + ": " + std::strerror(errno)};
+    }
+
+    // Heads & tails are written by one side and read by the other
+    unsigned loadAcquire(unsigned *ptr) { return std::atomic_ref<unsigned>{*ptr}.load(std::memory_order_acquire); }
+    void storeRelease(unsigned *ptr, unsigned value) { std::atomic_ref<unsigned>{*ptr}.store(value, std::memory_order_release); }
+
+    void *mapRing(int fd, std::size_t size, off_t offset) {
+        void *ptr {::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset)};
+        return ptr == MAP_FAILED? nullptr: ptr;
+    }
+}
+
+namespace Torrent {
+    IoRing::IoRing(const unsigned entries) {
+        io_uring_params params {};
+        fd = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &params));
+        if (fd < 0) throw systemError("io_uring_setup failed");
+
+        // Newer kernels map both rings with a single mmap
+        sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        const bool singleMap {(params.features & IORING_FEAT_SINGLE_MMAP) != 0};
+        if (singleMap) sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+
+        sqRing = mapRing(fd, sqRingSize, IORING_OFF_SQ_RING);
+        cqRing = singleMap? sqRing: mapRing(fd, cqRingSize, IORING_OFF_CQ_RING);
+        sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = mapRing(fd, sqesSize, IORING_OFF_SQES);
+        if (!sqRing || !cqRing || !sqes) {
+            const std::runtime_error error {systemError("Failed to map the io_uring rings")};
+            unmap(); throw error;
+        }
+
+        char *sq {static_cast<char*>(sqRing)}, *cq {static_cast<char*>(cqRing)};
+        sqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        sqMask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cqMask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes = cq + params.cq_off.cqes;
+        sqEntries = params.sq_entries;
+    }
+
+    IoRing::~IoRing() { unmap(); }
+
+    void IoRing::unmap() {
+        if (sqes) ::munmap(sqes, sqesSize);
+        if (cqRing && cqRing != sqRing) ::munmap(cqRing, cqRingSize);
+        if (sqRing) ::munmap(sqRing, sqRingSize);
+        if (fd != -1) ::close(fd);
+        sqes = cqRing = sqRing = nullptr; fd = -1;
+    }
+
+    bool IoRing::supported() {
+        static const bool result {[] {
+            try {
+                IoRing ring {2};
+
+                // Probe is followed by one entry per opcode, IORING_OP_READ needs 5.6 (same as the probe itself)
+                constexpr unsigned MAX_OPS {256};
+                alignas(io_uring_probe) std::array<std::byte, sizeof(io_uring_probe) + MAX_OPS * sizeof(io_uring_probe_op)> buffer {};
+                auto *probe {reinterpret_cast<io_uring_probe*>(buffer.data())};
+                if (::syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PROBE, probe, MAX_OPS) < 0) return false;
+                auto has {[probe](unsigned op) { return op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED); }};
+                return has(IORING_OP_WRITEV) && has(IORING_OP_READ);
+            } catch (std::exception &) { return false; }
+        }()};
+        return result;
+    }
+
+    void *IoRing::nextSqe() {
+        const unsigned tail {*sqTail};
+        if (tail - loadAcquire(sqHead) >= sqEntries || pending >= sqEntries) return nullptr;
+        const unsigned idx {tail & sqMask};
+        auto *sqe {static_cast<io_uring_sqe*>(sqes) + idx};
+        std::memset(sqe, 0, sizeof(io_uring_sqe));
+        sqArray[idx] = idx;
+        return sqe;
+    }
+
+    bool IoRing::writev(int fileFd, const iovec *iovs, unsigned count, std::uint64_t offset, std::uint64_t userData) {
+        auto *sqe {static_cast<io_uring_sqe*>(nextSqe())};
+        if (!sqe) return false;
+        sqe->opcode = IORING_OP_WRITEV; sqe->fd = fileFd; sqe->off = offset;
+        sqe->addr = reinterpret_cast<std::uint64_t>(iovs); sqe->len = count; sqe->user_data = userData;
+        storeRelease(sqTail, *sqTail + 1); ++queued; ++pending;
+        return true;
+    }
+
+    bool IoRing::read(int fileFd, void *buffer, unsigned length, std::uint64_t offset, std::uint64_t userData) {
+        auto *sqe {static_cast<io_uring_sqe*>(nextSqe())};
+        if (!sqe) return false;
+        sqe->opcode = IORING_OP_READ; sqe->fd = fileFd; sqe->off = offset;
+        sqe->addr = reinterpret_cast<std::uint64_t>(buffer); sqe->len = length; sqe->user_data = userData;
+        storeRelease(sqTail, *sqTail + 1); ++queued; ++pending;
+        return true;
+    }
+
+    void IoRing::submit(unsigned minComplete) {
+        unsigned flags {minComplete? IORING_ENTER_GETEVENTS: 0u};
+        while (queued || flags) {
+            long submitted {::syscall(__NR_io_uring_enter, fd, queued, minComplete, flags, nullptr, 0)};
+            if (submitted < 0 && errno == EINTR) continue;
+            if (submitted < 0) throw systemError("io_uring_enter failed");
+            if (!submitted && queued && !flags) throw std::runtime_error("io_uring_enter accepted no submissions");
+            queued -= static_cast<unsigned>(submitted); flags = 0; minComplete = 0;
+        }
+    }
+
+    std::size_t IoRing::reap(Completion *out, std::size_t max) {
+        unsigned head {*cqHead};
+        const unsigned tail {loadAcquire(cqTail)};
+        std::size_t count {};
+        for (; head != tail && count < max; ++head, ++count) {
+            const io_uring_cqe &cqe {static_cast<io_uring_cqe*>(cqes)[head & cqMask]};
+            out[count] = {cqe.user_data, cqe.res};
+        }
+        storeRelease(cqHead, head);
+        pending -= static_cast<unsigned>(count);
+        return count;
+    }
+}
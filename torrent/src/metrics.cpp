@@ -0,0 +1,127 @@
+#include "../include/metrics.hpp"
+
+#include <format>
+#include <fstream>
+#include <functional>
+#include <stdexcept>
+#include <string_view>
+#include <utility>
+
+namespace {
+    // Label values escape backslashes, quotes & newlines
+    std::string escapeLabel(std::string_view value) {
+        std::string out; out.reserve(value.size());
+        for (char ch: value) {
+            if (ch == '\\' || ch == '"') out += '\\';
+            if (ch == '\n') { out += "\\n"; continue; }
+            out += ch;
+        }
+        return out;
+    }
+
+    std::string toHex(std::string_view bytes) {
+        static constexpr std::string_view DIGITS {"0123456789abcdef"};
+        std::string out; out.reserve(bytes.size() * 2);
+        for (unsigned char ch: bytes) { out += DIGITS[ch >> 4]; out += DIGITS[ch & 0xF]; }
+        return out;
+    }
+
+    void header(std::string &out, std::string_view name, std::string_view type, std::string_view help) {
+        out += std::format("# HELP {} {}\n# TYPE {} {}\n", name, help, name, type);
+    }
+
+    template<typename T>
+    struct Metric {
+        std::string_view name, type, help;
+        std::function<double(const T&)> value;
+    };
+}
+
+namespace Torrent {
+    std::string formatPrometheus(const LoopMetrics &loop, const std::vector<TorrentMetrics> &torrents) {
+        std::string out;
+        header(out, "ctorrent_loop_iterations_total", "counter", "Event loop iterations");
+        out += std::format("ctorrent_loop_iterations_total {}\n", loop.iterations);
+        header(out, "ctorrent_loop_busy_seconds", "gauge", "Smoothed time spent per loop iteration outside of poll");
+        out += std::format("ctorrent_loop_busy_seconds {:.6f}\n", loop.busySeconds);
+        header(out, "ctorrent_loop_busy_seconds_max", "gauge", "Longest loop iteration since the last export");
+        out += std::format("ctorrent_loop_busy_seconds_max {:.6f}\n", loop.maxBusySeconds);
+
+        std::vector<std::string> torrentLabels;
+        for (const TorrentMetrics &torrent: torrents)
+            torrentLabels.push_back(std::format("torrent=\"{}\",info_hash=\"{}\"",
+                escapeLabel(torrent.name), toHex(torrent.infoHash)));
+
+        const std::vector<Metric<TorrentMetrics>> torrentMetrics {
+            {"ctorrent_downloaded_bytes_total", "counter", "Bytes of requested blocks received",
+                [](const TorrentMetrics &m) { return static_cast<double>(m.downloadedBytes); }},
+            {"ctorrent_uploaded_bytes_total", "counter", "Bytes of blocks sent to peers",
+                [](const TorrentMetrics &m) { return static_cast<double>(m.uploadedBytes); }},
+            {"ctorrent_verified_bytes_total", "counter", "Bytes of pieces passing the hash check",
+                [](const TorrentMetrics &m) { return static_cast<double>(m.verifiedBytes); }},
+            {"ctorrent_wasted_bytes_total", "counter", "Bytes received that were unrequested, malformed or failed the hash check",
+                [](const TorrentMetrics &m) { return static_cast<double>(m.wastedBytes); }},
+            {"ctorrent_hash_failures_total", "counter", "Pieces failing the hash check",
+                [](const TorrentMetrics &m) { return static_cast<double>(m.hashFailures); }},
+            {"ctorrent_goodput_bytes_per_second", "gauge", "Smoothed rate of verified bytes",
+                [](const TorrentMetrics &m) { return m.goodput; }},
+            {"ctorrent_pieces_done", "gauge", "Pieces verified",
+                [](const TorrentMetrics &m) { return static_cast<double>(m.piecesDone); }},
+            {"ctorrent_pieces", "gauge", "Pieces in the torrent",
+                [](const TorrentMetrics &m) { return static_cast<double>(m.numPieces); }},
+            {"ctorrent_disk_queue_depth", "gauge", "Verified pieces waiting to be written",
+                [](const TorrentMetrics &m) { return static_cast<double>(m.diskQueueDepth); }},
+            {"ctorrent_step_seconds", "gauge", "Smoothed time spent on the torrent's housekeeping per loop iteration",
+                [](const TorrentMetrics &m) { return m.stepSeconds; }},
+            {"ctorrent_peers", "gauge", "Connected peers past the handshake",
+                [](const TorrentMetrics &m) { return static_cast<double>(m.peers.size()); }},
+        };
+
+        const std::vector<Metric<PeerMetrics>> peerMetrics {
+            {"ctorrent_peer_download_bytes_per_second", "gauge", "Smoothed download rate from the peer",
+                [](const PeerMetrics &m) { return m.downloadRate; }},
+            {"ctorrent_peer_upload_bytes_per_second", "gauge", "Smoothed upload rate to the peer",
+                [](const PeerMetrics &m) { return m.uploadRate; }},
+            {"ctorrent_peer_rtt_seconds", "gauge", "Lowest request round trip time seen (0 until measured)",
+                [](const PeerMetrics &m) { return m.rttSeconds; }},
+            {"ctorrent_peer_outstanding_requests", "gauge", "Blocks requested from the peer & not yet received",
+                [](const PeerMetrics &m) { return static_cast<double>(m.outstanding); }},
+            {"ctorrent_peer_choked_seconds", "gauge", "Time the peer has choked us since the handshake",
+                [](const PeerMetrics &m) { return m.chokedSeconds; }},
+            {"ctorrent_peer_choked", "gauge", "Whether the peer is choking us",
+                [](const PeerMetrics &m) { return m.choked? 1.0: 0.0; }},
+            {"ctorrent_peer_snubbed", "gauge", "Whether the peer is sitting on our requests",
+                [](const PeerMetrics &m) { return m.snubbed? 1.0: 0.0; }},
+        };
+
+        for (const auto &[name, type, help, value]: torrentMetrics) {
+            header(out, name, type, help);
+            for (std::size_t idx {}; idx < torrents.size(); ++idx)
+                out += std::format("{}{{{}}} {}\n", name, torrentLabels[idx], value(torrents[idx]));
+        }
+
+        for (const auto &[name, type, help, value]: peerMetrics) {
+            header(out, name, type, help);
+            for (std::size_t idx {}; idx < torrents.size(); ++idx)
+                for (const PeerMetrics &peer: torrents[idx].peers)
+                    out += std::format("{}{{{},peer=\"{}\"}} {}\n", name, torrentLabels[idx], escapeLabel(peer.id), value(peer));
+        }
+
+        return out;
+    }
+
+    MetricsFile::MetricsFile(const std::filesystem::path &path, const std::chrono::seconds interval):
+        path {path}, tmpPath {path.string() + ".tmp"}, interval {interval}
+    {}
+
+    void MetricsFile::write(const std::string &contents, const std::chrono::steady_clock::time_point now) {
+        nextWrite = now + interval;
+        {
+            std::ofstream ofs {tmpPath, std::ios::binary | std::ios::trunc};
+            if (!(ofs << contents && ofs.flush())) throw std::runtime_error("Failed to write " + tmpPath.string());
+        }
+        std::error_code ec;
+        std::filesystem::rename(tmpPath, path, ec);
+        if (ec) throw std::runtime_error("Failed to replace " + path.string() + ": " + ec.message());
+    }
+}
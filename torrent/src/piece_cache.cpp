@@ -0,0 +1,51 @@
+#include "../include/piece_cache.hpp"
+
+#include <algorithm>
+
+namespace Torrent {
+    PieceCache::PieceCache(const std::size_t capacity): capacity {capacity} {}
+
+    void PieceCache::evictOne() {
+        auto &[key, piece] {lru.back()};
+        cachedBytes -= piece->size();
+        index.erase(key); lru.pop_back();
+    }
+
+    bool PieceCache::makeRoom(const std::size_t bytes) {
+        while (!lru.empty() && partialBytes + cachedBytes + bytes > capacity) evictOne();
+        return partialBytes + bytes <= capacity;
+    }
+
+    SharedPiece PieceCache::lookup(const void *owner, const std::uint32_t pieceIdx) {
+        auto it {index.find({owner, pieceIdx})};
+        if (it == index.end()) { ++misses; return nullptr; }
+        ++hits; lru.splice(lru.begin(), lru, it->second);
+        return it->second->second;
+    }
+
+    void PieceCache::insert(const void *owner, const std::uint32_t pieceIdx, SharedPiece piece) {
+        if (!piece || index.contains({owner, pieceIdx})) return;
+        while (!lru.empty() && partialBytes + cachedBytes + piece->size() > capacity) evictOne();
+        if (partialBytes + cachedBytes + piece->size() > capacity) return;
+
+        cachedBytes += piece->size();
+        lru.emplace_front(Key{owner, pieceIdx}, std::move(piece));
+        index.emplace(lru.front().first, lru.begin());
+    }
+
+    void PieceCache::drop(const void *owner) {
+        for (auto it {lru.begin()}; it != lru.end();) {
+            if (it->first.owner != owner) { ++it; continue; }
+            cachedBytes -= it->second->size();
+            index.erase(it->first); it = lru.erase(it);
+        }
+    }
+
+    PieceCache::Stats PieceCache::stats() const {
+        return {.hits=hits, .misses=misses, .partialBytes=partialBytes, .cachedBytes=cachedBytes, .capacity=capacity};
+    }
+
+    double PieceCache::hitRate() const {
+        return hits + misses? static_cast<double>(hits) / static_cast<double>(hits + misses): 0;
+    }
+}
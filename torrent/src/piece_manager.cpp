@@ -1,50 +1,93 @@
 #include "../include/piece_manager.hpp"
 
-#include "../../cryptography/hashlib.hpp"
 #include "../../misc/logger.hpp"
 
 #include <algorithm>
 #include <cstring>
+#include <limits>
+#include <random>
 #include <stdexcept>
 
 namespace Torrent {
     bool PieceManager::Piece::finished() const { return completedBlocks == actualNumBlocks; }
 
-    void PieceManager::Piece::writeBlock(std::uint32_t blockOffset, std::string &&piecePayload) {
+    bool PieceManager::Piece::writeBlock(std::uint32_t blockOffset, std::string_view block) {
         if (blockOffset >= actualPieceSize) throw std::runtime_error("Writing out of bounds");
-        auto writeSize {std::min(static_cast<std::uint32_t>(outer.blockSize), actualPieceSize - blockOffset)};
-        std::memcpy(buffer.data() + blockOffset, piecePayload.c_str() + 8, writeSize);
-        states[blockOffset / outer.blockSize] = State::DONE;
-        --requestedBlocks; ++completedBlocks;
+        const std::uint32_t blockIdx {blockOffset / outer.blockSize};
+        if (states[blockIdx] == State::DONE) return false;
+        if (states[blockIdx] == State::REQUESTED) --requestedBlocks;
+        auto writeSize {std::min<std::size_t>({outer.blockSize, actualPieceSize - blockOffset, block.size()})};
+        std::memcpy(buffer->data() + blockOffset, block.data(), writeSize);
+        states[blockIdx] = State::DONE; requesters[blockIdx] = 0;
+        ++completedBlocks;
+        return true;
     }
 
     std::uint32_t PieceManager::Piece::requestBlockNum(std::uint16_t blockIdx) {
         if (states[blockIdx] != State::PENDING) throw std::runtime_error{"Block requested twice"};
         states[blockIdx] = Piece::State::REQUESTED; ++requestedBlocks;
+        requesters[blockIdx] = 1;
         return blockIdx < actualNumBlocks - 1? outer.blockSize: lastBlockSize;
     }
 
     PieceManager::Piece::Piece(const PieceManager &outer, const std::uint32_t pieceIdx): 
-        outer {outer}, buffer {std::string(outer.pieceSize, '\0')},
+        outer {outer}, buffer {outer.bufferPool.acquire()},
         actualPieceSize {pieceIdx < outer.numPieces - 1 || outer.totalSize % outer.pieceSize == 0? 
             outer.pieceSize: static_cast<uint32_t>(outer.totalSize % outer.pieceSize)},
         lastBlockSize {actualPieceSize % outer.blockSize == 0? outer.blockSize: 
             static_cast<std::uint16_t>(actualPieceSize % outer.blockSize)},
         actualNumBlocks {static_cast<uint16_t>((actualPieceSize + outer.blockSize - 1) / outer.blockSize)},
-        states {std::vector<State>(actualNumBlocks, State::PENDING)}
-    {}
+        states {std::vector<State>(actualNumBlocks, State::PENDING)},
+        requesters {std::vector<std::uint8_t>(actualNumBlocks, 0)}
+    {
+        outer.cache.acquirePartial(outer.pieceSize);
+    }
+
+    PieceManager::Piece::~Piece() { outer.cache.releasePartial(outer.pieceSize); }
+
+    bool PieceManager::finished() const { return !remaining(); }
 
-    bool PieceManager::finished() const { return haves.size() == numPieces; }
+    bool PieceManager::inEndgame() const {
+        // Pieces of files skipped after they were started don't hold off the endgame
+        if (finished()) return false;
+        std::size_t wantedPartials {};
+        for (const auto &[pieceIdx, piece]: partialPieces) {
+            if (!wanted.test(pieceIdx)) continue;
+            if (piece.requestedBlocks + piece.completedBlocks != piece.actualNumBlocks) return false;
+            ++wantedPartials;
+        }
+        return wantedPartials == remaining();
+    }
 
     PieceManager::PieceManager(
             const std::uint64_t totalSize, const std::uint32_t pieceSize, 
-            const std::uint16_t blockSize, const std::string &pieceBlob
+            const std::uint16_t blockSize, const std::string &pieceBlob, PieceCache &cache
     ):
         totalSize {totalSize}, pieceSize {pieceSize}, blockSize {blockSize},
-        numPieces {static_cast<std::uint32_t>(totalSize + pieceSize - 1) / pieceSize},
+        numPieces {static_cast<std::uint32_t>((totalSize + pieceSize - 1) / pieceSize)},
         numBlocks {static_cast<std::uint16_t>((pieceSize + blockSize - 1) / blockSize)},
-        pieceBlob {pieceBlob}
-    {}
+        pieceBlob {pieceBlob}, bufferPool {pieceSize}, cache {cache}, haves {numPieces}, availability(numPieces, 0),
+        wanted {numPieces}, priorities(numPieces, FilePriority::Normal)
+    {
+        wanted.setAll();
+    }
+
+    void PieceManager::setFilePriorities(const std::vector<FileStruct> &files, const std::vector<FilePriority> &filePriorities) {
+        std::ranges::fill(priorities, FilePriority::Skip);
+        std::uint64_t offset {};
+        for (std::size_t fileIdx {}; fileIdx < files.size(); ++fileIdx) {
+            const std::uint64_t size {files[fileIdx].size};
+            const FilePriority priority {fileIdx < filePriorities.size()? filePriorities[fileIdx]: FilePriority::Normal};
+            for (std::uint64_t pieceIdx {offset / pieceSize}; size && pieceIdx <= (offset + size - 1) / pieceSize; ++pieceIdx)
+                priorities[pieceIdx] = std::max(priorities[pieceIdx], priority);
+            offset += size;
+        }
+
+        wanted.clear();
+        for (std::uint32_t pieceIdx {}; pieceIdx < numPieces; ++pieceIdx)
+            if (priorities[pieceIdx] != FilePriority::Skip) wanted.set(pieceIdx);
+        Logging::Dynamic::Debug("File priorities set, {}/{} pieces wanted", wanted.count(), numPieces);
+    }
 
     std::string_view PieceManager::getPieceHash(std::size_t idx) const {
         if (idx >= numPieces) throw std::runtime_error("Piece Hash idx requested out of range");
@@ -52,9 +95,15 @@ namespace Torrent {
     }
 
     void PieceManager::clearInTransitBlock(std::uint32_t pieceIdx, std::uint32_t blockOffset) {
+        auto pieceIt {partialPieces.find(pieceIdx)};
+        if (pieceIt == partialPieces.end()) return;
+
+        // Block might still be in flight with other peers (endgame) or already received
+        Piece &piece {pieceIt->second}; std::uint32_t blockIdx {blockOffset / blockSize};
+        if (piece.states[blockIdx] != Piece::State::REQUESTED || --piece.requesters[blockIdx] > 0) return;
+
         Logging::Dynamic::Trace("Piece #{}, Block #{} is now marked pending", pieceIdx, blockOffset);
-        Piece &piece {partialPieces.at(pieceIdx)};
-        piece.states[blockOffset / blockSize] = Piece::State::PENDING;
+        piece.states[blockIdx] = Piece::State::PENDING;
         --piece.requestedBlocks;
         if (!piece.requestedBlocks && !piece.completedBlocks)
             partialPieces.erase(pieceIdx);
@@ -66,64 +115,181 @@ namespace Torrent {
         }
     }
 
-    std::pair<bool, std::string> PieceManager::onBlockReceived(const std::uint32_t pieceIdx, 
-        const std::uint32_t blockOffset, std::string piecePayload) 
+    void PieceManager::onPeerHave(const std::uint32_t pieceIdx) {
+        if (pieceIdx < numPieces) ++availability[pieceIdx];
+    }
+
+    void PieceManager::onPeerBitfield(const DynamicBitset &peerHaves) {
+        peerHaves.forEach([this](std::size_t pieceIdx) { ++availability[pieceIdx]; });
+    }
+
+    void PieceManager::onPeerDisconnect(const DynamicBitset &peerHaves) {
+        peerHaves.forEach([this](std::size_t pieceIdx) { 
+            if (availability[pieceIdx]) --availability[pieceIdx]; 
+        });
+    }
+
+    SharedPiece PieceManager::onBlockReceived(const std::uint32_t pieceIdx, 
+        const std::uint32_t blockOffset, std::string_view block) 
     {
-        auto &partialPiece {partialPieces.at(pieceIdx)};
-        partialPiece.writeBlock(blockOffset, std::move(piecePayload));
-
-        bool pieceCompleted {false}; std::string retBuffer;
-        if (partialPiece.completedBlocks == partialPiece.actualNumBlocks) {
-            retBuffer = std::string {partialPiece.buffer.c_str(), partialPiece.actualPieceSize};
-            if (hashutil::sha1(retBuffer, true) != getPieceHash(pieceIdx)) {
-                Logging::Dynamic::Debug("Hash for piece# {} is INVALID, will be rerequested; "
-                    "pending {} pieces", pieceIdx, numPieces - haves.size());
-                retBuffer.clear();
-            } else {
-                double remaining_MB {static_cast<double>(numPieces - haves.size()) * pieceSize / (1024 * 1024)};
-                Logging::Dynamic::Debug("Piece# {:5d} downloaded, saving to disk; pending {:.2f} MB", pieceIdx, remaining_MB);
-                pieceCompleted = true; haves.insert(pieceIdx);
-            }
-            partialPieces.erase(pieceIdx);
+        auto partialIt {partialPieces.find(pieceIdx)};
+        if (partialIt == partialPieces.end()) return nullptr;
+
+        // Duplicate copies of a block arriving during endgame are discarded
+        auto &partialPiece {partialIt->second};
+        if (!partialPiece.writeBlock(blockOffset, block)) {
+            Logging::Dynamic::Debug("Piece# {}, Block Offset {} already received, discarding", pieceIdx, blockOffset);
+            return nullptr;
         }
-        return {pieceCompleted, retBuffer};
+
+        // Hand over the assembled piece for hashing, states are kept so it is not requested again
+        if (!partialPiece.finished()) return nullptr;
+        partialPiece.verifying = true;
+        partialPiece.buffer->resize(partialPiece.actualPieceSize);
+        Logging::Dynamic::Trace("Piece# {} assembled, verifying", pieceIdx);
+        return std::move(partialPiece.buffer);
+    }
+
+    void PieceManager::onPieceVerified(const std::uint32_t pieceIdx, bool valid) {
+        auto partialIt {partialPieces.find(pieceIdx)};
+        if (partialIt == partialPieces.end() || !partialIt->second.verifying) return;
+        partialPieces.erase(partialIt);
+
+        if (!valid) {
+            Logging::Dynamic::Debug("Hash for piece# {} is INVALID, will be rerequested; "
+                "pending {} pieces", pieceIdx, remaining());
+        } else {
+            haves.set(pieceIdx);
+            double remaining_MB {static_cast<double>(remaining()) * pieceSize / (1024 * 1024)};
+            Logging::Dynamic::Debug("Piece# {:5d} downloaded, saving to disk; pending {:.2f} MB", pieceIdx, remaining_MB);
+        }
+    }
+
+    void PieceManager::setPriorityWindow(const std::uint32_t first, const std::uint32_t count) {
+        windowStart = std::min(first, numPieces); windowSize = count;
     }
 
     std::vector<std::tuple<std::uint32_t, std::uint32_t, std::uint32_t>>
-    PieceManager::getPendingBlocks(const std::unordered_set<std::uint32_t> &peerHaves, std::uint8_t count) {
+    PieceManager::getPendingBlocks(const DynamicBitset &peerHaves, std::uint16_t count, 
+        std::span<const std::uint32_t> preferred) 
+    {
         std::vector<std::tuple<std::uint32_t, std::uint32_t, std::uint32_t>> result;
 
-        // Priority is to clear the partial pieces so we don't have too much in memory
-        for (auto partialIt {partialPieces.begin()}; partialIt != partialPieces.end() && result.size() < count; ++partialIt) {
-            auto &[pieceIdx, piece] {*partialIt};
-            if (peerHaves.contains(pieceIdx)) {
-                Logging::Dynamic::Trace("Partially processed piece #{} is being prioritized", pieceIdx);
-                std::uint16_t blockIdx {};
-                while (blockIdx < piece.actualNumBlocks && result.size() < count) {
-                    if (piece.states[blockIdx] == Piece::State::PENDING) {
-                        auto actualBlockSize {piece.requestBlockNum(blockIdx)};
-                        result.emplace_back(pieceIdx, static_cast<std::uint32_t>(blockIdx) * blockSize, actualBlockSize);        
-                    }
-                    ++blockIdx;
-                }
+        // Request the blocks of a partial piece that aren't in flight yet
+        auto requestPending {[this, &result, count](std::uint32_t pieceIdx, Piece &piece) {
+            for (std::uint16_t blockIdx {}; blockIdx < piece.actualNumBlocks && result.size() < count; ++blockIdx)
+                if (piece.states[blockIdx] == Piece::State::PENDING)
+                    result.emplace_back(pieceIdx, static_cast<std::uint32_t>(blockIdx) * blockSize, piece.requestBlockNum(blockIdx));
+        }};
+
+        // Request blocks of a piece nobody has started yet. Over budget the partial pieces have to
+        // complete first, a single one is always allowed so that tiny budgets can't stall the download
+        bool budgetLeft {true};
+        auto startPiece {[this, &requestPending, &budgetLeft](std::uint32_t pieceIdx, bool force = false) {
+            if (!cache.makeRoom(pieceSize) && !partialPieces.empty() && !force) {
+                Logging::Dynamic::Trace("Memory budget used up by {} partial pieces, not starting new ones", partialPieces.size());
+                budgetLeft = false; return;
+            }
+            requestPending(pieceIdx, partialPieces.try_emplace(pieceIdx, *this, pieceIdx).first->second);
+        }};
+
+        // A stream reader is waiting on these, in order
+        const std::uint32_t windowEnd {std::min(numPieces, windowStart + windowSize)};
+        for (std::uint32_t pieceIdx {windowStart}; pieceIdx < windowEnd && result.size() < count; ++pieceIdx) {
+            if (!peerHaves.test(pieceIdx) || haves.test(pieceIdx) || !wanted.test(pieceIdx)) continue;
+            if (auto partialIt {partialPieces.find(pieceIdx)}; partialIt != partialPieces.end()) 
+                requestPending(pieceIdx, partialIt->second);
+            else {
+                Logging::Dynamic::Trace("Piece #{} ahead of the stream cursor is being requested", pieceIdx);
+                startPiece(pieceIdx, true);
             }
         }
 
-        // Pick the pieces that we haven't downloaded or requested yet
-        for (auto peerHavesIt {peerHaves.begin()}; peerHavesIt != peerHaves.end() && result.size() < count; ++peerHavesIt) {
-            const std::uint32_t pieceIdx {*peerHavesIt};
-            if (!haves.contains(pieceIdx) && !partialPieces.contains(pieceIdx)) {
-                Logging::Dynamic::Trace("New piece #{} is being requested", pieceIdx);
-                auto inserted {partialPieces.try_emplace(pieceIdx, *this, pieceIdx)};
-                Piece &piece {inserted.first->second}; std::uint16_t blockIdx {};
-                while (blockIdx < piece.actualNumBlocks && result.size() < count) {
-                    auto actualBlockSize {piece.requestBlockNum(blockIdx)};
-                    result.emplace_back(pieceIdx, static_cast<std::uint32_t>(blockIdx) * blockSize, actualBlockSize);
-                    ++blockIdx;
+        // Wanted pieces the peer has that we haven't downloaded or requested yet
+        std::vector<std::uint32_t> candidates;
+        if (result.size() < count) {
+            for (std::size_t pieceIdx {peerHaves.findNextAndNot(haves)}; pieceIdx != DynamicBitset::npos; 
+                    pieceIdx = peerHaves.findNextAndNot(haves, pieceIdx + 1))
+                if (wanted.test(pieceIdx) && !partialPieces.contains(static_cast<std::uint32_t>(pieceIdx)))
+                    candidates.push_back(static_cast<std::uint32_t>(pieceIdx));
+        }
+
+        // Shuffle so that pieces with equal availability are picked at random
+        static std::mt19937 rng {std::random_device{}()};
+        std::ranges::shuffle(candidates, rng);
+
+        // Pick the highest priority & then rarest pieces first (below `maxAvailability`), 
+        // peers usually fill up the backlog with a single piece
+        auto candidatesEnd {candidates.end()};
+        auto startRarest {[&](std::uint32_t maxAvailability) {
+            while (candidates.begin() != candidatesEnd && result.size() < count && budgetLeft) {
+                auto rarestIt {std::min_element(candidates.begin(), candidatesEnd, [this](std::uint32_t p1, std::uint32_t p2) {
+                    if (priorities[p1] != priorities[p2]) return priorities[p1] > priorities[p2];
+                    return availability[p1] < availability[p2];
+                })};
+                const std::uint32_t pieceIdx {*rarestIt};
+                if (availability[pieceIdx] >= maxAvailability) return;
+                std::iter_swap(rarestIt, --candidatesEnd);
+
+                Logging::Dynamic::Trace("New piece #{} (availability={}) is being requested", pieceIdx, availability[pieceIdx]);
+                startPiece(pieceIdx);
+            }
+        }};
+
+        // Continue the partial pieces the peer has, those held by at most `maxAvailability` peers only
+        auto continuePartial {[&](std::uint32_t maxAvailability) {
+            for (auto partialIt {partialPieces.begin()}; partialIt != partialPieces.end() && result.size() < count; ++partialIt) {
+                auto &[pieceIdx, piece] {*partialIt};
+                if (peerHaves.test(pieceIdx) && availability[pieceIdx] <= maxAvailability) {
+                    Logging::Dynamic::Trace("Partially processed piece #{} is being prioritized", pieceIdx);
+                    requestPending(pieceIdx, piece);
                 }
             }
+        }};
+
+        // Pieces hardly anyone else has go first, others can finish the common pieces while the
+        // peer with the rare ones may not stay for long
+        continuePartial(RARE_AVAILABILITY);
+        startRarest(RARE_AVAILABILITY + 1);
+
+        // Priority is then to clear the partial pieces so we don't have too much in memory
+        continuePartial(std::numeric_limits<std::uint32_t>::max());
+
+        // Pieces suggested by the peer are likely in its cache, start those before going rarest first
+        for (std::uint32_t pieceIdx: preferred) {
+            if (result.size() >= count || !budgetLeft) break;
+            if (peerHaves.test(pieceIdx) && wanted.test(pieceIdx) && !haves.test(pieceIdx) && !partialPieces.contains(pieceIdx)) {
+                Logging::Dynamic::Trace("Suggested piece #{} is being requested", pieceIdx);
+                startPiece(pieceIdx);
+                if (auto it {std::ranges::find(candidates.begin(), candidatesEnd, pieceIdx)}; it != candidatesEnd)
+                    std::iter_swap(it, --candidatesEnd);
+            }
         }
 
+        startRarest(std::numeric_limits<std::uint32_t>::max());
+        return result;
+    }
+
+    std::vector<std::tuple<std::uint32_t, std::uint32_t, std::uint32_t>>
+    PieceManager::getEndgameBlocks(const DynamicBitset &peerHaves, 
+        const std::unordered_set<PieceBlock, HashPieceBlock> &peerPending, std::uint16_t count) 
+    {
+        std::vector<std::tuple<std::uint32_t, std::uint32_t, std::uint32_t>> result;
+        for (auto partialIt {partialPieces.begin()}; partialIt != partialPieces.end() && result.size() < count; ++partialIt) {
+            auto &[pieceIdx, piece] {*partialIt};
+            if (!peerHaves.test(pieceIdx)) continue;
+            for (std::uint16_t blockIdx {}; blockIdx < piece.actualNumBlocks && result.size() < count; ++blockIdx) {
+                const std::uint32_t blockOffset {static_cast<std::uint32_t>(blockIdx) * blockSize};
+                if (piece.states[blockIdx] == Piece::State::REQUESTED
+                    && piece.requesters[blockIdx] < MAX_ENDGAME_REQUESTERS
+                    && !peerPending.contains({pieceIdx, blockOffset, 0})) 
+                {
+                    Logging::Dynamic::Trace("Endgame: Piece #{}, Block #{} requested in duplicate", pieceIdx, blockOffset);
+                    ++piece.requesters[blockIdx];
+                    result.emplace_back(pieceIdx, blockOffset, blockIdx < piece.actualNumBlocks - 1? blockSize: piece.lastBlockSize);
+                }
+            }
+        }
         return result;
     }
 }
@@ -0,0 +1,165 @@
+#include "../include/progress_journal.hpp"
+
+#include "../../misc/logger.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <stdexcept>
+#include <unistd.h>
+
+namespace {
+    std::runtime_error systemError(const std::string &message) {
+        return std::runtime_error{message + ": " + std::strerror(errno)};
+    }
+
+    std::string readFile(const std::filesystem::path &path) {
+        std::ifstream ifs {path, std::ios::binary};
+        return {std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>()};
+    }
+
+    // Piece index of the journal entry at `pos`
+    std::uint32_t readEntry(std::string_view journal, std::size_t pos) {
+        std::uint32_t pieceIdx {};
+        for (std::size_t i {}; i < 4; ++i) pieceIdx = pieceIdx << 8 | static_cast<std::uint8_t>(journal[pos + i]);
+        return pieceIdx;
+    }
+
+    void writeAll(int fd, std::string_view data, const std::filesystem::path &path) {
+        while (!data.empty()) {
+            ssize_t written {::write(fd, data.data(), data.size())};
+            if (written == -1 && errno == EINTR) continue;
+            if (written <= 0) throw systemError("Failed to write " + path.string());
+            data.remove_prefix(static_cast<std::size_t>(written));
+        }
+    }
+}
+
+namespace Torrent {
+    ProgressJournal::ProgressJournal(const std::filesystem::path &snapshotPath, const std::size_t numPieces):
+        snapshotPath {snapshotPath}, journalPath {snapshotPath.string() + ".journal"}, numPieces {numPieces},
+        savedState {std::filesystem::exists(snapshotPath) || std::filesystem::exists(journalPath)},
+        onDisk {numPieces}, durable {numPieces}, lastSync {Clock::now()}, lastCompact {lastSync}
+    {}
+
+    ProgressJournal::~ProgressJournal() { if (fd != -1) ::close(fd); }
+
+    void ProgressJournal::open() {
+        if (fd != -1) return;
+        fd = ::open(journalPath.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd == -1) throw systemError("Failed to open " + journalPath.string());
+    }
+
+    void ProgressJournal::writeSnapshot() {
+        // Written aside & renamed over so that a crash leaves either the old or the new snapshot
+        const std::filesystem::path tmpPath {snapshotPath.string() + ".tmp"};
+        int tmpFd {::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)};
+        if (tmpFd == -1) throw systemError("Failed to open " + tmpPath.string());
+        try {
+            writeAll(tmpFd, durable.toWire(), tmpPath);
+            if (::fdatasync(tmpFd) == -1) throw systemError("Failed to sync " + tmpPath.string());
+        } catch (...) { ::close(tmpFd); throw; }
+        ::close(tmpFd);
+        std::filesystem::rename(tmpPath, snapshotPath);
+
+        // Rename must be durable before the journal entries it covers are dropped
+        if (int dirFd {::open(snapshotPath.parent_path().c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)}; dirFd != -1) {
+            ::fsync(dirFd); ::close(dirFd);
+        }
+        if (fd != -1 && ::ftruncate(fd, 0) == -1) throw systemError("Failed to truncate " + journalPath.string());
+        entries = 0; lastCompact = Clock::now();
+    }
+
+    std::optional<DynamicBitset> ProgressJournal::load() {
+        std::scoped_lock lock {mutex};
+        DynamicBitset pieces {numPieces};
+        if (std::filesystem::exists(snapshotPath)) {
+            if (!std::filesystem::is_regular_file(snapshotPath))
+                throw std::runtime_error("Download state save path is invalid");
+
+            // Older saves dropped trailing zero bytes, pad them back to the full bitfield
+            std::string bitFieldString {readFile(snapshotPath)};
+            if (bitFieldString.size() < (numPieces + 7) / 8)
+                bitFieldString.resize((numPieces + 7) / 8, '\0');
+            auto snapshot {DynamicBitset::fromWire(bitFieldString, numPieces)};
+            if (!snapshot) return std::nullopt;
+            pieces = std::move(*snapshot);
+        }
+
+        if (std::filesystem::exists(journalPath)) {
+            const std::string journal {readFile(journalPath)};
+            const std::size_t complete {journal.size() / 4 * 4};
+            for (std::size_t pos {}; pos < complete; pos += 4)
+                if (std::uint32_t pieceIdx {readEntry(journal, pos)}; pieceIdx < numPieces) pieces.set(pieceIdx);
+
+            // Appends must stay aligned, cut off the piece index that was being written when we went down
+            if (complete != journal.size()) {
+                Logging::Dynamic::Warn("Progress journal ends in a partial entry, dropping it");
+                std::filesystem::resize_file(journalPath, complete);
+            }
+            entries = complete / 4;
+            Logging::Dynamic::Debug("Replayed {} progress journal entries", entries);
+        }
+
+        onDisk = durable = pieces;
+        return pieces;
+    }
+
+    void ProgressJournal::reset(const DynamicBitset &pieces) {
+        std::scoped_lock lock {flushMutex, mutex};
+        onDisk = durable = pieces; pending.clear();
+        writeSnapshot();
+        if (fd == -1) std::filesystem::remove(journalPath);
+    }
+
+    bool ProgressJournal::record(const std::uint32_t first, const std::uint32_t last) {
+        std::string buffer;
+        for (std::uint32_t pieceIdx {first}; pieceIdx <= last; ++pieceIdx) {
+            for (int shift {24}; shift >= 0; shift -= 8)
+                buffer += static_cast<char>((pieceIdx >> shift) & 0xFF);
+        }
+
+        std::scoped_lock lock {mutex};
+        for (std::uint32_t pieceIdx {first}; pieceIdx <= last; ++pieceIdx) onDisk.set(pieceIdx);
+        pending += buffer;
+        return pending.size() / 4 >= SYNC_BATCH || Clock::now() - lastSync >= SYNC_INTERVAL;
+    }
+
+    void ProgressJournal::flush(const std::function<void()> &syncData) {
+        std::scoped_lock flushLock {flushMutex};
+        std::string batch;
+        { std::scoped_lock lock {mutex}; batch.swap(pending); }
+
+        // Entries are only appended once their data is durable, put back to be retried if it isn't
+        try { if (!batch.empty()) syncData(); }
+        catch (...) { std::scoped_lock lock {mutex}; pending.insert(0, batch); throw; }
+
+        std::scoped_lock lock {mutex};
+        if (!batch.empty()) {
+            open(); writeAll(fd, batch, journalPath);
+            if (::fdatasync(fd) == -1) throw systemError("Failed to sync " + journalPath.string());
+            for (std::size_t pos {}; pos < batch.size(); pos += 4) durable.set(readEntry(batch, pos));
+            entries += batch.size() / 4;
+        }
+        lastSync = Clock::now();
+        if (entries >= COMPACT_ENTRIES || (entries && lastSync - lastCompact >= COMPACT_INTERVAL)) {
+            Logging::Dynamic::Debug("Compacting {} progress journal entries into the snapshot", entries);
+            writeSnapshot();
+        }
+    }
+
+    void ProgressJournal::compact(const std::function<void()> &syncData) {
+        flush(syncData);
+        std::scoped_lock lock {flushMutex, mutex};
+        if (!durable.none()) writeSnapshot();
+        else std::filesystem::remove(snapshotPath);
+        if (fd != -1) { ::close(fd); fd = -1; }
+        std::filesystem::remove(journalPath);
+    }
+
+    std::size_t ProgressJournal::count() {
+        std::scoped_lock lock {mutex};
+        return onDisk.count();
+    }
+}
@@ -2,7 +2,9 @@
 #include "../include/torrent_tracker.hpp"
 
 #include "../../networking/net.hpp"
+#include "../../cryptography/hashlib.hpp"
 
+#include <algorithm>
 #include <cstdint>
 #include <cstring>
 
@@ -14,6 +16,24 @@ namespace {
         std::memcpy(buffer.data() + 4,   &msgId, 1);
         return buffer;
     }
+
+    // Messages carrying only a piece index: Have, SuggestPiece, AllowedFast
+    std::string buildIndexMessage(Torrent::MsgType msgId, std::uint32_t pIndex) {
+        std::string buffer {buildMessageHelper(9, 5, msgId)};
+        pIndex = net::utils::bswap(pIndex);
+        std::memcpy(buffer.data() + 5, &pIndex, 4);
+        return buffer;
+    }
+
+    // Messages addressing a block: Request, Cancel, RejectRequest
+    std::string buildBlockMessage(Torrent::MsgType msgId, std::uint32_t pIndex, std::uint32_t pBegin, std::uint32_t pLength) {
+        std::string buffer {buildMessageHelper(17, 13, msgId)};
+        net::utils::inplace_bswap(pIndex, pBegin, pLength);
+        std::memcpy(buffer.data() +  5,  &pIndex, 4);
+        std::memcpy(buffer.data() +  9,  &pBegin, 4);
+        std::memcpy(buffer.data() + 13, &pLength, 4);
+        return buffer;
+    }
 }
 
 namespace Torrent {
@@ -32,7 +52,9 @@ namespace Torrent {
               transactionId {randInteger<std::uint32_t>()}; 
         std::string key {randString(4)}; 
         std::int32_t numWant {net::utils::bswap<std::int32_t>(-1)};
-        std::uint16_t pPort {net::utils::bswap<std::uint16_t>(6881)};
+        std::uint16_t pPort {net::utils::bswap(tracker.port)};
+        std::uint64_t downloaded {net::utils::bswap(tracker.downloaded)}, 
+            left {net::utils::bswap(tracker.left)}, uploaded {net::utils::bswap(tracker.uploaded)};
 
         // Construct the announce request
         char buffer[98] {}; // Init to 0 & skip few fields below
@@ -41,7 +63,9 @@ namespace Torrent {
         std::memcpy(buffer + 12, &transactionId, 4);
         std::memcpy(buffer + 16, tracker.torrentFile.infoHash.c_str(), 20);
         std::memcpy(buffer + 36, tracker.peerID.c_str(), 20);
-        std::memcpy(buffer + 64, &tracker.torrentFile.length, 8);
+        std::memcpy(buffer + 56, &downloaded, 8);
+        std::memcpy(buffer + 64, &left, 8);
+        std::memcpy(buffer + 72, &uploaded, 8);
         std::memcpy(buffer + 88, key.c_str(), 4);
         std::memcpy(buffer + 92, &numWant, 4);
         std::memcpy(buffer + 96, &pPort, 2);
@@ -53,6 +77,7 @@ namespace Torrent {
         std::uint8_t pstrlen {19}; const char *pStr {"BitTorrent protocol"};
         std::memcpy(buffer +  0, &pstrlen, 1);
         std::memcpy(buffer +  1, pStr, 19);
+        buffer[27] = 0x04; // Fast Extension
         std::memcpy(buffer + 28, infoHash.c_str(), 20);
         std::memcpy(buffer + 48, peerID.c_str(), 20);
         return {buffer, 68};
@@ -64,12 +89,12 @@ namespace Torrent {
     std::string       buildUnchoke() { return buildMessageHelper(5, 1, MsgType::Unchoke); }
     std::string         buildChoke() { return buildMessageHelper(5, 1, MsgType::Choke); }
 
-    std::string buildHave(std::uint32_t pIndex) {
-        std::string buffer {buildMessageHelper(9, 5, MsgType::Have)};
-        pIndex = net::utils::bswap(pIndex);
-        std::memcpy(buffer.data() + 5, &pIndex, 4);
-        return buffer;
-    }
+    std::string           buildHaveAll() { return buildMessageHelper(5, 1, MsgType::HaveAll); }
+    std::string          buildHaveNone() { return buildMessageHelper(5, 1, MsgType::HaveNone); }
+
+    std::string buildHave(std::uint32_t pIndex) { return buildIndexMessage(MsgType::Have, pIndex); }
+    std::string buildSuggestPiece(std::uint32_t pIndex) { return buildIndexMessage(MsgType::SuggestPiece, pIndex); }
+    std::string buildAllowedFast(std::uint32_t pIndex) { return buildIndexMessage(MsgType::AllowedFast, pIndex); }
 
     std::string buildBitField(const std::string &bitfield) {
         std::uint32_t msgSize {static_cast<std::uint32_t>(bitfield.size() + 1)};
@@ -79,16 +104,15 @@ namespace Torrent {
     }
 
     std::string buildRequest(std::uint32_t pIndex, std::uint32_t pBegin, std::uint32_t pLength, bool cancel) {
-        std::string buffer {buildMessageHelper(17, 13, !cancel? MsgType::Request: MsgType::Cancel)};
-        net::utils::inplace_bswap(pIndex, pBegin, pLength);
-        std::memcpy(buffer.data() +  5,  &pIndex, 4);
-        std::memcpy(buffer.data() +  9,  &pBegin, 4);
-        std::memcpy(buffer.data() + 13, &pLength, 4);
-        return buffer;
+        return buildBlockMessage(!cancel? MsgType::Request: MsgType::Cancel, pIndex, pBegin, pLength);
+    }
+
+    std::string buildReject(std::uint32_t pIndex, std::uint32_t pBegin, std::uint32_t pLength) {
+        return buildBlockMessage(MsgType::RejectRequest, pIndex, pBegin, pLength);
     }
 
     std::string buildPiece(
-        std::uint32_t pIndex, std::uint32_t pBegin, const std::string &block
+        std::uint32_t pIndex, std::uint32_t pBegin, std::string_view block
     ) {
         auto blockSize {static_cast<std::uint32_t>(block.size())};
         std::string buffer {buildMessageHelper(blockSize + 13, blockSize + 9, MsgType::Piece)};
@@ -106,6 +130,33 @@ namespace Torrent {
         return buffer;
     }
 
+    bool supportsFastExtension(std::string_view handshake) {
+        return handshake.size() >= 28 && (handshake[27] & 0x04);
+    }
+
+    std::vector<std::uint32_t> allowedFastSet(const std::string &ip, const std::string &infoHash, 
+        std::uint32_t numPieces, std::size_t count) 
+    {
+        // x = (ip & 0xFFFFFF00) + infohash, rehashed until enough distinct indices are drawn
+        std::vector<std::uint32_t> result;
+        in_addr addr;
+        if (!numPieces || inet_pton(AF_INET, ip.c_str(), &addr) != 1) return result;
+        std::string x(4, '\0');
+        std::memcpy(x.data(), &addr.s_addr, 4); x[3] = '\0';
+        x += infoHash;
+
+        count = std::min<std::size_t>(count, numPieces);
+        while (result.size() < count) {
+            x = hashutil::sha1(x, true);
+            for (std::size_t i {}; i < 5 && result.size() < count; ++i) {
+                std::uint32_t y; std::memcpy(&y, x.data() + i * 4, 4);
+                std::uint32_t index {net::utils::bswap(y) % numPieces};
+                if (!std::ranges::contains(result, index)) result.push_back(index);
+            }
+        }
+        return result;
+    }
+
     std::uint32_t IsCompleteMessage(std::string_view buffer) {
         if (buffer.size() < 4) return false;
         std::uint32_t msgLen;
@@ -114,11 +165,11 @@ namespace Torrent {
         return buffer.size() >= msgLen + 4? msgLen: 0;
     }
 
-    std::tuple<MsgType, std::string> parseMessage(std::string_view message) {
+    std::tuple<MsgType, std::string_view> parseMessage(std::string_view message) {
         if (message.size() < 4) return {MsgType::Unknown, ""};
         if (message.size() == 4 && message == "\0\0\0\0") return {MsgType::KeepAlive, ""};
         std::uint8_t msgId; std::memcpy(&msgId, message.data() + 4, 1);
-        if (msgId > 9) return {MsgType::Unknown, ""};
-        return {static_cast<MsgType>(msgId), std::string{message.substr(5)}};
+        if (msgId > 17 || (msgId > 9 && msgId < 13)) return {MsgType::Unknown, ""};
+        return {static_cast<MsgType>(msgId), message.substr(5)};
     }
 }
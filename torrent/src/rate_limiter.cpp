@@ -0,0 +1,43 @@
+#include "../include/rate_limiter.hpp"
+
+#include <algorithm>
+
+namespace Torrent {
+    double TokenBucket::capacity() const {
+        return std::max(static_cast<double>(bytesPerSec) * BURST_SECONDS, MIN_BURST);
+    }
+
+    void TokenBucket::setRate(const std::uint64_t rate) {
+        bytesPerSec = rate;
+        tokens = std::min(tokens, capacity());
+    }
+
+    void TokenBucket::refill(const TimePoint now) {
+        const double elapsed {std::chrono::duration<double>(now - lastRefill).count()};
+        lastRefill = now;
+        if (limited() && elapsed > 0)
+            tokens = std::min(tokens + elapsed * static_cast<double>(bytesPerSec), capacity());
+    }
+
+    void TokenBucket::consume(const std::size_t bytes) {
+        if (limited()) tokens = std::max(0., tokens - static_cast<double>(bytes));
+    }
+
+    void BandwidthChannel::tick(const TokenBucket::TimePoint now) {
+        bucket.refill(now);
+        expected = std::max<std::size_t>(asked, 1);
+        asked = 0;
+    }
+
+    std::size_t BandwidthChannel::grant(const std::size_t peerAvailable) {
+        ++asked;
+        const std::size_t available {bucket.available()};
+        if (available == TokenBucket::UNLIMITED) return peerAvailable;
+
+        // Peers that asked last tick are expected to ask again, split what is left between
+        // the ones yet to come. The last to ask (or any past the estimate) may take it all
+        const std::size_t remaining {expected > asked? expected - asked + 1: 1};
+        const std::size_t share {std::max(available / remaining, std::min(MIN_GRANT, available))};
+        return std::min(share, peerAvailable);
+    }
+}
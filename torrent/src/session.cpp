@@ -0,0 +1,260 @@
+#include "../include/session.hpp"
+
+#include "../../misc/logger.hpp"
+
+#include <algorithm>
+#include <csignal>
+#include <thread>
+#include <unistd.h>
+
+namespace Torrent {
+    Session::Session(const int timeout, const std::uint16_t port, const std::size_t maxConnections,
+        const std::size_t maxUnchoked, const std::size_t diskThreads, const std::size_t hashThreads,
+        const std::size_t memoryBudget, const DiskBackend diskBackend
+    ):
+        timeout {timeout}, _port {port}, diskPool {diskThreads, diskBackend}, hashPool {hashThreads}, pieceCache {memoryBudget},
+        limits {.maxConnections=maxConnections, .maxUnchoked=maxUnchoked}
+    {
+        // Listen for inbound peers (port 0 picks a free one, announced to the trackers), uploads still
+        // work over outbound connections if this fails
+        try {
+            net::Socket listener {net::SOCKTYPE::TCP, net::IP::V4};
+            listener.bind("0.0.0.0", port);
+            listener.listen(64); listener.setNonBlocking();
+            sockaddr_in addr {}; socklen_t addrLen {sizeof(addr)};
+            ::getsockname(listener.fd(), reinterpret_cast<sockaddr*>(&addr), &addrLen);
+            _port = net::utils::bswap(addr.sin_port);
+            listenerFd = pollManager.track(std::move(listener), net::PollEventType::Readable);
+        } catch (net::SocketError &err) {
+            Logging::Dynamic::Warn("Unable to listen on port {}: {}", port, err.what());
+        }
+
+        // Upload reads complete on the disk pool, the loop wakes up to serve them (the socket owns a dup)
+        int completionFd {::dup(diskPool.completionFd())};
+        if (completionFd == -1) throw std::runtime_error("Failed to register the disk completion fd");
+        diskFd = pollManager.track(net::Socket{completionFd, net::SOCKTYPE::TCP, net::IP::V4}, net::PollEventType::Readable);
+    }
+
+    Session::~Session() {
+        // Torrents still around were interrupted, finalize them so that states are saved
+        for (auto &[infoHash, entry]: torrents) {
+            try { entry.downloader->stop(); }
+            catch (std::exception &ex) { Logging::Dynamic::Error("[{}] {}", entry.file->name, ex.what()); }
+        }
+        logCacheStats();
+    }
+
+    void Session::logCacheStats() const {
+        auto [hits, misses, partialBytes, cachedBytes, capacity] {pieceCache.stats()};
+        auto toMB {[](std::size_t bytes) { return static_cast<double>(bytes) / (1 << 20); }};
+        Logging::Dynamic::Info("Memory budget: {:.1f} MB, partial pieces: {:.1f} MB, read cache: {:.1f} MB, "
+            "hit rate: {:.1f}% ({} hits, {} misses)", toMB(capacity), toMB(partialBytes), toMB(cachedBytes), 
+            pieceCache.hitRate() * 100, hits, misses);
+    }
+
+    void Session::remove(const std::string &infoHash) {
+        if (auto it {torrents.find(infoHash)}; it != torrents.end())
+            it->second.removed = true;
+    }
+
+    void Session::enableStreaming(const std::uint16_t streamPort) {
+        if (streamServer) return;
+        streamServer = std::make_unique<StreamServer>(streamPort);
+        for (auto &[infoHash, entry]: torrents)
+            if (!entry.started) streamServer->add(entry.downloader->enableStreaming());
+    }
+
+    void Session::enableDHT(const std::uint16_t dhtPort, const std::filesystem::path &cachePath) {
+        if (dht) return;
+        try { dht = std::make_unique<DHTNode>(dhtPort, cachePath); }
+        catch (net::SocketError &err) {
+            Logging::Dynamic::Warn("Unable to start the DHT node on port {}: {}", dhtPort, err.what());
+            return;
+        }
+        for (auto &[infoHash, entry]: torrents)
+            if (!entry.started) entry.downloader->setDHT(*dht);
+    }
+
+    void Session::enableMetrics(const std::filesystem::path &path, const std::chrono::seconds interval) {
+        metricsFile = std::make_unique<MetricsFile>(path, interval);
+        Logging::Dynamic::Info("Exporting metrics to {} every {}s", path.string(), interval.count());
+    }
+
+    void Session::exportMetrics(TimePoint now) {
+        std::vector<TorrentMetrics> snapshots;
+        for (auto &[infoHash, entry]: torrents) {
+            if (!entry.started || entry.removed) continue;
+            snapshots.push_back(entry.downloader->metrics(now));
+            snapshots.back().stepSeconds = entry.stepSeconds;
+        }
+
+        try { metricsFile->write(formatPrometheus(loopMetrics, snapshots), now); }
+        catch (std::exception &ex) { Logging::Dynamic::Warn("Metrics export failed: {}", ex.what()); }
+        loopMetrics.maxBusySeconds = 0;
+    }
+
+    void Session::setFilePriorities(const std::string &infoHash, std::vector<FilePriority> priorities) {
+        auto it {torrents.find(infoHash)};
+        if (it == torrents.end()) throw std::runtime_error("Unknown torrent, can't set file priorities");
+        it->second.downloader->setFilePriorities(std::move(priorities));
+    }
+
+    void Session::setRateLimits(const std::uint64_t download, const std::uint64_t upload) {
+        limits.download.setRate(download); limits.upload.setRate(upload);
+        Logging::Dynamic::Info("Session rate limits: {} KB/s down, {} KB/s up (0 = unlimited)", download / 1024, upload / 1024);
+    }
+
+    void Session::setPeerRateLimits(const std::uint64_t download, const std::uint64_t upload) {
+        limits.peerDownloadRate = download; limits.peerUploadRate = upload;
+        Logging::Dynamic::Info("Per peer rate limits: {} KB/s down, {} KB/s up (0 = unlimited)", download / 1024, upload / 1024);
+    }
+
+    TorrentDownloader *Session::findOwner(int fd) {
+        if (auto it {fdOwners.find(fd)}; it != fdOwners.end()) {
+            auto tIt {torrents.find(it->second)};
+            if (tIt != torrents.end() && tIt->second.downloader->hasPeer(fd))
+                return tIt->second.downloader.get();
+        }
+
+        // FDs get reused once closed, look through all torrents on a cache miss
+        for (auto &[infoHash, entry]: torrents) {
+            if (entry.downloader->hasPeer(fd)) {
+                fdOwners[fd] = infoHash;
+                return entry.downloader.get();
+            }
+        }
+
+        return nullptr;
+    }
+
+    void Session::acceptInbound(TimePoint lastTick) {
+        std::string ip; std::uint16_t peerPort;
+        try {
+            auto inbound {pollManager.getSocket(listenerFd).accept(ip, peerPort)};
+            if (limits.connections >= limits.maxConnections) {
+                Logging::Dynamic::Debug("[{}:{}] Connection limit reached, rejecting inbound peer", ip, peerPort);
+                return;
+            }
+
+            inbound.setNonBlocking();
+            int fd {pollManager.track(std::move(inbound), net::PollEventType::Readable)};
+            pendingInbound.emplace(fd, Inbound{.ip=ip, .port=peerPort, .recvBuffer={}, .acceptedAt=lastTick});
+            ++limits.connections;
+        } catch (net::SocketError &err) {
+            Logging::Dynamic::Debug("Failed to accept inbound connection: {}", err.what());
+        }
+    }
+
+    void Session::dropInbound(int fd) {
+        pollManager.untrack(fd);
+        pendingInbound.erase(fd);
+        --limits.connections;
+    }
+
+    void Session::onInboundEvent(net::Socket &peer, net::PollEventType event, TimePoint lastTick) {
+        int fd {peer.fd()};
+        Inbound &inbound {pendingInbound.at(fd)};
+        if (event & net::PollEventType::Readable) {
+            try { peer.recvAll(inbound.recvBuffer); }
+            catch (net::SocketError &err) {
+                Logging::Dynamic::Debug("[{}:{}] Recv from inbound peer failed: {}", inbound.ip, inbound.port, err.what());
+                dropInbound(fd); return;
+            }
+        }
+
+        if (event & net::PollEventType::Error || event & net::PollEventType::Closed || peer.fd() == -1) {
+            dropInbound(fd); return;
+        }
+
+        // Handshake carries the info hash at bytes [28, 48), hand over to the matching torrent
+        if (inbound.recvBuffer.size() < 68) return;
+        auto it {torrents.find(inbound.recvBuffer.substr(28, 20))};
+        if (it == torrents.end() || !it->second.started || it->second.removed) {
+            Logging::Dynamic::Debug("[{}:{}] Inbound peer requested an unknown torrent", inbound.ip, inbound.port);
+            dropInbound(fd); return;
+        }
+
+        Inbound adopted {std::move(inbound)};
+        pendingInbound.erase(fd);
+        fdOwners[fd] = it->first;
+        it->second.downloader->adoptInbound(fd, adopted.ip, adopted.port, std::move(adopted.recvBuffer), lastTick);
+    }
+
+    bool Session::poll(int timeoutMs) {
+        const auto iterationStart {std::chrono::steady_clock::now()};
+
+        // Start torrents added since the last iteration, tracker failures only affect that torrent
+        for (auto &[infoHash, entry]: torrents) {
+            if (entry.started || entry.removed) continue;
+            try {
+                entry.downloader->start(pollManager, limits, timeout);
+                entry.started = true;
+            } catch (std::exception &ex) {
+                Logging::Dynamic::Error("[{}] Failed to start: {}", entry.file->name, ex.what());
+                entry.removed = true;
+            }
+        }
+
+        auto lastTick {std::chrono::steady_clock::now()};
+        limits.download.tick(lastTick); limits.upload.tick(lastTick);
+        auto &events {pollManager.poll(timeoutMs)};
+        const auto polledAt {std::chrono::steady_clock::now()};
+        for (auto &[peer, event]: events) {
+            if (peer.fd() == listenerFd) acceptInbound(lastTick);
+            else if (peer.fd() == diskFd) diskPool.clearCompletions();
+            else if (pendingInbound.contains(peer.fd())) onInboundEvent(peer, event, lastTick);
+            else if (TorrentDownloader *owner {findOwner(peer.fd())}) owner->onEvent(peer, event, lastTick);
+        }
+
+        // Inbound peers that never complete a handshake are dropped
+        std::erase_if(pendingInbound, [this, lastTick](const auto &kv) {
+            if (lastTick - kv.second.acceptedAt < std::chrono::seconds{timeout}) return false;
+            pollManager.untrack(kv.first); --limits.connections;
+            return true;
+        });
+
+        // Housekeeping for every torrent, finalize the ones that are done or removed
+        using Seconds = std::chrono::duration<double>;
+        for (auto it {torrents.begin()}; it != torrents.end();) {
+            auto &entry {it->second};
+            const auto stepStart {metricsFile? std::chrono::steady_clock::now(): TimePoint{}};
+            const bool running {!entry.removed && (!entry.started || entry.downloader->step(lastTick))};
+            if (metricsFile && entry.started) {
+                const double sample {Seconds{std::chrono::steady_clock::now() - stepStart}.count()};
+                entry.stepSeconds = METRICS_SMOOTHING * sample + (1 - METRICS_SMOOTHING) * entry.stepSeconds;
+            }
+
+            if (!running) {
+                entry.downloader->stop();
+                std::erase_if(fdOwners, [&it](const auto &kv) { return kv.second == it->first; });
+                it = torrents.erase(it);
+            } else ++it;
+        }
+
+        // Time spent waiting in poll doesn't count towards the loop's busy time
+        if (metricsFile) {
+            const auto now {std::chrono::steady_clock::now()};
+            const double busy {Seconds{(lastTick - iterationStart) + (now - polledAt)}.count()};
+            ++loopMetrics.iterations;
+            loopMetrics.busySeconds = METRICS_SMOOTHING * busy + (1 - METRICS_SMOOTHING) * loopMetrics.busySeconds;
+            loopMetrics.maxBusySeconds = std::max(loopMetrics.maxBusySeconds, busy);
+            if (metricsFile->due(now)) exportMetrics(now);
+        }
+
+        return !torrents.empty();
+    }
+
+    void Session::run() {
+        static bool interrupted {false};
+        std::signal(SIGINT, [](int) { interrupted = true; });
+        Logging::Dynamic::Info("Session started with {} torrents", torrents.size());
+        while (!interrupted && poll(5));
+
+        // Finished downloads can still be streamed, stay up until the user is done
+        if (streamServer && !interrupted) {
+            Logging::Dynamic::Info("All torrents are done, streaming until interrupted (Ctrl+C)");
+            while (!interrupted) std::this_thread::sleep_for(std::chrono::milliseconds{100});
+        }
+        if (interrupted) Logging::Dynamic::Warn("Interupt received, states will be saved before exit");
+    }
+}
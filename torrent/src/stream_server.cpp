@@ -0,0 +1,275 @@
+#include "../include/stream_server.hpp"
+
+#include "../../misc/logger.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <fcntl.h>
+#include <poll.h>
+#include <sstream>
+#include <unistd.h>
+
+namespace {
+    // Single byte range of a file: "bytes=first-last", "bytes=first-" or "bytes=-suffix" (RFC 9110).
+    // Returns inclusive [first, last] clamped to the file, nullopt if unsatisfiable or unsupported
+    std::optional<std::pair<std::uint64_t, std::uint64_t>> parseRange(std::string_view header, std::uint64_t size) {
+        if (!header.starts_with("bytes=") || header.find(',') != std::string_view::npos) return std::nullopt;
+        header.remove_prefix(6);
+        const std::size_t dash {header.find('-')};
+        if (dash == std::string_view::npos) return std::nullopt;
+
+        auto toNumber {[](std::string_view str) -> std::optional<std::uint64_t> {
+            std::uint64_t value {};
+            auto [ptr, ec] {std::from_chars(str.data(), str.data() + str.size(), value)};
+            if (str.empty() || ec != std::errc{} || ptr != str.data() + str.size()) return std::nullopt;
+            return value;
+        }};
+
+        std::string_view firstStr {header.substr(0, dash)}, lastStr {header.substr(dash + 1)};
+        if (firstStr.empty()) {
+            auto suffix {toNumber(lastStr)};
+            if (!suffix || !*suffix || !size) return std::nullopt;
+            return std::pair{size - std::min(*suffix, size), size - 1};
+        }
+
+        auto first {toNumber(firstStr)};
+        auto last {lastStr.empty()? std::optional{size - 1}: toNumber(lastStr)};
+        if (!first || !last || *first >= size || *last < *first) return std::nullopt;
+        return std::pair{*first, std::min(*last, size - 1)};
+    }
+
+    std::string statusLine(int status) {
+        switch (status) {
+            case 200: return "HTTP/1.1 200 OK\r\n";
+            case 206: return "HTTP/1.1 206 Partial Content\r\n";
+            case 404: return "HTTP/1.1 404 Not Found\r\n";
+            case 405: return "HTTP/1.1 405 Method Not Allowed\r\n";
+            case 416: return "HTTP/1.1 416 Range Not Satisfiable\r\n";
+            default: return "HTTP/1.1 400 Bad Request\r\n";
+        }
+    }
+}
+
+namespace Torrent {
+    StreamSource::StreamSource(const std::string &name, const std::uint32_t pieceSize, const std::uint64_t totalSize,
+        const std::vector<FileStruct> &files, const std::filesystem::path &dir, const DynamicBitset &haves
+    ):
+        _name {name}, pieceSize {pieceSize}, totalSize {totalSize}, onDisk {haves}
+    {
+        std::uint64_t offset {};
+        for (const auto &[path, size]: files) {
+            int fd {size? ::open((dir / path).c_str(), O_RDONLY | O_CLOEXEC): -1};
+            if (size && fd == -1) {
+                for (const File &file: _files) if (file.fd != -1) ::close(file.fd);
+                throw std::runtime_error("Failed to open " + (dir / path).string() + " for streaming");
+            }
+            _files.emplace_back(path, offset, size, fd);
+            offset += size;
+        }
+    }
+
+    StreamSource::~StreamSource() {
+        for (const File &file: _files)
+            if (file.fd != -1) ::close(file.fd);
+    }
+
+    void StreamSource::markWritten(const std::uint64_t offset, const std::uint64_t length) {
+        if (!length) return;
+        {
+            std::scoped_lock lock {mutex};
+            for (std::uint64_t pieceIdx {offset / pieceSize}; pieceIdx <= (offset + length - 1) / pieceSize; ++pieceIdx)
+                onDisk.set(pieceIdx);
+        }
+        written.notify_all();
+    }
+
+    void StreamSource::close() {
+        { std::scoped_lock lock {mutex}; closed = true; }
+        written.notify_all();
+    }
+
+    std::optional<std::uint64_t> StreamSource::cursor() const {
+        std::scoped_lock lock {mutex};
+        return readCursor;
+    }
+
+    bool StreamSource::waitFor(const std::uint64_t offset, const std::uint64_t length, const std::atomic<bool> &stop) {
+        if (!length) return true;
+        if (offset + length > totalSize) throw std::runtime_error("Stream read out of bounds");
+        const std::uint64_t first {offset / pieceSize}, last {(offset + length - 1) / pieceSize};
+        auto ready {[this, first, last] {
+            for (std::uint64_t pieceIdx {first}; pieceIdx <= last; ++pieceIdx)
+                if (!onDisk.test(pieceIdx)) return false;
+            return true;
+        }};
+
+        // Stop is polled since it is raised without touching our condition variable
+        std::unique_lock lock {mutex};
+        readCursor = offset;
+        while (!ready()) {
+            if (closed || stop) return false;
+            written.wait_for(lock, std::chrono::milliseconds{200});
+        }
+        return true;
+    }
+
+    void StreamSource::read(std::uint64_t offset, char *buffer, std::uint64_t length) const {
+        // First file whose range ends past the offset
+        auto it {std::ranges::upper_bound(_files, offset, {}, [](const File &file) { return file.offset + file.size; })};
+        for (; length && it != _files.end(); ++it) {
+            const std::uint64_t fileOffset {offset - it->offset}, chunk {std::min(length, it->size - fileOffset)};
+            for (std::uint64_t done {}; done < chunk;) {
+                ssize_t bytesRead {::pread(it->fd, buffer + done, chunk - done, static_cast<off_t>(fileOffset + done))};
+                if (bytesRead < 0 && errno == EINTR) continue;
+                if (bytesRead <= 0) throw std::runtime_error("Failed to read " + it->path.string());
+                done += static_cast<std::uint64_t>(bytesRead);
+            }
+            buffer += chunk; offset += chunk; length -= chunk;
+        }
+    }
+
+    StreamServer::StreamServer(const std::uint16_t port): listener {net::SOCKTYPE::TCP, net::IP::V4} {
+        listener.bind("127.0.0.1", port); listener.listen(static_cast<unsigned short>(MAX_CLIENTS));
+        sockaddr_in addr {}; socklen_t addrLen {sizeof(addr)};
+        ::getsockname(listener.fd(), reinterpret_cast<sockaddr*>(&addr), &addrLen);
+        _port = net::utils::bswap(addr.sin_port);
+        acceptor = std::thread{&StreamServer::acceptLoop, this};
+        Logging::Dynamic::Info("Streaming server listening on http://127.0.0.1:{}/", _port);
+    }
+
+    StreamServer::~StreamServer() {
+        stop = true; acceptor.join();
+        std::unique_lock lock {mutex};
+        for (auto &[name, source]: sources) source->close();
+        clientsDone.wait(lock, [this] { return !clients; });
+    }
+
+    void StreamServer::add(std::shared_ptr<StreamSource> source) {
+        std::scoped_lock lock {mutex};
+        Logging::Dynamic::Info("[{}] Streaming at http://127.0.0.1:{}/{}/", source->name(), _port,
+            net::URL::encode(source->name(), false));
+        sources[source->name()] = std::move(source);
+    }
+
+    void StreamServer::acceptLoop() {
+        while (!stop) {
+            pollfd pfd {.fd=listener.fd(), .events=POLLIN, .revents=0};
+            if (::poll(&pfd, 1, 100) <= 0) continue;
+            try {
+                net::Socket client {listener.accept()};
+                std::scoped_lock lock {mutex};
+                if (clients >= MAX_CLIENTS) {
+                    Logging::Dynamic::Warn("Stream client limit ({}) reached, dropping connection", MAX_CLIENTS);
+                    continue;
+                }
+                ++clients;
+                std::thread{&StreamServer::serve, this, std::move(client)}.detach();
+            } catch (net::SocketError &err) {
+                Logging::Dynamic::Debug("Failed to accept stream client: {}", err.what());
+            }
+        }
+    }
+
+    void StreamServer::serve(net::Socket client) {
+        try {
+            client.setTimeout(10, 10);
+            std::string request;
+            while (request.find("\r\n\r\n") == std::string::npos) {
+                if (request.size() > MAX_HEADER_SIZE) throw std::runtime_error("Request header too large");
+                std::string chunk {client.recv(4096)};
+                if (chunk.empty()) throw std::runtime_error("Client went away before sending a request");
+                request += chunk;
+            }
+
+            // <method> <target> <version>, headers are keyed in lower case
+            auto [requestLine, headers, _] {net::utils::parseHttpString(request)};
+            std::istringstream iss {requestLine}; std::string method, target;
+            iss >> method >> target;
+            auto rangeIt {headers.find("range")};
+            respond(client, method, target, rangeIt != headers.end() && !rangeIt->second.empty()? rangeIt->second.front(): "");
+        } catch (std::exception &ex) {
+            Logging::Dynamic::Debug("Stream client dropped: {}", ex.what());
+        }
+
+        std::scoped_lock lock {mutex};
+        if (!--clients) clientsDone.notify_all();
+    }
+
+    std::string StreamServer::listing() {
+        std::string body;
+        std::scoped_lock lock {mutex};
+        for (const auto &[name, source]: sources)
+            for (const auto &file: source->files())
+                body += "/" + net::URL::encode(name, false) + "/" + net::URL::encode(file.path.string(), false) + "\n";
+        return body;
+    }
+
+    void StreamServer::respond(net::Socket &client, const std::string &method, const std::string &target, const std::string &range) {
+        auto reply {[&client](int status, std::string_view extraHeaders = {}) {
+            client.sendAll(statusLine(status) + std::string{extraHeaders} + "Content-Length: 0\r\nConnection: close\r\n\r\n");
+        }};
+
+        if (method != "GET" && method != "HEAD") return reply(405, "Allow: GET, HEAD\r\n");
+        const std::string path {net::URL::decode(target.substr(0, target.find('?')))};
+        if (!path.starts_with('/')) return reply(400);
+
+        if (path == "/") {
+            std::string body {listing()};
+            client.sendAll(statusLine(200) + "Content-Type: text/plain\r\nContent-Length: "
+                + std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + (method == "GET"? body: ""));
+            return;
+        }
+
+        // /<torrent name>/<path in torrent>, single file torrents may leave out the file
+        std::string_view rest {std::string_view{path}.substr(1)};
+        const std::size_t slash {rest.find('/')};
+        const std::string torrentName {rest.substr(0, slash)};
+        const std::string filePath {slash == std::string_view::npos? "": rest.substr(slash + 1)};
+
+        std::shared_ptr<StreamSource> source;
+        {
+            std::scoped_lock lock {mutex};
+            if (auto it {sources.find(torrentName)}; it != sources.end()) source = it->second;
+        }
+        if (!source) return reply(404);
+
+        const auto &files {source->files()};
+        auto fileIt {filePath.empty() && files.size() == 1? files.begin():
+            std::ranges::find(files, std::filesystem::path{filePath}, &StreamSource::File::path)};
+        if (fileIt == files.end()) return reply(404);
+        const StreamSource::File &file {*fileIt};
+
+        // Players seek with a range per request, no range sends the whole file
+        std::uint64_t first {}, length {file.size};
+        if (!range.empty()) {
+            auto bounds {parseRange(range, file.size)};
+            if (!bounds) return reply(416, "Content-Range: bytes */" + std::to_string(file.size) + "\r\n");
+            first = bounds->first; length = bounds->second - bounds->first + 1;
+        }
+
+        Logging::Dynamic::Info("[{}] {} {} bytes {}-{}", source->name(), method, file.path.string(), first, first + length);
+        std::string head {statusLine(range.empty()? 200: 206) + "Content-Type: application/octet-stream\r\n"
+            "Accept-Ranges: bytes\r\nContent-Length: " + std::to_string(length) + "\r\nConnection: close\r\n"};
+        if (!range.empty()) head += "Content-Range: bytes " + std::to_string(first) + "-"
+            + std::to_string(first + length - 1) + "/" + std::to_string(file.size) + "\r\n";
+        client.sendAll(head + "\r\n");
+        if (method == "HEAD") return;
+
+        // Each chunk only waits for the pieces it covers, the wait also moves the
+        // torrent's priority window. A body cut short means the torrent went away
+        std::string buffer;
+        for (std::uint64_t sent {}; sent < length;) {
+            const std::uint64_t chunk {std::min(CHUNK_SIZE, length - sent)}, offset {file.offset + first + sent};
+            if (!source->waitFor(offset, chunk, stop)) {
+                Logging::Dynamic::Warn("[{}] Stream of {} stopped, pieces are no longer being downloaded",
+                    source->name(), file.path.string());
+                return;
+            }
+            buffer.resize(chunk);
+            source->read(offset, buffer.data(), chunk);
+            if (static_cast<std::uint64_t>(client.sendAll(buffer)) < chunk) return;
+            sent += chunk;
+        }
+    }
+}
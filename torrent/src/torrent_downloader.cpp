@@ -3,94 +3,461 @@
 #include "../include/protocol.hpp"
 
 #include "../../networking/net.hpp"
+#include "../../cryptography/hashlib.hpp"
 #include "../../misc/logger.hpp"
 
-#include <csignal>
+#include <algorithm>
+#include <cmath>
 #include <cstring>
+#include <future>
 #include <iostream>
+#include <optional>
+#include <thread>
+#include <tuple>
 
 namespace Torrent {
-    void TorrentDownloader::handleHave(const std::string &payload, PeerContext &ctx) {
+    void TorrentDownloader::handleHave(std::string_view payload, PeerContext &ctx) {
+        if (payload.size() != 4) return;
         std::uint32_t pieceIdx;
-        std::memcpy(&pieceIdx, payload.c_str(), 4);
+        std::memcpy(&pieceIdx, payload.data(), 4);
         pieceIdx = net::utils::bswap(pieceIdx);
-        ctx.haves.insert(pieceIdx);
+        if (pieceIdx < torrentFile.numPieces && ctx.haves.set(pieceIdx))
+            pieceManager.onPeerHave(pieceIdx);
         Logging::Dynamic::Trace("[{}] Client has Piece #{}", ctx.ID, pieceIdx);
     }
 
-    void TorrentDownloader::handleBitfield(const std::string &payload, PeerContext &ctx) {
-        if (payload.size() != (torrentFile.numPieces + 7) / 8) {
-            Logging::Dynamic::Debug("[{}] Bitfield received has invalid length: {}, "
+    void TorrentDownloader::handleBitfield(std::string_view payload, PeerContext &ctx) {
+        auto bits {DynamicBitset::fromWire(payload, torrentFile.numPieces)};
+        if (!bits) {
+            Logging::Dynamic::Debug("[{}] Bitfield received is invalid (length: {}), "
                     "will be dropped", ctx.ID, payload.size());
             return;
         }
-        ctx.haves = readBitField(payload);
-        Logging::Dynamic::Trace("[{}] Client has Pieces #{}", ctx.ID, ctx.haves.size());
+        pieceManager.onPeerDisconnect(ctx.haves);
+        ctx.haves = std::move(*bits);
+        pieceManager.onPeerBitfield(ctx.haves);
+        Logging::Dynamic::Trace("[{}] Client has Pieces #{}", ctx.ID, ctx.haves.count());
     }
 
-    void TorrentDownloader::handlePiece(const std::string &payload, PeerContext &ctx) {
+    void TorrentDownloader::handleHaveAll(std::string_view, PeerContext &ctx) {
+        pieceManager.onPeerDisconnect(ctx.haves);
+        ctx.haves.setAll();
+        pieceManager.onPeerBitfield(ctx.haves);
+        Logging::Dynamic::Trace("[{}] Client has all pieces", ctx.ID);
+    }
+
+    void TorrentDownloader::handleHaveNone(std::string_view, PeerContext &ctx) {
+        pieceManager.onPeerDisconnect(ctx.haves);
+        ctx.haves.clear();
+    }
+
+    void TorrentDownloader::handleSuggestPiece(std::string_view payload, PeerContext &ctx) {
+        if (payload.size() != 4) return;
+        std::uint32_t pieceIdx;
+        std::memcpy(&pieceIdx, payload.data(), 4);
+        pieceIdx = net::utils::bswap(pieceIdx);
+        if (pieceIdx < torrentFile.numPieces && ctx.suggested.size() < MAX_FAST_PIECES 
+            && !std::ranges::contains(ctx.suggested, pieceIdx))
+            ctx.suggested.push_back(pieceIdx);
+    }
+
+    void TorrentDownloader::handleAllowedFast(std::string_view payload, PeerContext &ctx) {
+        if (payload.size() != 4) return;
+        std::uint32_t pieceIdx;
+        std::memcpy(&pieceIdx, payload.data(), 4);
+        pieceIdx = net::utils::bswap(pieceIdx);
+        if (pieceIdx < torrentFile.numPieces && ctx.allowedFast.size() < MAX_FAST_PIECES 
+            && !std::ranges::contains(ctx.allowedFast, pieceIdx))
+            ctx.allowedFast.push_back(pieceIdx);
+        Logging::Dynamic::Trace("[{}] Piece #{} allowed while choked", ctx.ID, pieceIdx);
+    }
+
+    void TorrentDownloader::handleReject(std::string_view payload, PeerContext &ctx) {
+        // Payload: {index: int32, begin: int32, length: int32}
+        if (payload.size() != 12) return;
+        std::uint32_t pIndex, pBegin;
+        std::memcpy(&pIndex, payload.data() + 0, 4);
+        std::memcpy(&pBegin, payload.data() + 4, 4);
+        net::utils::inplace_bswap(pIndex, pBegin);
+
+        // Rejected blocks go straight back to the piece manager instead of waiting for a timeout
+        auto pendingIt {ctx.pending.find({pIndex, pBegin, 0})};
+        if (pendingIt == ctx.pending.end()) return;
+        PieceBlock block {*pendingIt};
+        ctx.pending.erase(pendingIt); --ctx.backlog;
+        if (ctx.rttProbe && *ctx.rttProbe == block) ctx.rttProbe.reset();
+        pieceManager.onPeerReset({block});
+        Logging::Dynamic::Trace("[{}] Request for block (pIdx={}, bOffset={}) rejected", ctx.ID, pIndex, pBegin);
+    }
+
+    void TorrentDownloader::handlePiece(std::string_view payload, PeerContext &ctx) {
         // Payload: {index: int32, begin: int32, block: char*}
+        if (payload.size() < 8) return;
         std::uint32_t pIndex, pBegin;
 
         // Check torrent.blockSize == payload's block size
-        std::memcpy(&pIndex, payload.c_str() + 0, 4);
-        std::memcpy(&pBegin, payload.c_str() + 4, 4);
+        std::memcpy(&pIndex, payload.data() + 0, 4);
+        std::memcpy(&pBegin, payload.data() + 4, 4);
         net::utils::inplace_bswap(pIndex, pBegin);
 
         auto pendingIt {ctx.pending.find({pIndex, pBegin, 0})};
         if (pendingIt == ctx.pending.end()) {
             Logging::Dynamic::Debug("[{}] Piece# {}, Block Offset {} was not requested "
                 "yet or has already been downloaded, dropping.", ctx.ID, pIndex, pBegin);
+            wastedBytes += payload.size() - 8;
             return;
         }
 
         // Convert the offset into a valid block index
         bool validBlock {payload.size() - 8 == pendingIt->blockSize};
+        PieceBlock block {*pendingIt};
         ctx.pending.erase(pendingIt); --ctx.backlog;
         Logging::Dynamic::Debug("[{}] Piece: {}, Block Offset {} => {}", ctx.ID, 
             pIndex, pBegin, validBlock? "Valid": "Invalid");
 
+        // Requests queued behind others only inflate the sample, the minimum tracks the actual RTT
+        if (ctx.rttProbe && *ctx.rttProbe == block) {
+            auto sample {std::chrono::steady_clock::now() - ctx.rttProbeSentAt};
+            if (!ctx.minRtt.count() || sample < ctx.minRtt) ctx.minRtt = sample;
+            ctx.rttProbe.reset();
+        }
+
         // Notify piece manager that we have received a block
-        if (validBlock) {
-            auto [pieceReady, piece] {pieceManager.onBlockReceived(pIndex, pBegin, payload)};
-            if (pieceReady) {
-                diskWriter.schedule(pIndex * torrentFile.pieceSize, std::move(piece));
-            }
+        if (!validBlock) wastedBytes += payload.size() - 8;
+        else {
+            ctx.downloaded += block.blockSize; ctx.rateBytes += block.blockSize;
+            downloadedBytes += block.blockSize; ctx.lastBlockAt = ctx.lastReadTimeStamp;
+            if (pieceManager.inEndgame()) cancelDuplicateRequests(block, &ctx);
+            if (SharedPiece piece {pieceManager.onBlockReceived(pIndex, pBegin, payload.substr(8))})
+                verifyPiece(pIndex, std::move(piece));
         }
     }
 
-    // Reset the peer context
-    void TorrentDownloader::handleChoke(const std::string&, PeerContext &ctx) {
-        clearPendingFromPeer(ctx); ctx.choked = true;
+    void TorrentDownloader::handleRequest(std::string_view payload, PeerContext &ctx) {
+        // Payload: {index: int32, begin: int32, length: int32}
+        if (payload.size() != 12) return;
+        std::uint32_t pIndex, pBegin, pLength;
+        std::memcpy(&pIndex,  payload.data() + 0, 4);
+        std::memcpy(&pBegin,  payload.data() + 4, 4);
+        std::memcpy(&pLength, payload.data() + 8, 4);
+        net::utils::inplace_bswap(pIndex, pBegin, pLength);
+
+        // Only serve unchoked peers (or allowed fast pieces), pieces we have & blocks within the piece (max 128 KB per spec)
+        const std::uint64_t blockEnd {static_cast<std::uint64_t>(pBegin) + pLength};
+        if ((ctx.amChoking && !std::ranges::contains(ctx.allowedFastOut, pIndex)) 
+            || !pieceManager.getHaves().test(pIndex) || !pLength || pLength > (1 << 17)
+            || blockEnd > torrentFile.pieceSize || ctx.requests.size() >= MAX_PEER_REQUESTS
+            || static_cast<std::uint64_t>(pIndex) * torrentFile.pieceSize + blockEnd > torrentFile.length) 
+        {
+            Logging::Dynamic::Debug("[{}] {} request for block (pIdx={}, bOffset={}, bSize={})", 
+                ctx.ID, ctx.fastExtension? "Rejecting": "Dropping", pIndex, pBegin, pLength);
+            if (ctx.fastExtension) ctx.sendBuffer += buildReject(pIndex, pBegin, pLength);
+            return;
+        }
+
+        ctx.requests.emplace_back(pIndex, pBegin, pLength);
+        serveRequests(ctx);
     }
 
-    void TorrentDownloader::handleUnchoke(const std::string&, PeerContext &ctx) {
-        ctx.unchokeAttempts = 0; ctx.choked = false;
+    void TorrentDownloader::handleCancel(std::string_view payload, PeerContext &ctx) {
+        if (payload.size() != 12) return;
+        std::uint32_t pIndex, pBegin;
+        std::memcpy(&pIndex, payload.data() + 0, 4);
+        std::memcpy(&pBegin, payload.data() + 4, 4);
+        net::utils::inplace_bswap(pIndex, pBegin);
+
+        // Fast peers expect either the piece or a reject for every request
+        auto it {std::ranges::find(ctx.requests, PieceBlock{pIndex, pBegin, 0})};
+        if (it == ctx.requests.end()) return;
+        if (ctx.fastExtension) ctx.sendBuffer += buildReject(it->pieceIdx, it->blockOffset, it->blockSize);
+        ctx.requests.erase(it);
+    }
+
+    // A free upload slot goes to the peer right away, the choke rounds only reshuffle taken ones
+    void TorrentDownloader::handleInterested(std::string_view, PeerContext &ctx) { 
+        ctx.peerInterested = true; 
+        if (ctx.amChoking && unchokedCount < UPLOAD_SLOTS && limits->unchoked < limits->maxUnchoked) {
+            setChoking(ctx, false); ++unchokedCount; ++limits->unchoked;
+        }
+    }
+    void TorrentDownloader::handleNotInterested(std::string_view, PeerContext &ctx) { ctx.peerInterested = false; }
+
+    // Reset the peer context, fast peers reject whatever they won't serve so requests are kept
+    void TorrentDownloader::handleChoke(std::string_view, PeerContext &ctx) {
+        if (!ctx.fastExtension) clearPendingFromPeer(ctx); 
+        if (!ctx.choked) ctx.chokedSince = ctx.lastReadTimeStamp;
+        ctx.choked = true;
+    }
+
+    // Snub timer starts over, the peer had no chance to deliver while choking us
+    void TorrentDownloader::handleUnchoke(std::string_view, PeerContext &ctx) {
+        if (ctx.choked) ctx.chokedTime += ctx.lastReadTimeStamp - ctx.chokedSince;
+        ctx.unchokeAttempts = 0; ctx.choked = false; ctx.lastBlockAt = ctx.lastReadTimeStamp;
     }
 
     void TorrentDownloader::clearPendingFromPeer(PeerContext &ctx) {
         // Reset any download pending from this peer
         pieceManager.onPeerReset({ctx.pending.begin(), ctx.pending.end()});
-        ctx.pending.clear(); ctx.backlog = 0;
+        ctx.pending.clear(); ctx.backlog = 0; ctx.rttProbe.reset();
+    }
+
+    void TorrentDownloader::serveRequests(PeerContext &ctx) {
+        // Pieces not in memory are read off the network thread, the peer is served again once they land
+        while (!ctx.requests.empty() && ctx.sendBuffer.size() < MAX_SEND_BUFFER) {
+            auto [pieceIdx, blockOffset, blockSize] {ctx.requests.front()};
+            try {
+                SharedPiece piece {diskWriter.tryRead(pieceIdx)};
+                ctx.awaitingRead = !piece;
+                if (!piece) return;
+                ctx.requests.pop_front();
+                ctx.sendBuffer += buildPiece(pieceIdx, blockOffset, std::string_view{*piece}.substr(blockOffset, blockSize));
+                ctx.uploaded += blockSize; ctx.uploadRateBytes += blockSize; uploadedBytes += blockSize;
+                Logging::Dynamic::Trace("[{}] Serving block (pIdx={}, bOffset={}, bSize={})", 
+                    ctx.ID, pieceIdx, blockOffset, blockSize);
+            } catch (std::exception &ex) {
+                Logging::Dynamic::Warn("[{}] Failed to read Piece #{} for upload: {}", ctx.ID, pieceIdx, ex.what());
+                ctx.requests.clear();
+            }
+        }
+    }
+
+    void TorrentDownloader::drainReads() {
+        std::vector<DiskWriter::ReadResult> results {diskWriter.drainReads()};
+        if (results.empty()) return;
+
+        // Requests for pieces that failed to read are dropped, rejected for fast peers
+        std::vector<std::uint32_t> failed;
+        for (const auto &[pieceIdx, piece, error]: results) {
+            if (piece) continue;
+            Logging::Dynamic::Warn("[{}] Failed to read Piece #{} for upload: {}", torrentFile.name, pieceIdx, error);
+            failed.push_back(pieceIdx);
+        }
+
+        for (auto &[fd, peerID]: fd2PeerID) {
+            PeerContext &ctx {states.at(peerID)};
+            if (!ctx.awaitingRead || ctx.closed) continue;
+            std::erase_if(ctx.requests, [&ctx, &failed](const PieceBlock &block) {
+                if (!std::ranges::contains(failed, block.pieceIdx)) return false;
+                if (ctx.fastExtension) ctx.sendBuffer += buildReject(block.pieceIdx, block.blockOffset, block.blockSize);
+                return true;
+            });
+            ctx.awaitingRead = false;
+            serveRequests(ctx); updateInterest(ctx);
+        }
+    }
+
+    void TorrentDownloader::setChoking(PeerContext &ctx, bool choke) {
+        if (ctx.amChoking == choke) return;
+        ctx.amChoking = choke;
+        ctx.sendBuffer += choke? buildChoke(): buildUnchoke();
+
+        // Fast peers get a reject for every dropped request, allowed fast ones are still served
+        if (choke && ctx.fastExtension) {
+            std::erase_if(ctx.requests, [&ctx](const PieceBlock &block) {
+                if (std::ranges::contains(ctx.allowedFastOut, block.pieceIdx)) return false;
+                ctx.sendBuffer += buildReject(block.pieceIdx, block.blockOffset, block.blockSize);
+                return true;
+            });
+        } else if (choke) ctx.requests.clear();
+        Logging::Dynamic::Debug("[{}] {} peer", ctx.ID, choke? "Choking": "Unchoking");
+    }
+
+    void TorrentDownloader::runChoker(TimePoint now) {
+        if (now - lastChokeRound < CHOKE_INTERVAL) return;
+        lastChokeRound = now;
+
+        // Reciprocate peers we download from the fastest, once complete reward the fastest downloaders
+        const bool complete {pieceManager.finished()};
+        std::vector<PeerContext*> candidates;
+        for (auto &[id, ctx]: states)
+            if (ctx.handshaked && !ctx.closed && ctx.peerInterested)
+                candidates.push_back(&ctx);
+        std::ranges::sort(candidates, std::greater{}, [complete](const PeerContext *ctx) { 
+            return complete? ctx->uploaded: ctx->downloaded; });
+
+        // Give back our share of the session wide unchoke budget before claiming it again
+        limits->unchoked -= unchokedCount;
+        const std::size_t budget {limits->maxUnchoked - limits->unchoked};
+        const std::size_t slots {std::min({static_cast<std::size_t>(UPLOAD_SLOTS), budget, candidates.size()})};
+
+        // Rotate the optimistic unchoke among the peers that didn't make the cut
+        auto optimisticIt {states.find(optimisticPeerID)};
+        bool optimisticValid {optimisticIt != states.end() && !optimisticIt->second.closed 
+            && optimisticIt->second.peerInterested};
+        if (!optimisticValid || now - lastOptimisticRound >= OPTIMISTIC_INTERVAL) {
+            lastOptimisticRound = now; optimisticPeerID.clear();
+            if (candidates.size() > slots && budget > slots) {
+                std::size_t pick {slots + randInteger<std::size_t>() % (candidates.size() - slots)};
+                optimisticPeerID = candidates[pick]->ID;
+                Logging::Dynamic::Debug("[{}] Picked for optimistic unchoke", optimisticPeerID);
+            }
+        }
+
+        std::unordered_set<std::string_view> unchokeIDs;
+        if (!optimisticPeerID.empty() && budget > slots) unchokeIDs.insert(optimisticPeerID);
+        for (std::size_t idx {}; idx < slots; ++idx)
+            unchokeIDs.insert(candidates[idx]->ID);
+
+        unchokedCount = 0;
+        for (auto &[id, ctx]: states) {
+            if (!ctx.handshaked || ctx.closed) continue;
+            bool unchoke {unchokeIDs.contains(ctx.ID)};
+            setChoking(ctx, !unchoke); unchokedCount += unchoke;
+            ctx.downloaded = 0; ctx.uploaded = 0;
+        }
+        limits->unchoked += unchokedCount;
+    }
+
+    void TorrentDownloader::broadcastHave(std::uint32_t pieceIdx) {
+        const bool complete {pieceManager.finished()};
+        for (auto &[id, ctx]: states) {
+            if (!ctx.handshaked || ctx.closed) continue;
+            if (!ctx.haves.test(pieceIdx)) ctx.sendBuffer += buildHave(pieceIdx);
+            if (ctx.fastExtension && ctx.amChoking && std::ranges::contains(ctx.allowedFastOut, pieceIdx))
+                ctx.sendBuffer += buildAllowedFast(pieceIdx);
+            if (complete) ctx.sendBuffer += buildNotinterested();
+        }
+    }
+
+    bool TorrentDownloader::seeding(TimePoint now) const {
+        // Seed until any of the configured limits is reached
+        if (!seedStart || (SEED_RATIO <= 0 && !SEED_TIME)) return false;
+        bool ratioReached {SEED_RATIO > 0 && static_cast<double>(uploadedBytes) 
+            >= SEED_RATIO * static_cast<double>(torrentFile.length)};
+        bool timeReached {SEED_TIME > 0 && now - *seedStart >= std::chrono::minutes{SEED_TIME}};
+        return !ratioReached && !timeReached;
+    }
+
+    void TorrentDownloader::cancelDuplicateRequests(const PieceBlock &block, const PeerContext *receiver) {
+        for (auto &[peerID, ctx]: states) {
+            if (&ctx == receiver || ctx.closed || !ctx.pending.erase(block)) continue;
+            Logging::Dynamic::Trace("[{}] Endgame: building cancel for block (pIdx={}, bOffset={})", 
+                ctx.ID, block.pieceIdx, block.blockOffset);
+            ctx.sendBuffer += buildRequest(block.pieceIdx, block.blockOffset, block.blockSize, true);
+            pieceManager.onPeerReset({block}); --ctx.backlog;
+            if (ctx.rttProbe && *ctx.rttProbe == block) ctx.rttProbe.reset();
+        }
+    }
+
+    void TorrentDownloader::cancelStaleRequests(const std::vector<std::uint32_t> &resetPieces) {
+        // Out of endgame a block stays requested from a single peer, every request
+        // for a piece that failed its hash check is for data thrown away already
+        std::unordered_set<PieceBlock, HashPieceBlock> kept;
+        for (auto &[peerID, ctx]: states) {
+            if (ctx.closed) continue;
+            std::vector<PieceBlock> cancelled;
+            std::erase_if(ctx.pending, [&](const PieceBlock &block) {
+                if (!std::ranges::contains(resetPieces, block.pieceIdx) && kept.insert(block).second) return false;
+                cancelled.push_back(block);
+                return true;
+            });
+            for (const PieceBlock &block: cancelled) {
+                Logging::Dynamic::Trace("[{}] Building cancel for stale block (pIdx={}, bOffset={})", 
+                    ctx.ID, block.pieceIdx, block.blockOffset);
+                ctx.sendBuffer += buildRequest(block.pieceIdx, block.blockOffset, block.blockSize, true);
+                --ctx.backlog;
+                if (ctx.rttProbe && *ctx.rttProbe == block) ctx.rttProbe.reset();
+            }
+            pieceManager.onPeerReset(cancelled);
+        }
+    }
+
+    void TorrentDownloader::updatePipelines(TimePoint now) {
+        if (now - lastRateRound < RATE_INTERVAL) return;
+        const double elapsed {std::chrono::duration<double>(now - lastRateRound).count()};
+        lastRateRound = now; bestRate = 0;
+
+        const double goodputSample {static_cast<double>(verifiedBytes - roundVerifiedBytes) / elapsed};
+        goodput = RATE_SMOOTHING * goodputSample + (1 - RATE_SMOOTHING) * goodput;
+        roundVerifiedBytes = verifiedBytes;
+
+        for (auto &[id, ctx]: states) {
+            if (!ctx.handshaked || ctx.closed) continue;
+
+            // Idle periods say nothing about what the peer can deliver, sample only while requests are out
+            if (!ctx.choked && (ctx.backlog || ctx.rateBytes)) {
+                const double sample {static_cast<double>(ctx.rateBytes) / elapsed};
+                ctx.rate = ctx.rate > 0? RATE_SMOOTHING * sample + (1 - RATE_SMOOTHING) * ctx.rate: sample;
+            }
+            ctx.rateBytes = 0;
+            bestRate = std::max(bestRate, ctx.rate);
+
+            const double uploadSample {static_cast<double>(ctx.uploadRateBytes) / elapsed};
+            ctx.uploadRate = RATE_SMOOTHING * uploadSample + (1 - RATE_SMOOTHING) * ctx.uploadRate;
+            ctx.uploadRateBytes = 0;
+
+            // Bandwidth delay product in blocks. Headroom lets the queue grow while it is what limits the rate
+            if (ADAPTIVE_BACKLOG && ctx.rate > 0 && ctx.minRtt.count()) {
+                const double bdp {ctx.rate * std::chrono::duration<double>(ctx.minRtt).count() / blockSize};
+                ctx.maxBacklog = static_cast<std::uint16_t>(std::clamp<double>(std::ceil(1.5 * bdp) + 2, MIN_BACKLOG, MAX_BACKLOG));
+                Logging::Dynamic::Trace("[{}] Rate: {:.1f} KB/s, RTT: {}ms, request queue depth: {}", ctx.ID, ctx.rate / 1024,
+                    std::chrono::duration_cast<std::chrono::milliseconds>(ctx.minRtt).count(), ctx.maxBacklog);
+            }
+        }
+    }
+
+    std::uint16_t TorrentDownloader::pipelineDepth(const PeerContext &ctx) const {
+        // Slow peers would hold up the last pieces, keep a single request in flight with them
+        const bool nearEnd {pieceManager.inEndgame() 
+            || pieceManager.remaining() <= fd2PeerID.size()};
+        if (nearEnd && ctx.rate > 0 && ctx.rate * SLOW_PEER_RATIO < bestRate) return 1;
+        return ctx.maxBacklog? ctx.maxBacklog: INITIAL_BACKLOG;
     }
 
     TorrentDownloader::~TorrentDownloader() {
-        const auto &haves {pieceManager.getHaves()};
-        if (haves.empty()) return;
-        std::string bitField {writeBitField(haves)}; 
-        std::ofstream ofs {StateSavePath, std::ios::binary};
-        ofs.write(bitField.c_str(), static_cast<long>(bitField.size()));
-        Logging::Dynamic::Info("Download state saved to disk, {}/{} pieces "
-            "were completed", haves.size(), torrentFile.numPieces);
+        // Journal already holds every piece written, fold it into a single snapshot
+        try {
+            journal.compact([this] { diskWriter.syncFiles(); });
+            Logging::Dynamic::Info("Download state saved to disk, {}/{} pieces "
+                "were completed", journal.count(), torrentFile.numPieces);
+        } catch (std::exception &ex) {
+            Logging::Dynamic::Error("[{}] Failed to save download state: {}", torrentFile.name, ex.what());
+        }
+    }
+
+    void TorrentDownloader::verifyPiece(std::uint32_t pieceIdx, SharedPiece piece) {
+        // Job owns everything it touches, torrent may be gone by the time it runs
+        ++verifying;
+        std::string expected {pieceManager.getPieceHash(pieceIdx)};
+        auto job {[queue = verified, pieceIdx, expected = std::move(expected), piece = std::move(piece)]() mutable {
+            bool valid {hashutil::sha1(*piece, true) == expected};
+            queue->push({pieceIdx, valid, std::move(piece)});
+        }};
+
+        // A pool without workers hashes on the loop itself
+        if (hashPool.size()) std::ignore = hashPool.enqueue(std::move(job));
+        else job();
+    }
+
+    void TorrentDownloader::drainVerified() {
+        std::vector<std::uint32_t> failed;
+        for (auto &[pieceIdx, valid, piece]: verified->drain()) {
+            --verifying;
+            pieceManager.onPieceVerified(pieceIdx, valid);
+            if (!valid) { ++hashFailures; wastedBytes += piece->size(); failed.push_back(pieceIdx); continue; }
+            verifiedBytes += piece->size();
+            diskWriter.schedule(static_cast<std::uint64_t>(pieceIdx) * torrentFile.pieceSize, std::move(piece));
+            broadcastHave(pieceIdx);
+        }
+
+        // Hash failures reset pieces & may drop us out of endgame (as may a file selection change)
+        const bool wasEndgame {std::exchange(endgame, pieceManager.inEndgame())};
+        if (!failed.empty() || (wasEndgame && !endgame && !pieceManager.finished())) cancelStaleRequests(failed);
     }
 
     TorrentDownloader::TorrentDownloader(
-        TorrentTracker &tTracker, const std::filesystem::path downloadDir, 
+        TorrentTracker &tTracker, DiskIOPool &diskPool, async::ThreadPool &hashPool, 
+        PieceCache &pieceCache, const std::filesystem::path downloadDir, 
         const std::uint16_t bSize, const std::uint8_t backlog, 
         const std::uint8_t maxUnchokeAttempts, 
         const std::uint8_t maxReconnectAttempts, 
         const std::uint16_t maxReqWaitTime,
-        const std::uint16_t minReconWaitTime
+        const std::uint16_t minReconWaitTime,
+        const std::uint8_t uploadSlots,
+        const double seedRatio,
+        const std::uint32_t seedTime,
+        const bool recheck,
+        const bool adaptiveBacklog
     ): 
         torrentFile {tTracker.torrentFile},
         torrentTracker {tTracker},
@@ -98,251 +465,669 @@ namespace Torrent {
         blockSize {bSize},
         MAX_REQ_WAIT_TIME {maxReqWaitTime},
         MIN_RECON_WAIT_TIME {minReconWaitTime},
-        MAX_BACKLOG {backlog}, 
+        INITIAL_BACKLOG {backlog}, 
         MAX_UNCHOKE_ATTEMPTS {maxUnchokeAttempts},
         MAX_RECONNECT_ATTEMPTS {maxReconnectAttempts},
+        ADAPTIVE_BACKLOG {adaptiveBacklog},
+        UPLOAD_SLOTS {uploadSlots},
+        SEED_RATIO {seedRatio},
+        SEED_TIME {seedTime},
         StateSavePath {downloadDir / ("." + torrentFile.name + ".ctorrent")},
-        coldStart {!std::filesystem::exists(StateSavePath)},
-        pieceManager {torrentFile.length, torrentFile.pieceSize, bSize, torrentFile.pieceBlob},
-        diskWriter {torrentFile.name, torrentFile.length, torrentFile.pieceSize, downloadDir, coldStart}
+        journal {StateSavePath, torrentFile.numPieces},
+        coldStart {!journal.hasSavedState()},
+        pieceManager {torrentFile.length, torrentFile.pieceSize, bSize, torrentFile.pieceBlob, pieceCache},
+        diskWriter {diskPool, pieceCache, torrentFile.name, torrentFile.length, torrentFile.pieceSize, torrentFile.files, downloadDir, coldStart},
+        hashPool {hashPool}, verified {std::make_shared<MPSCQueue<VerifiedPiece>>()},
+        handshake {buildHandshake(torrentFile.infoHash, peerID)},
+        allPieces {torrentFile.numPieces}
     {
-        // If save found reload the state
+        allPieces.setAll();
+        for (const std::string &url: torrentFile.webSeeds) {
+            try { webSeeds.emplace_back(url, torrentFile); }
+            catch (std::exception &ex) {
+                Logging::Dynamic::Warn("[{}] Skipping web seed {}: {}", torrentFile.name, url, ex.what());
+            }
+        }
+
+        // Pieces are journaled once on disk, the pool's sync thread syncs the files written to
+        // ahead of the journal batch that points to them
+        diskWriter.setSyncTask([this] { journal.flush([this] { diskWriter.syncFiles(); }); });
+        diskWriter.addWriteListener([this](std::uint64_t offset, std::uint64_t length) {
+            const auto first {static_cast<std::uint32_t>(offset / torrentFile.pieceSize)};
+            const auto last {static_cast<std::uint32_t>((offset + length - 1) / torrentFile.pieceSize)};
+            if (journal.record(first, last)) diskWriter.requestSync();
+        });
+
+        // If save found reload the state, snapshot with the journal replayed on top
         if (!coldStart) {
-            if (!std::filesystem::is_regular_file(StateSavePath))
-                throw std::runtime_error("Download state save path is invalid");
-
-            std::ifstream saveFile {StateSavePath, std::ios::binary};
-            std::string bitFieldString {std::istreambuf_iterator<char>(saveFile), 
-                std::istreambuf_iterator<char>()};
-            auto _haves {readBitField(bitFieldString)};
-            if (_haves.empty() || *std::ranges::max_element(_haves) >= torrentFile.numPieces)
-                Logging::Dynamic::Warn("Download state save is corrupted, will be overwritten");
-            else {
+            auto _haves {journal.load()};
+            if (!_haves || _haves->none())
+                Logging::Dynamic::Warn("Download state save is corrupted, existing data will be rechecked");
+            else if (!recheck) {
                 Logging::Dynamic::Info("Download state reloaded, {}/{} pieces "
-                    "have been completed", _haves.size(), torrentFile.numPieces);
-                pieceManager.getHaves() = std::move(_haves);
+                    "have been completed", _haves->count(), torrentFile.numPieces);
+                pieceManager.getHaves() = std::move(*_haves);
+                return;
             }
         }
+
+        // No usable state but a temp file from an earlier run, salvage whatever it holds
+        if (diskWriter.hasExistingData()) {
+            Logging::Dynamic::Info("[{}] Rechecking existing data, {} pieces", torrentFile.name, torrentFile.numPieces);
+            pieceManager.getHaves() = diskWriter.recheck(torrentFile.pieceBlob, hashPool);
+            journal.reset(pieceManager.getHaves());
+            Logging::Dynamic::Info("[{}] Recheck complete, {}/{} pieces are valid", 
+                torrentFile.name, pieceManager.getHaves().count(), torrentFile.numPieces);
+        }
     }
 
-    void TorrentDownloader::download(int timeout) {
-        // Get the peers from the tracker object
-        std::vector<std::pair<std::string, std::uint16_t>> peerList {torrentTracker.getPeers(timeout)};
-        if (peerList.empty()) { Logging::Dynamic::Error("No peers available"); return; }
+    void TorrentDownloader::processRecvBuffer(PeerContext &ctx) {
+        if (!ctx.handshaked && ctx.recvBuffer.size() >= 68) {
+            ctx.handshaked = std::memcmp(handshake.data(), ctx.recvBuffer.data(), 20) == 0 
+                && std::memcmp(handshake.data() + 28, ctx.recvBuffer.data() + 28, 20) == 0;
+            if (!ctx.handshaked) {
+                Logging::Dynamic::Debug("[{}] Handshake failed, will be dropped", ctx.ID);
+                ctx.closed = true;
+            } else {
+                ctx.fastExtension = supportsFastExtension(ctx.recvBuffer);
+                ctx.recvBuffer = ctx.recvBuffer.substr(68);
+                Logging::Dynamic::Debug("[{}] Handshake established{}", ctx.ID, ctx.fastExtension? " (fast extension)": "");
+                ctx.chokedSince = ctx.lastBlockAt = ctx.lastReadTimeStamp;
 
-        Logging::Dynamic::Info("Discovered {} peers.", peerList.size());
+                // Announce the pieces we have, fast peers always get one of HaveAll / HaveNone / Bitfield
+                const DynamicBitset &haves {pieceManager.getHaves()};
+                if (ctx.fastExtension && haves.all()) ctx.sendBuffer += buildHaveAll();
+                else if (ctx.fastExtension && haves.none()) ctx.sendBuffer += buildHaveNone();
+                else if (!haves.none()) ctx.sendBuffer += buildBitField(haves.toWire());
 
-        net::PollManager pollManager;
-        std::unordered_map<std::string, PeerContext> states;
-        std::unordered_map<int, std::string> fd2PeerID;
+                // Let fast peers start on a few pieces before they are unchoked
+                if (ctx.fastExtension) {
+                    ctx.allowedFastOut = allowedFastSet(ctx.ip, torrentFile.infoHash, 
+                        static_cast<std::uint32_t>(torrentFile.numPieces), ALLOWED_FAST_COUNT);
+                    for (std::uint32_t pieceIdx: ctx.allowedFastOut)
+                        if (haves.test(pieceIdx)) ctx.sendBuffer += buildAllowedFast(pieceIdx);
+                }
+                if (!pieceManager.finished()) ctx.sendBuffer += buildInterested();
+            }
+        }
 
-        // Connect to all available peers and fill send buffer with handshakes
-        std::string handshake {buildHandshake(torrentFile.infoHash, peerID)};
-        auto lastTick {std::chrono::steady_clock::now()};
-        for (const auto &[ip, port]: peerList) {
-            std::optional<net::IP> ipType {net::utils::checkIPType(ip)};
-            if (!ipType.has_value()) { Logging::Dynamic::Debug("Invalid IP: {}", ip); continue; }
+        if (ctx.handshaked) {
+            // Messages are parsed in place, consumed bytes are dropped from the buffer once at the end
+            std::string_view remaining {ctx.recvBuffer};
+            while (!ctx.closed && remaining.size() >= 4) {
+                // Keep alives have no message id or payload
+                if (remaining.starts_with(std::string_view{"\0\0\0\0", 4})) { remaining.remove_prefix(4); continue; }
+                const std::uint32_t msgLen {IsCompleteMessage(remaining)};
+                if (!msgLen) break;
 
-            // Create socket connection and the Peer Context
-            auto peer {net::Socket{net::SOCKTYPE::TCP, ipType.value()}};
-            peer.setNonBlocking(); peer.connect(ip, port);
-            PeerContext peerCtx {.ip=ip, .port=port, .ipV4=(ipType.value() == net::IP::V4), 
-                .ID=(ip + ':' + std::to_string(port)), .fd=peer.fd(), .sendBuffer=handshake, 
-                .lastReadTimeStamp=lastTick};
+                auto [msgType, message] {parseMessage(remaining.substr(0, msgLen + 4))};
+                Logging::Dynamic::Debug("[{}] Received {} from client", ctx.ID, str(msgType));
 
-            states.emplace(peerCtx.ID, std::move(peerCtx));
-            fd2PeerID.emplace(peer.fd(), peerCtx.ID);
+                // Process the message and update the internal context
+                switch (msgType) {
+                    case MsgType::Choke:       handleChoke(message, ctx); break;
+                    case MsgType::Unchoke:   handleUnchoke(message, ctx); break;
+                    case MsgType::Have:         handleHave(message, ctx); break;
+                    case MsgType::Piece:       handlePiece(message, ctx); break;
+                    case MsgType::Bitfield: handleBitfield(message, ctx); break;
+                    case MsgType::Interested:       handleInterested(message, ctx); break;
+                    case MsgType::NotInterested: handleNotInterested(message, ctx); break;
+                    case MsgType::Request:             handleRequest(message, ctx); break;
+                    case MsgType::Cancel:               handleCancel(message, ctx); break;
+                    default: break;
+                }
 
-            pollManager.track(std::move(peer), net::PollEventType::Writable);
-            Logging::Dynamic::Debug("Intiating connection with {}:{}", ip, port);
-        }
+                // Fast Extension messages are only valid once both sides negotiated it
+                if (ctx.fastExtension) {
+                    switch (msgType) {
+                        case MsgType::HaveAll:             handleHaveAll(message, ctx); break;
+                        case MsgType::HaveNone:           handleHaveNone(message, ctx); break;
+                        case MsgType::SuggestPiece:   handleSuggestPiece(message, ctx); break;
+                        case MsgType::AllowedFast:     handleAllowedFast(message, ctx); break;
+                        case MsgType::RejectRequest:        handleReject(message, ctx); break;
+                        default: break;
+                    }
+                }
 
-        std::size_t pendingPieceCount {torrentFile.numPieces - pieceManager.getHaves().size()};
-        double pendingSize {pendingPieceCount * torrentFile.pieceSize / (1024. * 1024.)};
-        Logging::Dynamic::Info("Established connection with {} peers, "
-            "Pending download: {:.2f} MB", pollManager.size(), pendingSize);
-
-        static bool interrupted {false};
-        std::signal(SIGINT, [](int) { interrupted = true; });
-        while (!interrupted && !pieceManager.finished() && !pollManager.empty()) {
-            auto lastTick {std::chrono::steady_clock::now()};
-            for (auto &[peer, event]: pollManager.poll(5)) {
-                PeerContext &ctx {states.at(fd2PeerID.at(peer.fd()))};
-
-                if (!ctx.closed && event & net::PollEventType::Readable) {
-                    std::string recvBytes;
-                    try { recvBytes = peer.recvAll(); } 
-                    catch (net::SocketError &err) {
-                        Logging::Dynamic::Debug("[{}] Recv from client failed: {}", ctx.ID, err.what());
+                // If choked, remind the peer we are interested (an Unchoke from us would 
+                // unchoke them instead). Wait for a maximum of 3 turns before disconnecting
+                if (ctx.choked && !pieceManager.finished()) {
+                    std::string interestedMsg {buildInterested()};
+                    if (ctx.unchokeAttempts > MAX_UNCHOKE_ATTEMPTS - 1 && !ctx.peerInterested && ctx.pending.empty()) {
+                        Logging::Dynamic::Debug("[{}] Exceeded max unchoke attempts, disconnecting", ctx.ID);
                         ctx.closed = true;
                     }
 
-                    if (!recvBytes.empty()) {
-                        Logging::Dynamic::Debug("[{}] Recv {} bytes from client", ctx.ID, recvBytes.size());
-                        ctx.lastReadTimeStamp = lastTick;
-
-                        // Get existing buffer size to expand recvBuffer
-                        std::size_t iSize {ctx.recvBuffer.size()};
-                        ctx.recvBuffer.resize(iSize + recvBytes.size());
-                        std::memmove(ctx.recvBuffer.data() + iSize, recvBytes.data(), recvBytes.size());
-
-                        Logging::Dynamic::Trace("[{}] Current recv buffer size: {}", ctx.ID, ctx.recvBuffer.size());
-
-                        if (!ctx.handshaked && ctx.recvBuffer.size() >= 68) {
-                            ctx.handshaked = std::memcmp(handshake.data(), ctx.recvBuffer.data(), 20) == 0 
-                                && std::memcmp(handshake.data() + 28, ctx.recvBuffer.data() + 28, 20) == 0;
-                            if (!ctx.handshaked) {
-                                Logging::Dynamic::Debug("[{}] Handshake failed, will be dropped", ctx.ID);
-                                ctx.closed = true;
-                            } else {
-                                ctx.recvBuffer = ctx.recvBuffer.substr(68);
-                                Logging::Dynamic::Debug("[{}] Handshake established", ctx.ID);
-                                ctx.sendBuffer = buildInterested();
-                            }
-                        }
-
-                        if (ctx.handshaked) {
-                            std::uint32_t msgLen;
-                            while ((msgLen = IsCompleteMessage(ctx.recvBuffer)) > 0 && !ctx.closed) {
-                                auto [msgType, message] {parseMessage(std::string_view{ctx.recvBuffer.data(), msgLen + 4})};
-                                Logging::Dynamic::Debug("[{}] Received {} from client", ctx.ID, str(msgType));
-
-                                // Process the message and update the internal context
-                                switch (msgType) {
-                                    case MsgType::Choke:       handleChoke(message, ctx); break;
-                                    case MsgType::Unchoke:   handleUnchoke(message, ctx); break;
-                                    case MsgType::Have:         handleHave(message, ctx); break;
-                                    case MsgType::Piece:       handlePiece(message, ctx); break;
-                                    case MsgType::Bitfield: handleBitfield(message, ctx); break;
-                                }
-
-                                // If choked, request for gettin unchoked. We will wait for a 
-                                // maximum of 3 turns before disconnecting from the peer
-                                if (ctx.choked) {
-                                    std::string unchokeMsg {buildUnchoke()};
-                                    if (ctx.unchokeAttempts > MAX_UNCHOKE_ATTEMPTS - 1) {
-                                        Logging::Dynamic::Debug("[{}] Exceeded max unchoke attempts, disconnecting", ctx.ID);
-                                        ctx.closed = true;
-                                    }
-
-                                    // If buffer already has unchoke, we haven't had
-                                    // a chance to send to client yet, don't increase attempts
-                                    else if (ctx.sendBuffer != unchokeMsg) {
-                                        ++ctx.unchokeAttempts;
-                                        Logging::Dynamic::Debug("[{}] Building unchoke for client, attempt: {}/{}", 
-                                                ctx.ID, ctx.unchokeAttempts, MAX_UNCHOKE_ATTEMPTS);
-                                        ctx.sendBuffer = unchokeMsg;
-                                    }
-                                }
-
-                                // If unchoked & peer not throttled, try requesting for block(s) available from peer
-                                else if (ctx.backlog < MAX_BACKLOG) {
-                                    auto pendingBlocks {pieceManager.getPendingBlocks(ctx.haves, MAX_BACKLOG - ctx.backlog)};
-                                    Logging::Dynamic::Debug("[{}] Building request for {} blocks", ctx.ID, pendingBlocks.size());
-                                    for (auto [pieceIdx, blockOffset, blockSize]: pendingBlocks) {
-                                        Logging::Dynamic::Trace("[{}] Building request for block (pIdx={}, bOffset={}, bSize={})", 
-                                                ctx.ID, pieceIdx, blockOffset, blockSize);
-                                        ctx.sendBuffer += buildRequest(pieceIdx, blockOffset, blockSize);
-                                        ctx.pending.emplace(pieceIdx, blockOffset, blockSize);
-                                        ++ctx.backlog;
-                                    }
-                                }
-
-                                ctx.recvBuffer = ctx.recvBuffer.substr(msgLen + 4);
-                            } // while IsCompleteMessage && !ctx.closed
-
-                        } // if ctx.handshaked
-
-                    } // if iSize
-
-                } // if !ctx.closed && event is readable
-
-                if (!ctx.closed && event & net::PollEventType::Writable) {
-                    try {
-                        long sentBytes {ctx.sendBuffer.empty()? 0: peer.sendAll(ctx.sendBuffer)};
-                        if (sentBytes) {
-                            Logging::Dynamic::Debug("[{}] Sent {} bytes to client", ctx.ID, sentBytes);
-                            ctx.sendBuffer = ctx.sendBuffer.substr(static_cast<std::size_t>(sentBytes));
-                        }
-                    } catch (net::SocketError &err) { 
-                        Logging::Dynamic::Debug("[{}] Send to client failed: {}", ctx.ID, err.what());
-                        ctx.closed = true;
+                    // If buffer already ends with interested, we haven't had
+                    // a chance to send to client yet, don't increase attempts
+                    else if (ctx.unchokeAttempts < MAX_UNCHOKE_ATTEMPTS && !ctx.sendBuffer.ends_with(interestedMsg)) {
+                        ++ctx.unchokeAttempts;
+                        Logging::Dynamic::Debug("[{}] Building interested for client, attempt: {}/{}", 
+                                ctx.ID, ctx.unchokeAttempts, MAX_UNCHOKE_ATTEMPTS);
+                        ctx.sendBuffer += interestedMsg;
                     }
                 }
 
-                // Drop client on closed or err event
-                if (event & net::PollEventType::Error || event & net::PollEventType::Closed || peer.fd() == -1) { 
-                    Logging::Dynamic::Debug("[{}] Got closed/err event", ctx.ID);
-                    ctx.closed = true;
-                }
+                // If unchoked (or choked with pieces allowed fast) & peer not throttled, 
+                // try requesting for block(s) available from peer
+                if (const std::uint16_t depth {pipelineDepth(ctx)}; 
+                    (!ctx.choked || !ctx.allowedFast.empty()) && ctx.backlog < depth)
+                    requestBlocks(ctx, depth);
+
+                remaining.remove_prefix(msgLen + 4);
+            } // while complete messages && !ctx.closed
+
+            ctx.recvBuffer.erase(0, ctx.recvBuffer.size() - remaining.size());
+
+        } // if ctx.handshaked
+    }
+
+    void TorrentDownloader::requestBlocks(PeerContext &ctx, std::uint16_t depth) {
+        // While choked only the pieces the peer allows fast can be requested
+        DynamicBitset allowed;
+        if (ctx.choked) {
+            allowed = DynamicBitset{torrentFile.numPieces};
+            for (std::uint32_t pieceIdx: ctx.allowedFast)
+                if (ctx.haves.test(pieceIdx)) allowed.set(pieceIdx);
+        }
+        const DynamicBitset &available {ctx.choked? allowed: ctx.haves};
+
+        // In endgame every remaining block is in flight, request duplicates instead
+        auto requestCount {static_cast<std::uint16_t>(depth - ctx.backlog)};
+        auto pendingBlocks {pieceManager.inEndgame()?
+            pieceManager.getEndgameBlocks(available, ctx.pending, requestCount):
+            pieceManager.getPendingBlocks(available, requestCount, ctx.suggested)};
+        Logging::Dynamic::Debug("[{}] Building request for {} blocks", ctx.ID, pendingBlocks.size());
+        for (auto [pieceIdx, blockOffset, blockSize]: pendingBlocks) {
+            Logging::Dynamic::Trace("[{}] Building request for block (pIdx={}, bOffset={}, bSize={})", 
+                    ctx.ID, pieceIdx, blockOffset, blockSize);
+            ctx.sendBuffer += buildRequest(pieceIdx, blockOffset, blockSize);
+            ctx.pending.emplace(pieceIdx, blockOffset, blockSize);
+            ++ctx.backlog;
+        }
 
-                // Only track for events we are interested in
-                if (!ctx.closed) {
-                    if (ctx.sendBuffer.empty()) {
-                        pollManager.updateTracking(peer.fd(), net::PollEventType::Readable);
-                        Logging::Dynamic::Trace("[{}] Send buffer empty, listening only for READABLE events", ctx.ID);
-                    } else if (ctx.handshaked) {
-                        pollManager.updateTracking(peer.fd(), net::PollEventType::Readable | net::PollEventType::Writable);
-                        Logging::Dynamic::Trace("[{}] Send buffer not empty, listening for READABLE & WRITABLE events", ctx.ID);
+        // Time one request at a time for the RTT estimate
+        if (!ctx.rttProbe && !pendingBlocks.empty()) {
+            auto [pieceIdx, blockOffset, blockSize] {pendingBlocks.front()};
+            ctx.rttProbe.emplace(pieceIdx, blockOffset, blockSize);
+            ctx.rttProbeSentAt = std::chrono::steady_clock::now();
+        }
+    }
+
+    void TorrentDownloader::dropPeer(PeerContext &ctx, TimePoint lastTick) {
+        clearPendingFromPeer(ctx);
+        pieceManager.onPeerDisconnect(ctx.haves); ctx.haves.clear();
+        pollManager->untrack(ctx.fd);
+        fd2PeerID.erase(ctx.fd);
+        --limits->connections;
+        ctx.lastReadTimeStamp = lastTick;
+        Logging::Dynamic::Debug("[{}] Dropped client (Pending reconnects: {}/{}), still connected to {} clients", 
+            ctx.ID, ctx.reconnectAttempts, MAX_RECONNECT_ATTEMPTS, fd2PeerID.size());
+    }
+
+    void TorrentDownloader::addPeer(const std::string &ip, std::uint16_t port, TimePoint lastTick) {
+        std::optional<net::IP> ipType {net::utils::checkIPType(ip)};
+        if (!ipType.has_value()) { Logging::Dynamic::Debug("Invalid IP: {}", ip); return; }
+
+        // Known peers the tracker still reports get a fresh set of reconnect attempts
+        std::string peerID {ip + ':' + std::to_string(port)};
+        if (auto it {states.find(peerID)}; it != states.end()) {
+            if (it->second.closed && !it->second.inbound && !fd2PeerID.contains(it->second.fd))
+                it->second.reconnectAttempts = 0;
+            return;
+        }
+
+        PeerContext peerCtx {.ip=ip, .port=port, .ipV4=(ipType.value() == net::IP::V4), 
+            .ID=std::move(peerID), .fd=-1, .closed=true, 
+            .lastReadTimeStamp=(lastTick - std::chrono::seconds{MIN_RECON_WAIT_TIME})};
+        peerCtx.haves = DynamicBitset{torrentFile.numPieces};
+
+        if (limits->connections < limits->maxConnections) {
+            try {
+                auto peer {net::Socket{net::SOCKTYPE::TCP, ipType.value()}};
+                peer.setNonBlocking(); peer.connect(ip, port);
+                peerCtx.fd = peer.fd(); peerCtx.closed = false; 
+                peerCtx.sendBuffer = handshake; peerCtx.lastReadTimeStamp = lastTick;
+                fd2PeerID.emplace(peer.fd(), peerCtx.ID);
+                pollManager->track(std::move(peer), net::PollEventType::Writable);
+                ++limits->connections;
+                Logging::Dynamic::Debug("Intiating connection with {}:{}", ip, port);
+            } catch (net::SocketError &err) {
+                Logging::Dynamic::Debug("[{}] Connect failed: {}", peerCtx.ID, err.what());
+            }
+        }
+
+        states.emplace(peerCtx.ID, std::move(peerCtx));
+    }
+
+    void TorrentDownloader::reannounce(TimePoint now) {
+        // Peers from a finished announce join the running swarm
+        if (announcing.valid()) {
+            if (announcing.wait_for(std::chrono::seconds{0}) != std::future_status::ready) return;
+            try {
+                std::size_t known {states.size()};
+                const std::vector<TorrentTracker::Peer> peers {announcing.get()};
+                for (const auto &[ip, port]: peers) addPeer(ip, port, now);
+                nextAnnounce = now + std::chrono::seconds{torrentTracker.interval};
+                if (announced) Logging::Dynamic::Info("[{}] Re-announced, {} new peers (seeders: {}, leechers: {})", 
+                    torrentFile.name, states.size() - known, torrentTracker.seeders, torrentTracker.leechers);
+                else Logging::Dynamic::Info("[{}] Discovered {} peers from {} trackers, connected to {}", torrentFile.name, 
+                    peers.size(), torrentTracker.trackerCount(), fd2PeerID.size());
+            } catch (std::exception &ex) {
+                // With the DHT or web seeds to fall back on dead trackers aren't fatal
+                nextAnnounce = now + ANNOUNCE_RETRY;
+                if (announced || dht || !webSeeds.empty()) 
+                    Logging::Dynamic::Warn("[{}] Announce failed: {}", torrentFile.name, ex.what());
+                else Logging::Dynamic::Error("[{}] No peers available: {}", torrentFile.name, ex.what());
+            }
+            announced = true;
+        }
+
+        // Trackers are queried off the event loop, stats are only updated while no announce is running
+        if (now < nextAnnounce) return;
+        torrentTracker.left = pieceManager.remaining() * std::uint64_t{torrentFile.pieceSize};
+        torrentTracker.downloaded = downloadedBytes; torrentTracker.uploaded = uploadedBytes;
+        announcing = std::async(std::launch::async, [&tracker = torrentTracker, timeout = announceTimeout] {
+            return tracker.getPeers(timeout); });
+        nextAnnounce = TimePoint::max();
+    }
+
+    void TorrentDownloader::lookupDHT(TimePoint now) {
+        if (dhtLookup.valid()) {
+            if (dhtLookup.wait_for(std::chrono::seconds{0}) != std::future_status::ready) return;
+            std::size_t known {states.size()};
+            const std::vector<TorrentTracker::Peer> peers {dhtLookup.get()};
+            for (const auto &[ip, port]: peers) addPeer(ip, port, now);
+            nextDHTLookup = now + (peers.empty()? DHT_RETRY: DHT_INTERVAL);
+            Logging::Dynamic::Info("[{}] DHT lookup found {} peers, {} new", torrentFile.name, peers.size(), states.size() - known);
+        }
+
+        // Seeds keep looking so that they stay announced
+        if (now < nextDHTLookup) return;
+        dhtLookup = std::async(std::launch::async, [node = dht, &infoHash = torrentFile.infoHash,
+            port = torrentTracker.port, timeout = std::chrono::seconds{announceTimeout}] {
+            return node->getPeers(infoHash, port, timeout); });
+        nextDHTLookup = TimePoint::max();
+    }
+
+    void TorrentDownloader::start(net::PollManager &pollManager, SessionLimits &limits, int timeout) {
+        this->pollManager = &pollManager; this->limits = &limits;
+        announceTimeout = timeout;
+        diskWriter.setWantedFiles(wantedFiles);
+
+        // The first announce runs off the event loop like the later ones, peers are connected as it completes
+        // within the session budget, the rest are parked as closed for the reconnect path to pick up
+        auto lastTick {std::chrono::steady_clock::now()};
+        nextAnnounce = lastTick;
+        reannounce(lastTick);
+
+        // Web seeds connect from `step` once resolved
+        for (WebSeed &seed: webSeeds) seed.resolve();
+        if (!webSeeds.empty()) Logging::Dynamic::Info("[{}] Using {}/{} web seeds", torrentFile.name,
+            std::ranges::count_if(webSeeds, &WebSeed::active), webSeeds.size());
+
+        std::size_t pendingPieceCount {pieceManager.remaining()};
+        double pendingSize {pendingPieceCount * torrentFile.pieceSize / (1024. * 1024.)};
+        Logging::Dynamic::Info("[{}] Announcing to {} trackers, pending download: {:.2f} MB", 
+            torrentFile.name, torrentTracker.trackerCount(), pendingSize);
+
+        // First DHT lookup goes out with the next step, the torrent's own nodes help a fresh node join
+        if (dht) {
+            for (const auto &[host, port]: torrentFile.dhtNodes) dht->addContact(host, port);
+            nextDHTLookup = lastTick;
+        }
+
+        lastChokeRound = lastOptimisticRound = lastRateRound = lastTick;
+    }
+
+    void TorrentDownloader::adoptInbound(int fd, const std::string &ip, std::uint16_t port, 
+            std::string &&recvBuffer, TimePoint lastTick) 
+    {
+        // Inbound peers never get reconnected once dropped
+        PeerContext peerCtx {.ip=ip, .port=port, .ipV4=true, .ID=(ip + ':' + std::to_string(port)), 
+            .fd=fd, .inbound=true, .reconnectAttempts=MAX_RECONNECT_ATTEMPTS, 
+            .recvBuffer=std::move(recvBuffer), .sendBuffer=handshake, .lastReadTimeStamp=lastTick};
+        peerCtx.haves = DynamicBitset{torrentFile.numPieces};
+        if (auto it {states.find(peerCtx.ID)}; it != states.end()) {
+            if (fd2PeerID.contains(it->second.fd)) {
+                pollManager->untrack(fd); --limits->connections;
+                return;
+            }
+            states.erase(it);
+        }
+
+        fd2PeerID.emplace(fd, peerCtx.ID);
+        Logging::Dynamic::Debug("[{}] Accepted inbound connection", peerCtx.ID);
+        auto &ctx {states.emplace(peerCtx.ID, std::move(peerCtx)).first->second};
+        pollManager->updateTracking(fd, net::PollEventType::Readable | net::PollEventType::Writable);
+        processRecvBuffer(ctx);
+    }
+
+    void TorrentDownloader::onEvent(net::Socket &peer, net::PollEventType event, TimePoint lastTick) {
+        if (auto seedIt {std::ranges::find(webSeeds, peer.fd(), &WebSeed::fd)}; seedIt != webSeeds.end())
+            return onWebSeedEvent(*seedIt, peer, event, lastTick);
+
+        PeerContext &ctx {states.at(fd2PeerID.at(peer.fd()))};
+
+        if (!ctx.closed && event & net::PollEventType::Readable) {
+            // Handshakes are never throttled, afterwards reads stay within the session & peer limits
+            std::size_t recvBytes {}, allowed {TokenBucket::UNLIMITED};
+            if (ctx.handshaked) allowed = limits->download.grant(ctx.downloadLimit.available());
+            try { if (allowed) recvBytes = peer.recvAll(ctx.recvBuffer, 1 << 14, allowed); } 
+            catch (net::SocketError &err) {
+                Logging::Dynamic::Debug("[{}] Recv from client failed: {}", ctx.ID, err.what());
+                ctx.closed = true;
+            }
+
+            if (recvBytes && ctx.handshaked) {
+                limits->download.consume(recvBytes);
+                ctx.downloadLimit.consume(recvBytes);
+            }
+
+            if (recvBytes) {
+                Logging::Dynamic::Debug("[{}] Recv {} bytes from client", ctx.ID, recvBytes);
+                ctx.lastReadTimeStamp = lastTick;
+                Logging::Dynamic::Trace("[{}] Current recv buffer size: {}", ctx.ID, ctx.recvBuffer.size());
+                processRecvBuffer(ctx);
+            }
+        }
+
+        if (!ctx.closed && event & net::PollEventType::Writable) {
+            serveRequests(ctx);
+            std::size_t allowed {TokenBucket::UNLIMITED};
+            if (ctx.handshaked && !ctx.sendBuffer.empty()) allowed = limits->upload.grant(ctx.uploadLimit.available());
+            try {
+                long sentBytes {ctx.sendBuffer.empty() || !allowed? 0: 
+                    peer.sendAll(std::string_view{ctx.sendBuffer}.substr(0, allowed))};
+                if (sentBytes) {
+                    Logging::Dynamic::Debug("[{}] Sent {} bytes to client", ctx.ID, sentBytes);
+                    ctx.sendBuffer.erase(0, static_cast<std::size_t>(sentBytes));
+                    if (ctx.handshaked) {
+                        limits->upload.consume(static_cast<std::size_t>(sentBytes));
+                        ctx.uploadLimit.consume(static_cast<std::size_t>(sentBytes));
                     }
                 }
-            } // for poll loop
-
-            // Process the clients that didn't send us anything or were closed inside our poll loop
-            for (auto &[fd, ctx]: states) {
-                auto timeDiff {lastTick - ctx.lastReadTimeStamp};
-                auto diffInSec {std::chrono::duration_cast<std::chrono::seconds>(timeDiff).count()};
-                // Good peers
-                if (!ctx.closed && diffInSec < MAX_REQ_WAIT_TIME) continue;
-
-                // Timed out peers (handshaked or not handshaked)
-                else if (!ctx.closed) {
-                    Logging::Dynamic::Trace("[{}] Client idled out, no message received for {}s", ctx.ID, diffInSec);
-                    if (ctx.choked) {
-                        Logging::Dynamic::Debug("[{}] Not handshaked or choked for too long, dropping", ctx.ID, diffInSec);
-                        ctx.closed = true;
-                    } else if (ctx.backlog) {
-                        Logging::Dynamic::Debug("[{}] Building cancel request for {} blocks", ctx.ID, ctx.pending.size());
-                        ctx.sendBuffer = "";
-                        for (auto [pieceIdx, blockOffset, blockSize]: ctx.pending) {
-                            Logging::Dynamic::Trace("[{}] Building cancel request for block (pIdx={}, bOffset={}, bSize={})", 
-                                ctx.ID, pieceIdx, blockOffset, blockSize);
-                            ctx.sendBuffer += buildRequest(pieceIdx, blockOffset, blockSize, false);
-                        }
-                        clearPendingFromPeer(ctx);
-                    }
+            } catch (net::SocketError &err) { 
+                Logging::Dynamic::Debug("[{}] Send to client failed: {}", ctx.ID, err.what());
+                ctx.closed = true;
+            }
+        }
+
+        // Drop client on closed or err event
+        if (event & net::PollEventType::Error || event & net::PollEventType::Closed || peer.fd() == -1) { 
+            Logging::Dynamic::Debug("[{}] Got closed/err event", ctx.ID);
+            ctx.closed = true;
+        }
+
+        // Only track for events we are interested in
+        if (!ctx.closed) updateInterest(ctx);
+    }
+
+    void TorrentDownloader::updateInterest(PeerContext &ctx) {
+        // Outbound sockets wait for the connect to complete until the handshake is out
+        if (!ctx.handshaked && !ctx.sendBuffer.empty()) return;
+
+        // Level triggered poll would spin on a socket we can't service, throttled
+        // directions are dropped from the poll set until the buckets refill
+        const bool wantsSend {!ctx.sendBuffer.empty() || (!ctx.requests.empty() && !ctx.awaitingRead)};
+        const bool sendThrottled {!ctx.uploadLimit.available() || limits->upload.exhausted()};
+        ctx.recvThrottled = ctx.handshaked && (!ctx.downloadLimit.available() || limits->download.exhausted());
+
+        auto events {ctx.recvThrottled? net::PollEventType::Unknown: net::PollEventType::Readable};
+        if (ctx.handshaked && wantsSend && !sendThrottled) events |= net::PollEventType::Writable;
+        pollManager->updateTracking(ctx.fd, events);
+        Logging::Dynamic::Trace("[{}] Listening for READABLE: {}, WRITABLE: {} events", ctx.ID, 
+            events & net::PollEventType::Readable, events & net::PollEventType::Writable);
+    }
+
+    void TorrentDownloader::onWebSeedEvent(WebSeed &seed, net::Socket &socket, net::PollEventType event, TimePoint lastTick) {
+        try {
+            if (event & net::PollEventType::Writable && !seed.sendBuffer.empty()) {
+                long sentBytes {socket.sendAll(seed.sendBuffer)};
+                seed.sendBuffer.erase(0, static_cast<std::size_t>(sentBytes));
+            }
+
+            // Responses count against the session download limit, blocks take the same path as those from peers
+            if (event & net::PollEventType::Readable) {
+                std::string data;
+                const std::size_t allowed {limits->download.grant(TokenBucket::UNLIMITED)};
+                const std::size_t recvBytes {allowed? socket.recvAll(data, 1 << 14, allowed): 0};
+                limits->download.consume(recvBytes);
+                if (recvBytes) seed.onData(data, lastTick, [this](const PieceBlock &block, std::string_view bytes) {
+                    downloadedBytes += block.blockSize;
+                    if (pieceManager.inEndgame()) cancelDuplicateRequests(block);
+                    if (SharedPiece piece {pieceManager.onBlockReceived(block.pieceIdx, block.blockOffset, bytes)})
+                        verifyPiece(block.pieceIdx, std::move(piece));
+                });
+            }
+        } catch (std::exception &ex) {
+            Logging::Dynamic::Warn("[{}] Web seed {} dropped: {}", torrentFile.name, seed.url(), ex.what());
+            return dropWebSeed(seed, lastTick, true);
+        }
+
+        // Servers close idle keep-alive connections, only errors or a close with requests in flight are failures
+        if (event & net::PollEventType::Error || event & net::PollEventType::Closed || socket.fd() == -1 || seed.done())
+            return dropWebSeed(seed, lastTick, event & net::PollEventType::Error || seed.inFlight());
+        updateInterest(seed);
+    }
+
+    void TorrentDownloader::updateInterest(WebSeed &seed) {
+        seed.recvThrottled = limits->download.exhausted();
+        auto events {seed.recvThrottled? net::PollEventType::Unknown: net::PollEventType::Readable};
+        if (!seed.sendBuffer.empty()) events |= net::PollEventType::Writable;
+        pollManager->updateTracking(seed.fd(), events);
+    }
+
+    void TorrentDownloader::dropWebSeed(WebSeed &seed, TimePoint lastTick, bool failed) {
+        pollManager->untrack(seed.fd());
+        pieceManager.onPeerReset(seed.disconnect(lastTick, failed, MAX_RECONNECT_ATTEMPTS));
+        Logging::Dynamic::Debug("[{}] Disconnected from web seed {}", torrentFile.name, seed.url());
+    }
+
+    void TorrentDownloader::serviceWebSeeds(TimePoint lastTick) {
+        for (WebSeed &seed: webSeeds) {
+            // Nothing left to fetch, or requests stalled for as long as we would wait on a peer
+            if (seed.fd() != -1 && (pieceManager.finished() || (seed.inFlight() && !seed.recvThrottled &&
+                lastTick - seed.lastReadTimeStamp() >= std::chrono::seconds{MAX_REQ_WAIT_TIME})))
+            {
+                if (!pieceManager.finished()) Logging::Dynamic::Debug("[{}] Web seed {} timed out", torrentFile.name, seed.url());
+                dropWebSeed(seed, lastTick, !pieceManager.finished());
+            }
+            if (pieceManager.finished()) continue;
+
+            if (seed.due(lastTick)) {
+                try { pollManager->track(seed.connect(lastTick), net::PollEventType::Writable); }
+                catch (net::SocketError &err) {
+                    Logging::Dynamic::Debug("[{}] Web seed {} connect failed: {}", torrentFile.name, seed.url(), err.what());
+                    pieceManager.onPeerReset(seed.disconnect(lastTick, true, MAX_RECONNECT_ATTEMPTS));
+                    continue;
                 }
+            }
+
+            // Endgame duplicates are left to the peers, a web seed is one connection & would only queue them up
+            if (seed.ready() && !pieceManager.inEndgame() && seed.inFlight() < WEB_SEED_QUEUE) {
+                const auto count {static_cast<std::uint16_t>((WEB_SEED_QUEUE - seed.inFlight()) / blockSize)};
+                seed.request(pieceManager.getPendingBlocks(allPieces, count));
+            }
+            if (seed.fd() != -1) updateInterest(seed);
+        }
+    }
+
+    void TorrentDownloader::setFilePriorities(std::vector<FilePriority> priorities) {
+        const auto &files {torrentFile.files};
+        if (priorities.size() > files.size())
+            throw std::runtime_error("Got " + std::to_string(priorities.size()) + " file priorities for a torrent with "
+                + std::to_string(files.size()) + " files");
+        priorities.resize(files.size(), FilePriority::Normal);
+        pieceManager.setFilePriorities(files, priorities);
+
+        std::uint64_t wantedSize {};
+        wantedFiles.assign(files.size(), true);
+        for (std::size_t fileIdx {}; fileIdx < files.size(); ++fileIdx) {
+            wantedFiles[fileIdx] = priorities[fileIdx] != FilePriority::Skip;
+            if (wantedFiles[fileIdx]) wantedSize += files[fileIdx].size;
+            Logging::Dynamic::Debug("[{}] File #{} {}: {}", torrentFile.name, fileIdx, files[fileIdx].path.string(), str(priorities[fileIdx]));
+        }
+
+        // Disk space for newly wanted files is reserved right away once running, otherwise on `start`
+        if (pollManager) diskWriter.setWantedFiles(wantedFiles);
+        Logging::Dynamic::Info("[{}] {}/{} files selected ({:.2f} MB)", torrentFile.name,
+            std::ranges::count(wantedFiles, true), files.size(), static_cast<double>(wantedSize) / (1024 * 1024));
+    }
+
+    std::shared_ptr<StreamSource> TorrentDownloader::enableStreaming() {
+        if (stream) return stream;
+        stream = std::make_shared<StreamSource>(torrentFile.name, torrentFile.pieceSize, torrentFile.length,
+            torrentFile.files, diskWriter.stagingPath(), pieceManager.getHaves());
+
+        // Pieces become readable once written, not when verified since they may still be queued
+        diskWriter.addWriteListener([source = stream](std::uint64_t offset, std::uint64_t length) {
+            source->markWritten(offset, length);
+        });
+        return stream;
+    }
+
+    bool TorrentDownloader::step(TimePoint lastTick) {
+        // Pieces hashed since the last tick are written & announced from the network thread,
+        // peers waiting on upload reads are served as the reads complete
+        drainVerified();
+        drainReads();
+
+        // Keep the pieces just ahead of the stream reader at the front of the request order
+        if (stream) {
+            if (auto cursor {stream->cursor()}) {
+                const std::uint64_t windowPieces {std::max<std::uint64_t>(2, STREAM_WINDOW / torrentFile.pieceSize)};
+                pieceManager.setPriorityWindow(static_cast<std::uint32_t>(*cursor / torrentFile.pieceSize),
+                    static_cast<std::uint32_t>(windowPieces));
+            }
+        }
+
+        // Once complete keep serving peers until the seed limits are reached
+        if (pieceManager.finished()) {
+            if (!seedStart) {
+                seedStart = lastTick;
+                if (seeding(lastTick)) Logging::Dynamic::Info("[{}] Download complete, seeding to peers", torrentFile.name);
+            }
+            if (!seeding(lastTick)) return false;
+        }
 
-                if (ctx.closed) {
-                    // Dropped from the poll loop or from timing out from above block
-                    if (fd2PeerID.contains(ctx.fd)) {
-                        clearPendingFromPeer(ctx);
-                        pollManager.untrack(ctx.fd);
-                        fd2PeerID.erase(ctx.fd);
-                        ctx.lastReadTimeStamp = lastTick;
-                        Logging::Dynamic::Debug("[{}] Dropped client (Pending reconnects: {}/{}), still connected to {} clients", 
-                            ctx.ID, ctx.reconnectAttempts, MAX_RECONNECT_ATTEMPTS, pollManager.size());
+        // Process the clients that didn't send us anything or were closed inside our poll loop
+        bool awaitingReconnect {false};
+        for (auto &[fd, ctx]: states) {
+            auto timeDiff {lastTick - ctx.lastReadTimeStamp};
+            auto diffInSec {std::chrono::duration_cast<std::chrono::seconds>(timeDiff).count()};
+
+            // Seeds have nothing to offer once we are complete
+            if (!ctx.closed && pieceManager.finished() && ctx.haves.all()) {
+                Logging::Dynamic::Debug("[{}] Both sides are seeds, dropping", ctx.ID);
+                ctx.reconnectAttempts = MAX_RECONNECT_ATTEMPTS; ctx.closed = true;
+            }
+
+            // Per peer limits may have been changed at runtime
+            ctx.downloadLimit.setRate(limits->peerDownloadRate); ctx.downloadLimit.refill(lastTick);
+            ctx.uploadLimit.setRate(limits->peerUploadRate); ctx.uploadLimit.refill(lastTick);
+
+            // Handlers of other peers may have queued messages (haves, cancels, choke updates),
+            // peers throttled on either direction are re-armed once tokens are back
+            if (!ctx.closed && ctx.handshaked && (!ctx.sendBuffer.empty() || !ctx.requests.empty() || ctx.recvThrottled))
+                updateInterest(ctx);
+
+            // Good peers, ones we stopped reading from haven't had the chance to send anything
+            if (!ctx.closed && (diffInSec < MAX_REQ_WAIT_TIME || ctx.recvThrottled)) continue;
+
+            // Timed out peers (handshaked or not handshaked)
+            else if (!ctx.closed) {
+                Logging::Dynamic::Trace("[{}] Client idled out, no message received for {}s", ctx.ID, diffInSec);
+                // Peers waiting on us to unchoke them are kept around for the choker
+                if (ctx.choked && !ctx.peerInterested) {
+                    Logging::Dynamic::Debug("[{}] Not handshaked or choked for too long, dropping", ctx.ID, diffInSec);
+                    ctx.closed = true;
+                } else if (ctx.backlog) {
+                    Logging::Dynamic::Debug("[{}] Building cancel request for {} blocks", ctx.ID, ctx.pending.size());
+                    for (auto [pieceIdx, blockOffset, blockSize]: ctx.pending) {
+                        Logging::Dynamic::Trace("[{}] Building cancel request for block (pIdx={}, bOffset={}, bSize={})", 
+                            ctx.ID, pieceIdx, blockOffset, blockSize);
+                        ctx.sendBuffer += buildRequest(pieceIdx, blockOffset, blockSize, true);
                     }
+                    clearPendingFromPeer(ctx);
+                }
+            }
 
-                    // Already been dropped and set threshold time has passed, try to reconnect
-                    else if (diffInSec >= MIN_RECON_WAIT_TIME && ctx.reconnectAttempts < MAX_RECONNECT_ATTEMPTS) {
+            if (ctx.closed) {
+                // Dropped from the poll loop or from timing out from above block
+                if (fd2PeerID.contains(ctx.fd)) dropPeer(ctx, lastTick);
+
+                // Already been dropped and set threshold time has passed, try to reconnect if the session has room
+                else if (ctx.reconnectAttempts < MAX_RECONNECT_ATTEMPTS && !pieceManager.finished()) {
+                    awaitingReconnect = true;
+                    if (diffInSec >= MIN_RECON_WAIT_TIME && limits->connections < limits->maxConnections) {
                         auto peer {net::Socket{net::SOCKTYPE::TCP, ctx.ipV4? net::IP::V4: net::IP::V6}};
                         peer.setNonBlocking(); peer.connect(ctx.ip, ctx.port);
                         ctx.onReconnect(peer.fd(), lastTick); fd2PeerID.emplace(peer.fd(), ctx.ID); 
-                        pollManager.track(std::move(peer), net::PollEventType::Writable);
+                        pollManager->track(std::move(peer), net::PollEventType::Writable);
+                        ++limits->connections;
                         ctx.sendBuffer = handshake;
                         Logging::Dynamic::Debug("Re-Initiating connection with {}, attempt: {}/{}", 
-                            ctx.ID, ctx.reconnectAttempts, 3);
+                            ctx.ID, ctx.reconnectAttempts, MAX_RECONNECT_ATTEMPTS);
                     }
-                } 
+                }
+            } 
+        }
+
+        // Periodically resize request queues, refresh peers from the trackers & pick the peers we upload to
+        serviceWebSeeds(lastTick);
+        updatePipelines(lastTick);
+        reannounce(lastTick);
+        if (dht) lookupDHT(lastTick);
+        runChoker(lastTick);
+
+        // Seeds stay alive without peers to accept inbound connections, with the DHT we keep waiting for peers
+        const bool webSeeding {!pieceManager.finished() && std::ranges::any_of(webSeeds, &WebSeed::active)};
+        const bool dhtWaiting {dht && !pieceManager.finished()};
+        return !fd2PeerID.empty() || awaitingReconnect || webSeeding || dhtWaiting || verifying || 
+            announcing.valid() || seedStart.has_value();
+    }
+
+    TorrentMetrics TorrentDownloader::metrics(TimePoint now) {
+        TorrentMetrics result {.name=torrentFile.name, .infoHash=torrentFile.infoHash, .downloadedBytes=downloadedBytes,
+            .uploadedBytes=uploadedBytes, .verifiedBytes=verifiedBytes, .wastedBytes=wastedBytes, .hashFailures=hashFailures,
+            .goodput=goodput, .piecesDone=pieceManager.getHaves().count(), .numPieces=torrentFile.numPieces,
+            .diskQueueDepth=diskWriter.queueDepth()};
 
+        using Seconds = std::chrono::duration<double>;
+        for (const auto &[id, ctx]: states) {
+            if (!ctx.handshaked || ctx.closed) continue;
+            const auto chokedTime {ctx.chokedTime + (ctx.choked? now - ctx.chokedSince: TimePoint::duration{})};
+            result.peers.push_back({.id=ctx.ID, .downloadRate=ctx.rate, .uploadRate=ctx.uploadRate,
+                .rttSeconds=Seconds{ctx.minRtt}.count(), .chokedSeconds=Seconds{chokedTime}.count(),
+                .outstanding=ctx.backlog, .choked=ctx.choked,
+                .snubbed=!ctx.choked && ctx.backlog && now - ctx.lastBlockAt >= SNUB_TIMEOUT});
+        }
+        return result;
+    }
+
+    bool TorrentDownloader::stop() {
+        if (pollManager) {
+            for (auto &[fd, peerID]: fd2PeerID) {
+                pollManager->untrack(fd);
+                --limits->connections;
             }
+            fd2PeerID.clear();
+            limits->unchoked -= unchokedCount; unchokedCount = 0;
+            for (WebSeed &seed: webSeeds)
+                if (seed.fd() != -1) dropWebSeed(seed, std::chrono::steady_clock::now(), false);
+        }
 
-        } // while not interrupted && pieceManager not empty && poll manager has tracking sockets
+        // Wait for pieces still being hashed so that they make it to disk & the saved state
+        while (verifying) {
+            drainVerified();
+            if (verifying) std::this_thread::sleep_for(std::chrono::milliseconds{1});
+        }
 
         // Display status to user
-        if (interrupted) Logging::Dynamic::Warn("Interupt received, states will be saved before exit");
-        bool status {diskWriter.finish(torrentFile.files, pieceManager.finished())};
-        Logging::Dynamic::Info("Download status: {}", (status? "DONE": "PENDING"));
+        bool status {diskWriter.finish(pieceManager.finished())};
+        if (stream) stream->close();
+        Logging::Dynamic::Info("[{}] Download status: {}", torrentFile.name, (status? "DONE": "PENDING"));
+        return status;
     }
 };
@@ -2,39 +2,25 @@
 #include "../include/torrent_file.hpp"
 
 #include "../../cryptography/hashlib.hpp"
-#include "../../json-parser/json/json.hpp"
 #include "../../misc/logger.hpp"
 
 #include <fstream>
 
 namespace Torrent {
-    std::uint64_t TorrentFile::calculateTotalLength(JSON::JSONHandle info) {
-        auto files {info["files"]};
-        if (!files.ptr) return static_cast<std::uint64_t>(info.at("length").to<std::int64_t>());
-        else {
-            auto filesObj {files.cast<JSON::JSONArrayNode>()};
-            return std::accumulate(filesObj.begin(), filesObj.end(), std::uint64_t {}, 
-                [] (std::uint64_t acc, JSON::JSONHandle file) {
-                    return acc + static_cast<std::uint64_t>(file.at("length").to<std::int64_t>());
-                }
-            );
-        }
-    }
-
-    std::vector<FileStruct> TorrentFile::parseFileStructure(JSON::JSONHandle info) {
-        auto files {info["files"]};
-        if (!files.ptr) return {{
-            info.at("name").to<std::string>(), 
-            static_cast<std::uint64_t>(info.at("length").to<std::int64_t>())
+    std::vector<FileStruct> TorrentFile::parseFileStructure(const Bencode::View &info) {
+        Bencode::View files {info["files"]};
+        if (!files) return {{
+            std::string{info.at("name").str()},
+            static_cast<std::uint64_t>(info.at("length").integer())
         }};
 
         else {
             std::vector<FileStruct> result;
-            for (JSON::JSONHandle file: files) {
+            for (auto [_, file]: files) {
                 auto filePath = std::ranges::fold_left(file.at("path"), std::filesystem::path {}, 
-                [] (auto acc, JSON::JSONHandle curr) { return acc / curr.to<std::string>(); });
-                auto fileSize {static_cast<std::uint64_t>(file.at("length").to<std::int64_t>())};
-                result.emplace_back(filePath, fileSize);
+                [] (auto acc, const auto &curr) { return acc / curr.second.str(); });
+                auto fileSize {static_cast<std::uint64_t>(file.at("length").integer())};
+                result.emplace_back(std::move(filePath), fileSize);
             }
             return result;
         }
@@ -50,28 +36,52 @@ namespace Torrent {
         ifs.seekg(0, std::ios::beg);
         ifs.read(buffer.data(), size);
 
-        // Read the bencoded torrent file
-        JSON::JSONHandle root = Bencode::decode(buffer);
+        // Read the bencoded torrent file, fields are views into the buffer
+        const Bencode::View root {Bencode::View::parse(buffer)};
 
-        // Extract the announce URL from torrent file
-        announceURL = root.at("announce").to<std::string>();
+        // Extract the tracker tiers, announce-list supersedes the announce URL when present
+        for (auto [_, tier]: root["announce-list"]) {
+            std::vector<std::string> urls;
+            for (auto [_, url]: tier) urls.emplace_back(url.str());
+            if (!urls.empty()) announceList.push_back(std::move(urls));
+        }
+        if (announceList.empty() && root["announce"])
+            announceList.push_back({std::string{root["announce"].str()}});
+
+        // Web seeds, `url-list` may be a single URL or a list of them
+        if (Bencode::View urlList {root["url-list"]}; urlList) {
+            if (urlList.type() == Bencode::View::Type::string) webSeeds.emplace_back(urlList.str());
+            else for (auto [_, url]: urlList) webSeeds.emplace_back(url.str());
+            std::erase_if(webSeeds, [](const std::string &url) { return url.empty(); });
+        }
+
+        // DHT nodes, a list of [host, port] pairs. Entries we can't make sense of are skipped
+        for (auto [_, node]: root["nodes"]) {
+            if (node.type() != Bencode::View::Type::list) continue;
+            try {
+                const std::string_view host {node[0].str()};
+                const std::int64_t port {node[1].integer()};
+                if (!host.empty() && port > 0 && port <= 65535) dhtNodes.emplace_back(host, static_cast<std::uint16_t>(port));
+            } catch (std::exception&) { continue; }
+        }
 
         // Extract other required fields
-        JSON::JSONHandle info {root.at("info")};
-        name = info.at("name").to<std::string>();
-        length = calculateTotalLength(info);
-        pieceSize = static_cast<std::uint32_t>(info["piece length"].to<std::int64_t>()); 
-        pieceBlob = info["pieces"].to<std::string>();
-        numPieces = (length + pieceSize - 1) / pieceSize;
+        const Bencode::View info {root.at("info")};
+        name = info.at("name").str();
+        pieceSize = static_cast<std::uint32_t>(info["piece length"].integer()); 
+        pieceBlob = info["pieces"].str();
 
         // Parse the 'files' meta to replicate it post download if applicable
         files = parseFileStructure(info);
+        multiFile = static_cast<bool>(info["files"]);
+        length = std::ranges::fold_left(files, std::uint64_t {}, [](std::uint64_t acc, const FileStruct &file) { return acc + file.size; });
+        numPieces = (length + pieceSize - 1) / pieceSize;
 
         // Sanity check on blob validity - can be equally split
         if (pieceBlob.size() % 20) throw std::runtime_error("Piece blob is corrupted");
 
-        // Reencode just the info dict to compute its sha1 hash (raw hash)
-        infoHash = hashutil::sha1(Bencode::encode(info.ptr, true), true);
+        // Info hash is over the info dict exactly as it appears in the file
+        infoHash = hashutil::sha1(info.raw(), true);
 
         // Print out the meta
         Logging::Dynamic::Info(
@@ -81,12 +91,17 @@ namespace Torrent {
             "  {:<12} {}\n"
             "  {:<12} {}\n"
             "  {:<12} {}\n"
+            "  {:<12} {}\n"
+            "  {:<12} {}\n"
             "  {:<12} {}",
             "Name:",       name,
             "Length:",     length,
             "Piece Size:", pieceSize,
             "Num Pieces:", numPieces,
-            "Announce:",   announceURL,
+            "Trackers:",   std::ranges::fold_left(announceList, std::size_t {}, 
+                               [](std::size_t acc, const auto &tier) { return acc + tier.size(); }),
+            "Web Seeds:",  webSeeds.size(),
+            "DHT Nodes:",  dhtNodes.size(),
             "File Count:", files.size()
         );
     }
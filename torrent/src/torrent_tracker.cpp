@@ -3,14 +3,35 @@
 #include "../include/bencode.hpp"
 #include "../include/protocol.hpp"
 
+#include "../../misc/logger.hpp"
+
+#include <algorithm>
+#include <future>
+#include <random>
+#include <unordered_set>
+
+namespace {
+    // Compact peer list: 4 byte IPv4 address followed by a 2 byte port, both big endian
+    std::vector<Torrent::TorrentTracker::Peer> parseCompactPeers(std::string_view compact) {
+        std::vector<Torrent::TorrentTracker::Peer> peers;
+        for (auto substr: compact | std::ranges::views::chunk(6)) {
+            if (substr.size() < 6) break;
+            std::string ip {substr.begin(), substr.begin() + 4};
+            std::uint16_t port; std::memcpy(&port, substr.data() + 4, 2);
+            peers.push_back({net::utils::ipBytesToString(ip), net::utils::bswap(port)});
+        }
+        return peers;
+    }
+}
+
 namespace Torrent {
-    std::vector<std::pair<std::string, std::uint16_t>> TorrentTracker::getUDPPeers(int timeout) {
+    TorrentTracker::Announce TorrentTracker::announceUDP(net::URL &url, int timeout) const {
         // Build & send a connection request (TODO: Implement retry logic)
         [[maybe_unused]] long sentBytes;
         std::string cReq {buildConnectionRequest()};
         net::Socket udpSock {net::SOCKTYPE::UDP};
         udpSock.setTimeout(timeout, timeout);
-        udpSock.connect(announceURL.ipAddr, announceURL.port);
+        udpSock.connect(url.resolve(), url.port);
         sentBytes = udpSock.send(cReq);
         std::string cResp {udpSock.recv()};
 
@@ -21,61 +42,130 @@ namespace Torrent {
             throw std::runtime_error("Invalid conn response from tracker");
 
         // Build & send a announce request (TODO: Implement retry logic)
-        std::string aReq {buildAnnounceRequest(torrentFile, cResp.substr(8, 8))};
+        std::string aReq {buildAnnounceRequest(*this, cResp.substr(8, 8))};
         sentBytes = udpSock.send(aReq);
         std::string aResp {udpSock.recv()}; // Ensure we read complete IP addrs
 
         // Validate announce response
-        if (!(aResp.size() >= 16 && 
+        if (!(aResp.size() >= 20 &&
             std::equal(aResp.begin(), aResp.begin() + 4, aReq.begin() + 8) &&
             std::equal(aResp.begin() + 4, aResp.begin() + 8, aReq.begin() + 12)))
             throw std::runtime_error("Invalid announce response from tracker");
 
         // Store the tracker-interval, seeders, leechers
-        std::memcpy(&interval, aResp.c_str() + 8, 4);
-        std::memcpy(&leechers, aResp.c_str() + 12, 4);
-        std::memcpy(&seeders, aResp.c_str() + 16, 4);
-        net::utils::inplace_bswap(interval, leechers, seeders);
+        Announce result;
+        std::memcpy(&result.interval, aResp.c_str() + 8, 4);
+        std::memcpy(&result.leechers, aResp.c_str() + 12, 4);
+        std::memcpy(&result.seeders, aResp.c_str() + 16, 4);
+        net::utils::inplace_bswap(result.interval, result.leechers, result.seeders);
 
         // Extract the peers
-        std::vector<std::pair<std::string, std::uint16_t>> peers;
-        auto substrs {std::string_view{aResp.data() + 20, aResp.size() - 20} | std::ranges::views::chunk(6)};
-        for (auto substr: substrs) {
-            std::string ip {substr.begin(), substr.begin() + 4};
-            std::uint16_t port; std::memcpy(&port, substr.data() + 4, 2);
-            peers.push_back({net::utils::ipBytesToString(ip), net::utils::bswap(port)});
-        }
-
-        return peers;
+        result.peers = parseCompactPeers(std::string_view{aResp}.substr(20));
+        return result;
     }
 
-    std::vector<std::pair<std::string, std::uint16_t>> TorrentTracker::getTCPPeers(int timeout) {
-        announceURL.params.clear();
+    TorrentTracker::Announce TorrentTracker::announceHTTP(const net::URL &url, int timeout) const {
+        // Params already on the announce URL (passkeys etc) are kept
+        net::URL announceURL {url};
         announceURL.setParam("info_hash", torrentFile.infoHash);
         announceURL.setParam("peer_id", peerID);
-        announceURL.setParam("port", "6881");
-        announceURL.setParam("uploaded", "0");
-        announceURL.setParam("downloaded", "0");
-        announceURL.setParam("left", std::to_string(torrentFile.length));
+        announceURL.setParam("port", std::to_string(port));
+        announceURL.setParam("uploaded", std::to_string(uploaded));
+        announceURL.setParam("downloaded", std::to_string(downloaded));
+        announceURL.setParam("left", std::to_string(left));
+        announceURL.setParam("compact", "1");
         net::HttpRequest req {announceURL};
         req.setHeader("user-agent", "CTorrent");
         net::HttpResponse resp{req.execute(timeout)};
 
         std::string respBodyStr {resp.header("transfer-encoding") == "chunked"? resp.unchunk(): resp.body};
         JSON::JSONHandle respBody {Bencode::decode(respBodyStr)};
-        std::vector<std::pair<std::string, std::uint16_t>> peers;
-        for (JSON::JSONHandle ipObj: respBody["peers"])
-            peers.push_back({ipObj["ip"].to<std::string>(), ipObj["port"].to<std::int64_t>()});     
+        if (auto failure {respBody["failure reason"]}; failure.ptr)
+            throw std::runtime_error("Tracker failure: " + failure.to<std::string>());
+
+        Announce result {.peers={},
+            .interval=static_cast<std::uint32_t>(respBody["interval"].to<std::int64_t>()),
+            .seeders=static_cast<std::uint32_t>(respBody["complete"].to<std::int64_t>()),
+            .leechers=static_cast<std::uint32_t>(respBody["incomplete"].to<std::int64_t>())};
+
+        // Trackers may ignore `compact` and send the dictionary model instead
+        JSON::JSONHandle peers {respBody["peers"]};
+        if (peers.ptr && peers.getType() == JSON::NodeType::value)
+            result.peers = parseCompactPeers(peers.to<std::string>());
+        else for (JSON::JSONHandle ipObj: peers)
+            result.peers.push_back({ipObj["ip"].to<std::string>(), ipObj["port"].to<std::int64_t>()});
+
+        return result;
+    }
+
+    TorrentTracker::Announce TorrentTracker::announceTier(std::vector<net::URL> &tier, int timeout) const {
+        for (auto it {tier.begin()}; it != tier.end(); ++it) {
+            try {
+                Announce result {it->protocol == "udp"? announceUDP(*it, timeout): announceHTTP(*it, timeout)};
+                Logging::Dynamic::Debug("[{}] Tracker {}://{} returned {} peers", torrentFile.name,
+                    it->protocol, it->domain, result.peers.size());
+                std::rotate(tier.begin(), it, it + 1);
+                return result;
+            } catch (std::exception &ex) {
+                Logging::Dynamic::Debug("[{}] Tracker {}://{} failed: {}", torrentFile.name,
+                    it->protocol, it->domain, ex.what());
+            }
+        }
+        throw std::runtime_error("No tracker in tier responded");
+    }
 
+    std::vector<TorrentTracker::Peer> TorrentTracker::getPeers(int timeout) {
+        // Tiers only touch their own trackers, announce to all of them in parallel
+        std::vector<std::future<Announce>> pending;
+        for (auto &tier: tiers)
+            pending.push_back(std::async(std::launch::async, [this, &tier, timeout] { return announceTier(tier, timeout); }));
+
+        // Merge, dropping peers reported by more than one tracker
+        std::vector<Peer> peers; std::unordered_set<std::string> seen;
+        std::size_t responded {}; std::uint32_t nextInterval {};
+        for (auto &future: pending) {
+            try {
+                Announce result {future.get()};
+                if (!responded++) { nextInterval = result.interval; seeders = 0; leechers = 0; }
+                nextInterval = std::min(nextInterval, result.interval);
+                seeders = std::max(seeders, result.seeders);
+                leechers = std::max(leechers, result.leechers);
+                for (auto &peer: result.peers)
+                    if (seen.insert(peer.first + ':' + std::to_string(peer.second)).second)
+                        peers.push_back(std::move(peer));
+            } catch (std::exception &ex) {
+                Logging::Dynamic::Debug("[{}] {}", torrentFile.name, ex.what());
+            }
+        }
+
+        if (!responded) throw std::runtime_error("None of the " + std::to_string(trackerCount()) + " trackers responded");
+        interval = std::max(nextInterval, MIN_INTERVAL);
         return peers;
     }
 
-    std::vector<std::pair<std::string, std::uint16_t>> TorrentTracker::getPeers(int timeout) {
-        return announceURL.protocol == "udp"? getUDPPeers(timeout): getTCPPeers(timeout);
+    std::size_t TorrentTracker::trackerCount() const {
+        return std::ranges::fold_left(tiers, std::size_t {}, [](std::size_t acc, const auto &tier) { return acc + tier.size(); });
     }
 
-    TorrentTracker::TorrentTracker(const TorrentFile &torrentFile): 
-        peerID {generatePeerID()}, torrentFile{torrentFile}, 
-        announceURL{torrentFile.announceURL} 
-    { announceURL.resolve(); }
+    TorrentTracker::TorrentTracker(const TorrentFile &torrentFile, const std::uint16_t port, const std::uint32_t minInterval):
+        MIN_INTERVAL {minInterval}, peerID {generatePeerID()}, torrentFile{torrentFile}, port {port}, left {torrentFile.length}
+    {
+        // Trackers within a tier are shuffled once (BEP 12), unsupported ones are skipped
+        static std::mt19937 rng {std::random_device{}()};
+        for (const auto &urls: torrentFile.announceList) {
+            std::vector<net::URL> tier;
+            for (const std::string &url: urls) {
+                try {
+                    net::URL parsed {url};
+                    if (parsed.protocol == "udp" || parsed.protocol == "http" || parsed.protocol == "https")
+                        tier.push_back(std::move(parsed));
+                    else Logging::Dynamic::Debug("[{}] Skipping unsupported tracker: {}", torrentFile.name, url);
+                } catch (std::exception &ex) {
+                    Logging::Dynamic::Debug("[{}] Skipping invalid tracker {}: {}", torrentFile.name, url, ex.what());
+                }
+            }
+            std::ranges::shuffle(tier, rng);
+            if (!tier.empty()) tiers.push_back(std::move(tier));
+        }
+    }
 }
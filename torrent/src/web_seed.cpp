@@ -0,0 +1,174 @@
+#include "../include/web_seed.hpp"
+#include "../include/torrent_file.hpp"
+
+#include "../../misc/logger.hpp"
+
+#include <algorithm>
+#include <charconv>
+#include <stdexcept>
+
+namespace {
+    // Path components are percent encoded one by one, separators are kept
+    std::string encodePath(const std::filesystem::path &path) {
+        std::string result;
+        for (const auto &component: path) {
+            if (!result.empty()) result += '/';
+            result += net::URL::encode(component.string(), false);
+        }
+        return result;
+    }
+
+    std::uint64_t toNumber(std::string_view str) {
+        std::uint64_t value {};
+        auto [ptr, ec] {std::from_chars(str.data(), str.data() + str.size(), value)};
+        if (str.empty() || ec != std::errc{} || ptr != str.data() + str.size())
+            throw std::runtime_error("Invalid number in response: " + std::string{str});
+        return value;
+    }
+}
+
+namespace Torrent {
+    WebSeed::WebSeed(const std::string &url, const TorrentFile &torrent):
+        pieceSize {torrent.pieceSize}, _url {url}, baseURL {url}
+    {
+        if (baseURL.protocol != "http") throw std::runtime_error("Unsupported web seed protocol: " + baseURL.protocol);
+        host = baseURL.domain + (baseURL.port != 80? ":" + std::to_string(baseURL.port): "");
+
+        // Single file torrents are at the URL itself unless it names a directory,
+        // multi file torrents are under <url>/<name>/ (BEP 19)
+        std::string base {baseURL.path};
+        if (torrent.multiFile || base.ends_with('/')) {
+            if (!base.ends_with('/')) base += '/';
+            base += net::URL::encode(torrent.name, false);
+        }
+
+        std::uint64_t offset {};
+        for (const auto &[path, size]: torrent.files) {
+            if (size) files.emplace_back(offset, size, torrent.multiFile? base + '/' + encodePath(path): base);
+            offset += size;
+        }
+    }
+
+    void WebSeed::resolve() {
+        try { baseURL.resolve(); }
+        catch (std::exception &ex) {
+            Logging::Dynamic::Warn("Web seed {} is unreachable: {}", _url, ex.what());
+            disabled = true;
+        }
+    }
+
+    net::Socket WebSeed::connect(TimePoint now) {
+        net::Socket socket {net::SOCKTYPE::TCP, baseURL.ipType};
+        socket.setNonBlocking(); socket.connect(baseURL.ipAddr, baseURL.port);
+        _fd = socket.fd(); lastRead = now; closeRequested = false;
+        Logging::Dynamic::Debug("Connecting to web seed {}", _url);
+        return socket;
+    }
+
+    std::vector<PieceBlock> WebSeed::disconnect(TimePoint now, bool failed, std::uint8_t maxFailures) {
+        std::vector<PieceBlock> unfinished {pending.begin(), pending.end()};
+        pending.clear(); requests.clear(); recvBuffer.clear(); block.clear(); sendBuffer.clear();
+        bodyLeft = pendingBytes = 0; _fd = -1;
+
+        if (failed && ++failures >= maxFailures) {
+            Logging::Dynamic::Warn("Web seed {} failed {} times in a row, giving up on it", _url, failures);
+            disabled = true;
+        }
+        retryAt = now + RETRY_INTERVAL * failures;
+        return unfinished;
+    }
+
+    void WebSeed::queueRange(std::uint64_t first, std::uint64_t last) {
+        // A range crossing file boundaries turns into a request per file, answered back to back
+        auto it {std::ranges::upper_bound(files, first, {}, [](const File &file) { return file.offset + file.size; })};
+        for (; it != files.end() && it->offset < last; ++it) {
+            const std::uint64_t start {std::max(first, it->offset) - it->offset};
+            const std::uint64_t end {std::min(last, it->offset + it->size) - it->offset};
+
+            net::URL fileURL {baseURL}; fileURL.setPathWithoutParams(it->path);
+            net::HttpRequest request {fileURL};
+            request.setHeader("Host", host);
+            request.setHeader("Range", "bytes=" + std::to_string(start) + "-" + std::to_string(end - 1));
+            request.setHeader("Connection", "keep-alive");
+            request.setHeader("User-Agent", "ctorrent");
+            sendBuffer += request.toString();
+            requests.push_back({.length=end - start, .wholeFile=(!start && end == it->size)});
+        }
+    }
+
+    void WebSeed::request(std::vector<std::tuple<std::uint32_t, std::uint32_t, std::uint32_t>> blocks) {
+        if (blocks.empty()) return;
+        auto offsetOf {[this](const auto &block) {
+            return std::uint64_t{std::get<0>(block)} * pieceSize + std::get<1>(block); }};
+        std::ranges::sort(blocks, {}, offsetOf);
+
+        // Blocks are laid out back to back in torrent order, runs without gaps share their requests
+        std::uint64_t runStart {offsetOf(blocks.front())}, runEnd {runStart};
+        for (const auto &[pieceIdx, blockOffset, blockSize]: blocks) {
+            const std::uint64_t offset {std::uint64_t{pieceIdx} * pieceSize + blockOffset};
+            if (offset != runEnd) { queueRange(runStart, runEnd); runStart = offset; }
+            runEnd = offset + blockSize;
+            pending.emplace_back(pieceIdx, blockOffset, blockSize);
+            pendingBytes += blockSize;
+        }
+        queueRange(runStart, runEnd);
+        Logging::Dynamic::Debug("Requested {} blocks from web seed {}", blocks.size(), _url);
+    }
+
+    void WebSeed::parseHeader(std::string_view header) {
+        // HTTP/1.1 <status> <reason>, headers are keyed in lower case
+        auto [statusLine, headers, _] {net::utils::parseHttpString(header)};
+        const std::size_t statusStart {statusLine.find(' ') + 1};
+        const std::uint64_t status {toNumber(std::string_view{statusLine}.substr(statusStart, 3))};
+
+        auto headerValue {[&headers](const std::string &key) {
+            auto it {headers.find(key)};
+            return it != headers.end() && !it->second.empty()? net::utils::toLower(it->second.front()): std::string{};
+        }};
+
+        // Servers ignoring the range answer 200 with the whole file, only usable if that's what we asked for
+        const Request request {requests.front()}; requests.pop_front();
+        if (status != 206 && !(status == 200 && request.wholeFile))
+            throw std::runtime_error("Server replied " + std::string{statusLine.substr(statusStart)});
+        if (headerValue("transfer-encoding").contains("chunked"))
+            throw std::runtime_error("Chunked responses are not supported");
+        if (toNumber(headerValue("content-length")) != request.length)
+            throw std::runtime_error("Response length doesn't match the requested range");
+        if (headerValue("connection").contains("close")) closeRequested = true;
+        bodyLeft = request.length;
+    }
+
+    void WebSeed::onData(std::string_view data, TimePoint now, const BlockHandler &onBlock) {
+        lastRead = now; recvBuffer += data;
+        std::string_view remaining {recvBuffer};
+        while (!remaining.empty()) {
+            if (!bodyLeft) {
+                if (requests.empty()) throw std::runtime_error("Got data that wasn't asked for");
+                const std::size_t headerEnd {remaining.find("\r\n\r\n")};
+                if (headerEnd == std::string_view::npos) {
+                    if (remaining.size() > MAX_HEADER_SIZE) throw std::runtime_error("Response header too large");
+                    break;
+                }
+                parseHeader(remaining.substr(0, headerEnd + 4));
+                remaining.remove_prefix(headerEnd + 4);
+                continue;
+            }
+
+            // Body bytes are cut into the blocks they were requested for
+            const auto chunk {static_cast<std::size_t>(std::min<std::uint64_t>(bodyLeft, remaining.size()))};
+            for (std::string_view body {remaining.substr(0, chunk)}; !body.empty();) {
+                if (pending.empty()) throw std::runtime_error("Response is longer than the blocks requested");
+                const PieceBlock &current {pending.front()};
+                const std::size_t take {std::min<std::size_t>(current.blockSize - block.size(), body.size())};
+                block.append(body.substr(0, take)); body.remove_prefix(take);
+                if (block.size() == current.blockSize) {
+                    const PieceBlock done {current};
+                    pending.pop_front(); pendingBytes -= done.blockSize;
+                    onBlock(done, block); block.clear(); failures = 0;
+                }
+            }
+            bodyLeft -= chunk; remaining.remove_prefix(chunk);
+        }
+        recvBuffer.erase(0, recvBuffer.size() - remaining.size());
+    }
+}
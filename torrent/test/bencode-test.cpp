@@ -0,0 +1,159 @@
+// Bencode reader checks & benchmark: the zero copy `Bencode::View` must agree with the `decode` DOM on
+// well formed input and reject malformed input. Large synthetic .torrent files (a huge pieces blob, 100k+
+// files) are then loaded both ways, timing parse + info hash and loading them through `TorrentFile`
+
+#include "../include/bencode.hpp"
+#include "../include/torrent_file.hpp"
+
+#include "../../cryptography/hashlib.hpp"
+#include "../../json-parser/json/json.hpp"
+#include "../../misc/logger.hpp"
+
+#include <unistd.h>
+
+#include <chrono>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <print>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+using Clock = std::chrono::steady_clock;
+
+const std::string GREEN{"\033[32m"};
+const std::string RED{"\033[31m"};
+const std::string RESET{"\033[0m"};
+
+namespace {
+    constexpr int BENCH_RUNS {5};
+
+    void printResult(bool condition, const std::string& message) {
+        std::cout << message << (condition ? GREEN + "PASS" + RESET : RED + "FAIL" + RESET) << "\n";
+    }
+
+    std::string bstr(std::string_view str) { return std::to_string(str.size()) + ':' + std::string{str}; }
+
+    bool throws(std::string_view encoded) {
+        try { (void) Bencode::View::parse(encoded); return false; }
+        catch (std::runtime_error&) { return true; }
+    }
+
+    // Best of a few runs in milliseconds
+    double bench(const std::function<void()> &fn) {
+        double best {std::numeric_limits<double>::max()};
+        for (int run {}; run < BENCH_RUNS; ++run) {
+            auto start {Clock::now()}; fn();
+            best = std::min(best, std::chrono::duration<double, std::milli>(Clock::now() - start).count());
+        }
+        return best;
+    }
+
+    // Synthetic torrent with keys in sorted order so that the re-encoded info dict matches the raw bytes
+    std::string makeTorrent(std::size_t numFiles, std::uint64_t fileSize, std::uint32_t pieceSize) {
+        std::mt19937_64 rng {42};
+        const std::uint64_t length {numFiles * fileSize};
+        std::string pieces((length + pieceSize - 1) / pieceSize * 20, '\0');
+        for (char &ch: pieces) ch = static_cast<char>(rng());
+
+        std::string info {"d"};
+        if (numFiles > 1) {
+            info += bstr("files") + 'l';
+            for (std::size_t i {}; i < numFiles; ++i) {
+                info += 'd' + bstr("length") + 'i' + std::to_string(fileSize) + 'e' + bstr("path") + 'l';
+                info += bstr("dir" + std::to_string(i % 100)) + bstr("file" + std::to_string(i) + ".bin") + "ee";
+            }
+            info += 'e';
+        } else info += bstr("length") + 'i' + std::to_string(length) + 'e';
+        info += bstr("name") + bstr("synthetic") + bstr("piece length") + 'i' + std::to_string(pieceSize) + 'e';
+        info += bstr("pieces") + bstr(pieces) + 'e';
+
+        return 'd' + bstr("announce") + bstr("http://127.0.0.1:6969/announce") + bstr("info") + info + 'e';
+    }
+
+    // The old way: build the DOM, re-encode the info dict & hash that
+    std::string domInfoHash(const std::string &encoded) {
+        JSON::JSONHandle root {Bencode::decode(encoded)};
+        return hashutil::sha1(Bencode::encode(root.at("info").ptr, true), true);
+    }
+
+    std::string viewInfoHash(const std::string &encoded) {
+        return hashutil::sha1(Bencode::View::parse(encoded).at("info").raw(), true);
+    }
+}
+
+int main() {
+    Logging::Dynamic::setLogLevel(Logging::Level::WARN);
+    bool passed {true}, result;
+
+    // Field access on a small document
+    {
+        const std::string encoded {"d4:listli1ei-22e3:abce4:name5:hello3:numi42e5:emptyde1:pli5e3:xyzee"};
+        Bencode::View root {Bencode::View::parse(encoded)};
+        result = root.type() == Bencode::View::Type::dict && root["name"].str() == "hello" && root["num"].integer() == 42
+            && root["list"][1].integer() == -22 && root["list"][2].str() == "abc" && !root["list"][3]
+            && root["empty"].type() == Bencode::View::Type::dict && root["empty"].begin() == root["empty"].end()
+            && root["missing"].str().empty() && !root["missing"].integer() && root["p"].at(1).raw() == "3:xyz";
+        printResult(result, std::format("{:<40}", "Field access: ")); passed &= result;
+
+        std::vector<std::string> keys;
+        for (auto [key, _]: root) keys.emplace_back(key);
+        result = keys == std::vector<std::string>{"list", "name", "num", "empty", "p"};
+        printResult(result, std::format("{:<40}", "Dict iteration in file order: ")); passed &= result;
+
+        result = false;
+        try { (void) root["name"].integer(); } catch (std::runtime_error&) { result = true; }
+        try { (void) root.at("missing"); result = false; } catch (std::runtime_error&) {}
+        printResult(result, std::format("{:<40}", "Type mismatch & missing key throw: ")); passed &= result;
+    }
+
+    // Malformed input is rejected up front
+    result = throws("") && throws("d") && throws("5:abc") && throws("i12") && throws("ie") && throws("i1x2e")
+        && throws("di1e1:ae") && throws("li1e") && throws("4:spam4:eggs") && throws("x") && throws("d1:a")
+        && throws(std::string(100000, 'l') + std::string(100000, 'e')) && throws("99999999999999999999999:a");
+    printResult(result, std::format("{:<40}", "Malformed input rejected: ")); passed &= result;
+
+    // Large torrents: 8 GB of 16 KB pieces (10 MB pieces blob) & 100k+ files
+    const fs::path root {fs::temp_directory_path() / ("ctorrent-bencode-" + std::to_string(getpid()))};
+    fs::create_directories(root);
+    struct Case { std::string name; std::size_t numFiles; std::uint64_t fileSize; std::uint32_t pieceSize; };
+    const std::vector<Case> cases {
+        {"huge-pieces", 1, std::uint64_t{8} << 30, 1 << 14},
+        {"many-files", 120'000, 1 << 16, 1 << 18},
+    };
+
+    std::println("{:<12} {:>8} {:>10} {:>11} {:>13} {:>14} {:>15}", "Torrent", "Size MB", "DOM ms", "View ms",
+        "DOM+hash ms", "View+hash ms", "TorrentFile ms");
+    std::vector<std::pair<std::string, bool>> matches;
+    for (const auto &[name, numFiles, fileSize, pieceSize]: cases) {
+        const std::string encoded {makeTorrent(numFiles, fileSize, pieceSize)};
+        const fs::path torrentPath {root / (name + ".torrent")};
+        std::ofstream{torrentPath, std::ios::binary} << encoded;
+
+        const std::string expected {domInfoHash(encoded)};
+        Torrent::TorrentFile torrent {torrentPath.string()};
+        result = viewInfoHash(encoded) == expected && torrent.infoHash == expected && torrent.files.size() == numFiles
+            && torrent.length == numFiles * fileSize && torrent.numPieces * 20 == torrent.pieceBlob.size();
+        matches.emplace_back(name, result);
+
+        const double domMs {bench([&] { (void) Bencode::decode(encoded); })};
+        const double viewMs {bench([&] { (void) Bencode::View::parse(encoded); })};
+        const double domHashMs {bench([&] { (void) domInfoHash(encoded); })};
+        const double viewHashMs {bench([&] { (void) viewInfoHash(encoded); })};
+        const double loadMs {bench([&] { Torrent::TorrentFile loaded {torrentPath.string()}; })};
+        std::println("{:<12} {:>8.1f} {:>10.1f} {:>11.1f} {:>13.1f} {:>14.1f} {:>15.1f}", name,
+            static_cast<double>(encoded.size()) / (1 << 20), domMs, viewMs, domHashMs, viewHashMs, loadMs);
+    }
+
+    for (const auto &[name, match]: matches) {
+        printResult(match, std::format("{:<40}", "Info hash & fields match (" + name + "): "));
+        passed &= match;
+    }
+
+    fs::remove_all(root);
+    return passed? 0: 1;
+}
@@ -0,0 +1,126 @@
+// Local DHT: a few dozen nodes on loopback join through a single entry node, then peers announced
+// from one end of the network must be found from the other. Also covers the node cache surviving
+// a restart & nodes shrugging off garbage datagrams
+
+#include "../include/dht.hpp"
+
+#include "../../cryptography/hashlib.hpp"
+#include "../../misc/logger.hpp"
+#include "../../networking/net.hpp"
+
+#include <arpa/inet.h>
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <format>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+
+namespace fs = std::filesystem;
+using Clock = std::chrono::steady_clock;
+
+const std::string GREEN{"\033[32m"};
+const std::string RED{"\033[31m"};
+const std::string RESET{"\033[0m"};
+
+namespace {
+    constexpr std::size_t NUM_NODES {32}, MIN_TABLE_SIZE {4};
+    constexpr std::chrono::milliseconds LOOKUP_TIMEOUT {3000};
+
+    void printResult(bool condition, const std::string& message) {
+        std::cout << message << (condition ? GREEN + "PASS" + RESET : RED + "FAIL" + RESET) << "\n";
+    }
+
+    bool hasPeer(const std::vector<Torrent::DHTNode::Peer> &peers, std::uint16_t port) {
+        return std::ranges::find(peers, Torrent::DHTNode::Peer{"127.0.0.1", port}) != peers.end();
+    }
+
+    // Wait until every node knows at least `count` others
+    bool waitForTables(const std::vector<std::unique_ptr<Torrent::DHTNode>> &nodes, std::size_t count) {
+        const auto deadline {Clock::now() + std::chrono::seconds{10}};
+        while (Clock::now() < deadline) {
+            if (std::ranges::all_of(nodes, [count](const auto &node) { return node->size() >= count; })) return true;
+            std::this_thread::sleep_for(std::chrono::milliseconds{50});
+        }
+        return false;
+    }
+}
+
+int main() {
+    Logging::Dynamic::setLogLevel(Logging::Level::WARN);
+    const fs::path root {fs::temp_directory_path() / ("ctorrent-dht-" + std::to_string(getpid()))};
+    fs::create_directories(root);
+    bool passed {true}, result;
+
+    // Everyone joins through the first node, no public routers involved
+    std::vector<std::unique_ptr<Torrent::DHTNode>> nodes;
+    nodes.push_back(std::make_unique<Torrent::DHTNode>(0, fs::path{}, std::vector<Torrent::DHTNode::Peer>{}));
+    for (std::size_t i {1}; i < NUM_NODES; ++i) {
+        nodes.push_back(std::make_unique<Torrent::DHTNode>(0, fs::path{}, std::vector<Torrent::DHTNode::Peer>{}));
+        nodes.back()->addContact("127.0.0.1", nodes.front()->port());
+    }
+
+    result = waitForTables(nodes, MIN_TABLE_SIZE);
+    printResult(result, std::format("{:<40}", "Routing tables filled: ")); passed &= result;
+
+    // Announce from one node, look up from another that never talked to it directly
+    const std::string infoHash {hashutil::sha1("ctorrent dht test", true)};
+    auto start {Clock::now()};
+    std::vector<Torrent::DHTNode::Peer> peers {nodes[NUM_NODES / 4]->getPeers(infoHash, 6881, LOOKUP_TIMEOUT)};
+    result = Clock::now() - start < LOOKUP_TIMEOUT;
+    printResult(result, std::format("{:<40}", "Lookup converges before timeout: ")); passed &= result;
+
+    std::this_thread::sleep_for(std::chrono::milliseconds{200});
+    peers = nodes[3 * NUM_NODES / 4]->getPeers(infoHash, 0, LOOKUP_TIMEOUT);
+    result = hasPeer(peers, 6881);
+    printResult(result, std::format("{:<40}", "Announced peer found by another node: ")); passed &= result;
+
+    peers = nodes[NUM_NODES / 2]->getPeers(hashutil::sha1("never announced", true), 0, LOOKUP_TIMEOUT);
+    result = peers.empty();
+    printResult(result, std::format("{:<40}", "No peers for an unknown hash: ")); passed &= result;
+
+    // Garbage, truncated & empty datagrams must not take a node down
+    {
+        net::Socket junk {net::SOCKTYPE::UDP, net::IP::V4};
+        const std::uint16_t target {nodes[1]->port()};
+        for (std::string_view message: {"not bencode", "d1:y1:qe", "d1:ad2:id3:abce1:q4:ping1:t2:aa1:y1:qe"})
+            junk.sendTo(message, "127.0.0.1", target);
+
+        // Empty datagrams read as EOF, Socket::sendTo won't send one
+        sockaddr_in addr {.sin_family=AF_INET, .sin_port=htons(target), .sin_addr={htonl(INADDR_LOOPBACK)}, .sin_zero={}};
+        ::sendto(junk.fd(), nullptr, 0, 0, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+        std::this_thread::sleep_for(std::chrono::milliseconds{200});
+        peers = nodes[1]->getPeers(infoHash, 0, LOOKUP_TIMEOUT);
+        result = hasPeer(peers, 6881);
+        printResult(result, std::format("{:<40}", "Node survives malformed messages: ")); passed &= result;
+    }
+
+    // A restarted node keeps its ID & rejoins from the cache alone
+    {
+        const fs::path cachePath {root / "dht-cache"};
+        std::string id;
+        {
+            Torrent::DHTNode node {0, cachePath, {}};
+            node.addContact("127.0.0.1", nodes.front()->port());
+            const auto deadline {Clock::now() + std::chrono::seconds{10}};
+            while (node.size() < MIN_TABLE_SIZE && Clock::now() < deadline)
+                std::this_thread::sleep_for(std::chrono::milliseconds{50});
+            id = node.id();
+        }
+
+        Torrent::DHTNode restarted {0, cachePath, {}};
+        result = fs::exists(cachePath) && restarted.id() == id;
+        printResult(result, std::format("{:<40}", "Node ID persisted in the cache: ")); passed &= result;
+
+        peers = restarted.getPeers(infoHash, 0, LOOKUP_TIMEOUT);
+        result = hasPeer(peers, 6881);
+        printResult(result, std::format("{:<40}", "Cached nodes bootstrap a lookup: ")); passed &= result;
+    }
+
+    nodes.clear();
+    fs::remove_all(root);
+    return passed? 0: 1;
+}
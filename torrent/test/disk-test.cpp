@@ -0,0 +1,180 @@
+// Disk backend checks & benchmark: a multi file torrent (pieces spanning file boundaries) is written out of
+// order through a `DiskWriter` on each backend, read back for upload (blocking & async) while & after it
+// lands and compared against the source once moved into place, also with an fd limit well below the file
+// count. Reports write & read throughput per backend
+
+#include "../include/disk_writer.hpp"
+#include "../include/piece_cache.hpp"
+
+#include "../../misc/logger.hpp"
+
+#include <poll.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <print>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+using Clock = std::chrono::steady_clock;
+
+const std::string GREEN{"\033[32m"};
+const std::string RED{"\033[31m"};
+const std::string RESET{"\033[0m"};
+
+namespace {
+    constexpr std::uint32_t PIECE_SIZE {1 << 18};
+    constexpr std::size_t NUM_FILES {40};
+
+    void printResult(bool condition, const std::string& message) {
+        std::cout << message << (condition ? GREEN + "PASS" + RESET : RED + "FAIL" + RESET) << "\n";
+    }
+
+    struct Backend { std::string name; std::size_t threads; Torrent::DiskBackend backend; std::size_t maxOpenFiles {512}; };
+
+    struct Result { 
+        double writeMBs {}, readMBs {}; std::size_t openFiles {}, syncs {}; 
+        bool readsMatch {false}, asyncMatch {false}, filesMatch {false}, uring {false}; 
+    };
+
+    Result run(const Backend &backend, const std::vector<Torrent::FileStruct> &files, const std::string &data,
+        const fs::path &root)
+    {
+        Result result;
+        const fs::path downloadDir {root / backend.name};
+        const auto numPieces {static_cast<std::uint32_t>((data.size() + PIECE_SIZE - 1) / PIECE_SIZE)};
+        Torrent::DiskIOPool pool {backend.threads, backend.backend, backend.maxOpenFiles};
+        result.uring = pool.usingIoUring();
+
+        // Tiny cache so that reads after the writes go to disk
+        Torrent::PieceCache cache {PIECE_SIZE};
+        Torrent::DiskWriter writer {pool, cache, "synthetic", data.size(), PIECE_SIZE, files, downloadDir, true};
+        writer.setWantedFiles({});
+        // Written files are synced on the pool's sync thread as the writes land
+        std::atomic<std::uint64_t> written {};
+        std::atomic<std::size_t> syncs {};
+        writer.setSyncTask([&writer, &syncs] { writer.syncFiles(); ++syncs; });
+        writer.addWriteListener([&written, &writer](std::uint64_t, std::uint64_t length) {
+            written.fetch_add(length); written.notify_all();
+            writer.requestSync();
+        });
+
+        // Pieces complete in random order in a real swarm
+        std::vector<std::uint32_t> order(numPieces);
+        for (std::uint32_t i {}; i < numPieces; ++i) order[i] = i;
+        std::ranges::shuffle(order, std::mt19937{7});
+        auto piece {[&data](std::uint32_t pieceIdx) {
+            const std::uint64_t offset {static_cast<std::uint64_t>(pieceIdx) * PIECE_SIZE};
+            return std::make_shared<const std::string>(data.substr(offset, PIECE_SIZE));
+        }};
+
+        // Reads racing the writes are served from memory or disk, either way they must be intact
+        result.readsMatch = true;
+        const auto start {Clock::now()};
+        for (std::size_t i {}; i < order.size(); ++i) {
+            writer.schedule(static_cast<std::uint64_t>(order[i]) * PIECE_SIZE, piece(order[i]));
+            if (i % 16 == 15) result.readsMatch &= *writer.read(order[i / 2]) == *piece(order[i / 2]);
+            result.openFiles = std::max(result.openFiles, pool.files().size());
+        }
+        for (std::uint64_t done; (done = written.load()) < data.size();) written.wait(done);
+        const double writeSecs {std::chrono::duration<double>(Clock::now() - start).count()};
+        result.writeMBs = static_cast<double>(data.size()) / (1 << 20) / writeSecs;
+
+        const auto readStart {Clock::now()};
+        for (std::uint32_t pieceIdx: order)
+            result.readsMatch &= *writer.read(pieceIdx) == *piece(pieceIdx);
+        const double readSecs {std::chrono::duration<double>(Clock::now() - readStart).count()};
+        result.readMBs = static_cast<double>(data.size()) / (1 << 20) / readSecs;
+
+        // Async reads land on the writer once the pool's completion fd fires, as in the event loop
+        result.asyncMatch = true;
+        for (std::size_t i {}; i < order.size() && result.asyncMatch; i += 8) {
+            Torrent::SharedPiece got;
+            while (result.asyncMatch && !(got = writer.tryRead(order[i]))) {
+                pollfd pfd {.fd=pool.completionFd(), .events=POLLIN, .revents=0};
+                result.asyncMatch = ::poll(&pfd, 1, 5000) == 1;
+                pool.clearCompletions();
+                for (const auto &read: writer.drainReads()) result.asyncMatch &= read.piece != nullptr;
+            }
+            result.asyncMatch &= got && *got == *piece(order[i]);
+        }
+
+        // Moved into place, every file must hold exactly its slice of the data
+        result.filesMatch = writer.finish(true);
+        result.syncs = syncs;
+        std::uint64_t offset {};
+        for (const auto &[path, size]: files) {
+            std::ifstream ifs {downloadDir / "synthetic" / path, std::ios::binary};
+            const std::string contents {std::istreambuf_iterator<char>{ifs}, {}};
+            result.filesMatch &= contents == std::string_view{data}.substr(offset, size);
+            offset += size;
+        }
+        return result;
+    }
+}
+
+int main() {
+    Logging::Dynamic::setLogLevel(Logging::Level::WARN);
+    bool passed {true};
+
+    // Odd sized files (including an empty one) so that most pieces straddle a file boundary
+    std::vector<Torrent::FileStruct> files;
+    std::uint64_t totalSize {};
+    for (std::size_t i {}; i < NUM_FILES; ++i) {
+        const std::uint64_t size {i == 3? 0: (std::uint64_t{3} << 20) + i * 77'777};
+        files.push_back({fs::path{"dir" + std::to_string(i % 4)} / ("file" + std::to_string(i) + ".bin"), size});
+        totalSize += size;
+    }
+
+    std::string data(totalSize, '\0');
+    std::mt19937_64 rng {42};
+    for (char &ch: data) ch = static_cast<char>(rng());
+
+    const fs::path root {fs::temp_directory_path() / ("ctorrent-disk-" + std::to_string(getpid()))};
+    fs::create_directories(root);
+    const std::vector<Backend> backends {
+        {"threads-1", 1, Torrent::DiskBackend::Threads},
+        {"threads-4", 4, Torrent::DiskBackend::Threads},
+        {"io_uring", 1, Torrent::DiskBackend::IoUring},
+        {"fds-8", 4, Torrent::DiskBackend::Threads, 8},
+        {"uring-fds-8", 1, Torrent::DiskBackend::IoUring, 8},
+    };
+
+    std::println("{:<10} {:>8} {:>14} {:>13}", "Backend", "Size MB", "Write MB/s", "Read MB/s");
+    std::vector<std::pair<Backend, Result>> results;
+    for (const Backend &backend: backends) {
+        Result result {run(backend, files, data, root)};
+        std::println("{:<10} {:>8.1f} {:>14.1f} {:>13.1f}{}", backend.name, static_cast<double>(totalSize) / (1 << 20),
+            result.writeMBs, result.readMBs, backend.backend == Torrent::DiskBackend::IoUring && !result.uring?
+            " (io_uring unavailable, ran on threads)": "");
+        results.emplace_back(backend, result);
+    }
+
+    for (const auto &[backend, result]: results) {
+        const std::string &name {backend.name};
+        printResult(result.readsMatch, std::format("{:<40}", "Reads match (" + name + "): "));
+        printResult(result.asyncMatch, std::format("{:<40}", "Async reads match (" + name + "): "));
+        printResult(result.filesMatch, std::format("{:<40}", "Files match (" + name + "): "));
+        printResult(result.syncs > 0, std::format("{:<40}", "Synced off the write path (" + name + "): "));
+        passed &= result.readsMatch && result.asyncMatch && result.filesMatch && result.syncs > 0;
+
+        // Files pinned by in flight writes may briefly push the cache past its limit, never up to every file
+        if (backend.maxOpenFiles < NUM_FILES) {
+            const bool bounded {result.openFiles <= backend.maxOpenFiles + 4};
+            printResult(bounded, std::format("{:<40}", "Open files bounded (" + name + "): "));
+            passed &= bounded;
+        }
+    }
+
+    fs::remove_all(root);
+    return passed? 0: 1;
+}
@@ -0,0 +1,131 @@
+// Piece selection checks: new pieces are started rarest first (availability from bitfields, haves &
+// disconnects), partial pieces are finished before anything new is started unless no other peer has it and
+// pieces a peer lacks are skipped
+
+#include "../include/dynamic_bitset.hpp"
+#include "../include/piece_cache.hpp"
+#include "../include/piece_manager.hpp"
+
+#include "../../misc/logger.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <format>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <tuple>
+#include <vector>
+
+const std::string GREEN{"\033[32m"};
+const std::string RED{"\033[31m"};
+const std::string RESET{"\033[0m"};
+
+namespace {
+    constexpr std::uint16_t BLOCK_SIZE {1 << 14}, BLOCKS_PER_PIECE {4};
+    constexpr std::uint32_t PIECE_SIZE {BLOCK_SIZE * BLOCKS_PER_PIECE};
+
+    // Distinct availability per piece, piece 3 is the rarest & piece 4 the most common
+    const std::vector<std::uint32_t> AVAILABILITY {5, 2, 7, 1, 8, 3, 6, 4};
+    const auto NUM_PIECES {static_cast<std::uint32_t>(AVAILABILITY.size())};
+
+    void printResult(bool condition, const std::string& message) {
+        std::cout << message << (condition ? GREEN + "PASS" + RESET : RED + "FAIL" + RESET) << "\n";
+    }
+
+    Torrent::DynamicBitset allPieces() {
+        Torrent::DynamicBitset pieces {NUM_PIECES}; pieces.setAll();
+        return pieces;
+    }
+
+    // Peers announce through bitfields, the i-th peer holds every piece at least i peers have
+    void announce(Torrent::PieceManager &manager) {
+        const std::uint32_t peers {std::ranges::max(AVAILABILITY)};
+        for (std::uint32_t peer {1}; peer <= peers; ++peer) {
+            Torrent::DynamicBitset haves {NUM_PIECES};
+            for (std::uint32_t pieceIdx {}; pieceIdx < NUM_PIECES; ++pieceIdx)
+                if (AVAILABILITY[pieceIdx] >= peer) haves.set(pieceIdx);
+            manager.onPeerBitfield(haves);
+        }
+    }
+
+    // Piece of the blocks handed out, nullopt if none or spanning several pieces
+    std::optional<std::uint32_t> pieceOf(const std::vector<std::tuple<std::uint32_t, std::uint32_t, std::uint32_t>> &blocks) {
+        if (blocks.empty()) return std::nullopt;
+        const std::uint32_t pieceIdx {std::get<0>(blocks.front())};
+        for (const auto &[idx, offset, size]: blocks) if (idx != pieceIdx) return std::nullopt;
+        return pieceIdx;
+    }
+}
+
+int main() {
+    Logging::Dynamic::setLogLevel(Logging::Level::ERROR);
+    const std::string pieceBlob(NUM_PIECES * 20, '\0');
+    const std::uint64_t totalSize {static_cast<std::uint64_t>(NUM_PIECES) * PIECE_SIZE};
+    Torrent::PieceCache cache {std::size_t{64} << 20};
+    bool passed {true}, result;
+
+    // Every new piece goes whole to a single call, they must come out in increasing availability
+    {
+        Torrent::PieceManager manager {totalSize, PIECE_SIZE, BLOCK_SIZE, pieceBlob, cache};
+        announce(manager);
+        std::vector<std::uint32_t> order;
+        for (std::uint32_t i {}; i < NUM_PIECES; ++i)
+            if (auto pieceIdx {pieceOf(manager.getPendingBlocks(allPieces(), BLOCKS_PER_PIECE))}) order.push_back(*pieceIdx);
+
+        result = order.size() == NUM_PIECES && order.front() == 3;
+        printResult(result, std::format("{:<40}", "Rarest piece is started first: ")); passed &= result;
+
+        result = order.size() == NUM_PIECES && std::ranges::is_sorted(order, {}, [](std::uint32_t p) { return AVAILABILITY[p]; });
+        printResult(result, std::format("{:<40}", "Pieces start in availability order: ")); passed &= result;
+    }
+
+    // A peer without the rarest piece is handed the next rarest it has
+    {
+        Torrent::PieceManager manager {totalSize, PIECE_SIZE, BLOCK_SIZE, pieceBlob, cache};
+        announce(manager);
+        Torrent::DynamicBitset haves {allPieces()}; haves.reset(3);
+        result = pieceOf(manager.getPendingBlocks(haves, BLOCKS_PER_PIECE)) == 1u;
+        printResult(result, std::format("{:<40}", "Pieces the peer lacks are skipped: ")); passed &= result;
+    }
+
+    // Haves & disconnects keep the counts current: piece 4 loses every holder but one, piece 3 gains some
+    {
+        Torrent::PieceManager manager {totalSize, PIECE_SIZE, BLOCK_SIZE, pieceBlob, cache};
+        announce(manager);
+        for (int i {}; i < 4; ++i) manager.onPeerHave(3);
+        Torrent::DynamicBitset gone {NUM_PIECES}; gone.set(4);
+        for (std::uint32_t i {1}; i < AVAILABILITY[4]; ++i) manager.onPeerDisconnect(gone);
+        const auto first {pieceOf(manager.getPendingBlocks(allPieces(), BLOCKS_PER_PIECE))};
+        const auto second {pieceOf(manager.getPendingBlocks(allPieces(), BLOCKS_PER_PIECE))};
+        result = first == 4u && second == 1u;
+        printResult(result, std::format("{:<40}", "Haves & disconnects update order: ")); passed &= result;
+    }
+
+    // Half of the rarest piece is requested, its other half goes out before any new piece is started
+    {
+        Torrent::PieceManager manager {totalSize, PIECE_SIZE, BLOCK_SIZE, pieceBlob, cache};
+        announce(manager);
+        const auto first {pieceOf(manager.getPendingBlocks(allPieces(), BLOCKS_PER_PIECE / 2))};
+        const auto rest {manager.getPendingBlocks(allPieces(), BLOCKS_PER_PIECE)};
+        result = first == 3u && rest.size() == BLOCKS_PER_PIECE && std::get<0>(rest.front()) == 3
+            && std::ranges::count(rest, 3u, [](const auto &block) { return std::get<0>(block); }) == BLOCKS_PER_PIECE / 2
+            && std::get<0>(rest.back()) == 1;
+        printResult(result, std::format("{:<40}", "Partial pieces come before new ones: ")); passed &= result;
+    }
+
+    // A common piece left partial by another peer waits while this peer has one nobody else has,
+    // not for pieces that are merely rarer
+    {
+        Torrent::PieceManager manager {totalSize, PIECE_SIZE, BLOCK_SIZE, pieceBlob, cache};
+        announce(manager);
+        Torrent::DynamicBitset common {NUM_PIECES}; common.set(4);
+        const auto partial {pieceOf(manager.getPendingBlocks(common, BLOCKS_PER_PIECE / 2))};
+        const auto next {manager.getPendingBlocks(allPieces(), BLOCKS_PER_PIECE)};
+        const auto after {manager.getPendingBlocks(allPieces(), BLOCKS_PER_PIECE / 2)};
+        result = partial == 4u && pieceOf(next) == 3u && pieceOf(after) == 4u;
+        printResult(result, std::format("{:<40}", "Rare new piece goes before partial: ")); passed &= result;
+    }
+
+    return passed? 0: 1;
+}
@@ -0,0 +1,111 @@
+// Session bookkeeping: adding, rejecting duplicates & removing torrents. The tracker stand-in accepts
+// announces but never answers, the event loop must keep turning while the announce is outstanding
+
+#include "../include/session.hpp"
+#include "../include/torrent_file.hpp"
+
+#include "../../cryptography/hashlib.hpp"
+#include "../../misc/logger.hpp"
+#include "../../networking/net.hpp"
+
+#include <poll.h>
+
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+namespace fs = std::filesystem;
+using Clock = std::chrono::steady_clock;
+
+const std::string GREEN{"\033[32m"};
+const std::string RED{"\033[31m"};
+const std::string RESET{"\033[0m"};
+
+namespace {
+    constexpr std::uint32_t PIECE_SIZE {1 << 16};
+    constexpr int TRACKER_TIMEOUT {2};
+    constexpr std::chrono::milliseconds MAX_POLL {250};
+
+    void printResult(bool condition, const std::string& message) {
+        std::cout << message << (condition ? GREEN + "PASS" + RESET : RED + "FAIL" + RESET) << "\n";
+    }
+
+    std::string bencodeStr(std::string_view str) { return std::to_string(str.size()) + ':' + std::string{str}; }
+
+    void writeTorrent(const fs::path &torrentPath, const std::string &name, const std::string &data, std::uint16_t trackerPort) {
+        std::string pieces;
+        for (std::size_t offset {}; offset < data.size(); offset += PIECE_SIZE)
+            pieces += hashutil::sha1(data.substr(offset, PIECE_SIZE), true);
+        std::string info {"d6:lengthi" + std::to_string(data.size()) + "e4:name" + bencodeStr(name)
+            + "12:piece lengthi" + std::to_string(PIECE_SIZE) + "e6:pieces" + bencodeStr(pieces) + "e"};
+        std::string announce {"http://127.0.0.1:" + std::to_string(trackerPort) + "/announce"};
+        std::ofstream ofs {torrentPath, std::ios::binary};
+        ofs << "d8:announce" << bencodeStr(announce) << "4:info" << info << "e";
+    }
+
+    // Accepts announces & holds the connections open without a reply
+    void runSilentTracker(net::Socket listener, std::atomic<bool> &stop, std::atomic<int> &announces) {
+        std::vector<net::Socket> held;
+        while (!stop) {
+            pollfd pfd {.fd=listener.fd(), .events=POLLIN, .revents=0};
+            if (::poll(&pfd, 1, 50) <= 0) continue;
+            try { held.push_back(listener.accept()); ++announces; }
+            catch (net::SocketError &) {}
+        }
+    }
+}
+
+int main() {
+    Logging::Dynamic::setLogLevel(Logging::Level::ERROR);
+    const fs::path root {fs::temp_directory_path() / ("ctorrent-session-" + std::to_string(getpid()))};
+    fs::create_directories(root / "downloads");
+    bool passed {true}, result;
+
+    net::Socket listener {net::SOCKTYPE::TCP, net::IP::V4};
+    listener.bind("127.0.0.1", 0); listener.listen(16);
+    sockaddr_in addr {}; socklen_t len {sizeof(addr)};
+    getsockname(listener.fd(), reinterpret_cast<sockaddr*>(&addr), &len);
+    std::atomic<bool> stop {false};
+    std::atomic<int> announces {};
+    std::thread tracker {runSilentTracker, std::move(listener), std::ref(stop), std::ref(announces)};
+
+    const std::string data(4 * PIECE_SIZE + 123, 'x');
+    writeTorrent(root / "a.torrent", "a.bin", data, ntohs(addr.sin_port));
+
+    {
+        Torrent::Session session {TRACKER_TIMEOUT, 0, 16, 4, 1, 1};
+        const std::string infoHash {session.add((root / "a.torrent").string(), root / "downloads")};
+        result = infoHash == Torrent::TorrentFile{(root / "a.torrent").string()}.infoHash && session.size() == 1;
+        printResult(result, std::format("{:<40}", "Add returns the info hash: ")); passed &= result;
+
+        bool rejected {false};
+        try { std::ignore = session.add((root / "a.torrent").string(), root / "downloads"); }
+        catch (std::runtime_error &) { rejected = true; }
+        result = rejected && session.size() == 1;
+        printResult(result, std::format("{:<40}", "Duplicate torrent is rejected: ")); passed &= result;
+
+        // The announce outlives these iterations, none of them may wait on it
+        auto slowest {Clock::duration::zero()};
+        bool running {true};
+        for (const auto start {Clock::now()}; running && Clock::now() - start < std::chrono::seconds{TRACKER_TIMEOUT} / 2;) {
+            const auto pollStart {Clock::now()};
+            running = session.poll(5);
+            slowest = std::max(slowest, Clock::now() - pollStart);
+        }
+        result = running && announces > 0 && slowest < MAX_POLL;
+        printResult(result, std::format("{:<40}", "Loop runs during the announce: ")); passed &= result;
+
+        session.remove(infoHash);
+        result = !session.poll(5) && session.size() == 0;
+        printResult(result, std::format("{:<40}", "Removed torrent is stopped: ")); passed &= result;
+    }
+
+    stop = true; tracker.join();
+    fs::remove_all(root);
+    return passed? 0: 1;
+}
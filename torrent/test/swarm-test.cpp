@@ -0,0 +1,468 @@
+// In-process swarm simulator: a synthetic torrent is served by a local HTTP tracker stand-in,
+// seeders on loopback with configurable bandwidth, latency, churn, corruption & missing pieces (some leaving
+// the swarm early) and optional HTTP web seeds. Each scenario downloads it with one or more leecher Sessions
+// (trading pieces among themselves) and reports time to complete, goodput, wasted bytes & CPU per GB, overall and on the network thread. Hash pool vs inline hashing
+// and adaptive vs fixed request queue depths are compared on the same swarms
+
+#include "../include/dynamic_bitset.hpp"
+#include "../include/protocol.hpp"
+#include "../include/session.hpp"
+#include "../include/torrent_file.hpp"
+
+#include "../../cryptography/hashlib.hpp"
+#include "../../misc/logger.hpp"
+#include "../../networking/net.hpp"
+
+#include <poll.h>
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <print>
+#include <random>
+#include <span>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+namespace fs = std::filesystem;
+using Clock = std::chrono::steady_clock;
+
+const std::string GREEN{"\033[32m"};
+const std::string RED{"\033[31m"};
+const std::string RESET{"\033[0m"};
+
+namespace {
+    constexpr std::uint32_t PIECE_SIZE {1 << 18}, NUM_PIECES {64};
+    constexpr std::chrono::seconds TIME_LIMIT {60};
+
+    // Pieces at the end of the torrent garbled once by corrupt seeders, requests still out for a piece
+    // failing its hash check (duplicates in endgame) are cancelled
+    constexpr std::uint32_t CORRUPT_PIECES {4};
+
+    // Leechers sharing a single throttled seeder in the trading scenario
+    constexpr std::size_t TRADING_LEECHERS {3};
+
+    // Link characteristics of a simulated seeder, zero disables the respective limit
+    struct PeerProfile {
+        std::uint64_t bytesPerSec {};
+        std::chrono::milliseconds latency {};  // delay before a request is served
+        std::chrono::milliseconds churn {};    // connections are dropped after roughly this long
+        bool corrupt {false};                  // first block served of each of the last pieces is garbled
+        std::uint32_t missing {};              // first pieces the seeder doesn't have
+        std::chrono::milliseconds leaveAfter {}; // seeder leaves the swarm this long after the start
+    };
+
+    // `hashThreads` of 0 verifies pieces inline on the network thread, `adaptiveBacklog` off keeps every
+    // peer at the initial request queue depth. Leechers all download at once & learn of each other from the tracker
+    struct Scenario { 
+        std::string name; std::vector<PeerProfile> seeders; std::size_t webSeeds {}, hashThreads {2}; 
+        bool adaptiveBacklog {true}; std::size_t leechers {1};
+    };
+
+    // State shared by the simulator threads of a scenario
+    struct Swarm {
+        const std::string &data;
+        const Torrent::TorrentFile &torrent;
+        const Clock::time_point start {Clock::now()};
+        std::atomic<bool> stop {false};
+        std::atomic<std::uint64_t> sentBytes {}, helperCpuUs {};
+
+        // Pieces requested from seeders that leave early, in order of first request
+        std::mutex mutex;
+        std::vector<std::uint32_t> leaverPieces;
+    };
+
+    // `rareFirst` is set for scenarios where only a seeder leaving early has some pieces: 
+    // whether those were the first it was asked for. `seededCopies` counts the copies seeders uploaded
+    struct Result { 
+        double seconds {}, goodput {}, wasted {}, cpuPerGB {}, loopCpuPerGB {}, seededCopies {}; bool complete {false}; 
+        std::optional<bool> rareFirst;
+    };
+
+    void printResult(bool condition, const std::string& message) {
+        std::cout << message << (condition ? GREEN + "PASS" + RESET : RED + "FAIL" + RESET) << "\n";
+    }
+
+    double cpuSeconds(int who) {
+        rusage usage {}; getrusage(who, &usage);
+        return static_cast<double>(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec)
+            + static_cast<double>(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+    }
+
+    bool waitReadable(int fd, int timeoutMs) {
+        pollfd pfd {.fd=fd, .events=POLLIN, .revents=0};
+        return ::poll(&pfd, 1, timeoutMs) > 0;
+    }
+
+    net::Socket listenLoopback(std::uint16_t &port) {
+        net::Socket sock {net::SOCKTYPE::TCP, net::IP::V4};
+        sock.bind("127.0.0.1", 0); sock.listen(64);
+        sockaddr_in addr {}; socklen_t len {sizeof(addr)};
+        getsockname(sock.fd(), reinterpret_cast<sockaddr*>(&addr), &len);
+        port = ntohs(addr.sin_port);
+        return sock;
+    }
+
+    std::string bencodeStr(std::string_view str) { return std::to_string(str.size()) + ':' + std::string{str}; }
+
+    // Single file torrent over `data` announcing to the given tracker, web seeds go into the url-list
+    void writeTorrent(const fs::path &torrentPath, const std::string &name, const std::string &data, 
+        std::uint16_t trackerPort, const std::vector<std::string> &webSeeds) 
+    {
+        std::string pieces;
+        for (std::size_t offset {}; offset < data.size(); offset += PIECE_SIZE)
+            pieces += hashutil::sha1(data.substr(offset, PIECE_SIZE), true);
+        std::string info {"d6:lengthi" + std::to_string(data.size()) + "e4:name" + bencodeStr(name)
+            + "12:piece lengthi" + std::to_string(PIECE_SIZE) + "e6:pieces" + bencodeStr(pieces) + "e"};
+        std::string announce {"http://127.0.0.1:" + std::to_string(trackerPort) + "/announce"};
+        std::ofstream ofs {torrentPath, std::ios::binary};
+        ofs << "d8:announce" << bencodeStr(announce) << "4:info" << info;
+        if (!webSeeds.empty()) {
+            ofs << "8:url-listl";
+            for (const std::string &url: webSeeds) ofs << bencodeStr(url);
+            ofs << "e";
+        }
+        ofs << "e";
+    }
+
+    // Answers every announce with the compact list of seeders & leechers, leaving out the one announcing
+    void runTracker(net::Socket listener, const std::vector<std::uint16_t> &ports, Swarm &swarm) {
+        while (!swarm.stop) {
+            if (!waitReadable(listener.fd(), 50)) continue;
+            try {
+                net::Socket client {listener.accept()};
+                std::string request;
+                while (request.find("\r\n\r\n") == std::string::npos && waitReadable(client.fd(), 1000)) {
+                    std::string chunk {client.recv(4096)};
+                    if (chunk.empty()) break;
+                    request += chunk;
+                }
+
+                const std::size_t portAt {request.find("port=")};
+                const std::uint16_t announced {portAt == std::string::npos? std::uint16_t{}: 
+                    static_cast<std::uint16_t>(std::stoul(request.substr(portAt + 5)))};
+                std::string peers;
+                for (std::uint16_t port: ports) {
+                    if (port == announced) continue;
+                    port = net::utils::bswap(port);
+                    peers += std::string{"\x7f\0\0\x01", 4} + std::string{reinterpret_cast<char*>(&port), 2};
+                }
+                std::string body {"d8:intervali1800e5:peers" + bencodeStr(peers) + "e"};
+                client.sendAll("HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: "
+                    + std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body);
+            } catch (net::SocketError &) {}
+        }
+        swarm.helperCpuUs += static_cast<std::uint64_t>(cpuSeconds(RUSAGE_THREAD) * 1e6);
+    }
+
+    // Serves a single leecher connection: all pieces, unchoked on interest,
+    // requests are answered after `latency` and paced to `bytesPerSec`
+    void servePeer(net::Socket peer, PeerProfile profile, Swarm &swarm) {
+        struct Pending { Clock::time_point readyAt; std::uint32_t index, begin, length; };
+        static const std::string peerID {"-SIM001-" + Torrent::randString(12)};
+        std::mt19937 rng {std::random_device{}()};
+
+        auto dropAt {Clock::time_point::max()};
+        if (profile.churn.count())
+            dropAt = Clock::now() + profile.churn / 2 + profile.churn * std::uniform_int_distribution<int>{0, 100}(rng) / 100;
+        if (profile.leaveAfter.count()) dropAt = std::min(dropAt, swarm.start + profile.leaveAfter);
+
+        std::string recvBuffer; std::deque<Pending> queue;
+        std::unordered_set<std::uint32_t> garbled;
+        bool handshaked {false}; auto nextSendAt {Clock::now()};
+        try {
+            // Accepted sockets come out non blocking, sendAll would cut messages short
+            peer.setNonBlocking(false);
+            while (!swarm.stop && peer.fd() != -1 && Clock::now() < dropAt) {
+                auto untilReady {queue.empty()? std::chrono::milliseconds{20}:
+                    std::chrono::duration_cast<std::chrono::milliseconds>(queue.front().readyAt - Clock::now())};
+                if (waitReadable(peer.fd(), static_cast<int>(std::clamp<long>(untilReady.count(), 0, 20)))) {
+                    std::string chunk {peer.recv(1 << 16)};
+                    if (peer.fd() == -1) break;
+                    recvBuffer += chunk;
+                }
+
+                if (!handshaked && recvBuffer.size() >= 68) {
+                    if (recvBuffer.compare(28, 20, swarm.torrent.infoHash) != 0) break;
+                    Torrent::DynamicBitset haves {swarm.torrent.numPieces}; haves.setAll();
+                    for (std::uint32_t pieceIdx {}; pieceIdx < profile.missing; ++pieceIdx) haves.reset(pieceIdx);
+                    peer.sendAll(Torrent::buildHandshake(swarm.torrent.infoHash, peerID)
+                        + (Torrent::supportsFastExtension(recvBuffer) && !profile.missing? 
+                            Torrent::buildHaveAll(): Torrent::buildBitField(haves.toWire())));
+                    recvBuffer.erase(0, 68); handshaked = true;
+                }
+
+                while (handshaked && recvBuffer.size() >= 4) {
+                    if (recvBuffer.starts_with(std::string_view{"\0\0\0\0", 4})) { recvBuffer.erase(0, 4); continue; }
+                    const std::uint32_t msgLen {Torrent::IsCompleteMessage(recvBuffer)};
+                    if (!msgLen) break;
+                    auto [msgType, payload] {Torrent::parseMessage(std::string_view{recvBuffer}.substr(0, msgLen + 4))};
+                    if (msgType == Torrent::MsgType::Interested) peer.sendAll(Torrent::buildUnchoke());
+                    else if ((msgType == Torrent::MsgType::Request || msgType == Torrent::MsgType::Cancel) && payload.size() == 12) {
+                        std::uint32_t index, begin, length;
+                        std::memcpy(&index, payload.data() + 0, 4);
+                        std::memcpy(&begin, payload.data() + 4, 4);
+                        std::memcpy(&length, payload.data() + 8, 4);
+                        net::utils::inplace_bswap(index, begin, length);
+                        if (msgType == Torrent::MsgType::Cancel)
+                            std::erase_if(queue, [&](const Pending &p) { return p.index == index && p.begin == begin; });
+                        else if (index >= profile.missing && static_cast<std::uint64_t>(index) * PIECE_SIZE + begin + length <= swarm.data.size()) {
+                            queue.push_back({Clock::now() + profile.latency, index, begin, length});
+                            if (profile.leaveAfter.count()) {
+                                std::scoped_lock lock {swarm.mutex};
+                                if (!std::ranges::contains(swarm.leaverPieces, index)) swarm.leaverPieces.push_back(index);
+                            }
+                        }
+                    }
+                    recvBuffer.erase(0, msgLen + 4);
+                }
+
+                while (!queue.empty() && queue.front().readyAt <= Clock::now()) {
+                    auto [readyAt, index, begin, length] {queue.front()}; queue.pop_front();
+                    if (profile.bytesPerSec) {
+                        std::this_thread::sleep_until(nextSendAt);
+                        nextSendAt = std::max(nextSendAt, Clock::now()) + std::chrono::nanoseconds{
+                            static_cast<std::int64_t>(length * 1e9 / static_cast<double>(profile.bytesPerSec))};
+                    }
+                    std::size_t offset {static_cast<std::size_t>(index) * PIECE_SIZE + begin};
+                    std::string block {swarm.data.substr(offset, length)};
+                    if (profile.corrupt && index + CORRUPT_PIECES >= swarm.torrent.numPieces && garbled.insert(index).second)
+                        block.front() ^= 0x5a;
+                    peer.sendAll(Torrent::buildPiece(index, begin, block));
+                    swarm.sentBytes += length;
+                }
+            }
+        } catch (net::SocketError &) {}
+        swarm.helperCpuUs += static_cast<std::uint64_t>(cpuSeconds(RUSAGE_THREAD) * 1e6);
+    }
+
+    // Keep-alive HTTP connection to a web seed: `GET /<name>` with a single byte range per request,
+    // answered in order. Requests for any other path get a 404 which fails the download
+    void serveWebSeed(net::Socket client, const std::string &path, Swarm &swarm) {
+        try {
+            // Accepted sockets come out non blocking, sendAll would cut responses short
+            client.setNonBlocking(false);
+            std::string buffer;
+            while (!swarm.stop) {
+                const std::size_t headerEnd {buffer.find("\r\n\r\n")};
+                if (headerEnd == std::string::npos) {
+                    if (!waitReadable(client.fd(), 50)) continue;
+                    std::string chunk {client.recv(1 << 16)};
+                    if (chunk.empty()) break;
+                    buffer += chunk;
+                    continue;
+                }
+
+                auto [requestLine, headers, _] {net::utils::parseHttpString(buffer.substr(0, headerEnd + 4))};
+                buffer.erase(0, headerEnd + 4);
+                if (!requestLine.starts_with("GET " + path + " ")) {
+                    client.sendAll("HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n");
+                    continue;
+                }
+
+                // Range: bytes=<first>-<last>, whole file without one
+                std::uint64_t first {}, last {swarm.data.size() - 1};
+                if (auto it {headers.find("range")}; it != headers.end() && !it->second.empty()) {
+                    const std::string &range {it->second.front()};
+                    first = std::stoull(range.substr(6));
+                    last = std::min<std::uint64_t>(last, std::stoull(range.substr(range.find('-') + 1)));
+                }
+                const std::string body {swarm.data.substr(first, last - first + 1)};
+                client.sendAll("HTTP/1.1 206 Partial Content\r\nContent-Range: bytes " + std::to_string(first) + "-"
+                    + std::to_string(last) + "/" + std::to_string(swarm.data.size()) + "\r\nContent-Length: "
+                    + std::to_string(body.size()) + "\r\n\r\n" + body);
+                swarm.sentBytes += body.size();
+            }
+        } catch (net::SocketError &) {}
+        swarm.helperCpuUs += static_cast<std::uint64_t>(cpuSeconds(RUSAGE_THREAD) * 1e6);
+    }
+
+    void runWebSeed(net::Socket listener, std::string path, Swarm &swarm) {
+        std::vector<std::thread> connections;
+        while (!swarm.stop) {
+            if (!waitReadable(listener.fd(), 50)) continue;
+            try { connections.emplace_back(serveWebSeed, listener.accept(), std::cref(path), std::ref(swarm)); }
+            catch (net::SocketError &) {}
+        }
+        for (auto &conn: connections) conn.join();
+        swarm.helperCpuUs += static_cast<std::uint64_t>(cpuSeconds(RUSAGE_THREAD) * 1e6);
+    }
+
+    void runSeeder(net::Socket listener, PeerProfile profile, Swarm &swarm) {
+        std::vector<std::thread> connections;
+        while (!swarm.stop && (!profile.leaveAfter.count() || Clock::now() < swarm.start + profile.leaveAfter)) {
+            if (!waitReadable(listener.fd(), 50)) continue;
+            try { connections.emplace_back(servePeer, listener.accept(), profile, std::ref(swarm)); }
+            catch (net::SocketError &) {}
+        }
+        for (auto &conn: connections) conn.join();
+        swarm.helperCpuUs += static_cast<std::uint64_t>(cpuSeconds(RUSAGE_THREAD) * 1e6);
+    }
+
+    Result runScenario(const Scenario &scenario, const fs::path &root, const std::string &data) {
+        const fs::path dir {root / scenario.name}, torrentPath {dir / (scenario.name + ".torrent")};
+        const auto downloadDir {[&dir](std::size_t leecher) { return dir / ("downloads-" + std::to_string(leecher)); }};
+        for (std::size_t leecher {}; leecher < scenario.leechers; ++leecher) fs::create_directories(downloadDir(leecher));
+
+        std::uint16_t trackerPort;
+        std::vector<std::uint16_t> ports(scenario.seeders.size()), webSeedPorts(scenario.webSeeds);
+        std::vector<net::Socket> listeners, webSeedListeners;
+        net::Socket trackerListener {listenLoopback(trackerPort)};
+        for (std::uint16_t &port: ports) listeners.push_back(listenLoopback(port));
+
+        // Web seeds serve the single file at http://127.0.0.1:<port>/<name>
+        const std::string name {scenario.name + ".bin"};
+        std::vector<std::string> webSeedURLs;
+        for (std::uint16_t &port: webSeedPorts) {
+            webSeedListeners.push_back(listenLoopback(port));
+            webSeedURLs.push_back("http://127.0.0.1:" + std::to_string(port) + "/" + name);
+        }
+        writeTorrent(torrentPath, name, data, trackerPort, webSeedURLs);
+
+        // Leechers under test listen on ports of their own, the tracker hands those out as well
+        std::vector<std::unique_ptr<Torrent::Session>> sessions;
+        for (std::size_t leecher {}; leecher < scenario.leechers; ++leecher) {
+            sessions.push_back(std::make_unique<Torrent::Session>(5, 0, 50, 8, 2, scenario.hashThreads));
+            ports.push_back(sessions.back()->port());
+        }
+
+        Torrent::TorrentFile torrent {torrentPath.string()};
+        Swarm swarm {.data=data, .torrent=torrent};
+        std::vector<std::thread> threads;
+        threads.emplace_back(runTracker, std::move(trackerListener), std::cref(ports), std::ref(swarm));
+        for (std::size_t idx {}; idx < listeners.size(); ++idx)
+            threads.emplace_back(runSeeder, std::move(listeners[idx]), scenario.seeders[idx], std::ref(swarm));
+        for (net::Socket &listener: webSeedListeners)
+            threads.emplace_back(runWebSeed, std::move(listener), "/" + name, std::ref(swarm));
+
+        // Leechers: 16 KB blocks, backlog of 8, quick reconnects to survive churn. All of them share this
+        // thread, each loop is polled in turn until every download is done
+        const double cpuStart {cpuSeconds(RUSAGE_SELF)}, loopCpuStart {cpuSeconds(RUSAGE_THREAD)};
+        const auto start {Clock::now()};
+        {
+            for (std::size_t leecher {}; leecher < sessions.size(); ++leecher)
+                sessions[leecher]->add(torrentPath.string(), downloadDir(leecher), std::uint16_t{1 << 14}, std::uint8_t{8},
+                    std::uint8_t{3}, std::uint8_t{50}, std::uint16_t{5}, std::uint16_t{1}, std::uint8_t{4}, 0., std::uint32_t{0}, 
+                    false, scenario.adaptiveBacklog);
+            const int pollTimeout {sessions.size() > 1? 1: 5};
+            std::vector<bool> running(sessions.size(), true);
+            while (std::ranges::contains(running, true) && Clock::now() - start < TIME_LIMIT)
+                for (std::size_t leecher {}; leecher < sessions.size(); ++leecher)
+                    if (running[leecher]) running[leecher] = sessions[leecher]->poll(pollTimeout);
+            sessions.clear();
+        }
+        const double seconds {std::chrono::duration<double>(Clock::now() - start).count()};
+
+        swarm.stop = true;
+        for (auto &thread: threads) thread.join();
+        const double loopCpu {cpuSeconds(RUSAGE_THREAD) - loopCpuStart};
+        const double cpu {cpuSeconds(RUSAGE_SELF) - cpuStart - static_cast<double>(swarm.helperCpuUs) / 1e6};
+
+        // Downloads must be byte for byte identical to what was seeded, files are moved under a directory named after the torrent
+        bool complete {true};
+        for (std::size_t leecher {}; leecher < scenario.leechers; ++leecher) {
+            std::ifstream ifs {downloadDir(leecher) / name / name, std::ios::binary};
+            complete &= std::string{std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>()} == data;
+        }
+
+        // Pieces only a leaving seeder has must be the first asked of it, ahead of any that others have too
+        std::optional<bool> rareFirst;
+        std::uint32_t rare {};
+        for (const PeerProfile &profile: scenario.seeders) rare = std::max(rare, profile.missing);
+        if (rare && std::ranges::any_of(scenario.seeders, [](const PeerProfile &p) { return p.leaveAfter.count() > 0; })) {
+            const std::span<const std::uint32_t> first {swarm.leaverPieces.data(), std::min<std::size_t>(rare, swarm.leaverPieces.size())};
+            rareFirst = first.size() == rare && std::ranges::all_of(first, [rare](std::uint32_t p) { return p < rare; });
+        }
+
+        // Figures are for all leechers together, bytes traded among them aren't counted as wasted
+        const auto size {static_cast<double>(data.size()) * static_cast<double>(scenario.leechers)};
+        const auto sent {static_cast<double>(swarm.sentBytes)};
+        return {.seconds=seconds, .goodput=size / seconds / (1 << 20),
+            .wasted=std::max(0., sent - size), .cpuPerGB=cpu / size * (1 << 30),
+            .loopCpuPerGB=loopCpu / size * (1 << 30), .seededCopies=sent / static_cast<double>(data.size()),
+            .complete=complete, .rareFirst=rareFirst};
+    }
+}
+
+int main() {
+    Logging::Dynamic::setLogLevel(Logging::Level::WARN);
+
+    std::string data(static_cast<std::size_t>(PIECE_SIZE) * NUM_PIECES - 12345, '\0');
+    std::mt19937_64 rng {42};
+    for (char &ch: data) ch = static_cast<char>(rng());
+
+    using namespace std::chrono_literals;
+    const std::vector<Scenario> scenarios {
+        {"baseline", {{}, {}, {}, {}}},
+        {"inline",   {{}, {}, {}, {}}, 0, 0},
+        {"latency",  {{8 << 20, 50ms, {}}, {8 << 20, 50ms, {}}, {8 << 20, 80ms, {}}, {8 << 20, 80ms, {}}}},
+        {"fixed",    {{8 << 20, 50ms, {}}, {8 << 20, 50ms, {}}, {8 << 20, 80ms, {}}, {8 << 20, 80ms, {}}}, 0, 2, false},
+        {"mixed",    {{8 << 20, 10ms, {}}, {8 << 20, 20ms, {}}, {8 << 20, 20ms, {}}, {64 << 10, 100ms, {}}}},
+        {"churn",    {{4 << 20, 20ms, 1500ms}, {4 << 20, 20ms, 2000ms}, {4 << 20, 20ms, 2500ms}, {4 << 20, 20ms, {}}}},
+        {"webseed",  {}, 1},
+        {"hybrid",   {{4 << 20, 20ms, {}}, {4 << 20, 20ms, {}}}, 1},
+        {"corrupt",  {{8 << 20, 10ms, {}}, {8 << 20, 10ms, {}}, {16 << 20, 5ms, {}, true}}},
+        {"trade",    {{2 << 20, 20ms, {}}}, 0, 2, true, TRADING_LEECHERS},
+        {"rare",     {{8 << 20, 20ms, {}, false, 4}, {8 << 20, 20ms, {}, false, 4}, {8 << 20, 20ms, {}, false, 4},
+                      {2 << 20, 20ms, {}, false, 0, 1500ms}}},
+    };
+
+    const fs::path root {fs::temp_directory_path() / ("ctorrent-swarm-" + std::to_string(getpid()))};
+    bool passed {true};
+    std::println("{:<10} {:>9} {:>12} {:>12} {:>12} {:>12}", "Scenario", "Time (s)", "Goodput MB/s", "Wasted KB", 
+        "CPU s / GB", "Loop CPU / GB");
+    std::vector<std::pair<std::string, Result>> results;
+    for (const Scenario &scenario: scenarios) {
+        Result result {runScenario(scenario, root, data)};
+        std::println("{:<10} {:>9.2f} {:>12.2f} {:>12.1f} {:>12.2f} {:>13.2f}", scenario.name,
+            result.seconds, result.goodput, result.wasted / 1024, result.cpuPerGB, result.loopCpuPerGB);
+        results.emplace_back(scenario.name, result);
+    }
+
+    for (const auto &[name, result]: results) {
+        printResult(result.complete, std::format("{:<28}", "Download complete (" + name + "): "));
+        passed &= result.complete;
+        if (result.rareFirst) {
+            printResult(*result.rareFirst, std::format("{:<28}", "Rare pieces first (" + name + "): "));
+            passed &= *result.rareFirst;
+        }
+    }
+
+    auto resultOf {[&results](std::string_view name) -> const Result & {
+        return std::ranges::find(results, name, [](const auto &entry) { return entry.first; })->second;
+    }};
+
+    // Same swarm hashed on the pool & inline: the network thread must shed the hashing
+    const Result &pooled {resultOf("baseline")}, &inlined {resultOf("inline")};
+    const bool offLoop {pooled.loopCpuPerGB < inlined.loopCpuPerGB};
+    std::println("Hash pool vs inline: goodput {:.2f} vs {:.2f} MB/s, network thread CPU {:.2f} vs {:.2f} s / GB",
+        pooled.goodput, inlined.goodput, pooled.loopCpuPerGB, inlined.loopCpuPerGB);
+    printResult(offLoop, std::format("{:<28}", "Hashing off the loop: ")); passed &= offLoop;
+
+    // Leechers downloading together must have traded: at least one of the copies they got didn't come from the seeder
+    const Result &trade {resultOf("trade")};
+    const bool traded {trade.seededCopies < TRADING_LEECHERS - 1};
+    std::println("Trading leechers: seeder uploaded {:.2f} copies for {} leechers", trade.seededCopies, TRADING_LEECHERS);
+    printResult(traded, std::format("{:<28}", "Leechers trade pieces: ")); passed &= traded;
+
+    // Same high latency swarm with queue depths following rate x RTT & fixed at the initial backlog
+    const Result &adaptive {resultOf("latency")}, &fixed {resultOf("fixed")};
+    const bool faster {adaptive.goodput > fixed.goodput};
+    std::println("Adaptive vs fixed queue depth: goodput {:.2f} vs {:.2f} MB/s ({:+.0f}%)",
+        adaptive.goodput, fixed.goodput, (adaptive.goodput / fixed.goodput - 1) * 100);
+    printResult(faster, std::format("{:<28}", "Adaptive depth is faster: ")); passed &= faster;
+
+    fs::remove_all(root);
+    return passed? 0: 1;
+}
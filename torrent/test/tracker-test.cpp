@@ -0,0 +1,232 @@
+// Tracker announces against local HTTP & UDP stand-ins: announce-list tiers fall back to the next tracker
+// when one fails, the tracker that answered is moved to the front of its tier, peers of all tiers are merged
+// and a running download re-announces every interval the trackers ask for
+
+#include "../include/disk_writer.hpp"
+#include "../include/piece_cache.hpp"
+#include "../include/torrent_downloader.hpp"
+#include "../include/torrent_file.hpp"
+#include "../include/torrent_tracker.hpp"
+
+#include "../../cryptography/hashlib.hpp"
+#include "../../misc/logger.hpp"
+#include "../../misc/threadPool.hpp"
+#include "../../networking/net.hpp"
+
+#include <poll.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+namespace fs = std::filesystem;
+using Clock = std::chrono::steady_clock;
+
+const std::string GREEN{"\033[32m"};
+const std::string RED{"\033[31m"};
+const std::string RESET{"\033[0m"};
+
+namespace {
+    constexpr std::uint32_t PIECE_SIZE {1 << 16};
+    constexpr int TRACKER_TIMEOUT {2};
+
+    // Re-announces every second are expected, at least MIN_REANNOUNCES within the wait
+    constexpr std::chrono::milliseconds REANNOUNCE_WAIT {3500};
+    constexpr int MIN_REANNOUNCES {3};
+
+    void printResult(bool condition, const std::string& message) {
+        std::cout << message << (condition ? GREEN + "PASS" + RESET : RED + "FAIL" + RESET) << "\n";
+    }
+
+    std::string bencodeStr(std::string_view str) { return std::to_string(str.size()) + ':' + std::string{str}; }
+
+    // Compact form of 127.0.0.1:<port>
+    std::string compactPeer(std::uint16_t port) {
+        port = net::utils::bswap(port);
+        return std::string{"\x7f\0\0\x01", 4} + std::string{reinterpret_cast<char*>(&port), 2};
+    }
+
+    std::uint16_t localPort(const net::Socket &sock) {
+        sockaddr_in addr {}; socklen_t len {sizeof(addr)};
+        getsockname(sock.fd(), reinterpret_cast<sockaddr*>(&addr), &len);
+        return ntohs(addr.sin_port);
+    }
+
+    bool waitReadable(int fd, int timeoutMs) {
+        pollfd pfd {.fd=fd, .events=POLLIN, .revents=0};
+        return ::poll(&pfd, 1, timeoutMs) > 0;
+    }
+
+    // Single file torrent announcing to the given tiers, the first tracker also goes into `announce`
+    void writeTorrent(const fs::path &torrentPath, const std::vector<std::vector<std::string>> &tiers) {
+        const std::string data(4 * PIECE_SIZE + 123, 'x');
+        std::string pieces;
+        for (std::size_t offset {}; offset < data.size(); offset += PIECE_SIZE)
+            pieces += hashutil::sha1(data.substr(offset, PIECE_SIZE), true);
+        std::string info {"d6:lengthi" + std::to_string(data.size()) + "e4:name" + bencodeStr(torrentPath.stem().string())
+            + "12:piece lengthi" + std::to_string(PIECE_SIZE) + "e6:pieces" + bencodeStr(pieces) + "e"};
+        std::ofstream ofs {torrentPath, std::ios::binary};
+        ofs << "d8:announce" << bencodeStr(tiers.front().front()) << "13:announce-listl";
+        for (const auto &tier: tiers) {
+            ofs << "l";
+            for (const std::string &url: tier) ofs << bencodeStr(url);
+            ofs << "e";
+        }
+        ofs << "e4:info" << info << "e";
+    }
+
+    // HTTP tracker answering every announce with `body`, a peer list or a failure reason
+    void runHttpTracker(net::Socket listener, std::string body, std::atomic<bool> &stop, std::atomic<int> &hits) {
+        const std::string response {"HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: "
+            + std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body};
+        while (!stop) {
+            if (!waitReadable(listener.fd(), 50)) continue;
+            try {
+                net::Socket client {listener.accept()};
+                std::string request;
+                while (request.find("\r\n\r\n") == std::string::npos && waitReadable(client.fd(), 1000)) {
+                    std::string chunk {client.recv(4096)};
+                    if (chunk.empty()) break;
+                    request += chunk;
+                }
+                ++hits; client.sendAll(response);
+            } catch (net::SocketError &) {}
+        }
+    }
+
+    // Peer that accepts connections & never says anything, keeps a download with no data running
+    void runSilentPeer(net::Socket listener, std::atomic<bool> &stop) {
+        std::vector<net::Socket> held;
+        while (!stop) {
+            if (!waitReadable(listener.fd(), 50)) continue;
+            try { held.push_back(listener.accept()); }
+            catch (net::SocketError &) {}
+        }
+    }
+
+    // UDP tracker (BEP 15): connection requests get an id, announces the `peers` & `interval` given
+    void runUdpTracker(net::Socket sock, std::string peers, const std::uint32_t interval,
+        std::atomic<bool> &stop, std::atomic<int> &hits)
+    {
+        while (!stop) {
+            if (!waitReadable(sock.fd(), 50)) continue;
+            try {
+                std::string host; std::uint16_t port;
+                const std::string request {sock.recvFrom(host, port)};
+                if (request.size() == 16) {
+                    sock.sendTo(std::string(4, '\0') + request.substr(12, 4) + "CONNID!!", host, port);
+                } else if (request.size() >= 98) {
+                    std::uint32_t action {1}, wait {interval}, leechers {2}, seeders {4};
+                    net::utils::inplace_bswap(action, wait, leechers, seeders);
+                    std::string response(20, '\0');
+                    std::memcpy(response.data() +  0, &action, 4);
+                    std::memcpy(response.data() +  4, request.data() + 12, 4);
+                    std::memcpy(response.data() +  8, &wait, 4);
+                    std::memcpy(response.data() + 12, &leechers, 4);
+                    std::memcpy(response.data() + 16, &seeders, 4);
+                    ++hits; sock.sendTo(response + peers, host, port);
+                }
+            } catch (net::SocketError &) {}
+        }
+    }
+}
+
+int main() {
+    Logging::Dynamic::setLogLevel(Logging::Level::ERROR);
+    const fs::path root {fs::temp_directory_path() / ("ctorrent-tracker-" + std::to_string(getpid()))};
+    fs::create_directories(root / "downloads");
+    bool passed {true}, result;
+
+    // Stand-ins: a failing & a working HTTP tracker sharing a tier, a UDP tracker in the next one and
+    // an HTTP tracker asking to be re-announced to every second, handing out a silent peer
+    std::vector<net::Socket> listeners;
+    for (int i {}; i < 4; ++i) {
+        net::Socket listener {net::SOCKTYPE::TCP, net::IP::V4};
+        listener.bind("127.0.0.1", 0); listener.listen(16);
+        listeners.push_back(std::move(listener));
+    }
+    net::Socket udpSock {net::SOCKTYPE::UDP, net::IP::V4};
+    udpSock.bind("127.0.0.1", 0);
+
+    const auto url {[](const std::string &protocol, const net::Socket &sock) {
+        return protocol + "://127.0.0.1:" + std::to_string(localPort(sock)) + "/announce"; }};
+    const std::string failingURL {url("http", listeners[0])}, workingURL {url("http", listeners[1])},
+        udpURL {url("udp", udpSock)}, periodicURL {url("http", listeners[2])};
+
+    std::atomic<bool> stop {false};
+    std::atomic<int> failingHits {}, workingHits {}, udpHits {}, periodicHits {};
+    std::vector<std::thread> trackers;
+    trackers.emplace_back(runHttpTracker, std::move(listeners[0]), "d14:failure reason6:bannede", std::ref(stop), std::ref(failingHits));
+    trackers.emplace_back(runHttpTracker, std::move(listeners[1]), "d8:completei3e10:incompletei1e8:intervali7e5:peers"
+        + bencodeStr(compactPeer(1001) + compactPeer(1002)) + "e", std::ref(stop), std::ref(workingHits));
+    trackers.emplace_back(runUdpTracker, std::move(udpSock), compactPeer(1002) + compactPeer(1003), 5, std::ref(stop), std::ref(udpHits));
+    trackers.emplace_back(runHttpTracker, std::move(listeners[2]), "d8:intervali1e5:peers"
+        + bencodeStr(compactPeer(localPort(listeners[3]))) + "e", std::ref(stop), std::ref(periodicHits));
+    trackers.emplace_back(runSilentPeer, std::move(listeners[3]), std::ref(stop));
+
+    writeTorrent(root / "tiers.torrent", {{failingURL, workingURL}, {udpURL}});
+    writeTorrent(root / "failing.torrent", {{failingURL}});
+    writeTorrent(root / "periodic.torrent", {{periodicURL}});
+
+    {
+        const Torrent::TorrentFile torrent {(root / "tiers.torrent").string()};
+        Torrent::TorrentTracker tracker {torrent, 6881, 1};
+        std::vector<Torrent::TorrentTracker::Peer> peers {tracker.getPeers(TRACKER_TIMEOUT)};
+        std::ranges::sort(peers);
+        result = peers == std::vector<Torrent::TorrentTracker::Peer>{{"127.0.0.1", 1001}, {"127.0.0.1", 1002}, {"127.0.0.1", 1003}}
+            && workingHits == 1 && udpHits == 1 && failingHits <= 1;
+        printResult(result, std::format("{:<40}", "Tiers fall back & peers are merged: ")); passed &= result;
+
+        result = tracker.interval == 5 && tracker.seeders == 4 && tracker.leechers == 2;
+        printResult(result, std::format("{:<40}", "Shortest interval & best stats kept: ")); passed &= result;
+
+        // Whichever order the tier was shuffled in, the working tracker now leads it
+        const int failedBefore {failingHits};
+        for (int i {}; i < 2; ++i) std::ignore = tracker.getPeers(TRACKER_TIMEOUT);
+        result = failingHits == failedBefore && workingHits == 3 && udpHits == 3;
+        printResult(result, std::format("{:<40}", "Responding tracker is promoted: ")); passed &= result;
+    }
+
+    {
+        const Torrent::TorrentFile torrent {(root / "failing.torrent").string()};
+        Torrent::TorrentTracker tracker {torrent};
+        bool threw {false};
+        try { std::ignore = tracker.getPeers(TRACKER_TIMEOUT); }
+        catch (std::runtime_error &) { threw = true; }
+        printResult(threw, std::format("{:<40}", "All trackers failing throws: ")); passed &= threw;
+    }
+
+    // A running download re-announces off the loop every interval the tracker asks for
+    {
+        const Torrent::TorrentFile torrent {(root / "periodic.torrent").string()};
+        Torrent::TorrentTracker tracker {torrent, 6881, 1};
+        Torrent::DiskIOPool diskPool {1};
+        async::ThreadPool hashPool {1};
+        Torrent::PieceCache cache {std::size_t{16} << 20};
+        net::PollManager pollManager;
+        Torrent::SessionLimits limits {.maxConnections=8, .maxUnchoked=4};
+
+        Torrent::TorrentDownloader downloader {tracker, diskPool, hashPool, cache, root / "downloads"};
+        downloader.start(pollManager, limits, TRACKER_TIMEOUT);
+        bool running {true};
+        for (const auto start {Clock::now()}; running && Clock::now() - start < REANNOUNCE_WAIT;) {
+            std::ignore = pollManager.poll(50);
+            running = downloader.step(Clock::now());
+        }
+        downloader.stop();
+        result = running && periodicHits >= MIN_REANNOUNCES;
+        printResult(result, std::format("{:<40}", "Download re-announces every interval: ")); passed &= result;
+    }
+
+    stop = true;
+    for (std::thread &tracker: trackers) tracker.join();
+    fs::remove_all(root);
+    return passed? 0: 1;
+}